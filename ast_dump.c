@@ -14,54 +14,55 @@ static void print_pipeline(FILE *stream, int64_t indent, struct pipeline_definit
     {
         sindent[i] = '|';
     }
-    sindent[indent] = 0;
+    /* deeper nesting is printed at the last indent level */
+    sindent[indent < 127 ? indent : 127] = 0;
     
     fprintf(stream, "%sPipeline:\n", sindent);
     
-    fprintf(stream, "%s| Arguments: %lld\n", sindent, pipeline->args_len);
+    fprintf(stream, "%s| Arguments: %" PRId64 "\n", sindent, pipeline->args_len);
     for (int64_t i = 0; i < pipeline->args_len; ++i)
     {
         if (pipeline->args[i].type == ARGUMENT_NAME)
         {
-            fprintf(stream, "%s| | Argument %lld : NAME : %s\n", sindent, i, pipeline->args[i].name);
+            fprintf(stream, "%s| | Argument %" PRId64 " : NAME : %s\n", sindent, i, pipeline->args[i].name);
         }
         else
         {
-            fprintf(stream, "%s| | Argument %lld : PIPE\n", sindent, i);
+            fprintf(stream, "%s| | Argument %" PRId64 " : PIPE\n", sindent, i);
             print_pipeline(stream, indent + 6, pipeline->args[i].pipeline);
         }
     }
     
-    fprintf(stream, "%s| Workers: %lld\n", sindent, pipeline->workers_len);
+    fprintf(stream, "%s| Workers: %" PRId64 "\n", sindent, pipeline->workers_len);
     for (int64_t i = 0; i < pipeline->workers_len; ++i)
     {
-        fprintf(stream, "%s| | Worker %lld : %s\n", sindent, i, pipeline->workers[i].name);
-        fprintf(stream, "%s| | | Substitutions : %lld\n", sindent, pipeline->workers[i].subs_len);
+        fprintf(stream, "%s| | Worker %" PRId64 " : %s\n", sindent, i, pipeline->workers[i].name);
+        fprintf(stream, "%s| | | Substitutions : %" PRId64 "\n", sindent, pipeline->workers[i].subs_len);
         for (int64_t j = 0; j < pipeline->workers[i].subs_len; ++j)
         {
             if (pipeline->workers[i].subs[j].type == SUBSTITUTION_SYMBOL)
             {
-                fprintf(stream, "%s| | | | Substitution %lld : SYMBOL : %s -> %s\n", sindent, j, pipeline->workers[i].subs[j].name, pipeline->workers[i].subs[j].symbol);
+                fprintf(stream, "%s| | | | Substitution %" PRId64 " : SYMBOL : %s -> %s\n", sindent, j, pipeline->workers[i].subs[j].name, pipeline->workers[i].subs[j].symbol);
             }
             else
             {
-                fprintf(stream, "%s| | | | Substitution %lld : PIPELINE : %s ->\n", sindent, j, pipeline->workers[i].subs[j].name);
+                fprintf(stream, "%s| | | | Substitution %" PRId64 " : PIPELINE : %s ->\n", sindent, j, pipeline->workers[i].subs[j].name);
                 print_pipeline(stream, indent + 10, pipeline->workers[i].subs[j].pipeline);
             }
         }
     }
     
-    fprintf(stream, "%s| Outputs: %lld\n", sindent, pipeline->outputs_len);
+    fprintf(stream, "%s| Outputs: %" PRId64 "\n", sindent, pipeline->outputs_len);
     for (int64_t i = 0; i < pipeline->outputs_len; ++i)
     {
-        fprintf(stream, "%s| | Output %lld : %s\n", sindent, i, pipeline->outputs[i].name);
+        fprintf(stream, "%s| | Output %" PRId64 " : %s\n", sindent, i, pipeline->outputs[i].name);
     }
 }
 
 static void print_def(FILE *stream, struct definition *definition)
 {
     fprintf(stream, "Definition %s\n", definition->name);
-    fprintf(stream, "Free vars: %lld\n", definition->free_vars_len);
+    fprintf(stream, "Free vars: %" PRId64 "\n", definition->free_vars_len);
     for (int64_t i = 0; i < definition->free_vars_len; ++i)
     {
         if (i != 0)
@@ -71,7 +72,7 @@ static void print_def(FILE *stream, struct definition *definition)
         fprintf(stream, "%s", definition->free_vars[i]);
     }
     fprintf(stream, "\n");
-    fprintf(stream, "Piped vars: %lld\n", definition->pipeline_vars_len);
+    fprintf(stream, "Piped vars: %" PRId64 "\n", definition->pipeline_vars_len);
     for (int64_t i = 0; i < definition->pipeline_vars_len; ++i)
     {
         if (i != 0)
@@ -81,7 +82,7 @@ static void print_def(FILE *stream, struct definition *definition)
         fprintf(stream, "%s", definition->pipeline_vars[i]);
     }
     fprintf(stream, "\n");
-    fprintf(stream, "Pipelines: %lld\n\n", definition->pipelines_len);
+    fprintf(stream, "Pipelines: %" PRId64 "\n\n", definition->pipelines_len);
     for (int64_t i = 0; i < definition->pipelines_len; ++i)
     {
         print_pipeline(stream, 0, &definition->pipelines[i]);
@@ -90,12 +91,16 @@ static void print_def(FILE *stream, struct definition *definition)
 
 void program_ast_dump(FILE *stream, struct program *program)
 {
+    program_pass_begin(program, PASS_AST_DUMP);
+
     /* print all file */
-    fprintf(stream, "Program from file %s of %lld lines of code %lld characters total\n", program->filename, program->code_lines, program->source_code_len);
+    fprintf(stream, "Program from file %s of %" PRId64 " lines of code %" PRId64 " characters total\n", program->filename, program->code_lines, program->source_code_len);
     for (int64_t i = 0; i < program->definitions_len; ++i)
     {
         struct definition *definition = program->definitions[i];
-        fprintf(stream, "-------------------- Definition %lld\n", i);
+        fprintf(stream, "-------------------- Definition %" PRId64 "\n", i);
         print_def(stream, definition);
     }
+
+    program_pass_end(program, PASS_AST_DUMP);
 }
@@ -0,0 +1,419 @@
+/* front-end benchmark: generates synthetic programs and measures parse,
+   ast dump and workflow building.
+
+   ./build.sh bench && bench/bench [--reps N] [--only NAME] [--print NAME]
+                                   [--baseline FILE] [--save FILE] [--threshold PCT]
+
+   Every repetition runs in a forked child, so peak RSS is per run.
+   Results are compared against bench/baseline.txt; --save rewrites it from the current run. */
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdarg.h"
+#include "inttypes.h"
+
+#include "unistd.h"
+#include "sys/wait.h"
+#include "sys/resource.h"
+
+
+struct bench_params
+{
+    const char *name;
+    int64_t definitions;
+    int64_t pipeline_length;
+    int64_t nesting_depth;
+    int64_t fan_in;
+    int64_t fan_out;
+    int64_t substitutions;
+};
+
+static struct bench_params scenarios[] = {
+    /* name          defs  length  depth  fan_in  fan_out  subs */
+    { "tiny",          10,      4,     1,      2,       2,    1 },
+    { "many_defs",    400,      4,     1,      2,       2,    1 },
+    { "long_chains",   60,     60,     1,      2,       2,    2 },
+    { "deep_nesting",  60,      4,    24,      2,       2,    1 },
+    { "wide_fan",      60,      4,     1,     16,      14,    1 },
+    { "many_subs",     60,      8,     2,      2,       2,   16 },
+};
+
+
+struct bench_result
+{
+    int64_t source_bytes;
+    int64_t definitions;
+    int64_t workers;
+    int64_t pipes;
+    int64_t pass_ns[PASS_COUNT];
+    int64_t peak_bytes;
+    int64_t max_rss_kb;
+};
+
+
+struct text
+{
+    char *data;
+    int64_t len;
+    int64_t alloc;
+};
+
+
+static void text_append(struct text *text, const char *format, ...)
+{
+    va_list args;
+    while (1)
+    {
+        va_start(args, format);
+        int64_t n = vsnprintf(text->data + text->len, text->alloc - text->len, format, args);
+        va_end(args);
+
+        if (text->len + n < text->alloc)
+        {
+            text->len += n;
+            return;
+        }
+
+        text->alloc = 2 * text->alloc + n + 1;
+        text->data = realloc(text->data, text->alloc);
+        if (text->data == NULL)
+        {
+            fprintf(stderr, "Error: No memory for BENCH.\n");
+            exit(1);
+        }
+    }
+}
+
+
+static int64_t clamp(int64_t value, int64_t low, int64_t high)
+{
+    return value < low ? low : value > high ? high : value;
+}
+
+
+/* f=(> step f=(> step ... f=v)) */
+static void generate_nested(struct text *text, int64_t depth)
+{
+    if (depth == 0)
+    {
+        text_append(text, "v");
+        return;
+    }
+    text_append(text, "(> step f=");
+    generate_nested(text, depth - 1);
+    text_append(text, ")");
+}
+
+
+static void generate_worker(struct text *text, struct bench_params *params, const char *name, int64_t index)
+{
+    text_append(text, " > %s", name);
+    for (int64_t s = 0; s < params->substitutions; ++s)
+    {
+        if (s == 0 && params->nesting_depth > 0)
+        {
+            text_append(text, " s0=");
+            generate_nested(text, params->nesting_depth);
+        }
+        else
+        {
+            text_append(text, " s%lld=k%lld", s, (index + s) % 7);
+        }
+    }
+}
+
+
+/* even definitions are parameterized helpers, odd ones are pure stages
+   that chain helpers and get built into the workflow */
+static char *generate_program(struct bench_params *params)
+{
+    struct bench_params p = *params;
+    /* keep inside parser limits of lang.h */
+    p.pipeline_length = clamp(p.pipeline_length, 1, MAX_PIPELINE_WORKERS - 2);
+    p.substitutions = clamp(p.substitutions, 0, MAX_PIPELINE_WORKER_SUBS);
+    p.fan_out = clamp(p.fan_out, 1, MAX_PIPELINES - 2);
+    p.fan_in = clamp(p.fan_in, 1, MAX_PIPELINE_ARGUMENTS);
+
+    struct text text = { NULL, 0, 0 };
+    text_append(&text, "# generated: %s\n\n", p.name);
+
+    for (int64_t d = 0; d < p.definitions; ++d)
+    {
+        if (d % 2 == 0)
+        {
+            text_append(&text, "x");
+            for (int64_t w = 0; w < p.pipeline_length; ++w)
+            {
+                generate_worker(&text, &p, w % 2 ? "mul" : "add", w);
+            }
+            text_append(&text, " |: helper_%lld(x)\n", d);
+            continue;
+        }
+
+        text_append(&text, "{\n    > !read >> src");
+        for (int64_t o = 0; o < p.fan_out; ++o)
+        {
+            text_append(&text, ";\n    src");
+            for (int64_t w = 0; w < p.pipeline_length; ++w)
+            {
+                generate_worker(&text, &p, "helper_0", w + o);
+            }
+            text_append(&text, " >> o_%lld", o);
+        }
+        text_append(&text, ";\n    ");
+        for (int64_t i = 0; i < p.fan_in; ++i)
+        {
+            text_append(&text, "%so_%lld", i == 0 ? "" : ", ", i % p.fan_out);
+        }
+        text_append(&text, " > add > !print\n} |: stage_%lld\n\n", d);
+    }
+
+    return text.data;
+}
+
+
+static void run_once(struct bench_params *params, struct bench_result *result)
+{
+    char *code = generate_program(params);
+
+    FILE *null_stream = fopen("/dev/null", "w");
+
+    struct program *program = program_create(params->name, code, strlen(code), 0);
+    program_parse(program);
+    program_ast_dump(null_stream, program);
+    program_get_workflow(program);
+    program_optimize_workflow(program);
+
+    memset(result, 0, sizeof(*result));
+    result->source_bytes = program->source_code_len;
+    result->definitions = program->definitions_len;
+    result->workers = program->workflow.workers_len;
+    result->pipes = program->workflow.pipes_len;
+    for (int64_t i = 0; i < PASS_COUNT; ++i)
+    {
+        result->pass_ns[i] = program->passes[i].wall_ns;
+    }
+    result->peak_bytes = program->memory.peak_bytes;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result->max_rss_kb = usage.ru_maxrss;
+
+    program_destroy(program);
+    free(code);
+    fclose(null_stream);
+}
+
+
+static int64_t run_scenario(struct bench_params *params, int64_t reps, struct bench_result *best)
+{
+    for (int64_t r = 0; r < reps; ++r)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            return 0;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            struct bench_result result;
+            close(fds[0]);
+            run_once(params, &result);
+            write(fds[1], &result, sizeof(result));
+            _exit(0);
+        }
+
+        close(fds[1]);
+        struct bench_result result;
+        int64_t got = read(fds[0], &result, sizeof(result));
+        close(fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (got != sizeof(result))
+        {
+            fprintf(stderr, "Error: scenario %s crashed\n", params->name);
+            return 0;
+        }
+
+        /* best of reps for timings, peaks are deterministic */
+        if (r == 0)
+        {
+            *best = result;
+        }
+        for (int64_t i = 0; i < PASS_COUNT; ++i)
+        {
+            if (result.pass_ns[i] < best->pass_ns[i])
+            {
+                best->pass_ns[i] = result.pass_ns[i];
+            }
+        }
+    }
+    return 1;
+}
+
+
+struct baseline
+{
+    char name[64];
+    double parse_ms;
+    double ast_dump_ms;
+    double workflow_ms;
+    int64_t peak_bytes;
+};
+
+
+static int64_t load_baseline(const char *filename, struct baseline *baselines, int64_t max)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+
+    int64_t len = 0;
+    char line[512];
+    while (len < max && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        struct baseline *b = &baselines[len];
+        if (sscanf(line, "%63s %lf %lf %lf %" SCNd64, b->name, &b->parse_ms, &b->ast_dump_ms, &b->workflow_ms, &b->peak_bytes) == 5)
+        {
+            len++;
+        }
+    }
+    fclose(f);
+    return len;
+}
+
+
+static double delta_pct(double now, double base)
+{
+    return base == 0 ? 0.0 : 100.0 * (now - base) / base;
+}
+
+
+int main(int argc, char **argv)
+{
+    int64_t reps = 5;
+    const char *only = NULL;
+    const char *print = NULL;
+    const char *baseline_file = "bench/baseline.txt";
+    const char *save_file = NULL;
+    double threshold = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) { reps = atoll(argv[++i]); }
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) { only = argv[++i]; }
+        else if (strcmp(argv[i], "--print") == 0 && i + 1 < argc) { print = argv[++i]; }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) { baseline_file = argv[++i]; }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) { save_file = argv[++i]; }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) { threshold = atof(argv[++i]); }
+        else
+        {
+            fprintf(stderr, "usage: %s [--reps N] [--only NAME] [--print NAME] [--baseline FILE] [--save FILE] [--threshold PCT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int64_t scenarios_len = sizeof(scenarios) / sizeof(*scenarios);
+
+    if (print != NULL)
+    {
+        for (int64_t s = 0; s < scenarios_len; ++s)
+        {
+            if (strcmp(scenarios[s].name, print) == 0)
+            {
+                char *code = generate_program(&scenarios[s]);
+                fputs(code, stdout);
+                free(code);
+                return 0;
+            }
+        }
+        fprintf(stderr, "Error: unknown scenario %s\n", print);
+        return 1;
+    }
+
+    struct baseline baselines[64];
+    int64_t baselines_len = load_baseline(baseline_file, baselines, 64);
+
+    FILE *save = NULL;
+    if (save_file != NULL)
+    {
+        save = fopen(save_file, "w");
+        if (save == NULL)
+        {
+            fprintf(stderr, "Error: can't write %s\n", save_file);
+            return 1;
+        }
+        fprintf(save, "# scenario parse_ms ast_dump_ms workflow_ms peak_bytes\n");
+    }
+
+    int64_t regressions = 0;
+    printf("%-14s %10s %10s %10s %10s %10s %12s %12s %10s\n",
+           "scenario", "KB", "parse ms", "MB/s", "defs/s", "dump ms", "workflow ms", "peak KB", "rss KB");
+    for (int64_t s = 0; s < scenarios_len; ++s)
+    {
+        struct bench_params *params = &scenarios[s];
+        if (only != NULL && strcmp(params->name, only) != 0)
+        {
+            continue;
+        }
+
+        struct bench_result result = { 0 };
+        if (!run_scenario(params, reps, &result))
+        {
+            regressions++;
+            continue;
+        }
+
+        double parse_ms = result.pass_ns[PASS_PARSE] / 1e6;
+        double dump_ms = result.pass_ns[PASS_AST_DUMP] / 1e6;
+        double workflow_ms = result.pass_ns[PASS_WORKFLOW] / 1e6;
+        double parse_s = result.pass_ns[PASS_PARSE] / 1e9;
+
+        printf("%-14s %10.1f %10.3f %10.2f %10.0f %10.3f %12.3f %12" PRId64 " %10" PRId64 "\n",
+               params->name, result.source_bytes / 1024.0, parse_ms,
+               parse_s == 0 ? 0.0 : result.source_bytes / 1e6 / parse_s,
+               parse_s == 0 ? 0.0 : result.definitions / parse_s,
+               dump_ms, workflow_ms, result.peak_bytes / 1024, result.max_rss_kb);
+
+        for (int64_t b = 0; b < baselines_len; ++b)
+        {
+            if (strcmp(baselines[b].name, params->name) != 0)
+            {
+                continue;
+            }
+            double d_parse = delta_pct(parse_ms, baselines[b].parse_ms);
+            double d_dump = delta_pct(dump_ms, baselines[b].ast_dump_ms);
+            double d_workflow = delta_pct(workflow_ms, baselines[b].workflow_ms);
+            double d_peak = delta_pct(result.peak_bytes, baselines[b].peak_bytes);
+            printf("%-14s %10s %+9.1f%% %10s %10s %+9.1f%% %+11.1f%% %+11.1f%%\n",
+                   "  vs baseline", "", d_parse, "", "", d_dump, d_workflow, d_peak);
+            if (threshold > 0 && (d_parse > threshold || d_dump > threshold || d_workflow > threshold || d_peak > threshold))
+            {
+                regressions++;
+            }
+        }
+
+        if (save != NULL)
+        {
+            fprintf(save, "%s %.3f %.3f %.3f %" PRId64 "\n", params->name, parse_ms, dump_ms, workflow_ms, result.peak_bytes);
+        }
+    }
+
+    if (save != NULL)
+    {
+        fclose(save);
+    }
+
+    return regressions != 0;
+}
@@ -0,0 +1,192 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* true= and false= pipelines of !if, built only once cond is known */
+int64_t is_branch(const struct builtin *builtin, struct pipeline_worker_substitution *sub)
+{
+    return builtin != NULL && builtin->result == RESULT_IF &&
+           (strcmp(sub->name, "true") == 0 || strcmp(sub->name, "false") == 0);
+}
+
+
+/* calls instances make outside of !if branches, those of scope s are
+   callees[offsets[s] .. offsets[s + 1]] */
+struct call_graph
+{
+    int64_t *offsets;
+    int64_t *callees;
+};
+
+
+/* state of tarjan's walk, index and low are 0 until visited */
+struct components
+{
+    int64_t *index;
+    int64_t *low;
+    char *on_stack;
+    int64_t *stack;
+    int64_t stack_len;
+    /* scope and next edge of each call being walked */
+    int64_t *frames;
+    int64_t *edges;
+    int64_t next_index;
+    /* definitions already warned about, one per instance would repeat */
+    char *reported;
+};
+
+
+/* instances in strongly connected component with more than one of
+   them, or one calling itself, call each other without end */
+static void report_component(struct program *program, struct workflow_builder *builder, struct call_graph *graph, struct components *walk, int64_t root)
+{
+    int64_t begin = walk->stack_len;
+    do
+    {
+        --begin;
+    } while (walk->stack[begin] != root);
+
+    int64_t recursive = walk->stack_len - begin > 1;
+    for (int64_t e = graph->offsets[root]; e < graph->offsets[root + 1] && !recursive; ++e)
+    {
+        recursive = graph->callees[e] == root;
+    }
+    for (int64_t i = begin; i < walk->stack_len; ++i)
+    {
+        int64_t definition = builder->scopes[walk->stack[i]].definition;
+        walk->on_stack[walk->stack[i]] = 0;
+        if (recursive && !walk->reported[definition])
+        {
+            walk->reported[definition] = 1;
+            program_log(program, LOG_WORKFLOW, LOG_WARNING, "Recursion outside of !if branch, it never stops calling itself", program->definitions[definition]->code_position, NULL);
+        }
+    }
+    walk->stack_len = begin;
+}
+
+
+/* iterative, so deep call chains don't overflow native stack */
+static void walk_components(struct program *program, struct workflow_builder *builder, struct call_graph *graph, struct components *walk, int64_t start)
+{
+    int64_t depth = 0;
+    walk->frames[depth] = start;
+    walk->edges[depth] = graph->offsets[start];
+    walk->index[start] = walk->low[start] = ++walk->next_index;
+    walk->on_stack[start] = 1;
+    walk->stack[walk->stack_len++] = start;
+
+    while (depth >= 0)
+    {
+        int64_t s = walk->frames[depth];
+        if (walk->edges[depth] < graph->offsets[s + 1])
+        {
+            int64_t callee = graph->callees[walk->edges[depth]++];
+            if (walk->index[callee] == 0)
+            {
+                ++depth;
+                walk->frames[depth] = callee;
+                walk->edges[depth] = graph->offsets[callee];
+                walk->index[callee] = walk->low[callee] = ++walk->next_index;
+                walk->on_stack[callee] = 1;
+                walk->stack[walk->stack_len++] = callee;
+            }
+            else if (walk->on_stack[callee] && walk->index[callee] < walk->low[s])
+            {
+                walk->low[s] = walk->index[callee];
+            }
+            continue;
+        }
+
+        if (walk->low[s] == walk->index[s])
+        {
+            report_component(program, builder, graph, walk, s);
+        }
+        if (--depth >= 0 && walk->low[s] < walk->low[walk->frames[depth]])
+        {
+            walk->low[walk->frames[depth]] = walk->low[s];
+        }
+    }
+}
+
+
+/* pipeline branches of !if are not built with the rest, see
+   program_instantiate_branch, so calls found while building are the
+   ones made as soon as instance runs. recursion among them calls
+   itself forever, so it is reported */
+void program_plan_branches(struct program *program, struct workflow_builder *builder)
+{
+    int64_t len = builder->scopes_len;
+    struct call_graph graph;
+    struct components walk;
+    memset(&walk, 0, sizeof(walk));
+    graph.offsets = program_alloc(program, sizeof(*graph.offsets) * (len + 1));
+    graph.callees = program_alloc(program, sizeof(*graph.callees) * (builder->calls_len + 1));
+    walk.index = program_alloc(program, sizeof(*walk.index) * (len + 1));
+    walk.low = program_alloc(program, sizeof(*walk.low) * (len + 1));
+    walk.on_stack = program_alloc(program, len + 1);
+    walk.stack = program_alloc(program, sizeof(*walk.stack) * (len + 1));
+    walk.frames = program_alloc(program, sizeof(*walk.frames) * (len + 1));
+    walk.edges = program_alloc(program, sizeof(*walk.edges) * (len + 1));
+    walk.reported = program_alloc(program, program->definitions_len + 1);
+
+    if (!program->memory.failed)
+    {
+        /* counting sort of calls by caller, index counts those placed */
+        memset(graph.offsets, 0, sizeof(*graph.offsets) * (len + 1));
+        memset(walk.index, 0, sizeof(*walk.index) * (len + 1));
+        for (int64_t i = 0; i < builder->calls_len; ++i)
+        {
+            graph.offsets[builder->calls[i].caller + 1]++;
+        }
+        for (int64_t s = 0; s < len; ++s)
+        {
+            graph.offsets[s + 1] += graph.offsets[s];
+        }
+        for (int64_t i = 0; i < builder->calls_len; ++i)
+        {
+            int64_t caller = builder->calls[i].caller;
+            graph.callees[graph.offsets[caller] + walk.index[caller]++] = builder->calls[i].callee;
+        }
+
+        memset(walk.index, 0, sizeof(*walk.index) * (len + 1));
+        memset(walk.on_stack, 0, len + 1);
+        memset(walk.reported, 0, program->definitions_len + 1);
+        for (int64_t s = 0; s < len; ++s)
+        {
+            if (walk.index[s] == 0)
+            {
+                walk_components(program, builder, &graph, &walk, s);
+            }
+        }
+    }
+
+    program_free(program, graph.offsets);
+    program_free(program, graph.callees);
+    program_free(program, walk.index);
+    program_free(program, walk.low);
+    program_free(program, walk.on_stack);
+    program_free(program, walk.stack);
+    program_free(program, walk.frames);
+    program_free(program, walk.edges);
+    program_free(program, walk.reported);
+}
+
+
+/* branch to instantiate once cond is known, NULL if there is none.
+   the other one is never built, so its workers are never scheduled */
+struct pipeline_worker_substitution *if_branch(struct pipeline_worker_definition *worker, int64_t cond)
+{
+    const char *name = cond ? "true" : "false";
+    for (int64_t i = 0; i < worker->subs_len; ++i)
+    {
+        if (strcmp(worker->subs[i].name, name) == 0)
+        {
+            return &worker->subs[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,314 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static int64_t is_boxed(int64_t type)
+{
+    int64_t kind = TYPE_KIND(type);
+    return kind != TYPE_BYTE && kind != TYPE_INT && kind != TYPE_DOUBLE;
+}
+
+
+/* limit is in bytes for whole process, 0 means no limit */
+struct memory_budget *memory_budget_create(int64_t limit, int64_t pipes_len, int64_t workers_len)
+{
+    struct memory_budget *budget = calloc(1, sizeof(*budget));
+    if (budget == NULL)
+    {
+        return NULL;
+    }
+    budget->limit = limit;
+    budget->pipes_len = pipes_len;
+    budget->workers_len = workers_len;
+    budget->pipe_bytes = calloc(pipes_len + 1, sizeof(*budget->pipe_bytes));
+    budget->pipe_peak_bytes = calloc(pipes_len + 1, sizeof(*budget->pipe_peak_bytes));
+    budget->worker_bytes = calloc(workers_len + 1, sizeof(*budget->worker_bytes));
+    budget->worker_peak_bytes = calloc(workers_len + 1, sizeof(*budget->worker_peak_bytes));
+    if (budget->pipe_bytes == NULL || budget->pipe_peak_bytes == NULL ||
+        budget->worker_bytes == NULL || budget->worker_peak_bytes == NULL)
+    {
+        memory_budget_destroy(budget);
+        return NULL;
+    }
+    return budget;
+}
+
+
+void memory_budget_destroy(struct memory_budget *budget)
+{
+    free(budget->pipe_bytes);
+    free(budget->pipe_peak_bytes);
+    free(budget->worker_bytes);
+    free(budget->worker_peak_bytes);
+    free(budget);
+}
+
+
+static void raise_peak(_Atomic int64_t *peak, int64_t bytes)
+{
+    int64_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (old < bytes && !atomic_compare_exchange_weak_explicit(peak, &old, bytes, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+
+/* reserves bytes if they fit into limit, returns 0 if they don't */
+static int64_t charge(struct memory_budget *budget, int64_t bytes)
+{
+    int64_t old = atomic_load_explicit(&budget->bytes, memory_order_relaxed);
+    do
+    {
+        if (budget->limit != 0 && old + bytes > budget->limit)
+        {
+            return 0;
+        }
+    }
+    while (!atomic_compare_exchange_weak_explicit(&budget->bytes, &old, old + bytes, memory_order_relaxed, memory_order_relaxed));
+
+    raise_peak(&budget->peak_bytes, old + bytes);
+    return 1;
+}
+
+
+int64_t memory_budget_charge_pipe(struct memory_budget *budget, int64_t pipe, int64_t bytes)
+{
+    if (!charge(budget, bytes))
+    {
+        return 0;
+    }
+    raise_peak(&budget->pipe_peak_bytes[pipe], atomic_fetch_add_explicit(&budget->pipe_bytes[pipe], bytes, memory_order_relaxed) + bytes);
+    return 1;
+}
+
+
+void memory_budget_release_pipe(struct memory_budget *budget, int64_t pipe, int64_t bytes)
+{
+    atomic_fetch_sub_explicit(&budget->pipe_bytes[pipe], bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&budget->bytes, bytes, memory_order_relaxed);
+}
+
+
+/* for scratch memory of worker, like reorder buffers or memo caches */
+int64_t memory_budget_charge_worker(struct memory_budget *budget, int64_t worker, int64_t bytes)
+{
+    if (!charge(budget, bytes))
+    {
+        return 0;
+    }
+    raise_peak(&budget->worker_peak_bytes[worker], atomic_fetch_add_explicit(&budget->worker_bytes[worker], bytes, memory_order_relaxed) + bytes);
+    return 1;
+}
+
+
+void memory_budget_release_worker(struct memory_budget *budget, int64_t worker, int64_t bytes)
+{
+    atomic_fetch_sub_explicit(&budget->worker_bytes[worker], bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&budget->bytes, bytes, memory_order_relaxed);
+}
+
+
+void memory_budget_report(FILE *stream, struct workflow *workflow, struct memory_budget *budget)
+{
+    fprintf(stream, "memory peak: %" PRId64 " bytes", atomic_load(&budget->peak_bytes));
+    if (budget->limit != 0)
+    {
+        fprintf(stream, " of %" PRId64 " budget", budget->limit);
+    }
+    fprintf(stream, "\n");
+    for (int64_t i = 0; i < budget->pipes_len && i < workflow->pipes_len; ++i)
+    {
+        int64_t peak = atomic_load(&budget->pipe_peak_bytes[i]);
+        if (peak != 0)
+        {
+            fprintf(stream, "pipe %" PRId64 ": %s peak %" PRId64 " bytes\n", i, workflow->pipe_names[i], peak);
+        }
+    }
+    for (int64_t i = 0; i < budget->workers_len && i < workflow->workers_len; ++i)
+    {
+        int64_t peak = atomic_load(&budget->worker_peak_bytes[i]);
+        if (peak != 0)
+        {
+            fprintf(stream, "worker %" PRId64 ": %s peak %" PRId64 " bytes\n", i, workflow->worker_names[i], peak);
+        }
+    }
+}
+
+
+/* ring takes what is left of budget, down to one item. spill == 0 or
+   boxed items make producers wait for consumer instead of spilling,
+   boxed values point to memory disk can't hold */
+int64_t bounded_pipe_init(struct bounded_pipe *pipe, struct memory_budget *budget, int64_t id, int64_t type, int64_t capacity, int64_t spill)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->budget = budget;
+    pipe->id = id;
+    pipe->spill_allowed = spill && !is_boxed(type);
+
+    int64_t element_size = type_element_size(type);
+    int64_t alloc = 1;
+    while (alloc < capacity)
+    {
+        alloc *= 2;
+    }
+    while (alloc > 1 && budget != NULL && !memory_budget_charge_pipe(budget, id, alloc * element_size))
+    {
+        alloc /= 2;
+    }
+    if (alloc == 1 && budget != NULL && !memory_budget_charge_pipe(budget, id, element_size))
+    {
+        /* one item is the least pipe can work with, it goes over budget */
+        atomic_fetch_add_explicit(&budget->bytes, element_size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&budget->pipe_bytes[id], element_size, memory_order_relaxed);
+    }
+    pipe->charged = alloc * element_size;
+
+    if (!typed_buffer_init(&pipe->buffer, type, alloc))
+    {
+        bounded_pipe_free(pipe);
+        return 0;
+    }
+    mtx_init(&pipe->lock, mtx_plain);
+    cnd_init(&pipe->not_full);
+    cnd_init(&pipe->not_empty);
+    pipe->sync_initialized = 1;
+    return 1;
+}
+
+
+void bounded_pipe_free(struct bounded_pipe *pipe)
+{
+    typed_buffer_free(&pipe->buffer);
+    if (pipe->budget != NULL && pipe->charged != 0)
+    {
+        memory_budget_release_pipe(pipe->budget, pipe->id, pipe->charged);
+        pipe->charged = 0;
+    }
+    if (pipe->spill_file != NULL)
+    {
+        fclose(pipe->spill_file);
+        pipe->spill_file = NULL;
+    }
+    if (pipe->sync_initialized)
+    {
+        mtx_destroy(&pipe->lock);
+        cnd_destroy(&pipe->not_full);
+        cnd_destroy(&pipe->not_empty);
+        pipe->sync_initialized = 0;
+    }
+}
+
+
+/* items in spill file are newer than ones in ring, so once something
+   is spilled every push goes to file until consumer drains it */
+static int64_t spill(struct bounded_pipe *pipe, const void *element)
+{
+    if (pipe->spill_file == NULL)
+    {
+        pipe->spill_file = tmpfile();
+        if (pipe->spill_file == NULL)
+        {
+            return 0;
+        }
+    }
+    int64_t element_size = pipe->buffer.element_size;
+    if (fseek(pipe->spill_file, pipe->spill_write * element_size, SEEK_SET) != 0 ||
+        fwrite(element, element_size, 1, pipe->spill_file) != 1)
+    {
+        return 0;
+    }
+    pipe->spill_write++;
+    pipe->spilled_total++;
+    return 1;
+}
+
+
+/* moves oldest spilled items into ring, sequentially from read offset */
+static void unspill(struct bounded_pipe *pipe)
+{
+    char chunk[4096];
+    int64_t element_size = pipe->buffer.element_size;
+    while (pipe->spill_read < pipe->spill_write && pipe->buffer.len < pipe->buffer.capacity)
+    {
+        int64_t count = pipe->spill_write - pipe->spill_read;
+        int64_t room = pipe->buffer.capacity - pipe->buffer.len;
+        count = count < room ? count : room;
+        count = count < (int64_t)sizeof(chunk) / element_size ? count : (int64_t)sizeof(chunk) / element_size;
+        if (fseek(pipe->spill_file, pipe->spill_read * element_size, SEEK_SET) != 0 ||
+            (int64_t)fread(chunk, element_size, count, pipe->spill_file) != count)
+        {
+            /* file went bad, what is in it is lost */
+            pipe->spill_read = pipe->spill_write;
+            break;
+        }
+        typed_buffer_push(&pipe->buffer, chunk, count);
+        pipe->spill_read += count;
+    }
+    if (pipe->spill_read == pipe->spill_write)
+    {
+        /* file is reused from its start */
+        pipe->spill_read = pipe->spill_write = 0;
+    }
+}
+
+
+/* blocks while ring is full and pipe can't spill, 0 once pipe is closed */
+int64_t bounded_pipe_push(struct bounded_pipe *pipe, const void *element)
+{
+    mtx_lock(&pipe->lock);
+    for (;;)
+    {
+        if (pipe->closed)
+        {
+            mtx_unlock(&pipe->lock);
+            return 0;
+        }
+        if (pipe->spill_write == 0 && pipe->buffer.len < pipe->buffer.capacity)
+        {
+            typed_buffer_push(&pipe->buffer, element, 1);
+            break;
+        }
+        if (pipe->spill_allowed && spill(pipe, element))
+        {
+            break;
+        }
+        pipe->producer_waits++;
+        cnd_wait(&pipe->not_full, &pipe->lock);
+    }
+    cnd_signal(&pipe->not_empty);
+    mtx_unlock(&pipe->lock);
+    return 1;
+}
+
+
+/* blocks while pipe is empty, 0 once it is closed and drained */
+int64_t bounded_pipe_pop(struct bounded_pipe *pipe, void *element)
+{
+    mtx_lock(&pipe->lock);
+    while (pipe->buffer.len == 0 && pipe->spill_write == 0 && !pipe->closed)
+    {
+        cnd_wait(&pipe->not_empty, &pipe->lock);
+    }
+    if (pipe->buffer.len == 0)
+    {
+        unspill(pipe);
+    }
+    int64_t popped = typed_buffer_pop(&pipe->buffer, element, 1);
+    cnd_signal(&pipe->not_full);
+    mtx_unlock(&pipe->lock);
+    return popped;
+}
+
+
+void bounded_pipe_close(struct bounded_pipe *pipe)
+{
+    mtx_lock(&pipe->lock);
+    pipe->closed = 1;
+    cnd_broadcast(&pipe->not_full);
+    cnd_broadcast(&pipe->not_empty);
+    mtx_unlock(&pipe->lock);
+}
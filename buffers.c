@@ -0,0 +1,157 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* scalars are stored unboxed, everything else as struct value */
+int64_t type_element_size(int64_t type)
+{
+    switch (TYPE_KIND(type))
+    {
+        case TYPE_BYTE:
+            return 1;
+        case TYPE_INT:
+            return sizeof(int64_t);
+        case TYPE_DOUBLE:
+            return sizeof(double);
+        default:
+            return sizeof(struct value);
+    }
+}
+
+
+/* capacity is rounded up to power of two, returns 0 if out of memory */
+int64_t typed_buffer_init(struct typed_buffer *buffer, int64_t type, int64_t capacity)
+{
+    int64_t alloc = 1;
+    while (alloc < capacity)
+    {
+        alloc *= 2;
+    }
+
+    buffer->type = type;
+    buffer->element_size = type_element_size(type);
+    buffer->head = 0;
+    buffer->len = 0;
+    buffer->capacity = alloc;
+    buffer->data = malloc(buffer->element_size * alloc);
+    return buffer->data != NULL;
+}
+
+
+static int64_t is_boxed(int64_t type)
+{
+    int64_t kind = TYPE_KIND(type);
+    return kind != TYPE_BYTE && kind != TYPE_INT && kind != TYPE_DOUBLE;
+}
+
+
+/* boxed values are owned by buffer while they are in it */
+void typed_buffer_free(struct typed_buffer *buffer)
+{
+    for (int64_t i = 0; buffer->data != NULL && is_boxed(buffer->type) && i < buffer->len; ++i)
+    {
+        value_release(((struct value *)buffer->data)[(buffer->head + i) & (buffer->capacity - 1)]);
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->len = 0;
+}
+
+
+/* copies up to count elements in, returns how many fit */
+int64_t typed_buffer_push(struct typed_buffer *buffer, const void *elements, int64_t count)
+{
+    int64_t mask = buffer->capacity - 1;
+    int64_t free_len = buffer->capacity - buffer->len;
+    count = count < free_len ? count : free_len;
+
+    /* at most two memcpy, before and after wrap around */
+    int64_t tail = (buffer->head + buffer->len) & mask;
+    int64_t first = count < buffer->capacity - tail ? count : buffer->capacity - tail;
+    memcpy(buffer->data + tail * buffer->element_size, elements, first * buffer->element_size);
+    memcpy(buffer->data, (const char *)elements + first * buffer->element_size, (count - first) * buffer->element_size);
+
+    buffer->len += count;
+    return count;
+}
+
+
+/* copies up to count elements out, returns how many there were */
+int64_t typed_buffer_pop(struct typed_buffer *buffer, void *elements, int64_t count)
+{
+    int64_t mask = buffer->capacity - 1;
+    count = count < buffer->len ? count : buffer->len;
+
+    int64_t first = count < buffer->capacity - buffer->head ? count : buffer->capacity - buffer->head;
+    memcpy(elements, buffer->data + buffer->head * buffer->element_size, first * buffer->element_size);
+    memcpy((char *)elements + first * buffer->element_size, buffer->data, (count - first) * buffer->element_size);
+
+    buffer->head = (buffer->head + count) & mask;
+    buffer->len -= count;
+    return count;
+}
+
+
+/* longest run of elements readable in place, for kernels working on
+   raw arrays. consume them with typed_buffer_skip */
+int64_t typed_buffer_peek(struct typed_buffer *buffer, void **elements)
+{
+    *elements = buffer->data + buffer->head * buffer->element_size;
+    int64_t run = buffer->capacity - buffer->head;
+    return buffer->len < run ? buffer->len : run;
+}
+
+
+void typed_buffer_skip(struct typed_buffer *buffer, int64_t count)
+{
+    count = count < buffer->len ? count : buffer->len;
+    buffer->head = (buffer->head + count) & (buffer->capacity - 1);
+    buffer->len -= count;
+}
+
+
+/* one buffer per pipe, typed as inferred by program_infer_types */
+struct typed_buffer *workflow_buffers_create(struct workflow *workflow, int64_t capacity)
+{
+    struct typed_buffer *buffers = calloc(workflow->pipes_len + 1, sizeof(*buffers));
+    if (buffers == NULL)
+    {
+        return NULL;
+    }
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        if (!typed_buffer_init(&buffers[i], workflow->pipe_types[i], capacity))
+        {
+            workflow_buffers_destroy(workflow, buffers);
+            return NULL;
+        }
+    }
+    return buffers;
+}
+
+
+void workflow_buffers_destroy(struct workflow *workflow, struct typed_buffer *buffers)
+{
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        typed_buffer_free(&buffers[i]);
+    }
+    free(buffers);
+}
+
+
+/* memory pipe buffers of whole workflow take with given capacity */
+int64_t workflow_buffers_bytes(struct workflow *workflow, int64_t capacity)
+{
+    int64_t bytes = 0;
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        bytes += type_element_size(workflow->pipe_types[i]) * capacity;
+    }
+    return bytes;
+}
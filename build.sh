@@ -0,0 +1,38 @@
+#!/bin/sh
+# linux counterpart of build.ps1: ./build.sh [bench|test]
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-cc}
+FLAGS="-g -std=gnu11 -fms-extensions $EXTRA_FLAGS"
+LIBS="-lpthread -lm -lrt"
+
+mkdir -p obj
+objects=""
+for f in *.c; do
+    o="obj/$f.o"
+    # rebuild if source or any header is newer than object
+    if [ ! -f "$o" ] || [ -n "$(find "$f" *.h -newer "$o" 2>/dev/null)" ]; then
+        echo "Building $f"
+        $CC $FLAGS -c "$f" -o "$o"
+    fi
+    objects="$objects $o"
+done
+echo "Linking..."
+$CC $FLAGS $objects -o a.out $LIBS
+
+if [ "$1" = "bench" ]; then
+    echo "Building bench"
+    # everything except the driver with main()
+    $CC $FLAGS -O2 -I. bench/bench.c $(ls *.c | grep -v '^parser\.c$') -o bench/bench $LIBS
+fi
+
+if [ "$1" = "test" ]; then
+    # tests link every object except the driver with main()
+    for t in tests/*.c; do
+        echo "Building $t"
+        $CC $FLAGS -I. "$t" $(echo $objects | tr ' ' '\n' | grep -v '^obj/parser\.c\.o$') -o "${t%.c}" $LIBS
+        "${t%.c}"
+    done
+    tests/smoke.sh ./a.out
+fi
@@ -0,0 +1,132 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* everything that is not here is either user definition or unknown */
+static const struct builtin builtins[] = {
+    { "!read", BUILTIN_EFFECTFUL, RESULT_FIXED, TYPE_STRING },
+    { "!print", BUILTIN_EFFECTFUL, RESULT_FIXED, TYPE_UNKNOWN },
+    /* path=NAME, bytes of file in order, see files.c */
+    { "!read_file", BUILTIN_EFFECTFUL, RESULT_FIXED, TYPE_BYTE },
+    { "!write_file", BUILTIN_EFFECTFUL, RESULT_FIXED, TYPE_UNKNOWN },
+    { "!rand", BUILTIN_EFFECTFUL, RESULT_FIXED, TYPE_INT },
+    { "!if", 0, RESULT_IF, TYPE_UNKNOWN },
+    { "!foreach", BUILTIN_ITERATOR, RESULT_FOREACH, TYPE_UNKNOWN },
+    /* iterators emit items one by one, so type is that of an item */
+    { "!str_iter", BUILTIN_ITERATOR, RESULT_FIXED, TYPE_BYTE },
+    { "!sum", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "!min", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "!max", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "!window", BUILTIN_STATEFUL, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "!lt", 0, RESULT_FIXED, TYPE_INT },
+    { "add", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "sub", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "mul", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "div", 0, RESULT_NUMERIC, TYPE_UNKNOWN },
+    { "range", BUILTIN_ITERATOR, RESULT_FIXED, TYPE_INT },
+};
+
+
+const struct builtin *builtin_find(const char *name)
+{
+    for (int64_t i = 0; i < (int64_t)(sizeof(builtins) / sizeof(builtins[0])); ++i)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+        {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
+static const struct
+{
+    const char *name;
+    enum window_operator op;
+} window_operators[] = {
+    { "!sum", WINDOW_SUM },
+    { "add", WINDOW_SUM },
+    { "mul", WINDOW_PRODUCT },
+    { "!min", WINDOW_MIN },
+    { "!max", WINDOW_MAX },
+};
+
+
+static int64_t parse_count(const char *symbol, int64_t *value)
+{
+    char *end = NULL;
+    long long parsed = strtoll(symbol, &end, 10);
+    if (end == symbol || *end != '\0' || parsed < 0)
+    {
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+
+/* program may be NULL, then nothing is logged */
+int64_t window_options_parse(struct program *program, struct pipeline_worker_definition *worker, struct window_options *options)
+{
+    int64_t has_op = 0;
+    options->op = WINDOW_SUM;
+    options->count = 0;
+    options->bytes = 0;
+    options->step = 1;
+
+    for (int64_t i = 0; i < worker->subs_len; ++i)
+    {
+        struct pipeline_worker_substitution *sub = &worker->subs[i];
+        char *message = NULL;
+        if (sub->type != SUBSTITUTION_SYMBOL)
+        {
+            message = "Argument of !window must be name or number, not pipeline";
+        }
+        else if (strcmp(sub->name, "f") == 0)
+        {
+            message = "!window supports only f=!sum, add, mul, !min or !max";
+            for (int64_t k = 0; k < (int64_t)(sizeof(window_operators) / sizeof(window_operators[0])); ++k)
+            {
+                if (strcmp(window_operators[k].name, sub->symbol) == 0)
+                {
+                    options->op = window_operators[k].op;
+                    has_op = 1;
+                    message = NULL;
+                }
+            }
+        }
+        else if (strcmp(sub->name, "count") == 0 || strcmp(sub->name, "bytes") == 0 || strcmp(sub->name, "step") == 0)
+        {
+            int64_t *value = sub->name[0] == 'c' ? &options->count : sub->name[0] == 'b' ? &options->bytes : &options->step;
+            message = parse_count(sub->symbol, value) ? NULL : "Argument of !window must be non negative number";
+        }
+        else
+        {
+            message = "Unknown argument of !window, expected f, count, bytes or step";
+        }
+
+        if (message != NULL)
+        {
+            if (program != NULL)
+            {
+                program_log(program, LOG_WORKFLOW, LOG_ERROR, message, sub->code_position, NULL);
+            }
+            return 0;
+        }
+    }
+
+    if (!has_op || (options->count == 0) == (options->bytes == 0))
+    {
+        if (program != NULL)
+        {
+            program_log(program, LOG_WORKFLOW, LOG_ERROR, "!window needs f and exactly one of count or bytes", worker->code_position, NULL);
+        }
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,146 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *status_names[] = {
+    [COMPILE_OK] = "ok",
+    [COMPILE_FAILED] = "failed",
+    [COMPILE_NO_MEMORY] = "no memory",
+    [COMPILE_INVALID_ARGUMENT] = "invalid argument",
+};
+
+
+const char *compile_status_name(enum compile_status status)
+{
+    return status_names[status];
+}
+
+
+struct compiler *compiler_create(struct compiler_options *options)
+{
+    struct compiler *compiler = malloc(sizeof(*compiler));
+    if (compiler == NULL)
+    {
+        return NULL;
+    }
+
+    if (options != NULL)
+    {
+        compiler->options = *options;
+    }
+    else
+    {
+        compiler->options = (struct compiler_options){
+            .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_OPTIMIZE | STAGE_TYPES,
+            .dump_stream = NULL,
+            .memory_limit = 0,
+            .profile = NULL,
+            .profile_len = 0,
+        };
+    }
+
+    return compiler;
+}
+
+
+void compiler_destroy(struct compiler *compiler)
+{
+    free(compiler);
+}
+
+
+/* compiles code_len bytes of code, stages == 0 means compiler defaults.
+   *result is set whenever program could be created, even on failure,
+   so diagnostics can be rendered; caller destroys it with program_destroy */
+enum compile_status compiler_compile(struct compiler *compiler, const char *filename, const char *code, int64_t code_len, int64_t stages, struct program **result)
+{
+    *result = NULL;
+
+    if (compiler == NULL || filename == NULL || code == NULL || code_len < 0)
+    {
+        return COMPILE_INVALID_ARGUMENT;
+    }
+
+    if (stages == 0)
+    {
+        stages = compiler->options.stages;
+    }
+    if (stages & (STAGE_WORKFLOW | STAGE_WORKFLOW_DUMP | STAGE_OPTIMIZE | STAGE_MEMOIZE | STAGE_TYPES))
+    {
+        stages |= STAGE_PARSE | STAGE_WORKFLOW;
+    }
+    if (stages & STAGE_AST_DUMP)
+    {
+        stages |= STAGE_PARSE;
+    }
+
+    FILE *dump_stream = compiler->options.dump_stream;
+
+    struct program *program = program_create(filename, code, code_len, compiler->options.memory_limit);
+    if (program == NULL)
+    {
+        return COMPILE_NO_MEMORY;
+    }
+    *result = program;
+
+    if (stages & STAGE_PARSE)
+    {
+        program_parse(program);
+    }
+    if (program->memory.failed)
+    {
+        return COMPILE_NO_MEMORY;
+    }
+
+    if ((stages & STAGE_AST_DUMP) && dump_stream != NULL)
+    {
+        program_ast_dump(dump_stream, program);
+    }
+
+    /* partially parsed definitions can't be built */
+    if ((stages & STAGE_WORKFLOW) && program->log.level_counts[LOG_ERROR] == 0)
+    {
+        program_get_workflow(program);
+        if (program->memory.failed)
+        {
+            return COMPILE_NO_MEMORY;
+        }
+
+        if ((stages & STAGE_OPTIMIZE) && program->log.level_counts[LOG_ERROR] == 0)
+        {
+            program_optimize_workflow(program);
+            program_hoist_invariants(program);
+            if (program->memory.failed)
+            {
+                return COMPILE_NO_MEMORY;
+            }
+        }
+
+        if (stages & STAGE_TYPES)
+        {
+            program_infer_types(program);
+        }
+
+        if (compiler->options.profile != NULL)
+        {
+            program_apply_profile(program, compiler->options.profile, compiler->options.profile_len);
+        }
+
+        /* purity is known once workflow is built */
+        if (stages & STAGE_MEMOIZE)
+        {
+            program_plan_memoization(program);
+        }
+
+        if ((stages & STAGE_WORKFLOW_DUMP) && dump_stream != NULL)
+        {
+            program_workflow_dump(dump_stream, program);
+        }
+    }
+
+    return program->log.level_counts[LOG_ERROR] == 0 ? COMPILE_OK : COMPILE_FAILED;
+}
@@ -0,0 +1,476 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include "sys/mman.h"
+#include "unistd.h"
+#endif
+
+/* swapcontext saves and restores signal mask, a syscall on every
+   switch, so x86-64 ELF switches stacks by hand. shadow stacks of CET
+   would see returns to other stacks, those builds keep ucontext */
+#if defined(__x86_64__) && defined(__ELF__) && !(defined(__CET__) && (__CET__ & 2))
+#define FIBER_SWITCH_ASM
+#elif !defined(_WIN32)
+#include "ucontext.h"
+#endif
+
+
+#define DEFAULT_FIBER_STACK (32 * 1024)
+/* every guard page splits its stack mapping in two, kernel caps them
+   per process at vm.max_map_count, 65530 by default. stacks past this
+   many go unguarded, so neighbouring ones merge into one mapping */
+#define MAX_GUARDED_STACKS 16384
+
+
+#ifdef FIBER_SWITCH_ASM
+/* pushes callee saved registers of System V ABI, MXCSR and x87 control
+   word included, stores stack pointer to *from and pops them back from
+   stack at to, whose return address resumes it */
+__attribute__((visibility("hidden"))) void fiber_switch_stacks(void **from, void *to);
+__asm__(
+    ".text\n"
+    ".globl fiber_switch_stacks\n"
+    ".hidden fiber_switch_stacks\n"
+    ".type fiber_switch_stacks, @function\n"
+    ".p2align 4\n"
+    "fiber_switch_stacks:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fiber_switch_stacks, .-fiber_switch_stacks\n");
+#endif
+
+
+enum fiber_state
+{
+    FIBER_FREE,
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_PARKED,
+};
+
+/* finished fibers keep their stack and wait in free list for the next
+   spawn, so stacks are pooled and never set up twice */
+struct fiber
+{
+#ifdef _WIN32
+    void *handle;
+#else
+#ifdef FIBER_SWITCH_ASM
+    /* where fiber_switch_stacks left registers of fiber */
+    void *sp;
+#else
+    ucontext_t context;
+#endif
+    /* mapping of stack_len, guard page at its low end if guarded */
+    char *stack;
+    int64_t guarded;
+#endif
+    fiber_function function;
+    void *arg;
+    enum fiber_state state;
+    /* link in ready queue, wait list or free list, -1 ends it */
+    int64_t next;
+};
+
+
+/* fibers switch only within thread that runs their scheduler */
+static _Thread_local struct fiber_scheduler *running_scheduler;
+#ifndef _WIN32
+/* of all schedulers, see MAX_GUARDED_STACKS */
+static _Atomic int64_t guarded_stacks;
+#endif
+
+
+static void switch_to_scheduler(struct fiber_scheduler *scheduler, struct fiber *fiber)
+{
+#ifdef _WIN32
+    (void)fiber;
+    SwitchToFiber(scheduler->main_context);
+#elif defined(FIBER_SWITCH_ASM)
+    fiber_switch_stacks(&fiber->sp, scheduler->main_context);
+#else
+    swapcontext(&fiber->context, scheduler->main_context);
+#endif
+}
+
+
+#ifndef _WIN32
+/* stack rounded up to pages and its guard page */
+static int64_t stack_len(struct fiber_scheduler *scheduler)
+{
+    int64_t page = sysconf(_SC_PAGESIZE);
+    return (scheduler->stack_size + page - 1) / page * page + page;
+}
+#endif
+
+
+#ifdef _WIN32
+static void WINAPI fiber_main(void *arg)
+{
+    (void)arg;
+#else
+static void fiber_main(void)
+{
+#endif
+    for (;;)
+    {
+        struct fiber_scheduler *scheduler = running_scheduler;
+        struct fiber *self = scheduler->fibers[scheduler->current];
+        self->function(self->arg);
+        self->state = FIBER_FREE;
+        switch_to_scheduler(running_scheduler, self);
+    }
+}
+
+
+/* stack_size 0 means default of 32 KiB */
+struct fiber_scheduler *fiber_scheduler_create(int64_t stack_size)
+{
+    struct fiber_scheduler *scheduler = calloc(1, sizeof(*scheduler));
+    if (scheduler == NULL)
+    {
+        return NULL;
+    }
+    scheduler->stack_size = stack_size > 0 ? stack_size : DEFAULT_FIBER_STACK;
+    scheduler->current = -1;
+    scheduler->free_head = -1;
+    scheduler->ready_head = -1;
+    scheduler->ready_tail = -1;
+
+#if !defined(_WIN32) && !defined(FIBER_SWITCH_ASM)
+    scheduler->main_context = malloc(sizeof(ucontext_t));
+    if (scheduler->main_context == NULL)
+    {
+        free(scheduler);
+        return NULL;
+    }
+#endif
+    return scheduler;
+}
+
+
+void fiber_scheduler_destroy(struct fiber_scheduler *scheduler)
+{
+    for (int64_t i = 0; i < scheduler->fibers_len; ++i)
+    {
+#ifdef _WIN32
+        DeleteFiber(scheduler->fibers[i]->handle);
+#else
+        munmap(scheduler->fibers[i]->stack, stack_len(scheduler));
+        atomic_fetch_sub(&guarded_stacks, scheduler->fibers[i]->guarded);
+#endif
+        free(scheduler->fibers[i]);
+    }
+    free(scheduler->fibers);
+#if !defined(_WIN32) && !defined(FIBER_SWITCH_ASM)
+    free(scheduler->main_context);
+#endif
+    free(scheduler);
+}
+
+
+static void make_ready(struct fiber_scheduler *scheduler, int64_t id)
+{
+    struct fiber *fiber = scheduler->fibers[id];
+    fiber->state = FIBER_READY;
+    fiber->next = -1;
+    if (scheduler->ready_tail == -1)
+    {
+        scheduler->ready_head = id;
+    }
+    else
+    {
+        scheduler->fibers[scheduler->ready_tail]->next = id;
+    }
+    scheduler->ready_tail = id;
+}
+
+
+static int64_t new_fiber(struct fiber_scheduler *scheduler)
+{
+    if (scheduler->fibers_len == scheduler->fibers_alloc)
+    {
+        int64_t alloc = 2*scheduler->fibers_alloc + !scheduler->fibers_alloc;
+        struct fiber **fibers = realloc(scheduler->fibers, sizeof(*fibers) * alloc);
+        if (fibers == NULL)
+        {
+            return -1;
+        }
+        scheduler->fibers = fibers;
+        scheduler->fibers_alloc = alloc;
+    }
+
+    /* fibers are allocated one by one, saved contexts must not move */
+    struct fiber *fiber = calloc(1, sizeof(*fiber));
+    if (fiber == NULL)
+    {
+        return -1;
+    }
+#ifdef _WIN32
+    fiber->handle = CreateFiber(scheduler->stack_size, fiber_main, NULL);
+    if (fiber->handle == NULL)
+    {
+        free(fiber);
+        return -1;
+    }
+#else
+    int64_t len = stack_len(scheduler);
+    int64_t page = sysconf(_SC_PAGESIZE);
+    fiber->stack = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fiber->stack == MAP_FAILED)
+    {
+        free(fiber);
+        return -1;
+    }
+    /* overflow faults instead of writing into neighbour */
+    fiber->guarded = atomic_fetch_add(&guarded_stacks, 1) < MAX_GUARDED_STACKS &&
+                     mprotect(fiber->stack, page, PROT_NONE) == 0;
+    if (!fiber->guarded)
+    {
+        atomic_fetch_sub(&guarded_stacks, 1);
+    }
+#ifdef FIBER_SWITCH_ASM
+    /* frame fiber_switch_stacks pops: control words, six registers and
+       fiber_main as return address, whose own return address is never
+       used and keeps ABI alignment at its entry */
+    void **top = (void **)(fiber->stack + len);
+    memset(top - 9, 0, 9 * sizeof(*top));
+    top[-2] = (void *)(uintptr_t)fiber_main;
+    uint32_t control[2] = { 0x1F80, 0x037F };
+    memcpy(top - 9, control, sizeof(control));
+    fiber->sp = top - 9;
+#else
+    if (getcontext(&fiber->context) != 0)
+    {
+        munmap(fiber->stack, len);
+        free(fiber);
+        return -1;
+    }
+    fiber->context.uc_stack.ss_sp = fiber->stack + page;
+    fiber->context.uc_stack.ss_size = len - page;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_main, 0);
+#endif
+#endif
+
+    scheduler->fibers[scheduler->fibers_len] = fiber;
+    return scheduler->fibers_len++;
+}
+
+
+/* function runs on fiber once scheduler gets to it, -1 if out of memory */
+int64_t fiber_spawn(struct fiber_scheduler *scheduler, fiber_function function, void *arg)
+{
+    int64_t id = scheduler->free_head;
+    if (id != -1)
+    {
+        scheduler->free_head = scheduler->fibers[id]->next;
+    }
+    else
+    {
+        id = new_fiber(scheduler);
+        if (id == -1)
+        {
+            return -1;
+        }
+    }
+
+    scheduler->fibers[id]->function = function;
+    scheduler->fibers[id]->arg = arg;
+    scheduler->alive++;
+    make_ready(scheduler, id);
+    return id;
+}
+
+
+/* called from fiber, lets every other ready fiber run first */
+void fiber_yield(struct fiber_scheduler *scheduler)
+{
+    int64_t id = scheduler->current;
+    make_ready(scheduler, id);
+    switch_to_scheduler(scheduler, scheduler->fibers[id]);
+}
+
+
+/* called from fiber, it doesn't run again until fiber_wake */
+void fiber_park(struct fiber_scheduler *scheduler)
+{
+    int64_t id = scheduler->current;
+    scheduler->fibers[id]->state = FIBER_PARKED;
+    switch_to_scheduler(scheduler, scheduler->fibers[id]);
+}
+
+
+void fiber_wake(struct fiber_scheduler *scheduler, int64_t id)
+{
+    if (scheduler->fibers[id]->state == FIBER_PARKED)
+    {
+        make_ready(scheduler, id);
+    }
+}
+
+
+/* runs ready fibers on calling thread until there are none, returns
+   number of fibers left parked, nonzero means they wait for each other */
+int64_t fiber_scheduler_run(struct fiber_scheduler *scheduler)
+{
+    struct fiber_scheduler *outer = running_scheduler;
+    running_scheduler = scheduler;
+#ifdef _WIN32
+    /* fiber of outer scheduler is already fiber */
+    void *thread_fiber = outer == NULL ? ConvertThreadToFiber(NULL) : NULL;
+    scheduler->main_context = GetCurrentFiber();
+#endif
+
+    while (scheduler->ready_head != -1)
+    {
+        int64_t id = scheduler->ready_head;
+        struct fiber *fiber = scheduler->fibers[id];
+        scheduler->ready_head = fiber->next;
+        if (scheduler->ready_head == -1)
+        {
+            scheduler->ready_tail = -1;
+        }
+
+        fiber->state = FIBER_RUNNING;
+        scheduler->current = id;
+        scheduler->switches++;
+#ifdef _WIN32
+        SwitchToFiber(fiber->handle);
+#elif defined(FIBER_SWITCH_ASM)
+        fiber_switch_stacks(&scheduler->main_context, fiber->sp);
+#else
+        swapcontext(scheduler->main_context, &fiber->context);
+#endif
+        scheduler->current = -1;
+
+        if (fiber->state == FIBER_FREE)
+        {
+            fiber->next = scheduler->free_head;
+            scheduler->free_head = id;
+            scheduler->alive--;
+        }
+    }
+
+#ifdef _WIN32
+    if (thread_fiber != NULL)
+    {
+        ConvertFiberToThread();
+    }
+#endif
+    running_scheduler = outer;
+    return scheduler->alive;
+}
+
+
+/* capacity is rounded up to power of two, returns 0 if out of memory */
+int64_t fiber_pipe_init(struct fiber_pipe *pipe, int64_t type, int64_t capacity)
+{
+    pipe->readers_head = pipe->readers_tail = -1;
+    pipe->writers_head = pipe->writers_tail = -1;
+    pipe->closed = 0;
+    return typed_buffer_init(&pipe->buffer, type, capacity);
+}
+
+
+void fiber_pipe_free(struct fiber_pipe *pipe)
+{
+    typed_buffer_free(&pipe->buffer);
+}
+
+
+static void wait_on(struct fiber_scheduler *scheduler, int64_t *head, int64_t *tail)
+{
+    int64_t id = scheduler->current;
+    scheduler->fibers[id]->next = -1;
+    if (*tail == -1)
+    {
+        *head = id;
+    }
+    else
+    {
+        scheduler->fibers[*tail]->next = id;
+    }
+    *tail = id;
+    fiber_park(scheduler);
+}
+
+
+static void wake_all(struct fiber_scheduler *scheduler, int64_t *head, int64_t *tail)
+{
+    while (*head != -1)
+    {
+        int64_t id = *head;
+        *head = scheduler->fibers[id]->next;
+        fiber_wake(scheduler, id);
+    }
+    *tail = -1;
+}
+
+
+/* blocks fiber, never thread, while pipe is full */
+int64_t fiber_pipe_write(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe, const void *element)
+{
+    while (pipe->buffer.len == pipe->buffer.capacity && !pipe->closed)
+    {
+        wait_on(scheduler, &pipe->writers_head, &pipe->writers_tail);
+    }
+    if (pipe->closed)
+    {
+        return 0;
+    }
+    typed_buffer_push(&pipe->buffer, element, 1);
+    wake_all(scheduler, &pipe->readers_head, &pipe->readers_tail);
+    return 1;
+}
+
+
+/* blocks fiber while pipe is empty, returns 0 once it is closed and drained */
+int64_t fiber_pipe_read(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe, void *element)
+{
+    while (pipe->buffer.len == 0 && !pipe->closed)
+    {
+        wait_on(scheduler, &pipe->readers_head, &pipe->readers_tail);
+    }
+    if (pipe->buffer.len == 0)
+    {
+        return 0;
+    }
+    typed_buffer_pop(&pipe->buffer, element, 1);
+    wake_all(scheduler, &pipe->writers_head, &pipe->writers_tail);
+    return 1;
+}
+
+
+void fiber_pipe_close(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe)
+{
+    pipe->closed = 1;
+    wake_all(scheduler, &pipe->readers_head, &pipe->readers_tail);
+    wake_all(scheduler, &pipe->writers_head, &pipe->writers_tail);
+}
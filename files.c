@@ -0,0 +1,578 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "fcntl.h"
+
+#ifdef _WIN32
+#include "io.h"
+#else
+#include "unistd.h"
+#endif
+
+#ifdef __linux__
+#include "errno.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "sys/uio.h"
+#include "linux/io_uring.h"
+#endif
+
+
+#define MAX_FILE_DEPTH 64
+
+
+#ifdef __linux__
+
+/* rings are mapped from kernel, there is no liburing to lean on */
+struct file_ring
+{
+    int fd;
+    /* registered buffers, block i of memory is buffer i */
+    int64_t fixed;
+    uint32_t pending;
+
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    _Atomic uint32_t *sq_head;
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t *sq_array;
+
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+
+static void ring_destroy(struct file_ring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+
+/* returns NULL if kernel has no io_uring or doesn't let us use it */
+static struct file_ring *ring_create(char *memory, int64_t block_size, int64_t depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct file_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_map_len = ring->sq_map_len > ring->cq_map_len ? ring->sq_map_len : ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_map :
+                   mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        ring_destroy(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (_Atomic uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    char *cq = ring->cq_map;
+    ring->cq_head = (_Atomic uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* pinned buffers save kernel mapping pages on every request, when
+       memlock limit doesn't allow it plain reads and writes are used */
+    struct iovec iovecs[MAX_FILE_DEPTH];
+    for (int64_t i = 0; i < depth; ++i)
+    {
+        iovecs[i].iov_base = memory + i * block_size;
+        iovecs[i].iov_len = block_size;
+    }
+    ring->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, (unsigned)depth) == 0;
+    return ring;
+}
+
+
+static void ring_submit(struct file_ring *ring, int fd, int64_t write, int64_t slot, char *data, int64_t len, int64_t offset)
+{
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED) : (write ? IORING_OP_WRITE : IORING_OP_READ);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = ring->fixed ? (uint16_t)slot : 0;
+    sqe->user_data = (uint64_t)slot;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->pending++;
+}
+
+
+/* submits what is queued, waits for at least min_complete completions */
+static int64_t ring_enter(struct file_ring *ring, int64_t min_complete)
+{
+    for (;;)
+    {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, (unsigned)min_complete,
+                                min_complete != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0)
+        {
+            ring->pending -= submitted;
+            return 1;
+        }
+        if (errno != EINTR && errno != EAGAIN)
+        {
+            return 0;
+        }
+    }
+}
+
+
+/* returns slot of next completion and its result, 0 if there is none */
+static int64_t ring_reap(struct file_ring *ring, int64_t *slot, int64_t *result)
+{
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire))
+    {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *slot = (int64_t)cqe->user_data;
+    *result = cqe->res;
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+    return 1;
+}
+
+#else
+
+/* never created, blocks go through pread and pwrite */
+struct file_ring
+{
+    int fd;
+    uint32_t pending;
+};
+
+
+static struct file_ring *ring_create(char *memory, int64_t block_size, int64_t depth)
+{
+    (void)memory, (void)block_size, (void)depth;
+    return NULL;
+}
+
+
+static void ring_destroy(struct file_ring *ring)
+{
+    (void)ring;
+}
+
+
+static void ring_submit(struct file_ring *ring, int fd, int64_t write, int64_t slot, char *data, int64_t len, int64_t offset)
+{
+    (void)ring, (void)fd, (void)write, (void)slot, (void)data, (void)len, (void)offset;
+}
+
+
+static int64_t ring_enter(struct file_ring *ring, int64_t min_complete)
+{
+    (void)ring, (void)min_complete;
+    return 0;
+}
+
+
+static int64_t ring_reap(struct file_ring *ring, int64_t *slot, int64_t *result)
+{
+    (void)ring, (void)slot, (void)result;
+    return 0;
+}
+
+#endif
+
+
+static int64_t positioned_io(int fd, int64_t write, char *data, int64_t len, int64_t offset)
+{
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0)
+    {
+        return -1;
+    }
+    return write ? _write(fd, data, (unsigned)len) : _read(fd, data, (unsigned)len);
+#else
+    return write ? pwrite(fd, data, len, offset) : pread(fd, data, len, offset);
+#endif
+}
+
+
+static void close_fd(int fd)
+{
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+
+/* rest of block goes out. without ring it's done before this returns */
+static int64_t transfer(struct file_ring *ring, int fd, int64_t write, int64_t slot, struct file_block *block)
+{
+    if (ring != NULL)
+    {
+        block->in_flight = 1;
+        ring_submit(ring, fd, write, slot, block->data + block->done, block->want - block->done, block->offset + block->done);
+        return 1;
+    }
+    while (block->done < block->want)
+    {
+        int64_t result = positioned_io(fd, write, block->data + block->done, block->want - block->done, block->offset + block->done);
+        if (result < 0 || (result == 0 && write))
+        {
+            return 0;
+        }
+        if (result == 0)
+        {
+            /* file got shorter since it was opened */
+            block->want = block->done;
+        }
+        block->done += result;
+    }
+    return 1;
+}
+
+
+/* handles completions until block is done, or only ones already there
+   if wait is 0. short transfers are submitted again for the rest */
+static int64_t complete(struct file_ring *ring, int fd, int64_t write, struct file_block *blocks, struct file_block *block, int64_t wait)
+{
+    if (ring == NULL)
+    {
+        return 1;
+    }
+    if (ring->pending != 0 && !ring_enter(ring, 0))
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        int64_t slot, result;
+        while (ring_reap(ring, &slot, &result))
+        {
+            struct file_block *done = &blocks[slot];
+            done->in_flight = 0;
+            if (result < 0 || (result == 0 && write))
+            {
+                return 0;
+            }
+            if (result == 0)
+            {
+                done->want = done->done;
+            }
+            done->done += result;
+            if (done->done < done->want)
+            {
+                transfer(ring, fd, write, slot, done);
+            }
+        }
+        if (!block->in_flight || !wait)
+        {
+            return 1;
+        }
+        if (!ring_enter(ring, 1))
+        {
+            return 0;
+        }
+    }
+}
+
+
+static int64_t setup_blocks(char **memory, struct file_block **blocks, int64_t *block_size, int64_t *depth)
+{
+    *block_size = *block_size > 0 ? *block_size : 1 << 20;
+    *depth = *depth < 1 ? 1 : *depth > MAX_FILE_DEPTH ? MAX_FILE_DEPTH : *depth;
+    *memory = malloc(*block_size * *depth);
+    *blocks = calloc(*depth, sizeof(**blocks));
+    if (*memory == NULL || *blocks == NULL)
+    {
+        free(*memory);
+        free(*blocks);
+        return 0;
+    }
+    for (int64_t i = 0; i < *depth; ++i)
+    {
+        (*blocks)[i].data = *memory + i * *block_size;
+    }
+    return 1;
+}
+
+
+/* keeps reads in flight while there are free blocks and file goes on */
+static void read_ahead(struct file_source *source)
+{
+    while (source->submitted < source->depth && source->next_offset < source->size && !source->failed)
+    {
+        int64_t slot = (source->head + source->submitted) % source->depth;
+        struct file_block *block = &source->blocks[slot];
+        block->offset = source->next_offset;
+        block->want = source->size - source->next_offset < source->block_size ? source->size - source->next_offset : source->block_size;
+        block->done = 0;
+        block->delivered = 0;
+        /* pread shortens want right away if file got shorter */
+        source->next_offset += block->want;
+        source->submitted++;
+        source->failed |= !transfer(source->ring, source->fd, 0, slot, block);
+    }
+}
+
+
+/* regular files only, size is taken once. block_size 0 means 1 MiB,
+   depth is clamped to 1..64 */
+int64_t file_source_open(struct file_source *source, const char *path, int64_t block_size, int64_t depth)
+{
+    memset(source, 0, sizeof(*source));
+#ifdef _WIN32
+    source->fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    source->fd = open(path, O_RDONLY);
+#endif
+    if (source->fd < 0)
+    {
+        return 0;
+    }
+#ifdef _WIN32
+    source->size = _lseeki64(source->fd, 0, SEEK_END);
+#else
+    source->size = lseek(source->fd, 0, SEEK_END);
+#endif
+    if (source->size < 0 || !setup_blocks(&source->memory, &source->blocks, &block_size, &depth))
+    {
+        close_fd(source->fd);
+        return 0;
+    }
+    source->block_size = block_size;
+    source->depth = depth;
+    source->ring = ring_create(source->memory, block_size, depth);
+    read_ahead(source);
+    return 1;
+}
+
+
+/* pushes bytes into buffer of TYPE_BYTE pipe in file order, whole
+   blocks at once while they fit. waits only if nothing was ready.
+   returns bytes pushed, -1 on error */
+int64_t file_source_next(struct file_source *source, struct typed_buffer *buffer)
+{
+    if (buffer->element_size != 1)
+    {
+        return -1;
+    }
+    int64_t pushed = 0;
+    while (source->submitted != 0 && !source->failed)
+    {
+        struct file_block *block = &source->blocks[source->head];
+        if (!complete(source->ring, source->fd, 0, source->blocks, block, pushed == 0))
+        {
+            source->failed = 1;
+            break;
+        }
+        if (block->in_flight)
+        {
+            break;
+        }
+        int64_t count = typed_buffer_push(buffer, block->data + block->delivered, block->done - block->delivered);
+        block->delivered += count;
+        pushed += count;
+        if (block->delivered < block->done)
+        {
+            break;
+        }
+        /* block is free for next read while pipe is consumed */
+        source->head = (source->head + 1) % source->depth;
+        source->submitted--;
+        read_ahead(source);
+    }
+    source->delivered += pushed;
+    return source->failed ? -1 : pushed;
+}
+
+
+int64_t file_source_finished(struct file_source *source)
+{
+    return source->failed || (source->submitted == 0 && source->next_offset >= source->size);
+}
+
+
+void file_source_close(struct file_source *source)
+{
+    /* kernel may still write into blocks, they are waited for first */
+    for (int64_t i = 0; source->ring != NULL && i < source->depth; ++i)
+    {
+        if (!complete(source->ring, source->fd, 0, source->blocks, &source->blocks[i], 1))
+        {
+            break;
+        }
+    }
+    if (source->ring != NULL)
+    {
+        ring_destroy(source->ring);
+    }
+    close_fd(source->fd);
+    free(source->memory);
+    free(source->blocks);
+    memset(source, 0, sizeof(*source));
+    source->fd = -1;
+}
+
+
+/* file is created or truncated */
+int64_t file_sink_open(struct file_sink *sink, const char *path, int64_t block_size, int64_t depth)
+{
+    memset(sink, 0, sizeof(*sink));
+#ifdef _WIN32
+    sink->fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (sink->fd < 0)
+    {
+        return 0;
+    }
+    if (!setup_blocks(&sink->memory, &sink->blocks, &block_size, &depth))
+    {
+        close_fd(sink->fd);
+        return 0;
+    }
+    sink->block_size = block_size;
+    sink->depth = depth;
+    sink->ring = ring_create(sink->memory, block_size, depth);
+    return 1;
+}
+
+
+/* filled block goes out, next one to fill is oldest in flight */
+static void flush_block(struct file_sink *sink)
+{
+    struct file_block *block = &sink->blocks[sink->fill];
+    block->offset = sink->next_offset;
+    block->done = 0;
+    sink->next_offset += block->want;
+    sink->failed |= !transfer(sink->ring, sink->fd, 1, sink->fill, block);
+
+    sink->fill = (sink->fill + 1) % sink->depth;
+    block = &sink->blocks[sink->fill];
+    sink->failed |= !complete(sink->ring, sink->fd, 1, sink->blocks, block, 1);
+    block->want = 0;
+}
+
+
+/* returns 0 once some write failed */
+int64_t file_sink_write(struct file_sink *sink, const void *data, int64_t len)
+{
+    const char *bytes = data;
+    while (len > 0 && !sink->failed)
+    {
+        struct file_block *block = &sink->blocks[sink->fill];
+        int64_t count = sink->block_size - block->want < len ? sink->block_size - block->want : len;
+        memcpy(block->data + block->want, bytes, count);
+        block->want += count;
+        bytes += count;
+        len -= count;
+        if (block->want == sink->block_size)
+        {
+            flush_block(sink);
+        }
+    }
+    return !sink->failed;
+}
+
+
+/* takes everything out of buffer of TYPE_BYTE pipe, returns bytes
+   written, -1 on error */
+int64_t file_sink_drain(struct file_sink *sink, struct typed_buffer *buffer)
+{
+    if (buffer->element_size != 1)
+    {
+        return -1;
+    }
+    int64_t written = 0;
+    while (buffer->len != 0)
+    {
+        void *bytes;
+        int64_t count = typed_buffer_peek(buffer, &bytes);
+        if (!file_sink_write(sink, bytes, count))
+        {
+            return -1;
+        }
+        typed_buffer_skip(buffer, count);
+        written += count;
+    }
+    return written;
+}
+
+
+/* writes last partial block and waits for all, returns 0 if any failed */
+int64_t file_sink_close(struct file_sink *sink)
+{
+    if (sink->blocks[sink->fill].want != 0 && !sink->failed)
+    {
+        flush_block(sink);
+    }
+    for (int64_t i = 0; sink->ring != NULL && i < sink->depth; ++i)
+    {
+        sink->failed |= !complete(sink->ring, sink->fd, 1, sink->blocks, &sink->blocks[i], 1);
+    }
+    if (sink->ring != NULL)
+    {
+        ring_destroy(sink->ring);
+    }
+    close_fd(sink->fd);
+    free(sink->memory);
+    free(sink->blocks);
+    int64_t ok = !sink->failed;
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+    return ok;
+}
@@ -0,0 +1,848 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* items one kernel call of host_run moves at most */
+#define HOST_BATCH 256
+
+
+static int64_t is_boxed(int64_t type)
+{
+    int64_t kind = TYPE_KIND(type);
+    return kind != TYPE_BYTE && kind != TYPE_INT && kind != TYPE_DOUBLE;
+}
+
+
+/* pipes hold items of type inferred by types stage, capacity is per
+   pipe. threads > 1 runs every kernel on a pool of its own */
+struct host_session *host_session_create(struct program *program, int64_t capacity, int64_t threads)
+{
+    struct workflow *workflow = &program->workflow;
+    struct host_session *host = calloc(1, sizeof(*host));
+    if (host == NULL)
+    {
+        return NULL;
+    }
+
+    host->program = program;
+    host->workflow = workflow;
+    host->threads = threads;
+    host->capacity = capacity;
+    host->buffers = workflow_buffers_create(workflow, capacity);
+    host->batches = calloc(workflow->pipes_len + 1, sizeof(*host->batches));
+    host->kernels = calloc(workflow->workers_len + 1, sizeof(*host->kernels));
+    if (host->buffers == NULL || host->batches == NULL || host->kernels == NULL)
+    {
+        host_session_destroy(host);
+        return NULL;
+    }
+    return host;
+}
+
+
+/* pools, pipes and kernels of session, they go with workflow */
+static void release_state(struct workflow *workflow, struct typed_buffer *buffers, struct host_batch *batches, struct host_kernel *kernels)
+{
+    for (int64_t i = 0; kernels != NULL && i < workflow->workers_len; ++i)
+    {
+        if (kernels[i].map != NULL)
+        {
+            parallel_map_close(kernels[i].map);
+            parallel_map_destroy(kernels[i].map);
+        }
+    }
+    if (buffers != NULL)
+    {
+        workflow_buffers_destroy(workflow, buffers);
+    }
+    free(batches);
+    free(kernels);
+}
+
+
+void host_session_destroy(struct host_session *host)
+{
+    if (host->trace != NULL && host->trace_stream != NULL)
+    {
+        trace_export_chrome(host->trace_stream, host->program, host->trace);
+    }
+    if (host->summary_stream != NULL)
+    {
+        trace_export_summary(host->summary_stream, host->program);
+    }
+    if (host->trace != NULL)
+    {
+        trace_destroy(host->trace);
+    }
+    release_state(host->workflow, host->buffers, host->batches, host->kernels);
+    free(host);
+}
+
+
+/* kernels run from now on go to chrome trace of at most max_events
+   events, summary of worker and pipe stats is written on destroy.
+   either stream may be NULL. returns 0 if there is no memory */
+int64_t host_session_trace(struct host_session *host, FILE *trace, FILE *summary, int64_t max_events)
+{
+    host->trace_stream = trace;
+    host->summary_stream = summary;
+    if (trace == NULL || host->trace != NULL)
+    {
+        return 1;
+    }
+    host->trace = trace_create(max_events);
+    if (host->trace == NULL)
+    {
+        return 0;
+    }
+    host->trace_buffer = trace_thread_attach(host->trace);
+    return host->trace_buffer != NULL;
+}
+
+
+/* key is definition.name, or name alone for what root scopes like main
+   hold. nth picks among matches in order they were built, as one
+   definition may have several instances and one scope several workers
+   of same name. names and scopes are those of pipes or of workers */
+static int64_t find_named(struct workflow *workflow, struct program *program, const char *key, int64_t nth,
+                          int64_t len, char **names, int64_t *scopes)
+{
+    const char *dot = strchr(key, '.');
+    const char *name = dot != NULL ? dot + 1 : key;
+    int64_t definition_len = dot != NULL ? dot - key : 0;
+    for (int64_t i = 0; i < len; ++i)
+    {
+        int64_t scope = scopes[i];
+        if (scope < 0 || scope >= workflow->scopes_len || strcmp(names[i], name) != 0)
+        {
+            continue;
+        }
+        const char *definition = program->definitions[workflow->scope_definitions[scope]]->name;
+        int64_t in_scope = dot == NULL ? workflow->scope_callers[scope] == -1 :
+                           strncmp(definition, key, definition_len) == 0 && definition[definition_len] == '\0';
+        if (in_scope && nth-- == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* pipe named like pipeline variable or >> output, like main.src, see
+   find_named. -1 if there is none */
+int64_t host_find_pipe(struct host_session *host, const char *key, int64_t nth)
+{
+    struct workflow *workflow = host->workflow;
+    return find_named(workflow, host->program, key, nth, workflow->pipes_len, workflow->pipe_names, workflow->pipe_scopes);
+}
+
+
+/* worker calling name, like main.!print, see find_named */
+int64_t host_find_worker(struct host_session *host, const char *key, int64_t nth)
+{
+    struct workflow *workflow = host->workflow;
+    return find_named(workflow, host->program, key, nth, workflow->workers_len, workflow->worker_names, workflow->worker_scopes);
+}
+
+
+/* function computes worker for one item, only workers with exactly
+   one input pipe can be run this way. returns 0 if worker can't */
+int64_t host_bind_kernel(struct host_session *host, int64_t worker, map_function function, void *context)
+{
+    struct workflow *workflow = host->workflow;
+    if (worker < 0 || worker >= workflow->workers_len ||
+        workflow->worker_inputs_offsets[worker + 1] - workflow->worker_inputs_offsets[worker] != 1)
+    {
+        return 0;
+    }
+
+    struct host_kernel *kernel = &host->kernels[worker];
+    kernel->function = function;
+    kernel->context = context;
+    if (host->threads > 1 && kernel->map == NULL)
+    {
+        int64_t input = workflow->worker_inputs[workflow->worker_inputs_offsets[worker]];
+        int64_t output_type = workflow->worker_outputs_offsets[worker] != workflow->worker_outputs_offsets[worker + 1] ?
+                              workflow->pipe_types[workflow->worker_outputs[workflow->worker_outputs_offsets[worker]]] : TYPE_DYNAMIC;
+        struct parallel_map_options options = {
+            .threads = host->threads,
+            .batch = MAX_MAP_BATCH,
+            .window = HOST_BATCH,
+            .ordered = 1,
+        };
+        kernel->map = parallel_map_create(&options, function, context,
+                                          type_element_size(workflow->pipe_types[input]), type_element_size(output_type));
+        if (kernel->map == NULL)
+        {
+            kernel->function = NULL;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* lends count items to pipe, they are read in place until host_pending
+   says none is left, only then the caller may reuse the memory. returns
+   0 while previous batch of the pipe is still being read */
+int64_t host_feed(struct host_session *host, int64_t pipe, const void *elements, int64_t count)
+{
+    struct host_batch *batch = &host->batches[pipe];
+    if (batch->read < batch->len)
+    {
+        return 0;
+    }
+    batch->data = elements;
+    batch->len = count;
+    batch->read = 0;
+    return 1;
+}
+
+
+int64_t host_pending(struct host_session *host, int64_t pipe)
+{
+    return host->batches[pipe].len - host->batches[pipe].read;
+}
+
+
+/* items readable in place, lent batch goes before buffered items */
+static int64_t peek_input(struct host_session *host, int64_t pipe, const char **elements)
+{
+    struct host_batch *batch = &host->batches[pipe];
+    if (batch->read < batch->len)
+    {
+        *elements = (const char *)batch->data + batch->read * host->buffers[pipe].element_size;
+        return batch->len - batch->read;
+    }
+    void *data;
+    int64_t len = typed_buffer_peek(&host->buffers[pipe], &data);
+    *elements = data;
+    return len;
+}
+
+
+static void consume_input(struct host_session *host, int64_t pipe, int64_t count)
+{
+    struct host_batch *batch = &host->batches[pipe];
+    if (batch->read < batch->len)
+    {
+        batch->read += count;
+        return;
+    }
+
+    /* lent items stay owned by host, buffered ones by pipe */
+    struct typed_buffer *buffer = &host->buffers[pipe];
+    for (int64_t i = 0; is_boxed(buffer->type) && i < count; ++i)
+    {
+        value_release(((struct value *)buffer->data)[(buffer->head + i) & (buffer->capacity - 1)]);
+    }
+    typed_buffer_skip(buffer, count);
+}
+
+
+/* copies up to count items of pipe out, returns how many there were */
+int64_t host_drain(struct host_session *host, int64_t pipe, void *elements, int64_t count)
+{
+    const char *lent;
+    int64_t element_size = host->buffers[pipe].element_size;
+    int64_t drained = 0;
+
+    struct host_batch *batch = &host->batches[pipe];
+    if (batch->read < batch->len)
+    {
+        drained = peek_input(host, pipe, &lent);
+        drained = drained < count ? drained : count;
+        memcpy(elements, lent, drained * element_size);
+        if (is_boxed(host->buffers[pipe].type))
+        {
+            /* caller gets references of its own */
+            for (int64_t i = 0; i < drained; ++i)
+            {
+                value_retain(((struct value *)elements)[i]);
+            }
+        }
+        batch->read += drained;
+    }
+    return drained + typed_buffer_pop(&host->buffers[pipe], (char *)elements + drained * element_size, count - drained);
+}
+
+
+static int64_t run_kernel(struct host_session *host, int64_t worker)
+{
+    struct workflow *workflow = host->workflow;
+    struct host_kernel *kernel = &host->kernels[worker];
+    int64_t input = workflow->worker_inputs[workflow->worker_inputs_offsets[worker]];
+    int64_t outputs_begin = workflow->worker_outputs_offsets[worker];
+    int64_t outputs_end = workflow->worker_outputs_offsets[worker + 1];
+
+    const char *elements;
+    int64_t count = peek_input(host, input, &elements);
+    /* profile asks for small batches where consumers starved */
+    int64_t batch = workflow->pipe_batches[input] != 0 && workflow->pipe_batches[input] < HOST_BATCH ? workflow->pipe_batches[input] : HOST_BATCH;
+    count = count < batch ? count : batch;
+    for (int64_t i = outputs_begin; i < outputs_end; ++i)
+    {
+        struct typed_buffer *buffer = &host->buffers[workflow->worker_outputs[i]];
+        count = count < buffer->capacity - buffer->len ? count : buffer->capacity - buffer->len;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    int64_t input_size = host->buffers[input].element_size;
+    int64_t output_type = outputs_begin != outputs_end ? workflow->pipe_types[workflow->worker_outputs[outputs_begin]] : TYPE_DYNAMIC;
+    int64_t output_size = type_element_size(output_type);
+    uint64_t results[HOST_BATCH];
+
+    /* busy time goes to profile, pool threads aren't timed separately */
+    int64_t begin_ns = time_now_ns();
+    if (kernel->map != NULL)
+    {
+        /* window holds whole batch, so pushes never block */
+        for (int64_t i = 0; i < count; ++i)
+        {
+            parallel_map_push(kernel->map, elements + i * input_size);
+        }
+        for (int64_t i = 0; i < count; ++i)
+        {
+            parallel_map_pop(kernel->map, (char *)results + i * output_size);
+        }
+    }
+    else
+    {
+        for (int64_t i = 0; i < count; ++i)
+        {
+            kernel->function(kernel->context, elements + i * input_size, (char *)results + i * output_size);
+        }
+    }
+    worker_stats_busy(host->trace_buffer, workflow, worker, begin_ns, time_now_ns());
+    consume_input(host, input, count);
+
+    for (int64_t i = outputs_begin; i < outputs_end; ++i)
+    {
+        typed_buffer_push(&host->buffers[workflow->worker_outputs[i]], results, count);
+    }
+    if (is_boxed(output_type))
+    {
+        /* one reference per output pipe, none if there is no output */
+        for (int64_t i = 0; i < count; ++i)
+        {
+            if (outputs_begin == outputs_end)
+            {
+                value_release(((struct value *)results)[i]);
+            }
+            value_retain_n(((struct value *)results)[i], outputs_end - outputs_begin - 1);
+        }
+    }
+
+    worker_stats_items(workflow, worker, count, count);
+    return count;
+}
+
+
+/* bound consumer of first fused output of worker, -1 if there is none */
+static int64_t fused_consumer(struct host_session *host, int64_t worker)
+{
+    struct workflow *workflow = host->workflow;
+    for (int64_t i = workflow->worker_outputs_offsets[worker]; i < workflow->worker_outputs_offsets[worker + 1]; ++i)
+    {
+        int64_t pipe = workflow->worker_outputs[i];
+        if (workflow->pipe_flags[pipe] & PIPE_FUSED)
+        {
+            int64_t consumer = workflow->pipe_consumers[workflow->pipe_consumers_offsets[pipe]];
+            return host->kernels[consumer].function != NULL ? consumer : -1;
+        }
+    }
+    return -1;
+}
+
+
+/* runs bound kernels on the calling thread until none can move an item,
+   returns number of items moved. kernels on pool still wait for them */
+int64_t host_run(struct host_session *host)
+{
+    int64_t total = 0;
+    int64_t moved = 1;
+    while (moved != 0)
+    {
+        moved = 0;
+        for (int64_t i = 0; i < host->workflow->workers_len; ++i)
+        {
+            if (host->kernels[i].function == NULL)
+            {
+                continue;
+            }
+            int64_t count = run_kernel(host, i);
+            moved += count;
+            /* fused consumers take the batch while it is still in cache */
+            for (int64_t w = fused_consumer(host, i); count != 0 && w != -1; w = fused_consumer(host, w))
+            {
+                count = run_kernel(host, w);
+                moved += count;
+            }
+        }
+        total += moved;
+    }
+    return total;
+}
+
+
+/* pipe or worker as other version of program sees it: instance it is
+   in, name and which one of that name in instance. instance is its
+   definition together with callables its free vars are bound to, each
+   is built once, so that is its whole identity and doesn't depend on
+   order of call sites */
+struct swap_key
+{
+    int64_t scope;
+    const char *name;
+    int64_t nth;
+    uint64_t hash;
+};
+
+
+static struct definition *scope_definition(struct program *program, int64_t scope)
+{
+    struct workflow *workflow = &program->workflow;
+    return scope >= 0 && scope < workflow->scopes_len ? program->definitions[workflow->scope_definitions[scope]] : NULL;
+}
+
+
+/* text with its terminator, so "ab", "c" and "a", "bc" differ */
+static uint64_t text_hash(uint64_t hash, const char *text)
+{
+    for (; *text != '\0'; ++text)
+    {
+        hash = (hash ^ (unsigned char)*text) * 0x100000001B3ull;
+    }
+    return (hash ^ 0xFF) * 0x100000001B3ull;
+}
+
+
+/* same for every program, NULL for data bindings hashes as "" */
+static uint64_t scope_hash(struct program *program, int64_t scope)
+{
+    struct workflow *workflow = &program->workflow;
+    struct definition *definition = scope_definition(program, scope);
+    uint64_t hash = text_hash(0xCBF29CE484222325ull, definition != NULL ? definition->name : "");
+    for (int64_t k = 0; definition != NULL && k < workflow->scope_bindings_offsets[scope + 1] - workflow->scope_bindings_offsets[scope]; ++k)
+    {
+        const char *binding = workflow->scope_bindings[workflow->scope_bindings_offsets[scope] + k];
+        hash = text_hash(hash, binding != NULL ? binding : "");
+    }
+    return hash;
+}
+
+
+/* names are interned per program, so both are compared as text */
+static int64_t same_scope(struct program *program, int64_t scope, struct program *other, int64_t other_scope)
+{
+    struct definition *definition = scope_definition(program, scope);
+    struct definition *other_definition = scope_definition(other, other_scope);
+    if (definition == NULL || other_definition == NULL)
+    {
+        return definition == other_definition;
+    }
+    int64_t *offsets = program->workflow.scope_bindings_offsets;
+    int64_t *other_offsets = other->workflow.scope_bindings_offsets;
+    if (strcmp(definition->name, other_definition->name) != 0 ||
+        offsets[scope + 1] - offsets[scope] != other_offsets[other_scope + 1] - other_offsets[other_scope])
+    {
+        return 0;
+    }
+    for (int64_t k = 0; k < offsets[scope + 1] - offsets[scope]; ++k)
+    {
+        const char *binding = program->workflow.scope_bindings[offsets[scope] + k];
+        const char *other_binding = other->workflow.scope_bindings[other_offsets[other_scope] + k];
+        if ((binding == NULL) != (other_binding == NULL) || (binding != NULL && strcmp(binding, other_binding) != 0))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* power of two at least twice len, every slot -1 */
+static int64_t *create_slots(int64_t len, int64_t *alloc)
+{
+    *alloc = 1;
+    while (*alloc < 2 * len)
+    {
+        *alloc *= 2;
+    }
+    int64_t *slots = malloc(sizeof(*slots) * *alloc);
+    if (slots != NULL)
+    {
+        memset(slots, -1, sizeof(*slots) * *alloc);
+    }
+    return slots;
+}
+
+
+/* scopes and names are those of pipes or of workers */
+static struct swap_key *make_keys(struct program *program, int64_t len, int64_t *scopes, char **names)
+{
+    struct workflow *workflow = &program->workflow;
+    struct swap_key *keys = calloc(len + 1, sizeof(*keys));
+    uint64_t *hashes = malloc(sizeof(*hashes) * (workflow->scopes_len + 1));
+    /* first item of each scope and name counts the others */
+    int64_t *counts = calloc(len + 1, sizeof(*counts));
+    int64_t alloc;
+    int64_t *slots = create_slots(len, &alloc);
+    if (keys == NULL || hashes == NULL || counts == NULL || slots == NULL)
+    {
+        free(keys);
+        keys = NULL;
+        goto cleanup;
+    }
+
+    for (int64_t s = 0; s < workflow->scopes_len; ++s)
+    {
+        hashes[s] = scope_hash(program, s);
+    }
+    for (int64_t i = 0; i < len; ++i)
+    {
+        int64_t scope = scopes[i];
+        uint64_t hash = text_hash(scope >= 0 && scope < workflow->scopes_len ? hashes[scope] : 0, names[i]);
+        uint64_t slot = hash & (alloc - 1);
+        while (slots[slot] != -1 && (scopes[slots[slot]] != scope || strcmp(names[slots[slot]], names[i]) != 0))
+        {
+            slot = (slot + 1) & (alloc - 1);
+        }
+        if (slots[slot] == -1)
+        {
+            slots[slot] = i;
+        }
+        int64_t nth = counts[slots[slot]]++;
+        keys[i] = (struct swap_key){ scope, names[i], nth, (hash ^ (uint64_t)nth) * 0x9E3779B97F4A7C15ull };
+    }
+
+cleanup:
+    free(hashes);
+    free(counts);
+    free(slots);
+    return keys;
+}
+
+
+/* match[i] is what item i of new version was in old one, -1 if nothing */
+static int64_t *match_keys(struct program *program, struct swap_key *keys, int64_t len,
+                           struct program *old, struct swap_key *old_keys, int64_t old_len)
+{
+    int64_t *match = malloc((len + 1) * sizeof(*match));
+    int64_t alloc;
+    int64_t *slots = create_slots(old_len, &alloc);
+    if (match == NULL || slots == NULL)
+    {
+        free(match);
+        free(slots);
+        return NULL;
+    }
+
+    for (int64_t k = 0; k < old_len; ++k)
+    {
+        uint64_t slot = old_keys[k].hash & (alloc - 1);
+        while (slots[slot] != -1)
+        {
+            slot = (slot + 1) & (alloc - 1);
+        }
+        slots[slot] = k;
+    }
+    for (int64_t i = 0; i < len; ++i)
+    {
+        match[i] = -1;
+        for (uint64_t slot = keys[i].hash & (alloc - 1); slots[slot] != -1 && match[i] == -1; slot = (slot + 1) & (alloc - 1))
+        {
+            struct swap_key *key = &old_keys[slots[slot]];
+            if (key->hash == keys[i].hash && key->nth == keys[i].nth && strcmp(key->name, keys[i].name) == 0 &&
+                same_scope(program, keys[i].scope, old, key->scope))
+            {
+                match[i] = slots[slot];
+            }
+        }
+    }
+    free(slots);
+    return match;
+}
+
+
+/* scope is changed if text of its definition differs in other program,
+   or other program has no definition of that name */
+static int64_t *changed_scopes(struct program *program, struct program *other)
+{
+    struct workflow *workflow = &program->workflow;
+    int64_t *changed = calloc(workflow->scopes_len + 1, sizeof(*changed));
+    int64_t *definitions_changed = malloc(sizeof(*definitions_changed) * (program->definitions_len + 1));
+    int64_t alloc;
+    int64_t *slots = create_slots(other->definitions_len, &alloc);
+    if (changed == NULL || definitions_changed == NULL || slots == NULL)
+    {
+        free(changed);
+        changed = NULL;
+        goto cleanup;
+    }
+
+    for (int64_t i = 0; i < other->definitions_len; ++i)
+    {
+        uint64_t slot = text_hash(0, other->definitions[i]->name) & (alloc - 1);
+        while (slots[slot] != -1)
+        {
+            slot = (slot + 1) & (alloc - 1);
+        }
+        slots[slot] = i;
+    }
+    for (int64_t d = 0; d < program->definitions_len; ++d)
+    {
+        struct definition *definition = program->definitions[d];
+        struct code_span span = definition->code_position;
+        definitions_changed[d] = 1;
+        for (uint64_t slot = text_hash(0, definition->name) & (alloc - 1); slots[slot] != -1; slot = (slot + 1) & (alloc - 1))
+        {
+            struct code_span other_span = other->definitions[slots[slot]]->code_position;
+            if (strcmp(other->definitions[slots[slot]]->name, definition->name) == 0 &&
+                span.end - span.begin == other_span.end - other_span.begin &&
+                memcmp(program->source_code + span.begin, other->source_code + other_span.begin, span.end - span.begin) == 0)
+            {
+                definitions_changed[d] = 0;
+            }
+        }
+    }
+    for (int64_t s = 0; s < workflow->scopes_len; ++s)
+    {
+        changed[s] = definitions_changed[workflow->scope_definitions[s]];
+    }
+
+cleanup:
+    free(definitions_changed);
+    free(slots);
+    return changed;
+}
+
+
+/* unnamed pipe is told apart from others of its scope only by order,
+   so it is same pipe only if workers at both of its ends are same ones
+   at same place in their definition */
+static int64_t is_named(struct workflow *workflow, int64_t pipe)
+{
+    const char *name = workflow->pipe_names[pipe];
+    return strcmp(name, "implict pipe") != 0 && strcmp(name, "inline pipe") != 0 && strcmp(name, "numeric pipeline") != 0;
+}
+
+
+static int64_t same_ends(struct program *program, int64_t pipe, struct program *old, int64_t old_pipe)
+{
+    struct workflow *workflow = &program->workflow;
+    struct workflow *old_workflow = &old->workflow;
+    struct definition *definition = scope_definition(program, workflow->pipe_scopes[pipe]);
+    struct definition *old_definition = scope_definition(old, old_workflow->pipe_scopes[old_pipe]);
+    if (definition == NULL || old_definition == NULL)
+    {
+        return 0;
+    }
+    int64_t begin = definition->code_position.begin;
+    int64_t old_begin = old_definition->code_position.begin;
+    for (int64_t side = 0; side < 2; ++side)
+    {
+        int64_t *offsets = side ? workflow->pipe_consumers_offsets : workflow->pipe_producers_offsets;
+        int64_t *workers = side ? workflow->pipe_consumers : workflow->pipe_producers;
+        int64_t *old_offsets = side ? old_workflow->pipe_consumers_offsets : old_workflow->pipe_producers_offsets;
+        int64_t *old_workers = side ? old_workflow->pipe_consumers : old_workflow->pipe_producers;
+        int64_t len = offsets[pipe + 1] - offsets[pipe];
+        if (len != old_offsets[old_pipe + 1] - old_offsets[old_pipe])
+        {
+            return 0;
+        }
+        for (int64_t i = 0; i < len; ++i)
+        {
+            int64_t worker = workers[offsets[pipe] + i];
+            int64_t old_worker = old_workers[old_offsets[old_pipe] + i];
+            struct code_span span = workflow->worker_code_positions[worker];
+            struct code_span old_span = old_workflow->worker_code_positions[old_worker];
+            if (strcmp(workflow->worker_names[worker], old_workflow->worker_names[old_worker]) != 0 ||
+                span.begin - begin != old_span.begin - old_begin || span.end - span.begin != old_span.end - old_span.begin)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static int64_t is_internal(struct workflow *workflow, int64_t pipe)
+{
+    return workflow->pipe_producers_offsets[pipe] != workflow->pipe_producers_offsets[pipe + 1] &&
+           workflow->pipe_consumers_offsets[pipe] != workflow->pipe_consumers_offsets[pipe + 1];
+}
+
+
+/* moves running session onto workflow of recompiled program. scopes
+   of changed definitions are replaced whole once pipes between their
+   own workers are empty. pipes fed or drained from outside keep their
+   items and lent batches, kernels stay bound to workers of same name.
+   returns 1 when swapped, then old program may be destroyed, 0 while
+   changed part still holds items, -1 if new program can't take them */
+int64_t host_swap(struct host_session *host, struct program *program, struct swap_report *report)
+{
+    struct workflow *old = host->workflow;
+    struct workflow *workflow = &program->workflow;
+    memset(report, 0, sizeof(*report));
+    report->blocking_pipe = -1;
+    if (program->log.level_counts[LOG_ERROR] != 0)
+    {
+        return -1;
+    }
+
+    /* quiescent point, bound kernels moved everything they could */
+    host_run(host);
+
+    int64_t result = -1;
+    int64_t *changed = changed_scopes(host->program, program);
+    int64_t *new_changed = changed_scopes(program, host->program);
+    struct swap_key *old_pipes = make_keys(host->program, old->pipes_len, old->pipe_scopes, old->pipe_names);
+    struct swap_key *pipes = make_keys(program, workflow->pipes_len, workflow->pipe_scopes, workflow->pipe_names);
+    struct swap_key *old_workers = make_keys(host->program, old->workers_len, old->worker_scopes, old->worker_names);
+    struct swap_key *workers = make_keys(program, workflow->workers_len, workflow->worker_scopes, workflow->worker_names);
+    int64_t *pipe_match = NULL, *worker_match = NULL, *pipe_targets = NULL;
+    struct typed_buffer *buffers = NULL;
+    struct host_batch *batches = NULL;
+    struct host_kernel *kernels = NULL, *carried = NULL;
+    if (changed == NULL || new_changed == NULL || old_pipes == NULL || pipes == NULL || old_workers == NULL || workers == NULL)
+    {
+        goto cleanup;
+    }
+    pipe_match = match_keys(program, pipes, workflow->pipes_len, host->program, old_pipes, old->pipes_len);
+    worker_match = match_keys(program, workers, workflow->workers_len, host->program, old_workers, old->workers_len);
+    pipe_targets = malloc(sizeof(*pipe_targets) * (old->pipes_len + 1));
+    if (pipe_match == NULL || worker_match == NULL || pipe_targets == NULL)
+    {
+        goto cleanup;
+    }
+    for (int64_t p = 0; p < old->pipes_len; ++p)
+    {
+        pipe_targets[p] = -1;
+    }
+    for (int64_t q = 0; q < workflow->pipes_len; ++q)
+    {
+        if (pipe_match[q] != -1)
+        {
+            pipe_targets[pipe_match[q]] = q;
+        }
+    }
+    for (int64_t s = 0; s < workflow->scopes_len; ++s)
+    {
+        report->swapped_scopes += new_changed[s];
+    }
+
+    for (int64_t p = 0; p < old->pipes_len; ++p)
+    {
+        if (host->buffers[p].len + host_pending(host, p) == 0)
+        {
+            continue;
+        }
+        /* items between workers of changed part would lose them */
+        if (changed[old->pipe_scopes[p]] && is_internal(old, p))
+        {
+            report->blocking_pipe = p;
+            result = 0;
+            goto cleanup;
+        }
+        int64_t target = pipe_targets[p];
+        if (target == -1 || workflow->pipe_types[target] != old->pipe_types[p] ||
+            (!is_named(old, p) && !same_ends(program, target, host->program, p)))
+        {
+            report->blocking_pipe = p;
+            goto cleanup;
+        }
+    }
+
+    buffers = workflow_buffers_create(workflow, host->capacity);
+    batches = calloc(workflow->pipes_len + 1, sizeof(*batches));
+    kernels = calloc(workflow->workers_len + 1, sizeof(*kernels));
+    carried = calloc(workflow->workers_len + 1, sizeof(*carried));
+    if (buffers == NULL || batches == NULL || kernels == NULL || carried == NULL)
+    {
+        goto cleanup;
+    }
+
+    /* buffers change hands, items aren't copied */
+    for (int64_t q = 0; q < workflow->pipes_len; ++q)
+    {
+        int64_t p = pipe_match[q];
+        if (p != -1 && workflow->pipe_types[q] == old->pipe_types[p])
+        {
+            struct typed_buffer buffer = buffers[q];
+            buffers[q] = host->buffers[p];
+            host->buffers[p] = buffer;
+            batches[q] = host->batches[p];
+            report->rebound_pipes++;
+            report->moved_items += buffers[q].len + batches[q].len - batches[q].read;
+        }
+    }
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        int64_t v = worker_match[w];
+        if (v != -1 && host->kernels[v].function != NULL)
+        {
+            carried[w] = host->kernels[v];
+            carried[w].map = NULL;
+            host->kernels[v].function = NULL;
+        }
+    }
+    for (int64_t v = 0; v < old->workers_len; ++v)
+    {
+        report->dropped_kernels += host->kernels[v].function != NULL;
+    }
+
+    /* pools are made again, item sizes may differ */
+    release_state(old, host->buffers, host->batches, host->kernels);
+    if (host->trace != NULL && host->trace_stream != NULL)
+    {
+        /* ids of events so far are workers and pipes of old workflow */
+        trace_flush_chrome(host->trace_stream, host->program, host->trace);
+    }
+    host->program = program;
+    host->workflow = workflow;
+    host->buffers = buffers;
+    host->batches = batches;
+    host->kernels = kernels;
+    buffers = NULL;
+    batches = NULL;
+    kernels = NULL;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (carried[w].function != NULL)
+        {
+            int64_t bound = host_bind_kernel(host, w, carried[w].function, carried[w].context);
+            report->rebound_kernels += bound;
+            report->dropped_kernels += !bound;
+        }
+    }
+    result = 1;
+
+cleanup:
+    if (buffers != NULL)
+    {
+        workflow_buffers_destroy(workflow, buffers);
+    }
+    free(batches);
+    free(kernels);
+    free(carried);
+    free(pipe_match);
+    free(worker_match);
+    free(pipe_targets);
+    free(changed);
+    free(new_changed);
+    free(old_pipes);
+    free(pipes);
+    free(old_workers);
+    free(workers);
+    return result;
+}
@@ -0,0 +1,119 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static int64_t is_iterator(struct workflow *workflow, int64_t worker)
+{
+    const struct builtin *builtin = builtin_find(workflow->worker_names[worker]);
+    return builtin != NULL && (builtin->flags & BUILTIN_ITERATOR);
+}
+
+
+/* pipes downstream of range, !str_iter or !foreach carry one item per
+   iteration up to a worker like reduce that folds them into one value,
+   all others carry one value for whole run. workers fed by
+   iteration read the latter once and get them broadcast, instead of
+   having them sent through pipe again with every item */
+void program_hoist_invariants(struct program *program)
+{
+    program_pass_begin(program, PASS_INVARIANTS);
+
+    struct workflow *workflow = &program->workflow;
+    int64_t *stack = program_alloc(program, sizeof(*stack) * (workflow->pipes_len + 1));
+    if (stack == NULL)
+    {
+        program_pass_end(program, PASS_INVARIANTS);
+        return;
+    }
+
+    int64_t stack_len = 0;
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        workflow->pipe_flags[p] &= ~(PIPE_VARYING | PIPE_BROADCAST);
+    }
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (!is_iterator(workflow, w))
+        {
+            continue;
+        }
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            int64_t pipe = workflow->worker_outputs[i];
+            if (!(workflow->pipe_flags[pipe] & PIPE_VARYING))
+            {
+                workflow->pipe_flags[pipe] |= PIPE_VARYING;
+                stack[stack_len++] = pipe;
+            }
+        }
+    }
+
+    while (stack_len != 0)
+    {
+        int64_t pipe = stack[--stack_len];
+        for (int64_t i = workflow->pipe_consumers_offsets[pipe]; i < workflow->pipe_consumers_offsets[pipe + 1]; ++i)
+        {
+            int64_t worker = workflow->pipe_consumers[i];
+            if (program_worker_aggregates(program, workflow->worker_names[worker]))
+            {
+                continue;
+            }
+            for (int64_t j = workflow->worker_outputs_offsets[worker]; j < workflow->worker_outputs_offsets[worker + 1]; ++j)
+            {
+                int64_t output = workflow->worker_outputs[j];
+                if (!(workflow->pipe_flags[output] & PIPE_VARYING))
+                {
+                    workflow->pipe_flags[output] |= PIPE_VARYING;
+                    stack[stack_len++] = output;
+                }
+            }
+        }
+    }
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        int64_t iterated = 0;
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            iterated |= (workflow->pipe_flags[workflow->worker_inputs[i]] & PIPE_VARYING) != 0;
+        }
+        if (!iterated)
+        {
+            continue;
+        }
+
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            int64_t pipe = workflow->worker_inputs[i];
+            if (!(workflow->pipe_flags[pipe] & PIPE_VARYING))
+            {
+                workflow->pipe_flags[pipe] |= PIPE_BROADCAST;
+            }
+        }
+
+        /* symbols are resolved in order of substitutions */
+        struct pipeline_worker_definition *worker = workflow->worker_definitions[w];
+        int64_t symbol = workflow->worker_symbols_offsets[w];
+        for (int64_t i = 0; i < worker->subs_len; ++i)
+        {
+            if (worker->subs[i].type != SUBSTITUTION_SYMBOL)
+            {
+                continue;
+            }
+            int64_t pipe = workflow->worker_symbols[symbol++];
+            if (pipe != -1 && !(workflow->pipe_flags[pipe] & PIPE_VARYING))
+            {
+                workflow->pipe_flags[pipe] |= PIPE_BROADCAST;
+                program_log(program, LOG_WORKFLOW, LOG_NOTE, "Substitution doesn't change between iterations, it is computed once and broadcast", worker->subs[i].code_position, NULL);
+            }
+        }
+    }
+
+    program_free(program, stack);
+    program_pass_end(program, PASS_INVARIANTS);
+}
@@ -4,6 +4,7 @@
 
 #include "inttypes.h"
 #include "stdio.h"
+#include "stdatomic.h"
 
 
 enum log_source_type
@@ -18,6 +19,14 @@ enum log_level
     LOG_NOTE,
     LOG_WARNING,
     LOG_ERROR,
+    LOG_LEVEL_COUNT,
+};
+
+enum log_format
+{
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_JSON,
+    LOG_FORMAT_SARIF,
 };
 
 /* 0 0 means empty code span. */
@@ -36,14 +45,28 @@ struct log_item
     enum log_level level;
     char *message;
     struct code_span code_span;
-    struct log_item *associated_item;
+    /* index in compilation_log, -1 if none */
+    int64_t associated_item;
 };
 
+/* items keep only spans into the source, text is rendered on demand */
 struct compilation_log
 {
     struct log_item *items;
     int64_t items_len;
     int64_t items_alloc;
+    int64_t items_dropped;
+
+    int64_t level_counts[LOG_LEVEL_COUNT];
+};
+
+struct log_render_options
+{
+    enum log_format format;
+    enum log_level min_level;
+    /* 0 means no limit */
+    int64_t max_errors;
+    int64_t deduplicate;
 };
 
 
@@ -103,6 +126,11 @@ struct pipeline_worker_definition
 
     struct pipeline_worker_substitution subs[MAX_PIPELINE_WORKER_SUBS];
     int64_t subs_len;
+
+    /* pipeline branches of !if, set when worker is built */
+    int64_t lazy_branches;
+    /* call may be answered from memo cache, set by program_plan_memoization */
+    int64_t memoize;
 };
 
 
@@ -138,47 +166,349 @@ struct definition
 
     struct pipeline_definition pipelines[MAX_PIPELINES];
     int64_t pipelines_len;
+
+    /* enum purity_flags, set by program_infer_purity */
+    int64_t flags;
+    /* pure as long as what its free vars are bound to is pure, each
+       call is decided by program_plan_memoization */
+    int64_t memoize;
+    /* enum value_type of result, set by program_infer_types */
+    int64_t result_type;
 };
 
 
-#define MAX_PIPELINE_INPUT 16
-#define MAX_PIPELINE_OUTPUT 16
+enum builtin_flags
+{
+    /* reads or writes outside world, never merged, removed or replicated */
+    BUILTIN_EFFECTFUL = 1,
+    /* result depends on items seen before, can't be split between replicas */
+    BUILTIN_STATEFUL = 2,
+    /* emits items of a sequence one by one, see program_hoist_invariants */
+    BUILTIN_ITERATOR = 4,
+};
 
+/* inferred for definitions and workers */
+enum purity_flags
+{
+    /* no effects, may be merged or removed */
+    PURITY_PURE = 1,
+    /* pure and keeps nothing between items, may be replicated */
+    PURITY_STATELESS = 2,
+};
 
-struct worker
+/* element types of pipes, sequences keep their element type in
+   higher bits, so [[int]] is TYPE_SEQUENCE_OF(TYPE_SEQUENCE_OF(TYPE_INT)) */
+enum value_type
+{
+    /* nothing known yet */
+    TYPE_UNKNOWN,
+    TYPE_INT,
+    TYPE_DOUBLE,
+    TYPE_BYTE,
+    TYPE_STRING,
+    TYPE_SEQUENCE,
+    /* differs between items, values are boxed */
+    TYPE_DYNAMIC,
+};
+
+#define TYPE_KIND(type) ((type) & 15)
+#define TYPE_ELEMENT(type) ((type) >> 4)
+#define TYPE_SEQUENCE_OF(type) (((type) << 4) | TYPE_SEQUENCE)
+
+/* how builtin result type is computed */
+enum builtin_result
+{
+    /* always type field */
+    RESULT_FIXED,
+    /* arithmetic on input types, bytes promote to int */
+    RESULT_NUMERIC,
+    /* sequence of results of function passed as f */
+    RESULT_FOREACH,
+    /* join of true and false branches */
+    RESULT_IF,
+};
+
+struct builtin
+{
+    const char *name;
+    int64_t flags;
+    enum builtin_result result;
+    int64_t type;
+};
+
+enum window_operator
+{
+    WINDOW_SUM,
+    WINDOW_PRODUCT,
+    WINDOW_MIN,
+    WINDOW_MAX,
+};
+
+/* arguments of !window, like "!window f=!sum count=100 step=10".
+   window holds last count items or as many newest items as fit into
+   bytes, exactly one of them is set. result comes every step items,
+   step 0 or step >= count makes windows tumble instead of slide */
+struct window_options
+{
+    enum window_operator op;
+    int64_t count;
+    int64_t bytes;
+    int64_t step;
+};
+
+
+/* runtime counters, updated by executor threads (see runtime.h) */
+struct worker_stats
+{
+    _Atomic int64_t items_in;
+    _Atomic int64_t items_out;
+    _Atomic int64_t busy_ns;
+    _Atomic int64_t blocked_input_ns;
+    _Atomic int64_t blocked_output_ns;
+    /* !if only, how often each branch was taken */
+    _Atomic int64_t branch_true;
+    _Atomic int64_t branch_false;
+};
+
+
+struct pipe_stats
+{
+    _Atomic int64_t enqueued;
+    _Atomic int64_t dequeued;
+    _Atomic int64_t max_depth;
+};
+
+
+/* workflow while it is being built, records and edges are appended
+   in source order and frozen into struct workflow by workflow_freeze */
+struct workflow_worker_record
 {
-    struct pipe *inputs[MAX_PIPELINE_INPUT];
-    int64_t inputs_len;
-    
-    struct pipe *outputs[MAX_PIPELINE_OUTPUT];
-    int64_t outputs_len;
-    
     char *name;
     struct code_span code_position;
-
     struct pipeline_worker_definition *worker_definition;
+    int64_t scope;
+    /* last worker of false and true branch of !if, -1 until built */
+    int64_t branches[2];
 };
 
-
-struct pipe
+struct workflow_pipe_record
 {
     char *name;
     struct code_span code_position;
+    int64_t scope;
+    /* enum pipe_flags */
+    int64_t flags;
 };
 
+/* instance of definition, see scope_definitions */
+struct workflow_scope_record
+{
+    int64_t definition;
+    int64_t caller;
+    /* index of first binding in builder, one per free var */
+    int64_t bindings;
+    /* first of entry pipes added together, -1 if there are none */
+    int64_t entries;
+};
 
-struct workflow
+struct workflow_edge
+{
+    int64_t worker;
+    int64_t pipe;
+};
+
+/* instance caller calls instance callee outside of !if branches */
+struct workflow_call
+{
+    int64_t caller;
+    int64_t callee;
+};
+
+struct workflow_builder
 {
-    struct worker **workers;
+    /* definition new records belong to, see scope_definitions */
+    int64_t scope;
+
+    struct workflow_worker_record *workers;
     int64_t workers_len;
     int64_t workers_alloc;
-    
-    struct pipe **pipes;
+
+    struct workflow_pipe_record *pipes;
     int64_t pipes_len;
     int64_t pipes_alloc;
+
+    /* worker reads pipe */
+    struct workflow_edge *inputs;
+    int64_t inputs_len;
+    int64_t inputs_alloc;
+
+    /* worker writes pipe */
+    struct workflow_edge *outputs;
+    int64_t outputs_len;
+    int64_t outputs_alloc;
+
+    struct workflow_scope_record *scopes;
+    int64_t scopes_len;
+    int64_t scopes_alloc;
+
+    char **bindings;
+    int64_t bindings_len;
+    int64_t bindings_alloc;
+
+    /* found while building, read by program_plan_branches */
+    struct workflow_call *calls;
+    int64_t calls_len;
+    int64_t calls_alloc;
+};
+
+
+/* frozen workflow graph in compressed sparse rows, workers and pipes are
+   plain indices. inputs of worker w are
+   worker_inputs[worker_inputs_offsets[w] .. worker_inputs_offsets[w + 1]]
+   in port order, the other adjacency arrays work the same way */
+enum pipe_flags
+{
+    /* carries one item per iteration of range, !str_iter or !foreach */
+    PIPE_VARYING = 1,
+    /* read once and reused by every iteration of its consumers */
+    PIPE_BROADCAST = 2,
+    /* host runs consumer right after producer, not in its turn */
+    PIPE_FUSED = 4,
+    /* pipeline or free var of instance, written by workers calling it */
+    PIPE_ENTRY = 8,
+};
+
+struct workflow
+{
+    int64_t workers_len;
+    char **worker_names;
+    struct code_span *worker_code_positions;
+    struct pipeline_worker_definition **worker_definitions;
+    /* definition worker belongs to, see scope_definitions */
+    int64_t *worker_scopes;
+    /* enum purity_flags */
+    int64_t *worker_flags;
+    struct worker_stats *worker_stats;
+    /* share of busy time in permille from profile, 0 without one */
+    int64_t *worker_weights;
+    /* last worker of branch !if worker w takes when cond is c is at
+       2 * w + c, -1 until program_instantiate_branch builds it */
+    int64_t *worker_branches;
+
+    int64_t *worker_inputs_offsets;
+    int64_t *worker_inputs;
+    int64_t *worker_outputs_offsets;
+    int64_t *worker_outputs;
+
+    int64_t pipes_len;
+    char **pipe_names;
+    struct code_span *pipe_code_positions;
+    int64_t *pipe_scopes;
+    /* enum value_type of items */
+    int64_t *pipe_types;
+    struct pipe_stats *pipe_stats;
+    /* enum pipe_flags */
+    int64_t *pipe_flags;
+    /* items handed over at once, 0 means runtime default */
+    int64_t *pipe_batches;
+
+    int64_t *pipe_producers_offsets;
+    int64_t *pipe_producers;
+    int64_t *pipe_consumers_offsets;
+    int64_t *pipe_consumers;
+    /* pipes workers read through symbol substitutions like a=a[0] or
+       cond=x[1], one per symbol substitution in order, -1 where it
+       names no pipe of worker's scope. pipe_symbol_readers is the
+       reverse, without those */
+    int64_t *worker_symbols_offsets;
+    int64_t *worker_symbols;
+    int64_t *pipe_symbol_readers_offsets;
+    int64_t *pipe_symbol_readers;
+
+    /* scope is instance of definition, index in program->definitions,
+       one per distinct binding of its free vars to callables. caller
+       is worker that instantiated it first, -1 for roots. bindings of
+       scope s are scope_bindings[scope_bindings_offsets[s] ..
+       scope_bindings_offsets[s + 1]], one per free var, interned name
+       of callable or NULL if var is bound to data or not at all */
+    int64_t scopes_len;
+    int64_t *scope_definitions;
+    int64_t *scope_callers;
+    int64_t *scope_bindings_offsets;
+    char **scope_bindings;
+};
+
+
+struct memory_stats
+{
+    /* 0 means no limit */
+    int64_t limit;
+    int64_t failed;
+
+    int64_t allocations;
+    int64_t allocated_bytes;
+    int64_t bytes;
+    int64_t peak_bytes;
+    int64_t pass_peak_bytes;
+};
+
+
+/* open addressing set of interned names */
+struct name_pool
+{
+    char **slots;
+    int64_t slots_alloc;
+    int64_t names_len;
+};
+
+
+enum compile_pass
+{
+    PASS_LINE_INDEX,
+    PASS_PARSE,
+    PASS_AST_DUMP,
+    PASS_PURITY,
+    PASS_WORKFLOW,
+    PASS_OPTIMIZE,
+    PASS_TYPES,
+    PASS_INVARIANTS,
+    PASS_PROFILE,
+    PASS_COUNT,
+};
+
+enum pass_report_format
+{
+    PASS_REPORT_TABLE,
+    PASS_REPORT_JSON,
+};
+
+struct pass_stats
+{
+    int64_t runs;
+    int64_t wall_ns;
+    int64_t allocations;
+    int64_t allocated_bytes;
+    int64_t peak_bytes;
+
+    int64_t begin_ns;
+    int64_t begin_allocations;
+    int64_t begin_allocated_bytes;
 };
 
 
+/* what program_optimize_workflow removed */
+struct optimize_stats
+{
+    int64_t merged_workers;
+    int64_t merged_pipes;
+    int64_t dead_workers;
+    int64_t dead_pipes;
+};
+
+
+struct allocation_header;
+
+
 struct program
 {
     char *filename;
@@ -192,15 +522,109 @@ struct program
     struct definition **definitions;
     int64_t definitions_len;
     int64_t definitions_alloc;
+    /* definitions by interned name, see program_find_definition */
+    int64_t *definition_slots;
+    int64_t definition_slots_alloc;
+    int64_t definitions_indexed;
 
     struct workflow workflow;
+    struct optimize_stats optimization;
+
+    struct memory_stats memory;
+    struct allocation_header *allocations;
+    struct name_pool names;
+    struct pass_stats passes[PASS_COUNT];
+};
+
+
+enum compile_status
+{
+    COMPILE_OK,
+    COMPILE_FAILED,
+    COMPILE_NO_MEMORY,
+    COMPILE_INVALID_ARGUMENT,
+};
+
+/* stages to run, later stages imply the ones they depend on */
+enum compile_stage
+{
+    STAGE_PARSE = 1,
+    STAGE_AST_DUMP = 2,
+    STAGE_WORKFLOW = 4,
+    STAGE_WORKFLOW_DUMP = 8,
+    STAGE_OPTIMIZE = 16,
+    STAGE_MEMOIZE = 32,
+    STAGE_TYPES = 64,
+};
+
+struct compiler_options
+{
+    int64_t stages;
+    /* dump stages write here, nothing is written if NULL */
+    FILE *dump_stream;
+    /* per program, in bytes, 0 means no limit */
+    int64_t memory_limit;
+    /* written by program_profile_write in previous run, may be NULL */
+    const char *profile;
+    int64_t profile_len;
+};
+
+/* immutable after creation, may be shared by any number of threads */
+struct compiler
+{
+    struct compiler_options options;
 };
 
 
+void program_position_to_line_col(struct program *program, int64_t position, int64_t *line, int64_t *col);
 struct log_item *program_log(struct program *program, enum log_source_type source, enum log_level level, char *message, struct code_span code_span, struct log_item *associated_item);
-struct program *program_create_from_code(char *filename, char *code);
+int64_t program_log_render(FILE *stream, struct program *program, struct log_render_options *options);
+int64_t time_now_ns(void);
+void *program_alloc(struct program *program, int64_t size);
+void *program_realloc(struct program *program, void *ptr, int64_t size);
+void program_free(struct program *program, void *ptr);
+void program_free_all(struct program *program);
+char *program_intern(struct program *program, const char *s, int64_t len);
+void program_pass_begin(struct program *program, enum compile_pass pass);
+void program_pass_end(struct program *program, enum compile_pass pass);
+void program_pass_report(FILE *stream, struct program *program, enum pass_report_format format);
+struct program *program_create(const char *filename, const char *code, int64_t code_len, int64_t memory_limit);
+void program_destroy(struct program *program);
+void program_parse(struct program *program);
 void program_ast_dump(FILE *stream, struct program *program);
+int64_t workflow_add_worker(struct program *program, struct workflow_builder *builder, char *name, struct code_span code_position, struct pipeline_worker_definition *worker_definition);
+int64_t workflow_add_pipe(struct program *program, struct workflow_builder *builder, char *name, struct code_span code_position);
+void workflow_connect_input(struct program *program, struct workflow_builder *builder, int64_t worker, int64_t pipe);
+void workflow_connect_output(struct program *program, struct workflow_builder *builder, int64_t worker, int64_t pipe);
+int64_t workflow_add_scope(struct program *program, struct workflow_builder *builder, int64_t definition, int64_t caller, char **bindings);
+void workflow_freeze(struct program *program, struct workflow_builder *builder, struct workflow *workflow);
+void workflow_release(struct program *program, struct workflow *workflow);
+int64_t program_find_definition(struct program *program, const char *name);
 void program_get_workflow(struct program *program);
+void program_workflow_dump(FILE *stream, struct program *program);
+const struct builtin *builtin_find(const char *name);
+int64_t window_options_parse(struct program *program, struct pipeline_worker_definition *worker, struct window_options *options);
+void program_infer_purity(struct program *program);
+int64_t program_worker_purity(struct program *program, struct definition *scope, struct pipeline_worker_definition *worker);
+void program_classify_workers(struct program *program);
+int64_t program_worker_aggregates(struct program *program, const char *name);
+void program_plan_branches(struct program *program, struct workflow_builder *builder);
+int64_t program_instantiate_branch(struct program *program, int64_t worker, int64_t cond);
+struct pipeline_worker_substitution *if_branch(struct pipeline_worker_definition *worker, int64_t cond);
+int64_t is_branch(const struct builtin *builtin, struct pipeline_worker_substitution *sub);
+void program_plan_memoization(struct program *program);
+void program_optimize_workflow(struct program *program);
+void program_hoist_invariants(struct program *program);
+void program_profile_write(FILE *stream, struct program *program);
+void program_apply_profile(struct program *program, const char *profile, int64_t profile_len);
+void program_infer_types(struct program *program);
+int64_t type_join(int64_t a, int64_t b);
+int64_t type_name(int64_t type, char *buffer, int64_t buffer_len);
+
+struct compiler *compiler_create(struct compiler_options *options);
+void compiler_destroy(struct compiler *compiler);
+enum compile_status compiler_compile(struct compiler *compiler, const char *filename, const char *code, int64_t code_len, int64_t stages, struct program **result);
+const char *compile_status_name(enum compile_status status);
 
 
 #endif
@@ -7,25 +7,32 @@
 #include "inttypes.h"
 
 
-static char *str_from_code(struct program *program, int64_t begin, int64_t end)
-{
-    if (end > program->source_code_len)
-    {
-        end = program->source_code_len;
-    }
-    if (begin >= end)
-    {
-        char *empty = malloc(1);
-        empty[0] = '\0';
-        return empty;
-    }
-    char *res = malloc(end - begin + 1);
-    memcpy(res, program->source_code + begin, end - begin);
-    res[end - begin] = 0;
-    return res;
-}
+/* longest piece of code printed after text diagnostic */
+#define MAX_RENDERED_SPAN 80
+
+
+static const char *source_names[] = {
+    [LOG_PARSER] = "PARSER",
+    [LOG_WORKFLOW] = "WORKFLOW",
+};
+
+static const char *level_names[] = {
+    [LOG_INFO] = "INFO",
+    [LOG_NOTE] = "NOTE",
+    [LOG_WARNING] = "WARNING",
+    [LOG_ERROR] = "ERROR",
+};
 
-static void position_to_line_col(struct program *program, int64_t pos, int64_t *line, int64_t *col)
+static const char *sarif_levels[] = {
+    [LOG_INFO] = "note",
+    [LOG_NOTE] = "note",
+    [LOG_WARNING] = "warning",
+    [LOG_ERROR] = "error",
+};
+
+
+/* line is 1-based, col is 1-based */
+void program_position_to_line_col(struct program *program, int64_t pos, int64_t *line, int64_t *col)
 {
     int64_t l = 0, r = program->code_lines, m = 0;
     while (r - l > 1)
@@ -37,55 +44,221 @@ static void position_to_line_col(struct program *program, int64_t pos, int64_t *
         { r = m; }
     }
     *line = l + 1;
-    *col = pos - program->line_to_position[l];
+    *col = pos - program->line_to_position[l] + 1;
 }
 
 
+/* only stores the item, nothing is printed until program_log_render */
 struct log_item *program_log(struct program *program, enum log_source_type source, enum log_level level, char *message, struct code_span code_span, struct log_item *associated_item)
 {
+    struct compilation_log *log = &program->log;
 
-    if (program->log.items_len >= program->log.items_alloc)
+    if (log->items_len >= log->items_alloc)
     {
-        program->log.items_alloc = 2 * program->log.items_alloc + !program->log.items_alloc;
-        void *new_ptr = realloc(program->log.items, sizeof(*program->log.items) * program->log.items_alloc);
+        int64_t new_alloc = 2 * log->items_alloc + !log->items_alloc;
+        void *new_ptr = program_realloc(program, log->items, sizeof(*log->items) * new_alloc);
         if (new_ptr == NULL)
         {
-            fprintf(stderr, "Error: No memory for PARSING.\n");
-            exit(1);
+            /* can't store it, but still have to fail compilation */
+            log->items_dropped++;
+            log->level_counts[level]++;
+            return NULL;
         }
 
-        program->log.items = new_ptr;
+        log->items = new_ptr;
+        log->items_alloc = new_alloc;
     }
 
-    program->log.items[program->log.items_len++] = (struct log_item){
+    log->items[log->items_len++] = (struct log_item){
         .source = source,
         .level = level,
         .message = message,
         .code_span = code_span,
-        .associated_item = associated_item,
+        .associated_item = associated_item == NULL ? -1 : associated_item - log->items,
     };
+    log->level_counts[level]++;
+
+    return &log->items[log->items_len - 1];
+}
+
+
+static uint64_t log_item_hash(struct log_item *item)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)item->message;
+    hash = hash * 31 + item->source;
+    hash = hash * 31 + item->level;
+    hash = hash * 31 + item->code_span.begin;
+    hash = hash * 31 + item->code_span.end;
+    return hash * 0x9E3779B97F4A7C15ull;
+}
+
+
+/* messages are string literals, so equal messages share a pointer */
+static int64_t log_item_equal(struct log_item *a, struct log_item *b)
+{
+    return a->source == b->source &&
+           a->level == b->level &&
+           a->message == b->message &&
+           a->code_span.begin == b->code_span.begin &&
+           a->code_span.end == b->code_span.end;
+}
+
+
+static void print_json_string(FILE *stream, const char *s, int64_t len)
+{
+    fputc('"', stream);
+    for (int64_t i = 0; i < len && s[i] != '\0'; ++i)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+        {
+            fprintf(stream, "\\%c", s[i]);
+        }
+        else if ((unsigned char)s[i] < 0x20)
+        {
+            fprintf(stream, "\\u%04x", s[i]);
+        }
+        else
+        {
+            fputc(s[i], stream);
+        }
+    }
+    fputc('"', stream);
+}
+
 
-    switch (source)
+static void render_item(FILE *stream, struct program *program, struct log_item *item, enum log_format format, int64_t index)
+{
+    int64_t line, col, end_line, end_col;
+    program_position_to_line_col(program, item->code_span.begin, &line, &col);
+    program_position_to_line_col(program, item->code_span.end, &end_line, &end_col);
+
+    int64_t begin = item->code_span.begin;
+    int64_t end = item->code_span.end < program->source_code_len ? item->code_span.end : program->source_code_len;
+    int64_t len = end > begin ? end - begin : 0;
+
+    switch (format)
     {
-        case LOG_PARSER:
-            printf("PARSER::");
-        case LOG_WORKFLOW:
-            printf("WORKFLOW::");
+        case LOG_FORMAT_TEXT:
+        {
+            fprintf(stream, "%s::%s:%s:%" PRId64 ":%" PRId64 " %s\n", source_names[item->source], level_names[item->level], program->filename, line, col, item->message);
+            /* span is printed straight from source, no copy */
+            fprintf(stream, "[at <%.*s%s>]\n", (int)(len < MAX_RENDERED_SPAN ? len : MAX_RENDERED_SPAN), program->source_code + begin, len > MAX_RENDERED_SPAN ? "..." : "");
+            break;
+        }
+        case LOG_FORMAT_JSON:
+        {
+            fprintf(stream, "%s\n{\"source\":\"%s\",\"level\":\"%s\",\"message\":", index == 0 ? "" : ",", source_names[item->source], level_names[item->level]);
+            print_json_string(stream, item->message, INT64_MAX);
+            fprintf(stream, ",\"file\":");
+            print_json_string(stream, program->filename, INT64_MAX);
+            fprintf(stream, ",\"line\":%" PRId64 ",\"col\":%" PRId64 ",\"begin\":%" PRId64 ",\"end\":%" PRId64 ",\"associated\":%" PRId64 "}", line, col, item->code_span.begin, item->code_span.end, item->associated_item);
+            break;
+        }
+        case LOG_FORMAT_SARIF:
+        {
+            fprintf(stream, "%s\n{\"ruleId\":\"%s\",\"level\":\"%s\",\"message\":{\"text\":", index == 0 ? "" : ",", source_names[item->source], sarif_levels[item->level]);
+            print_json_string(stream, item->message, INT64_MAX);
+            fprintf(stream, "},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":");
+            print_json_string(stream, program->filename, INT64_MAX);
+            fprintf(stream, "},\"region\":{\"startLine\":%" PRId64 ",\"startColumn\":%" PRId64 ",\"endLine\":%" PRId64 ",\"endColumn\":%" PRId64 ",\"charOffset\":%" PRId64 ",\"charLength\":%" PRId64 ",\"snippet\":{\"text\":",
+                    line, col, end_line, end_col, begin, len);
+            print_json_string(stream, program->source_code + begin, len);
+            fprintf(stream, "}}}}]}");
+            break;
+        }
     }
-    switch (level)
+}
+
+
+int64_t program_log_render(FILE *stream, struct program *program, struct log_render_options *options)
+{
+    struct compilation_log *log = &program->log;
+
+    /* set of already rendered items, used only for deduplication */
+    int64_t *seen = NULL;
+    int64_t seen_alloc = 0;
+    if (options->deduplicate)
     {
-        case LOG_INFO: printf("INFO");
-        case LOG_NOTE: printf("NOTE");
-        case LOG_WARNING: printf("WARNING");
-        case LOG_ERROR: printf("ERROR");
+        seen_alloc = 16;
+        while (seen_alloc < 2 * log->items_len)
+        {
+            seen_alloc *= 2;
+        }
+        seen = malloc(sizeof(*seen) * seen_alloc);
+        if (seen != NULL)
+        {
+            memset(seen, -1, sizeof(*seen) * seen_alloc);
+        }
     }
-    int64_t line, col;
-    position_to_line_col(program, code_span.begin, &line, &col);
-    printf(":%s:%lld:%lld %s\n", program->filename, line, col, message);
 
-    char *s = str_from_code(program, code_span.begin, code_span.end);
-    printf("[at <%s>]\n", s);
-    free(s);
+    switch (options->format)
+    {
+        case LOG_FORMAT_TEXT:
+            break;
+        case LOG_FORMAT_JSON:
+            fprintf(stream, "{\"diagnostics\":[");
+            break;
+        case LOG_FORMAT_SARIF:
+            fprintf(stream, "{\"version\":\"2.1.0\",\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\",\"runs\":[{\"tool\":{\"driver\":{\"name\":\"lang\"}},\"results\":[");
+            break;
+    }
+
+    int64_t shown = 0, shown_errors = 0, suppressed = log->items_dropped;
+    for (int64_t i = 0; i < log->items_len; ++i)
+    {
+        struct log_item *item = &log->items[i];
+
+        if (item->level < options->min_level)
+        {
+            continue;
+        }
+        if (options->max_errors > 0 && shown_errors >= options->max_errors)
+        {
+            suppressed++;
+            continue;
+        }
+
+        if (seen != NULL)
+        {
+            uint64_t slot = log_item_hash(item) & (seen_alloc - 1);
+            int64_t duplicate = 0;
+            while (seen[slot] != -1)
+            {
+                if (log_item_equal(&log->items[seen[slot]], item))
+                {
+                    duplicate = 1;
+                    break;
+                }
+                slot = (slot + 1) & (seen_alloc - 1);
+            }
+            if (duplicate)
+            {
+                continue;
+            }
+            seen[slot] = i;
+        }
+
+        render_item(stream, program, item, options->format, shown);
+        shown++;
+        shown_errors += (item->level == LOG_ERROR);
+    }
+
+    switch (options->format)
+    {
+        case LOG_FORMAT_TEXT:
+            if (suppressed != 0)
+            {
+                fprintf(stream, "%" PRId64 " more diagnostics not shown\n", suppressed);
+            }
+            break;
+        case LOG_FORMAT_JSON:
+            fprintf(stream, "\n],\"shown\":%" PRId64 ",\"suppressed\":%" PRId64 "}\n", shown, suppressed);
+            break;
+        case LOG_FORMAT_SARIF:
+            fprintf(stream, "\n]}]}\n");
+            break;
+    }
 
-    return &program->log.items[program->log.items_len - 1];
+    free(seen);
+    return shown;
 }
@@ -0,0 +1,258 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* key bytes are followed by value bytes */
+struct memo_entry
+{
+    uint64_t hash;
+    int64_t definition;
+    int64_t key_len;
+    int64_t value_len;
+    /* next entry in bucket chain, -1 ends it */
+    int64_t next;
+    /* cleared by clock hand, set by every hit */
+    int64_t referenced;
+    char *data;
+};
+
+
+static uint64_t memo_hash(int64_t definition, const void *key, int64_t key_len)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ (uint64_t)definition;
+    for (int64_t i = 0; i < key_len; ++i)
+    {
+        hash = (hash ^ ((const unsigned char *)key)[i]) * 0x100000001B3ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+
+static struct memo_shard *shard_of(struct memo_cache *cache, uint64_t hash)
+{
+    /* low bits pick bucket inside shard, high bits pick shard */
+    return &cache->shards[(hash >> 48) % cache->shards_len];
+}
+
+
+/* capacity is number of entries in whole cache, 0 disables caching */
+struct memo_cache *memo_cache_create(int64_t definitions_len, int64_t capacity, int64_t shards_len)
+{
+    struct memo_cache *cache = malloc(sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+
+    if (shards_len <= 0)
+    {
+        shards_len = 16;
+    }
+    /* every shard holds at least one entry, so the whole cache never
+       holds more than capacity of them */
+    if (shards_len > capacity)
+    {
+        shards_len = capacity > 0 ? capacity : 1;
+    }
+
+    cache->definitions_len = definitions_len;
+    cache->stats = calloc(definitions_len + 1, sizeof(*cache->stats));
+    cache->shards = calloc(shards_len, sizeof(*cache->shards));
+    if (cache->stats == NULL || cache->shards == NULL)
+    {
+        memo_cache_destroy(cache);
+        return NULL;
+    }
+
+    /* shards_len counts initialized shards, destroy touches only them */
+    for (int64_t i = 0; i < shards_len; ++i)
+    {
+        struct memo_shard *shard = &cache->shards[i];
+        if (mtx_init(&shard->lock, mtx_plain) != thrd_success)
+        {
+            memo_cache_destroy(cache);
+            return NULL;
+        }
+        cache->shards_len++;
+        int64_t shard_capacity = capacity / shards_len + (i < capacity % shards_len);
+        shard->capacity = shard_capacity;
+        shard->buckets_len = 1;
+        while (shard->buckets_len < shard_capacity)
+        {
+            shard->buckets_len *= 2;
+        }
+        shard->entries = calloc(shard_capacity + 1, sizeof(*shard->entries));
+        shard->buckets = malloc(sizeof(*shard->buckets) * shard->buckets_len);
+        if (shard->entries == NULL || shard->buckets == NULL)
+        {
+            memo_cache_destroy(cache);
+            return NULL;
+        }
+        memset(shard->buckets, -1, sizeof(*shard->buckets) * shard->buckets_len);
+    }
+
+    return cache;
+}
+
+
+void memo_cache_destroy(struct memo_cache *cache)
+{
+    for (int64_t i = 0; cache->shards != NULL && i < cache->shards_len; ++i)
+    {
+        struct memo_shard *shard = &cache->shards[i];
+        for (int64_t j = 0; shard->entries != NULL && j < shard->entries_len; ++j)
+        {
+            free(shard->entries[j].data);
+        }
+        free(shard->entries);
+        free(shard->buckets);
+        mtx_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    free(cache->stats);
+    free(cache);
+}
+
+
+/* returns value length and copies up to value_alloc bytes of it,
+   -1 on miss or unknown definition */
+int64_t memo_lookup(struct memo_cache *cache, int64_t definition, const void *key, int64_t key_len, void *value, int64_t value_alloc)
+{
+    if (definition < 0 || definition >= cache->definitions_len)
+    {
+        return -1;
+    }
+    uint64_t hash = memo_hash(definition, key, key_len);
+    struct memo_shard *shard = shard_of(cache, hash);
+    int64_t value_len = -1;
+
+    mtx_lock(&shard->lock);
+    for (int64_t i = shard->buckets_len > 0 ? shard->buckets[hash & (shard->buckets_len - 1)] : -1; i != -1; i = shard->entries[i].next)
+    {
+        struct memo_entry *entry = &shard->entries[i];
+        if (entry->hash == hash && entry->definition == definition && entry->key_len == key_len &&
+            memcmp(entry->data, key, key_len) == 0)
+        {
+            entry->referenced = 1;
+            value_len = entry->value_len;
+            memcpy(value, entry->data + key_len, value_len < value_alloc ? value_len : value_alloc);
+            break;
+        }
+    }
+    mtx_unlock(&shard->lock);
+
+    atomic_fetch_add_explicit(value_len == -1 ? &cache->stats[definition].misses : &cache->stats[definition].hits, 1, memory_order_relaxed);
+    return value_len;
+}
+
+
+static void unlink_entry(struct memo_shard *shard, int64_t index)
+{
+    int64_t *link = &shard->buckets[shard->entries[index].hash & (shard->buckets_len - 1)];
+    while (*link != index)
+    {
+        link = &shard->entries[*link].next;
+    }
+    *link = shard->entries[index].next;
+}
+
+
+/* clock hand skips recently hit entries once, first one not hit is evicted */
+static int64_t evict(struct memo_cache *cache, struct memo_shard *shard)
+{
+    for (;;)
+    {
+        struct memo_entry *entry = &shard->entries[shard->hand];
+        int64_t index = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->entries_len;
+        if (entry->referenced)
+        {
+            entry->referenced = 0;
+            continue;
+        }
+
+        unlink_entry(shard, index);
+        atomic_fetch_add_explicit(&cache->stats[entry->definition].evictions, 1, memory_order_relaxed);
+        free(entry->data);
+        entry->data = NULL;
+        return index;
+    }
+}
+
+
+/* results of pure definitions never change, so racing inserts of
+   one key store equal values and the later one is dropped */
+void memo_insert(struct memo_cache *cache, int64_t definition, const void *key, int64_t key_len, const void *value, int64_t value_len)
+{
+    if (definition < 0 || definition >= cache->definitions_len)
+    {
+        return;
+    }
+    uint64_t hash = memo_hash(definition, key, key_len);
+    struct memo_shard *shard = shard_of(cache, hash);
+    if (shard->capacity == 0)
+    {
+        return;
+    }
+
+    char *data = malloc(key_len + value_len + 1);
+    if (data == NULL)
+    {
+        return;
+    }
+    memcpy(data, key, key_len);
+    memcpy(data + key_len, value, value_len);
+
+    mtx_lock(&shard->lock);
+    int64_t *bucket = &shard->buckets[hash & (shard->buckets_len - 1)];
+    for (int64_t i = *bucket; i != -1; i = shard->entries[i].next)
+    {
+        struct memo_entry *entry = &shard->entries[i];
+        if (entry->hash == hash && entry->definition == definition && entry->key_len == key_len &&
+            memcmp(entry->data, key, key_len) == 0)
+        {
+            mtx_unlock(&shard->lock);
+            free(data);
+            return;
+        }
+    }
+
+    int64_t index = shard->entries_len < shard->capacity ? shard->entries_len++ : evict(cache, shard);
+    shard->entries[index] = (struct memo_entry){
+        .hash = hash,
+        .definition = definition,
+        .key_len = key_len,
+        .value_len = value_len,
+        .next = *bucket,
+        .referenced = 0,
+        .data = data,
+    };
+    *bucket = index;
+    mtx_unlock(&shard->lock);
+
+    atomic_fetch_add_explicit(&cache->stats[definition].insertions, 1, memory_order_relaxed);
+}
+
+
+void memo_stats_dump(FILE *stream, struct program *program, struct memo_cache *cache)
+{
+    fprintf(stream, "%-24s %12s %12s %12s %12s %7s\n", "definition", "hits", "misses", "inserted", "evicted", "hit %");
+    for (int64_t i = 0; i < cache->definitions_len && i < program->definitions_len; ++i)
+    {
+        struct memo_stats *stats = &cache->stats[i];
+        int64_t hits = atomic_load(&stats->hits), misses = atomic_load(&stats->misses);
+        if (hits + misses == 0)
+        {
+            continue;
+        }
+        fprintf(stream, "%-24s %12" PRId64 " %12" PRId64 " %12" PRId64 " %12" PRId64 " %7.2f\n",
+                program->definitions[i]->name, hits, misses,
+                atomic_load(&stats->insertions), atomic_load(&stats->evictions),
+                100.0 * hits / (hits + misses));
+    }
+}
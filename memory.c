@@ -0,0 +1,237 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* every allocation is linked into program->allocations, so
+   program_destroy can release a program in any state */
+struct allocation_header
+{
+    struct allocation_header *prev;
+    struct allocation_header *next;
+    int64_t size;
+    /* keeps returned pointers 16 byte aligned */
+    int64_t reserved;
+};
+
+
+static int64_t account_allocation(struct program *program, int64_t size)
+{
+    struct memory_stats *memory = &program->memory;
+
+    if (memory->limit != 0 && memory->bytes + size > memory->limit)
+    {
+        memory->failed = 1;
+        return 0;
+    }
+
+    memory->allocations++;
+    memory->allocated_bytes += size;
+    memory->bytes += size;
+    if (memory->bytes > memory->peak_bytes)
+    {
+        memory->peak_bytes = memory->bytes;
+    }
+    if (memory->bytes > memory->pass_peak_bytes)
+    {
+        memory->pass_peak_bytes = memory->bytes;
+    }
+    return 1;
+}
+
+
+static void link_allocation(struct program *program, struct allocation_header *header)
+{
+    header->prev = NULL;
+    header->next = program->allocations;
+    if (header->next != NULL)
+    {
+        header->next->prev = header;
+    }
+    program->allocations = header;
+}
+
+
+static void unlink_allocation(struct program *program, struct allocation_header *header)
+{
+    if (header->prev != NULL)
+    {
+        header->prev->next = header->next;
+    }
+    else
+    {
+        program->allocations = header->next;
+    }
+    if (header->next != NULL)
+    {
+        header->next->prev = header->prev;
+    }
+}
+
+
+/* returns NULL and marks program as failed if out of memory */
+void *program_alloc(struct program *program, int64_t size)
+{
+    if (!account_allocation(program, size))
+    {
+        return NULL;
+    }
+
+    struct allocation_header *header = malloc(sizeof(*header) + size);
+    if (header == NULL)
+    {
+        program->memory.bytes -= size;
+        program->memory.failed = 1;
+        return NULL;
+    }
+
+    header->size = size;
+    link_allocation(program, header);
+
+    return header + 1;
+}
+
+
+/* on failure old block stays valid, as with realloc */
+void *program_realloc(struct program *program, void *ptr, int64_t size)
+{
+    if (ptr == NULL)
+    {
+        return program_alloc(program, size);
+    }
+
+    struct allocation_header *header = (struct allocation_header *)ptr - 1;
+    int64_t old_size = header->size;
+
+    program->memory.bytes -= old_size;
+    if (!account_allocation(program, size))
+    {
+        program->memory.bytes += old_size;
+        return NULL;
+    }
+
+    unlink_allocation(program, header);
+    struct allocation_header *new_header = realloc(header, sizeof(*header) + size);
+    if (new_header == NULL)
+    {
+        link_allocation(program, header);
+        program->memory.bytes += old_size - size;
+        program->memory.failed = 1;
+        return NULL;
+    }
+
+    new_header->size = size;
+    link_allocation(program, new_header);
+
+    return new_header + 1;
+}
+
+
+void program_free(struct program *program, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct allocation_header *header = (struct allocation_header *)ptr - 1;
+    program->memory.bytes -= header->size;
+    unlink_allocation(program, header);
+    free(header);
+}
+
+
+void program_free_all(struct program *program)
+{
+    struct allocation_header *header = program->allocations;
+    while (header != NULL)
+    {
+        struct allocation_header *next = header->next;
+        free(header);
+        header = next;
+    }
+    program->allocations = NULL;
+    program->memory.bytes = 0;
+}
+
+
+static uint64_t name_hash(const char *s, int64_t len)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ull;
+    for (int64_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+
+static int64_t name_pool_grow(struct program *program)
+{
+    struct name_pool *pool = &program->names;
+
+    int64_t new_alloc = pool->slots_alloc == 0 ? 64 : 2 * pool->slots_alloc;
+    char **new_slots = program_alloc(program, sizeof(*new_slots) * new_alloc);
+    if (new_slots == NULL)
+    {
+        return 0;
+    }
+    memset(new_slots, 0, sizeof(*new_slots) * new_alloc);
+
+    for (int64_t i = 0; i < pool->slots_alloc; ++i)
+    {
+        if (pool->slots[i] != NULL)
+        {
+            uint64_t slot = name_hash(pool->slots[i], strlen(pool->slots[i])) & (new_alloc - 1);
+            while (new_slots[slot] != NULL)
+            {
+                slot = (slot + 1) & (new_alloc - 1);
+            }
+            new_slots[slot] = pool->slots[i];
+        }
+    }
+
+    program_free(program, pool->slots);
+    pool->slots = new_slots;
+    pool->slots_alloc = new_alloc;
+    return 1;
+}
+
+
+/* returns one shared copy per distinct name, NULL if out of memory */
+char *program_intern(struct program *program, const char *s, int64_t len)
+{
+    struct name_pool *pool = &program->names;
+
+    /* keep load factor below 1/2 */
+    if (2 * (pool->names_len + 1) > pool->slots_alloc && !name_pool_grow(program))
+    {
+        return NULL;
+    }
+
+    uint64_t slot = name_hash(s, len) & (pool->slots_alloc - 1);
+    while (pool->slots[slot] != NULL)
+    {
+        if (strncmp(pool->slots[slot], s, len) == 0 && pool->slots[slot][len] == '\0')
+        {
+            return pool->slots[slot];
+        }
+        slot = (slot + 1) & (pool->slots_alloc - 1);
+    }
+
+    char *name = program_alloc(program, len + 1);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    memcpy(name, s, len);
+    name[len] = '\0';
+
+    pool->slots[slot] = name;
+    pool->names_len++;
+    return name;
+}
@@ -0,0 +1,600 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "ctype.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static uint64_t hash_bytes(uint64_t hash, const char *s, int64_t len)
+{
+    for (int64_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char)s[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+
+static uint64_t hash_int(uint64_t hash, uint64_t x)
+{
+    return (hash ^ x) * 0x9E3779B97F4A7C15ull;
+}
+
+
+static int64_t span_text_equal(struct program *program, struct code_span a, struct code_span b)
+{
+    return a.end - a.begin == b.end - b.begin &&
+           memcmp(program->source_code + a.begin, program->source_code + b.begin, a.end - a.begin) == 0;
+}
+
+
+/* numeric pipes are the only ones nobody writes to */
+static int64_t is_literal_pipe(struct program *program, struct workflow *workflow, int64_t pipe)
+{
+    if (workflow->pipe_producers_offsets[pipe] != workflow->pipe_producers_offsets[pipe + 1])
+    {
+        return 0;
+    }
+    struct code_span span = workflow->pipe_code_positions[pipe];
+    if (span.end <= span.begin)
+    {
+        return 0;
+    }
+    for (int64_t i = span.begin; i < span.end; ++i)
+    {
+        if (!isdigit(program->source_code[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* state of one optimization run, all arrays are indexed by old ids */
+struct optimizer
+{
+    struct program *program;
+    struct workflow *workflow;
+
+    int64_t *worker_canon;
+    int64_t *pipe_canon;
+    int64_t *pure;
+    int64_t *live;
+
+    /* open addressing, -1 is empty slot */
+    int64_t *table;
+    int64_t table_alloc;
+};
+
+
+static uint64_t worker_hash(struct optimizer *optimizer, int64_t worker)
+{
+    struct workflow *workflow = optimizer->workflow;
+    struct pipeline_worker_definition *definition = workflow->worker_definitions[worker];
+
+    /* names are interned, so pointers identify them */
+    uint64_t hash = hash_int(0xCBF29CE484222325ull, (uintptr_t)definition->name);
+    hash = hash_int(hash, workflow->worker_scopes[worker]);
+    for (int64_t i = 0; i < definition->subs_len; ++i)
+    {
+        struct pipeline_worker_substitution *sub = &definition->subs[i];
+        hash = hash_int(hash, (uintptr_t)sub->name);
+        if (sub->type == SUBSTITUTION_SYMBOL)
+        {
+            hash = hash_int(hash, (uintptr_t)sub->symbol);
+        }
+        else
+        {
+            struct code_span span = sub->pipeline->code_position;
+            hash = hash_bytes(hash, optimizer->program->source_code + span.begin, span.end - span.begin);
+        }
+    }
+    for (int64_t i = workflow->worker_inputs_offsets[worker]; i < workflow->worker_inputs_offsets[worker + 1]; ++i)
+    {
+        hash = hash_int(hash, optimizer->pipe_canon[workflow->worker_inputs[i]]);
+    }
+    return hash_int(hash, workflow->worker_outputs_offsets[worker + 1] - workflow->worker_outputs_offsets[worker]);
+}
+
+
+/* same builtin, same substitutions in same order, same inputs */
+static int64_t worker_equal(struct optimizer *optimizer, int64_t a, int64_t b)
+{
+    struct workflow *workflow = optimizer->workflow;
+    struct pipeline_worker_definition *x = workflow->worker_definitions[a];
+    struct pipeline_worker_definition *y = workflow->worker_definitions[b];
+
+    if (x->name != y->name || x->subs_len != y->subs_len || workflow->worker_scopes[a] != workflow->worker_scopes[b])
+    {
+        return 0;
+    }
+    for (int64_t i = 0; i < x->subs_len; ++i)
+    {
+        if (x->subs[i].name != y->subs[i].name || x->subs[i].type != y->subs[i].type)
+        {
+            return 0;
+        }
+        if (x->subs[i].type == SUBSTITUTION_SYMBOL ?
+            x->subs[i].symbol != y->subs[i].symbol :
+            !span_text_equal(optimizer->program, x->subs[i].pipeline->code_position, y->subs[i].pipeline->code_position))
+        {
+            return 0;
+        }
+    }
+
+    int64_t a_inputs = workflow->worker_inputs_offsets[a], b_inputs = workflow->worker_inputs_offsets[b];
+    int64_t inputs_len = workflow->worker_inputs_offsets[a + 1] - a_inputs;
+    if (inputs_len != workflow->worker_inputs_offsets[b + 1] - b_inputs)
+    {
+        return 0;
+    }
+    for (int64_t i = 0; i < inputs_len; ++i)
+    {
+        if (optimizer->pipe_canon[workflow->worker_inputs[a_inputs + i]] != optimizer->pipe_canon[workflow->worker_inputs[b_inputs + i]])
+        {
+            return 0;
+        }
+    }
+
+    return workflow->worker_outputs_offsets[a + 1] - workflow->worker_outputs_offsets[a] ==
+           workflow->worker_outputs_offsets[b + 1] - workflow->worker_outputs_offsets[b];
+}
+
+
+/* pipe of >> output, substitutions and host find it by name */
+static int64_t is_named(struct workflow *workflow, int64_t pipe)
+{
+    const char *name = workflow->pipe_names[pipe];
+    return strcmp(name, "implict pipe") != 0 && strcmp(name, "inline pipe") != 0 && strcmp(name, "numeric pipeline") != 0;
+}
+
+
+/* outputs of merged worker are redirected, so nobody else may write
+   them, and named ones would disappear together with their name */
+static int64_t outputs_exclusive(struct workflow *workflow, int64_t worker)
+{
+    for (int64_t i = workflow->worker_outputs_offsets[worker]; i < workflow->worker_outputs_offsets[worker + 1]; ++i)
+    {
+        int64_t pipe = workflow->worker_outputs[i];
+        if (workflow->pipe_producers_offsets[pipe + 1] - workflow->pipe_producers_offsets[pipe] != 1 || is_named(workflow, pipe))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int64_t table_reset(struct optimizer *optimizer, int64_t len)
+{
+    int64_t alloc = 16;
+    while (alloc < 2 * len)
+    {
+        alloc *= 2;
+    }
+    if (alloc > optimizer->table_alloc)
+    {
+        program_free(optimizer->program, optimizer->table);
+        optimizer->table = program_alloc(optimizer->program, sizeof(*optimizer->table) * alloc);
+        optimizer->table_alloc = optimizer->table == NULL ? 0 : alloc;
+        if (optimizer->table == NULL)
+        {
+            return 0;
+        }
+    }
+    memset(optimizer->table, -1, sizeof(*optimizer->table) * optimizer->table_alloc);
+    return 1;
+}
+
+
+static void merge_literals(struct optimizer *optimizer)
+{
+    struct program *program = optimizer->program;
+    struct workflow *workflow = optimizer->workflow;
+    int64_t mask = optimizer->table_alloc - 1;
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        if (!is_literal_pipe(program, workflow, p))
+        {
+            continue;
+        }
+
+        struct code_span span = workflow->pipe_code_positions[p];
+        uint64_t hash = hash_int(hash_bytes(0xCBF29CE484222325ull, program->source_code + span.begin, span.end - span.begin), workflow->pipe_scopes[p]);
+        uint64_t slot = hash & mask;
+        while (optimizer->table[slot] != -1)
+        {
+            int64_t other = optimizer->table[slot];
+            if (workflow->pipe_scopes[other] == workflow->pipe_scopes[p] &&
+                span_text_equal(program, workflow->pipe_code_positions[other], span))
+            {
+                optimizer->pipe_canon[p] = other;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (optimizer->table[slot] == -1)
+        {
+            optimizer->table[slot] = p;
+        }
+    }
+}
+
+
+/* workers are visited in topological order, so canonical ids of
+   all inputs are known before worker itself is hashed */
+static void merge_workers(struct optimizer *optimizer, int64_t *order, int64_t *pending)
+{
+    struct workflow *workflow = optimizer->workflow;
+    int64_t mask = optimizer->table_alloc - 1;
+    int64_t order_len = 0, head = 0;
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        pending[w] = 0;
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            int64_t pipe = workflow->worker_inputs[i];
+            pending[w] += workflow->pipe_producers_offsets[pipe + 1] - workflow->pipe_producers_offsets[pipe];
+        }
+        if (pending[w] == 0)
+        {
+            order[order_len++] = w;
+        }
+    }
+
+    /* workers on cycles never become ready and are left as they are */
+    while (head < order_len)
+    {
+        int64_t w = order[head++];
+
+        if (optimizer->pure[w] && outputs_exclusive(workflow, w))
+        {
+            uint64_t slot = worker_hash(optimizer, w) & mask;
+            while (optimizer->table[slot] != -1)
+            {
+                int64_t other = optimizer->table[slot];
+                if (worker_equal(optimizer, other, w))
+                {
+                    optimizer->worker_canon[w] = other;
+                    int64_t outputs_len = workflow->worker_outputs_offsets[w + 1] - workflow->worker_outputs_offsets[w];
+                    for (int64_t k = 0; k < outputs_len; ++k)
+                    {
+                        int64_t pipe = workflow->worker_outputs[workflow->worker_outputs_offsets[w] + k];
+                        optimizer->pipe_canon[pipe] = workflow->worker_outputs[workflow->worker_outputs_offsets[other] + k];
+                    }
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            if (optimizer->table[slot] == -1)
+            {
+                optimizer->table[slot] = w;
+            }
+        }
+
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            int64_t pipe = workflow->worker_outputs[i];
+            for (int64_t j = workflow->pipe_consumers_offsets[pipe]; j < workflow->pipe_consumers_offsets[pipe + 1]; ++j)
+            {
+                int64_t consumer = workflow->pipe_consumers[j];
+                if (--pending[consumer] == 0)
+                {
+                    order[order_len++] = consumer;
+                }
+            }
+        }
+    }
+}
+
+
+static uint64_t pipe_name_hash(int64_t scope, const char *name, int64_t len)
+{
+    return hash_int(hash_bytes(0xCBF29CE484222325ull, name, len), scope);
+}
+
+
+static void index_pipe_names(struct optimizer *optimizer)
+{
+    struct workflow *workflow = optimizer->workflow;
+    int64_t mask = optimizer->table_alloc - 1;
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        uint64_t slot = pipe_name_hash(workflow->pipe_scopes[p], workflow->pipe_names[p], strlen(workflow->pipe_names[p])) & mask;
+        while (optimizer->table[slot] != -1)
+        {
+            slot = (slot + 1) & mask;
+        }
+        optimizer->table[slot] = p;
+    }
+}
+
+
+static void push_producers(struct optimizer *optimizer, int64_t pipe, int64_t *stack, int64_t *stack_len)
+{
+    struct workflow *workflow = optimizer->workflow;
+
+    pipe = optimizer->pipe_canon[pipe];
+    for (int64_t j = workflow->pipe_producers_offsets[pipe]; j < workflow->pipe_producers_offsets[pipe + 1]; ++j)
+    {
+        int64_t producer = workflow->pipe_producers[j];
+        if (!optimizer->live[producer])
+        {
+            optimizer->live[producer] = 1;
+            stack[(*stack_len)++] = producer;
+        }
+    }
+}
+
+
+/* substitutions like a=a[0] read pipe a without an edge in the graph */
+static void push_symbol(struct optimizer *optimizer, int64_t scope, const char *symbol, int64_t *stack, int64_t *stack_len)
+{
+    struct workflow *workflow = optimizer->workflow;
+    int64_t mask = optimizer->table_alloc - 1;
+    int64_t len = strcspn(symbol, "[.");
+
+    uint64_t slot = pipe_name_hash(scope, symbol, len) & mask;
+    for (; optimizer->table[slot] != -1; slot = (slot + 1) & mask)
+    {
+        int64_t pipe = optimizer->table[slot];
+        if (workflow->pipe_scopes[pipe] == scope &&
+            strncmp(workflow->pipe_names[pipe], symbol, len) == 0 && workflow->pipe_names[pipe][len] == '\0')
+        {
+            push_producers(optimizer, pipe, stack, stack_len);
+        }
+    }
+}
+
+
+static void push_pipeline_symbols(struct optimizer *optimizer, int64_t scope, struct pipeline_definition *pipeline, int64_t *stack, int64_t *stack_len);
+
+
+static void push_worker_symbols(struct optimizer *optimizer, int64_t scope, struct pipeline_worker_definition *worker, int64_t *stack, int64_t *stack_len)
+{
+    for (int64_t i = 0; i < worker->subs_len; ++i)
+    {
+        if (worker->subs[i].type == SUBSTITUTION_SYMBOL)
+        {
+            push_symbol(optimizer, scope, worker->subs[i].symbol, stack, stack_len);
+        }
+        else
+        {
+            push_pipeline_symbols(optimizer, scope, worker->subs[i].pipeline, stack, stack_len);
+        }
+    }
+}
+
+
+static void push_pipeline_symbols(struct optimizer *optimizer, int64_t scope, struct pipeline_definition *pipeline, int64_t *stack, int64_t *stack_len)
+{
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
+    {
+        if (pipeline->args[i].type == ARGUMENT_NAME)
+        {
+            push_symbol(optimizer, scope, pipeline->args[i].name, stack, stack_len);
+        }
+        else
+        {
+            push_pipeline_symbols(optimizer, scope, pipeline->args[i].pipeline, stack, stack_len);
+        }
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        push_worker_symbols(optimizer, scope, &pipeline->workers[i], stack, stack_len);
+    }
+}
+
+
+/* effectful workers and pipeline results nobody reads are roots,
+   everything they don't depend on is dead */
+static void mark_live(struct optimizer *optimizer, int64_t *stack)
+{
+    struct workflow *workflow = optimizer->workflow;
+    int64_t stack_len = 0;
+
+    index_pipe_names(optimizer);
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        optimizer->live[w] = 0;
+    }
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (optimizer->worker_canon[w] == w && !optimizer->live[w] &&
+            (!optimizer->pure[w] || workflow->worker_outputs_offsets[w] == workflow->worker_outputs_offsets[w + 1]))
+        {
+            optimizer->live[w] = 1;
+            stack[stack_len++] = w;
+        }
+    }
+
+    while (stack_len > 0)
+    {
+        int64_t w = stack[--stack_len];
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            push_producers(optimizer, workflow->worker_inputs[i], stack, &stack_len);
+        }
+        push_worker_symbols(optimizer, workflow->worker_scopes[w], workflow->worker_definitions[w], stack, &stack_len);
+    }
+}
+
+
+static void rebuild(struct optimizer *optimizer, int64_t *worker_map, int64_t *pipe_map)
+{
+    struct program *program = optimizer->program;
+    struct workflow *workflow = optimizer->workflow;
+    struct optimize_stats *stats = &program->optimization;
+
+    struct workflow_builder builder;
+    memset(&builder, 0, sizeof(builder));
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        pipe_map[p] = -1;
+    }
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (!optimizer->live[w])
+        {
+            continue;
+        }
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            pipe_map[optimizer->pipe_canon[workflow->worker_inputs[i]]] = 0;
+        }
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            pipe_map[workflow->worker_outputs[i]] = 0;
+        }
+    }
+
+    for (int64_t p = 0; p < workflow->pipes_len && !program->memory.failed; ++p)
+    {
+        if (optimizer->pipe_canon[p] != p)
+        {
+            stats->merged_pipes++;
+        }
+        else if (pipe_map[p] == -1)
+        {
+            stats->dead_pipes++;
+        }
+        else
+        {
+            builder.scope = workflow->pipe_scopes[p];
+            pipe_map[p] = workflow_add_pipe(program, &builder, workflow->pipe_names[p], workflow->pipe_code_positions[p]);
+            if (pipe_map[p] != -1)
+            {
+                builder.pipes[pipe_map[p]].flags = workflow->pipe_flags[p];
+            }
+        }
+    }
+
+    for (int64_t w = 0; w < workflow->workers_len && !program->memory.failed; ++w)
+    {
+        if (optimizer->worker_canon[w] != w)
+        {
+            stats->merged_workers++;
+            program_log(program, LOG_WORKFLOW, LOG_NOTE, "Worker is identical to an earlier one and was merged into it", workflow->worker_code_positions[w], NULL);
+            continue;
+        }
+        if (!optimizer->live[w])
+        {
+            stats->dead_workers++;
+            program_log(program, LOG_WORKFLOW, LOG_NOTE, "Result of worker is never used, worker was removed", workflow->worker_code_positions[w], NULL);
+            continue;
+        }
+
+        builder.scope = workflow->worker_scopes[w];
+        worker_map[w] = workflow_add_worker(program, &builder, workflow->worker_names[w], workflow->worker_code_positions[w], workflow->worker_definitions[w]);
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            workflow_connect_input(program, &builder, worker_map[w], pipe_map[optimizer->pipe_canon[workflow->worker_inputs[i]]]);
+        }
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            workflow_connect_output(program, &builder, worker_map[w], pipe_map[workflow->worker_outputs[i]]);
+        }
+    }
+
+    /* built branch ends in worker its tail was merged into */
+    for (int64_t w = 0; w < workflow->workers_len && !program->memory.failed; ++w)
+    {
+        for (int64_t cond = 0; cond < 2 && optimizer->worker_canon[w] == w && optimizer->live[w]; ++cond)
+        {
+            int64_t tail = workflow->worker_branches[2 * w + cond];
+            tail = tail != -1 ? optimizer->worker_canon[tail] : -1;
+            builder.workers[worker_map[w]].branches[cond] = tail != -1 && optimizer->live[tail] ? worker_map[tail] : -1;
+        }
+    }
+
+    /* scopes stay, merged caller is the one it was merged into */
+    for (int64_t s = 0; s < workflow->scopes_len && !program->memory.failed; ++s)
+    {
+        int64_t caller = workflow->scope_callers[s];
+        caller = caller != -1 ? optimizer->worker_canon[caller] : -1;
+        caller = caller != -1 && optimizer->live[caller] ? worker_map[caller] : -1;
+        workflow_add_scope(program, &builder, workflow->scope_definitions[s], caller,
+                           workflow->scope_bindings + workflow->scope_bindings_offsets[s]);
+    }
+
+    if (program->memory.failed)
+    {
+        /* old graph is still valid, keep it */
+        workflow_freeze(program, &builder, &(struct workflow){0});
+        return;
+    }
+
+    struct workflow optimized;
+    workflow_freeze(program, &builder, &optimized);
+    workflow_release(program, workflow);
+    *workflow = optimized;
+    program_classify_workers(program);
+}
+
+
+/* merges identical pure workers and literal pipes, then removes
+   workers whose results can't reach any effect or pipeline result */
+void program_optimize_workflow(struct program *program)
+{
+    program_pass_begin(program, PASS_OPTIMIZE);
+
+    struct workflow *workflow = &program->workflow;
+    struct optimizer optimizer = {
+        .program = program,
+        .workflow = workflow,
+    };
+    memset(&program->optimization, 0, sizeof(program->optimization));
+
+    int64_t workers_len = workflow->workers_len, pipes_len = workflow->pipes_len;
+    optimizer.worker_canon = program_alloc(program, sizeof(int64_t) * workers_len);
+    optimizer.pure = program_alloc(program, sizeof(int64_t) * workers_len);
+    optimizer.live = program_alloc(program, sizeof(int64_t) * workers_len);
+    optimizer.pipe_canon = program_alloc(program, sizeof(int64_t) * pipes_len);
+    int64_t *order = program_alloc(program, sizeof(int64_t) * workers_len);
+    int64_t *pending = program_alloc(program, sizeof(int64_t) * workers_len);
+    int64_t *pipe_map = program_alloc(program, sizeof(int64_t) * pipes_len);
+
+    if (!program->memory.failed && table_reset(&optimizer, pipes_len))
+    {
+        for (int64_t w = 0; w < workers_len; ++w)
+        {
+            optimizer.worker_canon[w] = w;
+            optimizer.pure[w] = (workflow->worker_flags[w] & PURITY_PURE) != 0;
+        }
+        for (int64_t p = 0; p < pipes_len; ++p)
+        {
+            optimizer.pipe_canon[p] = p;
+        }
+
+        merge_literals(&optimizer);
+        if (table_reset(&optimizer, workers_len))
+        {
+            merge_workers(&optimizer, order, pending);
+        }
+        if (!program->memory.failed && table_reset(&optimizer, pipes_len))
+        {
+            /* order is free again, reused as stack */
+            mark_live(&optimizer, order);
+            rebuild(&optimizer, pending, pipe_map);
+        }
+    }
+
+    program_free(program, optimizer.worker_canon);
+    program_free(program, optimizer.pure);
+    program_free(program, optimizer.live);
+    program_free(program, optimizer.pipe_canon);
+    program_free(program, optimizer.table);
+    program_free(program, order);
+    program_free(program, pending);
+    program_free(program, pipe_map);
+
+    program_pass_end(program, PASS_OPTIMIZE);
+}
@@ -0,0 +1,339 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+enum slot_state
+{
+    SLOT_FREE,
+    SLOT_PENDING,
+    SLOT_RUNNING,
+    SLOT_DONE,
+};
+
+
+/* one thread of parallel map */
+struct map_thread
+{
+    struct parallel_map *map;
+    thrd_t thread;
+    struct trace_buffer *trace_buffer;
+};
+
+
+static void *slot_input(struct parallel_map *map, int64_t slot)
+{
+    return map->inputs + slot * map->input_size;
+}
+
+
+static void *slot_output(struct parallel_map *map, int64_t slot)
+{
+    return map->outputs + slot * map->output_size;
+}
+
+
+static int map_thread_main(void *arg)
+{
+    struct map_thread *self = arg;
+    struct parallel_map *map = self->map;
+    /* slots taken in one go, so the lock is taken once per batch */
+    int64_t batch[MAX_MAP_BATCH];
+
+    if (map->options.trace != NULL)
+    {
+        self->trace_buffer = trace_thread_attach(map->options.trace);
+    }
+
+    mtx_lock(&map->lock);
+    for (;;)
+    {
+        while (map->pending_len == 0 && !map->shutdown)
+        {
+            cnd_wait(&map->work_available, &map->lock);
+        }
+        if (map->pending_len == 0)
+        {
+            break;
+        }
+
+        int64_t batch_len = 0;
+        while (batch_len < map->options.batch && map->pending_len > 0)
+        {
+            int64_t slot = map->pending[map->pending_head];
+            map->pending_head = (map->pending_head + 1) % map->options.window;
+            map->pending_len--;
+            map->states[slot] = SLOT_RUNNING;
+            batch[batch_len++] = slot;
+        }
+        mtx_unlock(&map->lock);
+
+        int64_t begin_ns = time_now_ns();
+        for (int64_t i = 0; i < batch_len; ++i)
+        {
+            map->function(map->context, slot_input(map, batch[i]), slot_output(map, batch[i]));
+        }
+        if (map->options.workflow != NULL)
+        {
+            worker_stats_busy(self->trace_buffer, map->options.workflow, map->options.worker, begin_ns, time_now_ns());
+            worker_stats_items(map->options.workflow, map->options.worker, batch_len, batch_len);
+        }
+
+        mtx_lock(&map->lock);
+        for (int64_t i = 0; i < batch_len; ++i)
+        {
+            map->states[batch[i]] = SLOT_DONE;
+            if (!map->options.ordered)
+            {
+                map->done[(map->done_head + map->done_len) % map->options.window] = batch[i];
+                map->done_len++;
+            }
+        }
+        cnd_broadcast(&map->result_ready);
+    }
+    mtx_unlock(&map->lock);
+
+    return 0;
+}
+
+
+/* options are copied, zero fields get defaults */
+struct parallel_map *parallel_map_create(struct parallel_map_options *options, map_function function, void *context, int64_t input_size, int64_t output_size)
+{
+    struct parallel_map *map = malloc(sizeof(*map));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    memset(map, 0, sizeof(*map));
+
+    map->options = *options;
+    if (map->options.threads <= 0)
+    {
+        map->options.threads = runtime_cores();
+    }
+    if (map->options.batch <= 0)
+    {
+        map->options.batch = 1;
+    }
+    if (map->options.batch > MAX_MAP_BATCH)
+    {
+        map->options.batch = MAX_MAP_BATCH;
+    }
+    if (map->options.window <= 0)
+    {
+        map->options.window = 4 * map->options.threads * map->options.batch;
+    }
+
+    int64_t window = map->options.window;
+    map->function = function;
+    map->context = context;
+    map->input_size = input_size;
+    map->output_size = output_size;
+
+    map->inputs = malloc(input_size * window + 1);
+    map->outputs = malloc(output_size * window + 1);
+    map->states = calloc(window, sizeof(*map->states));
+    map->pending = malloc(sizeof(*map->pending) * window);
+    map->done = malloc(sizeof(*map->done) * window);
+    map->free_slots = malloc(sizeof(*map->free_slots) * window);
+    map->threads = calloc(map->options.threads, sizeof(*map->threads));
+    if (map->inputs == NULL || map->outputs == NULL || map->states == NULL || map->pending == NULL ||
+        map->done == NULL || map->free_slots == NULL || map->threads == NULL)
+    {
+        parallel_map_destroy(map);
+        return NULL;
+    }
+    for (int64_t i = 0; i < window; ++i)
+    {
+        map->free_slots[i] = window - 1 - i;
+    }
+    map->free_slots_len = window;
+
+    mtx_init(&map->lock, mtx_plain);
+    cnd_init(&map->work_available);
+    cnd_init(&map->result_ready);
+    cnd_init(&map->not_full);
+    map->sync_initialized = 1;
+
+    for (int64_t i = 0; i < map->options.threads; ++i)
+    {
+        map->threads[i].map = map;
+        if (thrd_create(&map->threads[i].thread, map_thread_main, &map->threads[i]) != thrd_success)
+        {
+            break;
+        }
+        map->threads_started++;
+    }
+    if (map->threads_started == 0)
+    {
+        parallel_map_destroy(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+
+/* blocks while window is full, returns sequence number of the item */
+int64_t parallel_map_push(struct parallel_map *map, const void *input)
+{
+    int64_t window = map->options.window;
+
+    mtx_lock(&map->lock);
+    /* in ordered mode a slow item holds the window, so memory stays bounded */
+    while (map->pushed - map->popped >= window)
+    {
+        cnd_wait(&map->not_full, &map->lock);
+    }
+
+    int64_t slot;
+    if (map->options.ordered)
+    {
+        slot = map->pushed % window;
+    }
+    else
+    {
+        slot = map->free_slots[--map->free_slots_len];
+    }
+
+    memcpy(slot_input(map, slot), input, map->input_size);
+    map->states[slot] = SLOT_PENDING;
+    map->pending[(map->pending_head + map->pending_len) % window] = slot;
+    map->pending_len++;
+    int64_t seq = map->pushed++;
+
+    cnd_signal(&map->work_available);
+    mtx_unlock(&map->lock);
+
+    return seq;
+}
+
+
+/* no more items will be pushed, pop returns 0 after the last result */
+void parallel_map_close(struct parallel_map *map)
+{
+    mtx_lock(&map->lock);
+    map->closed = 1;
+    cnd_broadcast(&map->result_ready);
+    mtx_unlock(&map->lock);
+}
+
+
+/* ordered maps return results in push order, unordered ones as soon
+   as they are ready. returns 1 if output was written, 0 at the end */
+int64_t parallel_map_pop(struct parallel_map *map, void *output)
+{
+    int64_t window = map->options.window;
+
+    mtx_lock(&map->lock);
+    for (;;)
+    {
+        if (map->options.ordered && map->popped < map->pushed && map->states[map->popped % window] == SLOT_DONE)
+        {
+            break;
+        }
+        if (!map->options.ordered && map->done_len > 0)
+        {
+            break;
+        }
+        if (map->closed && map->popped == map->pushed)
+        {
+            mtx_unlock(&map->lock);
+            return 0;
+        }
+        cnd_wait(&map->result_ready, &map->lock);
+    }
+
+    int64_t slot;
+    if (map->options.ordered)
+    {
+        slot = map->popped % window;
+    }
+    else
+    {
+        slot = map->done[map->done_head];
+        map->done_head = (map->done_head + 1) % window;
+        map->done_len--;
+        map->free_slots[map->free_slots_len++] = slot;
+    }
+
+    memcpy(output, slot_output(map, slot), map->output_size);
+    map->states[slot] = SLOT_FREE;
+    map->popped++;
+
+    cnd_signal(&map->not_full);
+    mtx_unlock(&map->lock);
+
+    return 1;
+}
+
+
+void parallel_map_destroy(struct parallel_map *map)
+{
+    if (map->sync_initialized)
+    {
+        mtx_lock(&map->lock);
+        map->shutdown = 1;
+        cnd_broadcast(&map->work_available);
+        mtx_unlock(&map->lock);
+
+        /* threads finish items still pending, nobody will pop them */
+        for (int64_t i = 0; i < map->threads_started; ++i)
+        {
+            thrd_join(map->threads[i].thread, NULL);
+        }
+
+        mtx_destroy(&map->lock);
+        cnd_destroy(&map->work_available);
+        cnd_destroy(&map->result_ready);
+        cnd_destroy(&map->not_full);
+    }
+
+    free(map->inputs);
+    free(map->outputs);
+    free(map->states);
+    free(map->pending);
+    free(map->done);
+    free(map->free_slots);
+    free(map->threads);
+    free(map);
+}
+
+
+/* maps len items from inputs to outputs, order is always kept */
+int64_t parallel_map_run(struct parallel_map_options *options, map_function function, void *context,
+                         const void *inputs, int64_t input_size, int64_t len, void *outputs, int64_t output_size)
+{
+    struct parallel_map_options ordered = *options;
+    ordered.ordered = 1;
+
+    struct parallel_map *map = parallel_map_create(&ordered, function, context, input_size, output_size);
+    if (map == NULL)
+    {
+        return 0;
+    }
+
+    /* popping interleaved with pushing keeps the window moving */
+    int64_t popped = 0;
+    for (int64_t i = 0; i < len; ++i)
+    {
+        while (map->pushed - popped >= map->options.window)
+        {
+            parallel_map_pop(map, (char *)outputs + popped * output_size);
+            popped++;
+        }
+        parallel_map_push(map, (const char *)inputs + i * input_size);
+    }
+    parallel_map_close(map);
+    while (parallel_map_pop(map, (char *)outputs + popped * output_size))
+    {
+        popped++;
+    }
+
+    parallel_map_destroy(map);
+    return 1;
+}
@@ -1,10 +1,13 @@
 #include "lang.h"
+#include "runtime.h"
 
 #include "stdio.h"
 #include "malloc.h"
+#include "stdlib.h"
+#include "string.h"
 #include "inttypes.h"
 
-char *read_code(const char *filename)
+char *read_code(const char *filename, int64_t *code_len)
 {
     FILE *f = fopen(filename, "r");
     if (f == NULL)
@@ -19,6 +22,7 @@ char *read_code(const char *filename)
     char *buf = malloc(file_size + 1);
     int64_t res = fread(buf, 1, file_size, f);
     buf[res] = 0;
+    *code_len = res;
     
     fclose(f);
 
@@ -27,20 +31,295 @@ char *read_code(const char *filename)
 
 int main(int argc, char **argv)
 {
-    if (argc == 1)
+    char *input_file = NULL;
+    int64_t time_passes = 0;
+    enum pass_report_format report_format = PASS_REPORT_TABLE;
+    char *diagnostics_file = NULL;
+    int64_t optimize = 1;
+    int64_t memoize = 0;
+    /* -1 means no replication plan */
+    int64_t replicas = -1;
+    /* -1 means no partitioning into processes */
+    int64_t processes = -1;
+    char *profile_file = NULL;
+    char *profile_out_file = NULL;
+    int64_t trace_summary = 0;
+    char *server_socket = NULL;
+    char *client_socket = NULL;
+    struct log_render_options log_options = {
+        .format = LOG_FORMAT_TEXT,
+        .min_level = LOG_INFO,
+        .max_errors = 0,
+        .deduplicate = 1,
+    };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--time-passes") == 0)
+        {
+            time_passes = 1;
+        }
+        else if (strcmp(argv[i], "--time-passes=json") == 0)
+        {
+            time_passes = 1;
+            report_format = PASS_REPORT_JSON;
+        }
+        else if (strcmp(argv[i], "--diagnostics=text") == 0)
+        {
+            log_options.format = LOG_FORMAT_TEXT;
+        }
+        else if (strcmp(argv[i], "--diagnostics=json") == 0)
+        {
+            log_options.format = LOG_FORMAT_JSON;
+        }
+        else if (strcmp(argv[i], "--diagnostics=sarif") == 0)
+        {
+            log_options.format = LOG_FORMAT_SARIF;
+        }
+        else if (strncmp(argv[i], "--diagnostics-file=", 19) == 0)
+        {
+            diagnostics_file = argv[i] + 19;
+        }
+        else if (strcmp(argv[i], "--min-level=note") == 0)
+        {
+            log_options.min_level = LOG_NOTE;
+        }
+        else if (strcmp(argv[i], "--min-level=warning") == 0)
+        {
+            log_options.min_level = LOG_WARNING;
+        }
+        else if (strcmp(argv[i], "--min-level=error") == 0)
+        {
+            log_options.min_level = LOG_ERROR;
+        }
+        else if (strncmp(argv[i], "--max-errors=", 13) == 0)
+        {
+            log_options.max_errors = atoll(argv[i] + 13);
+        }
+        else if (strcmp(argv[i], "--no-dedup") == 0)
+        {
+            log_options.deduplicate = 0;
+        }
+        else if (strcmp(argv[i], "--no-optimize") == 0)
+        {
+            optimize = 0;
+        }
+        else if (strcmp(argv[i], "--memoize") == 0)
+        {
+            memoize = 1;
+        }
+        else if (strcmp(argv[i], "--replicas") == 0)
+        {
+            replicas = 0;
+        }
+        else if (strncmp(argv[i], "--replicas=", 11) == 0)
+        {
+            replicas = atoll(argv[i] + 11);
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+        {
+            profile_file = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--profile-out=", 14) == 0)
+        {
+            profile_out_file = argv[i] + 14;
+        }
+        else if (strcmp(argv[i], "--trace-summary") == 0)
+        {
+            trace_summary = 1;
+        }
+        else if (strcmp(argv[i], "--processes") == 0)
+        {
+            processes = 0;
+        }
+        else if (strncmp(argv[i], "--processes=", 12) == 0)
+        {
+            processes = atoll(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "--server=", 9) == 0)
+        {
+            server_socket = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--client=", 9) == 0)
+        {
+            client_socket = argv[i] + 9;
+        }
+        else
+        {
+            input_file = argv[i];
+        }
+    }
+
+    if (server_socket != NULL)
+    {
+        /* compiled files stay in memory between requests of clients */
+        struct compiler_options options = {
+            .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_TYPES | (optimize ? STAGE_OPTIMIZE : 0) | (memoize ? STAGE_MEMOIZE : 0),
+            .dump_stream = NULL,
+            .memory_limit = 0,
+        };
+        struct compile_server *server = compile_server_create(&options, &log_options);
+        if (server == NULL || !compile_server_listen(server, server_socket))
+        {
+            printf("Error: can't listen on %s\n", server_socket);
+            if (server != NULL)
+            {
+                compile_server_destroy(server);
+            }
+            return 1;
+        }
+        compile_server_serve(server);
+        compile_server_destroy(server);
+        return 0;
+    }
+
+    if (input_file == NULL)
     {
         printf("need input file\n");
         return 1;
     }
-    char *input_file = argv[1];
 
-    char *code = read_code(input_file);
+    if (client_socket != NULL)
+    {
+        /* server may run in other directory, it gets absolute path */
+        char request[4096];
+#ifdef _WIN32
+        char *path = _fullpath(NULL, input_file, 0);
+#else
+        char *path = realpath(input_file, NULL);
+#endif
+        snprintf(request, sizeof(request), "compile %s", path != NULL ? path : input_file);
+        free(path);
+        if (!compile_client_request(client_socket, request, stdout))
+        {
+            printf("Error: compilation through %s failed\n", client_socket);
+            return 1;
+        }
+        return 0;
+    }
+
+    int64_t code_len = 0;
+    char *code = read_code(input_file, &code_len);
     
     if (code == NULL)
     {
         printf("Error: can't read file\n");
+        return 1;
+    }
+
+    int64_t profile_len = 0;
+    char *profile = NULL;
+    if (profile_file != NULL)
+    {
+        profile = read_code(profile_file, &profile_len);
+        if (profile == NULL)
+        {
+            printf("Error: can't read profile\n");
+            free(code);
+            return 1;
+        }
+    }
+
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_AST_DUMP | STAGE_WORKFLOW | STAGE_WORKFLOW_DUMP | STAGE_TYPES | (optimize ? STAGE_OPTIMIZE : 0) | (memoize ? STAGE_MEMOIZE : 0),
+        .dump_stream = stdout,
+        .memory_limit = 0,
+        .profile = profile,
+        .profile_len = profile_len,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    if (compiler == NULL)
+    {
+        printf("Error: No memory for COMPILER.\n");
+        return 1;
+    }
+
+    struct program *program = NULL;
+    enum compile_status status = compiler_compile(compiler, input_file, code, code_len, 0, &program);
+    free(code);
+    free(profile);
+
+    if (program == NULL)
+    {
+        printf("Error: compilation %s\n", compile_status_name(status));
+        compiler_destroy(compiler);
+        return 1;
     }
 
-    struct program *program = program_create_from_code(argv[1], code);
-    (void)program;
+    FILE *diagnostics = stdout;
+    if (diagnostics_file != NULL)
+    {
+        diagnostics = fopen(diagnostics_file, "w");
+        if (diagnostics == NULL)
+        {
+            printf("Error: can't write diagnostics file\n");
+            program_destroy(program);
+            compiler_destroy(compiler);
+            return 1;
+        }
+    }
+    if (replicas >= 0 && status == COMPILE_OK)
+    {
+        struct replica_plan *plan = replica_plan_create(&program->workflow, replicas);
+        if (plan != NULL)
+        {
+            replica_plan_dump(stdout, program, plan);
+            replica_plan_destroy(plan);
+        }
+    }
+    if (processes >= 0 && status == COMPILE_OK)
+    {
+        struct partition_plan *plan = partition_plan_create(&program->workflow, processes);
+        if (plan != NULL)
+        {
+            partition_plan_dump(stdout, program, plan);
+            partition_plan_destroy(plan);
+        }
+    }
+
+    if (trace_summary && status == COMPILE_OK)
+    {
+        /* where --profile says time went, per worker and pipe. the
+           driver runs nothing itself, so there is no other data */
+        if (profile_file == NULL)
+        {
+            printf("Note: no runtime data, summary shows stats of --profile and all of them are zero without one\n");
+        }
+        trace_export_summary(stdout, program);
+    }
+    if (profile_out_file != NULL && status == COMPILE_OK)
+    {
+        /* stats loaded by --profile, all zero without one */
+        FILE *profile_out = fopen(profile_out_file, "w");
+        if (profile_out == NULL)
+        {
+            printf("Error: can't write profile\n");
+        }
+        else
+        {
+            program_profile_write(profile_out, program);
+            fclose(profile_out);
+        }
+    }
+
+    program_log_render(diagnostics, program, &log_options);
+    if (diagnostics != stdout)
+    {
+        fclose(diagnostics);
+    }
+
+    if (time_passes)
+    {
+        program_pass_report(stderr, program, report_format);
+    }
+
+    if (status == COMPILE_NO_MEMORY)
+    {
+        printf("Error: No memory for COMPILATION.\n");
+    }
+
+    program_destroy(program);
+    compiler_destroy(compiler);
+
+    return status != COMPILE_OK;
 }
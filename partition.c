@@ -0,0 +1,647 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include "errno.h"
+#include "fcntl.h"
+#include "signal.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/wait.h"
+#endif
+
+
+static int64_t is_boxed(int64_t type)
+{
+    int64_t kind = TYPE_KIND(type);
+    return kind != TYPE_BYTE && kind != TYPE_INT && kind != TYPE_DOUBLE;
+}
+
+
+/* Kahn order, workers left in cycles follow in index order. worker
+   reading pipe through substitution like a=a[0] waits for its
+   producers as if it was an input */
+static int64_t topological_order(struct workflow *workflow, int64_t *order)
+{
+    int64_t *waiting = calloc(workflow->workers_len + 1, sizeof(*waiting));
+    char *placed = calloc(workflow->workers_len + 1, 1);
+    if (waiting == NULL || placed == NULL)
+    {
+        free(waiting);
+        free(placed);
+        return 0;
+    }
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        for (int64_t side = 0; side < 2; ++side)
+        {
+            int64_t *offsets = side ? workflow->worker_symbols_offsets : workflow->worker_inputs_offsets;
+            int64_t *pipes = side ? workflow->worker_symbols : workflow->worker_inputs;
+            for (int64_t i = offsets[w]; i < offsets[w + 1]; ++i)
+            {
+                int64_t pipe = pipes[i];
+                waiting[w] += pipe != -1 ? workflow->pipe_producers_offsets[pipe + 1] - workflow->pipe_producers_offsets[pipe] : 0;
+            }
+        }
+    }
+
+    int64_t len = 0, head = 0;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (waiting[w] == 0)
+        {
+            order[len++] = w;
+            placed[w] = 1;
+        }
+    }
+    for (;;)
+    {
+        for (; head < len; ++head)
+        {
+            int64_t w = order[head];
+            for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+            {
+                int64_t pipe = workflow->worker_outputs[i];
+                for (int64_t side = 0; side < 2; ++side)
+                {
+                    int64_t *offsets = side ? workflow->pipe_symbol_readers_offsets : workflow->pipe_consumers_offsets;
+                    int64_t *readers = side ? workflow->pipe_symbol_readers : workflow->pipe_consumers;
+                    for (int64_t j = offsets[pipe]; j < offsets[pipe + 1]; ++j)
+                    {
+                        int64_t reader = readers[j];
+                        if (--waiting[reader] == 0 && !placed[reader])
+                        {
+                            order[len++] = reader;
+                            placed[reader] = 1;
+                        }
+                    }
+                }
+            }
+        }
+        if (len == workflow->workers_len)
+        {
+            break;
+        }
+        /* break cycle at first worker not placed yet */
+        for (int64_t w = 0; w < workflow->workers_len; ++w)
+        {
+            if (!placed[w])
+            {
+                order[len++] = w;
+                placed[w] = 1;
+                break;
+            }
+        }
+    }
+
+    free(waiting);
+    free(placed);
+    return 1;
+}
+
+
+static int64_t group_root(int64_t *groups, int64_t worker)
+{
+    while (groups[worker] != worker)
+    {
+        groups[worker] = groups[groups[worker]];
+        worker = groups[worker];
+    }
+    return worker;
+}
+
+
+/* workers joined by boxed pipes stay together, their pointers mean
+   nothing in other processes, readers of substitutions included */
+static void group_boxed(struct workflow *workflow, int64_t *groups)
+{
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        groups[w] = w;
+    }
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        if (!is_boxed(workflow->pipe_types[p]))
+        {
+            continue;
+        }
+        int64_t first = -1;
+        for (int64_t side = 0; side < 3; ++side)
+        {
+            int64_t *offsets = side == 2 ? workflow->pipe_symbol_readers_offsets :
+                               side == 1 ? workflow->pipe_consumers_offsets : workflow->pipe_producers_offsets;
+            int64_t *workers = side == 2 ? workflow->pipe_symbol_readers :
+                               side == 1 ? workflow->pipe_consumers : workflow->pipe_producers;
+            for (int64_t i = offsets[p]; i < offsets[p + 1]; ++i)
+            {
+                int64_t root = group_root(groups, workers[i]);
+                first = first == -1 ? root : first;
+                groups[root] = first;
+            }
+        }
+    }
+}
+
+
+/* cuts topological order into partitions of equal number of workers,
+   so chains of stages are cut the fewest times. group of workers joined
+   by boxed pipes goes whole to partition of its first worker in order,
+   partitions left empty by big groups are dropped. pipes whose producers
+   and consumers, or workers reading them through substitutions, end up
+   in different partitions get channels */
+struct partition_plan *partition_plan_create(struct workflow *workflow, int64_t partitions)
+{
+    partitions = partitions > 0 ? partitions : runtime_cores();
+    partitions = partitions < workflow->workers_len ? partitions : workflow->workers_len;
+    partitions = partitions > 0 ? partitions : 1;
+
+    struct partition_plan *plan = calloc(1, sizeof(*plan));
+    int64_t *order = malloc(sizeof(*order) * (workflow->workers_len + 1));
+    int64_t *groups = malloc(sizeof(*groups) * (workflow->workers_len + 1));
+    int64_t *group_sizes = calloc(workflow->workers_len + 1, sizeof(*group_sizes));
+    if (plan == NULL || order == NULL || groups == NULL || group_sizes == NULL)
+    {
+        free(plan);
+        free(order);
+        free(groups);
+        free(group_sizes);
+        return NULL;
+    }
+    plan->workers_len = workflow->workers_len;
+    plan->pipes_len = workflow->pipes_len;
+    plan->worker_partitions = malloc(sizeof(*plan->worker_partitions) * (workflow->workers_len + 1));
+    plan->pipe_partitions = malloc(sizeof(*plan->pipe_partitions) * (workflow->pipes_len + 1));
+    if (plan->worker_partitions == NULL || plan->pipe_partitions == NULL || !topological_order(workflow, order))
+    {
+        free(order);
+        free(groups);
+        free(group_sizes);
+        partition_plan_destroy(plan);
+        return NULL;
+    }
+
+    group_boxed(workflow, groups);
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        group_sizes[group_root(groups, w)]++;
+        plan->worker_partitions[w] = -1;
+    }
+    int64_t placed = 0, last = -1;
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        int64_t root = group_root(groups, order[i]);
+        if (plan->worker_partitions[root] == -1)
+        {
+            int64_t partition = placed * partitions / workflow->workers_len;
+            /* numbers stay dense when a group covers whole partitions */
+            plan->partitions += partition != last;
+            last = partition;
+            plan->worker_partitions[root] = plan->partitions - 1;
+            placed += group_sizes[root];
+        }
+    }
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        plan->worker_partitions[w] = plan->worker_partitions[group_root(groups, w)];
+    }
+    free(order);
+    free(groups);
+    free(group_sizes);
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        plan->pipe_partitions[p] = -2;
+        for (int64_t i = workflow->pipe_producers_offsets[p]; i < workflow->pipe_producers_offsets[p + 1]; ++i)
+        {
+            int64_t from = plan->worker_partitions[workflow->pipe_producers[i]];
+            int64_t consumers_len = workflow->pipe_consumers_offsets[p + 1] - workflow->pipe_consumers_offsets[p];
+            int64_t readers_len = workflow->pipe_symbol_readers_offsets[p + 1] - workflow->pipe_symbol_readers_offsets[p];
+            for (int64_t j = 0; j < consumers_len + readers_len; ++j)
+            {
+                int64_t reader = j < consumers_len ? workflow->pipe_consumers[workflow->pipe_consumers_offsets[p] + j] :
+                                 workflow->pipe_symbol_readers[workflow->pipe_symbol_readers_offsets[p] + j - consumers_len];
+                int64_t to = plan->worker_partitions[reader];
+                if (from == to)
+                {
+                    continue;
+                }
+
+                int64_t known = 0;
+                for (int64_t k = 0; k < plan->channels_len; ++k)
+                {
+                    known |= plan->channels[k].pipe == p && plan->channels[k].from == from && plan->channels[k].to == to;
+                }
+                if (known)
+                {
+                    continue;
+                }
+                if (plan->channels_len == plan->channels_alloc)
+                {
+                    int64_t alloc = 2*plan->channels_alloc + !plan->channels_alloc;
+                    struct partition_channel *channels = realloc(plan->channels, sizeof(*channels) * alloc);
+                    if (channels == NULL)
+                    {
+                        partition_plan_destroy(plan);
+                        return NULL;
+                    }
+                    plan->channels = channels;
+                    plan->channels_alloc = alloc;
+                }
+                plan->channels[plan->channels_len++] = (struct partition_channel){
+                    .pipe = p,
+                    .from = from,
+                    .to = to,
+                    .element_size = type_element_size(workflow->pipe_types[p]),
+                };
+            }
+        }
+    }
+
+    /* every pipe left in one partition belongs to it, -1 marks crossing */
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        for (int64_t side = 0; side < 3; ++side)
+        {
+            int64_t *offsets = side == 2 ? workflow->worker_symbols_offsets :
+                               side == 1 ? workflow->worker_outputs_offsets : workflow->worker_inputs_offsets;
+            int64_t *pipes = side == 2 ? workflow->worker_symbols :
+                             side == 1 ? workflow->worker_outputs : workflow->worker_inputs;
+            for (int64_t i = offsets[w]; i < offsets[w + 1]; ++i)
+            {
+                if (pipes[i] == -1)
+                {
+                    continue;
+                }
+                int64_t *partition = &plan->pipe_partitions[pipes[i]];
+                *partition = *partition == -2 || *partition == plan->worker_partitions[w] ? plan->worker_partitions[w] : -1;
+            }
+        }
+    }
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        /* nobody touches it, any partition will do */
+        plan->pipe_partitions[p] = plan->pipe_partitions[p] == -2 ? 0 : plan->pipe_partitions[p];
+    }
+    return plan;
+}
+
+
+void partition_plan_destroy(struct partition_plan *plan)
+{
+    free(plan->worker_partitions);
+    free(plan->pipe_partitions);
+    free(plan->channels);
+    free(plan);
+}
+
+
+void partition_plan_dump(FILE *stream, struct program *program, struct partition_plan *plan)
+{
+    struct workflow *workflow = &program->workflow;
+    fprintf(stream, "Partitions: %" PRId64 ", channels: %" PRId64 "\n", plan->partitions, plan->channels_len);
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        fprintf(stream, "worker %" PRId64 ": %s -> process %" PRId64 "\n", i, workflow->worker_names[i], plan->worker_partitions[i]);
+    }
+    for (int64_t k = 0; k < plan->channels_len; ++k)
+    {
+        struct partition_channel *channel = &plan->channels[k];
+        fprintf(stream, "channel %" PRId64 ": pipe %" PRId64 ":%s process %" PRId64 " -> %" PRId64 "\n", k, channel->pipe, workflow->pipe_names[channel->pipe],
+                channel->from, channel->to);
+    }
+}
+
+
+#ifndef _WIN32
+
+/* single producer single consumer ring, head and tail on own lines */
+struct shm_ring_header
+{
+    _Atomic int64_t head;
+    char head_padding[56];
+    _Atomic int64_t tail;
+    char tail_padding[56];
+    int64_t capacity;
+    int64_t element_size;
+    _Atomic int64_t closed;
+};
+
+
+/* capacity is rounded up to power of two */
+int64_t shm_ring_create(struct shm_ring *ring, const char *name, int64_t element_size, int64_t capacity)
+{
+    int64_t alloc = 1;
+    while (alloc < capacity)
+    {
+        alloc *= 2;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    int fd = shm_open(ring->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ring->mapped_bytes = sizeof(struct shm_ring_header) + alloc * element_size;
+    if (ftruncate(fd, ring->mapped_bytes) != 0)
+    {
+        close(fd);
+        shm_unlink(ring->name);
+        return 0;
+    }
+    void *memory = mmap(NULL, ring->mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        shm_unlink(ring->name);
+        return 0;
+    }
+
+    ring->header = memory;
+    ring->data = (char *)memory + sizeof(struct shm_ring_header);
+    ring->owner = 1;
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->tail, 0);
+    atomic_init(&ring->header->closed, 0);
+    ring->header->capacity = alloc;
+    ring->header->element_size = element_size;
+    return 1;
+}
+
+
+/* for processes not forked after ring was created */
+int64_t shm_ring_open(struct shm_ring *ring, const char *name)
+{
+    memset(ring, 0, sizeof(*ring));
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    int fd = shm_open(ring->name, O_RDWR, 0600);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct shm_ring_header header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        close(fd);
+        return 0;
+    }
+    ring->mapped_bytes = sizeof(header) + header.capacity * header.element_size;
+    void *memory = mmap(NULL, ring->mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        return 0;
+    }
+    ring->header = memory;
+    ring->data = (char *)memory + sizeof(header);
+    return 1;
+}
+
+
+void shm_ring_destroy(struct shm_ring *ring)
+{
+    if (ring->header != NULL)
+    {
+        munmap(ring->header, ring->mapped_bytes);
+    }
+    if (ring->owner)
+    {
+        shm_unlink(ring->name);
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+/* never blocks, returns 0 if ring is full */
+int64_t shm_ring_push(struct shm_ring *ring, const void *element)
+{
+    struct shm_ring_header *header = ring->header;
+    int64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&header->head, memory_order_acquire) == header->capacity)
+    {
+        return 0;
+    }
+    memcpy(ring->data + (tail & (header->capacity - 1)) * header->element_size, element, header->element_size);
+    atomic_store_explicit(&header->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+
+/* never blocks, returns 0 if ring is empty */
+int64_t shm_ring_pop(struct shm_ring *ring, void *element)
+{
+    struct shm_ring_header *header = ring->header;
+    int64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&header->tail, memory_order_acquire))
+    {
+        return 0;
+    }
+    memcpy(element, ring->data + (head & (header->capacity - 1)) * header->element_size, header->element_size);
+    atomic_store_explicit(&header->head, head + 1, memory_order_release);
+    return 1;
+}
+
+
+void shm_ring_close(struct shm_ring *ring)
+{
+    atomic_store_explicit(&ring->header->closed, 1, memory_order_release);
+}
+
+
+/* closed and drained, pop won't ever return anything again */
+int64_t shm_ring_finished(struct shm_ring *ring)
+{
+    struct shm_ring_header *header = ring->header;
+    return atomic_load_explicit(&header->closed, memory_order_acquire) &&
+           atomic_load_explicit(&header->head, memory_order_relaxed) == atomic_load_explicit(&header->tail, memory_order_acquire);
+}
+
+
+static void stop(pid_t *pids, int64_t started)
+{
+    for (int64_t i = 0; i < started; ++i)
+    {
+        if (pids[i] > 0)
+        {
+            kill(pids[i], SIGTERM);
+        }
+    }
+}
+
+
+/* reaps one of processes started by launch, never other children of
+   caller. returns its index and whether it succeeded, -1 once all are
+   reaped */
+static int64_t reap(pid_t *pids, int64_t started, int64_t *ok)
+{
+    for (;;)
+    {
+        int64_t running = 0;
+        for (int64_t i = 0; i < started; ++i)
+        {
+            if (pids[i] <= 0)
+            {
+                continue;
+            }
+            running++;
+            int status = 0;
+            pid_t pid = waitpid(pids[i], &status, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR))
+            {
+                continue;
+            }
+            /* pid taken by somebody else counts as failed */
+            if (ok != NULL)
+            {
+                *ok = pid == pids[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+            pids[i] = 0;
+            return i;
+        }
+        if (running == 0)
+        {
+            return -1;
+        }
+        usleep(1000);
+    }
+}
+
+
+/* creates ring of every channel, forks one process per partition and
+   waits for them. process that fails takes the others down with it.
+   returns number of partitions that failed or were stopped, -1 if
+   they couldn't all start */
+int64_t partition_launch(struct partition_plan *plan, int64_t capacity, partition_function function, void *context)
+{
+    struct shm_ring *rings = calloc(plan->channels_len + 1, sizeof(*rings));
+    pid_t *pids = calloc(plan->partitions, sizeof(*pids));
+    int64_t created = 0;
+    int64_t failed = -1;
+    if (rings == NULL || pids == NULL)
+    {
+        goto cleanup;
+    }
+
+    for (; created < plan->channels_len; ++created)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/pipeline-%" PRId64 "-%" PRId64, (int64_t)getpid(), created);
+        if (!shm_ring_create(&rings[created], name, plan->channels[created].element_size, capacity))
+        {
+            goto cleanup;
+        }
+    }
+
+    /* rings are mapped before fork, so children share them as they are */
+    int64_t started = 0;
+    for (; started < plan->partitions; ++started)
+    {
+        pids[started] = fork();
+        if (pids[started] == 0)
+        {
+            _exit(function(context, plan, started, rings) == 0 ? 0 : 1);
+        }
+        if (pids[started] < 0)
+        {
+            /* partitions that did start would wait on their channels forever */
+            stop(pids, started);
+            while (reap(pids, started, NULL) >= 0)
+            {
+            }
+            goto cleanup;
+        }
+    }
+
+    failed = 0;
+    for (;;)
+    {
+        int64_t ok = 0;
+        if (reap(pids, started, &ok) < 0)
+        {
+            break;
+        }
+        if (!ok)
+        {
+            failed++;
+            stop(pids, started);
+        }
+    }
+
+cleanup:
+    for (int64_t i = 0; i < created; ++i)
+    {
+        shm_ring_destroy(&rings[i]);
+    }
+    free(rings);
+    free(pids);
+    return failed;
+}
+
+#else
+
+/* processes on Windows share memory through named file mappings,
+   which aren't wired up yet, so workflow stays in one process there */
+int64_t shm_ring_create(struct shm_ring *ring, const char *name, int64_t element_size, int64_t capacity)
+{
+    (void)name, (void)element_size, (void)capacity;
+    memset(ring, 0, sizeof(*ring));
+    return 0;
+}
+
+
+int64_t shm_ring_open(struct shm_ring *ring, const char *name)
+{
+    (void)name;
+    memset(ring, 0, sizeof(*ring));
+    return 0;
+}
+
+
+void shm_ring_destroy(struct shm_ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+int64_t shm_ring_push(struct shm_ring *ring, const void *element)
+{
+    (void)ring, (void)element;
+    return 0;
+}
+
+
+int64_t shm_ring_pop(struct shm_ring *ring, void *element)
+{
+    (void)ring, (void)element;
+    return 0;
+}
+
+
+void shm_ring_close(struct shm_ring *ring)
+{
+    (void)ring;
+}
+
+
+int64_t shm_ring_finished(struct shm_ring *ring)
+{
+    (void)ring;
+    return 1;
+}
+
+
+int64_t partition_launch(struct partition_plan *plan, int64_t capacity, partition_function function, void *context)
+{
+    (void)plan, (void)capacity, (void)function, (void)context;
+    return -1;
+}
+
+#endif
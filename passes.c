@@ -0,0 +1,148 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "time.h"
+
+#ifdef _WIN32
+#include "windows.h"
+#endif
+
+
+static const char *pass_names[PASS_COUNT] = {
+    [PASS_LINE_INDEX] = "line index",
+    [PASS_PARSE] = "parse",
+    [PASS_AST_DUMP] = "ast dump",
+    [PASS_PURITY] = "purity",
+    [PASS_WORKFLOW] = "workflow",
+    [PASS_OPTIMIZE] = "optimize",
+    [PASS_TYPES] = "types",
+    [PASS_INVARIANTS] = "invariants",
+    [PASS_PROFILE] = "profile",
+};
+
+
+int64_t time_now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+void program_pass_begin(struct program *program, enum compile_pass pass)
+{
+    struct pass_stats *stats = &program->passes[pass];
+
+    stats->begin_allocations = program->memory.allocations;
+    stats->begin_allocated_bytes = program->memory.allocated_bytes;
+    program->memory.pass_peak_bytes = program->memory.bytes;
+    stats->begin_ns = time_now_ns();
+}
+
+
+void program_pass_end(struct program *program, enum compile_pass pass)
+{
+    struct pass_stats *stats = &program->passes[pass];
+
+    stats->runs++;
+    stats->wall_ns += time_now_ns() - stats->begin_ns;
+    stats->allocations += program->memory.allocations - stats->begin_allocations;
+    stats->allocated_bytes += program->memory.allocated_bytes - stats->begin_allocated_bytes;
+    if (program->memory.pass_peak_bytes > stats->peak_bytes)
+    {
+        stats->peak_bytes = program->memory.pass_peak_bytes;
+    }
+}
+
+
+static int64_t count_pipelines(struct pipeline_definition *pipeline)
+{
+    int64_t count = 1;
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
+    {
+        if (pipeline->args[i].type == ARGUMENT_PIPELINE)
+        {
+            count += count_pipelines(pipeline->args[i].pipeline);
+        }
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        for (int64_t j = 0; j < pipeline->workers[i].subs_len; ++j)
+        {
+            if (pipeline->workers[i].subs[j].type == SUBSTITUTION_PIPELINE)
+            {
+                count += count_pipelines(pipeline->workers[i].subs[j].pipeline);
+            }
+        }
+    }
+    return count;
+}
+
+
+void program_pass_report(FILE *stream, struct program *program, enum pass_report_format format)
+{
+    int64_t pipelines = 0;
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        for (int64_t j = 0; j < program->definitions[i]->pipelines_len; ++j)
+        {
+            pipelines += count_pipelines(&program->definitions[i]->pipelines[j]);
+        }
+    }
+
+    int64_t total_ns = 0;
+    for (int64_t i = 0; i < PASS_COUNT; ++i)
+    {
+        total_ns += program->passes[i].wall_ns;
+    }
+
+    if (format == PASS_REPORT_JSON)
+    {
+        fprintf(stream, "{\"passes\":[");
+        for (int64_t i = 0; i < PASS_COUNT; ++i)
+        {
+            struct pass_stats *stats = &program->passes[i];
+            fprintf(stream, "%s{\"name\":\"%s\",\"runs\":%" PRId64 ",\"wall_ns\":%" PRId64 ",\"allocations\":%" PRId64 ",\"allocated_bytes\":%" PRId64 ",\"peak_bytes\":%" PRId64 "}",
+                    i == 0 ? "" : ",", pass_names[i], stats->runs, stats->wall_ns, stats->allocations, stats->allocated_bytes, stats->peak_bytes);
+        }
+        fprintf(stream, "],\"total_ns\":%" PRId64 ",\"peak_bytes\":%" PRId64 ",", total_ns, program->memory.peak_bytes);
+        fprintf(stream, "\"counts\":{\"definitions\":%" PRId64 ",\"pipelines\":%" PRId64 ",\"workers\":%" PRId64 ",\"pipes\":%" PRId64 ",\"names\":%" PRId64 ",",
+                program->definitions_len, pipelines, program->workflow.workers_len, program->workflow.pipes_len, program->names.names_len);
+        fprintf(stream, "\"merged_workers\":%" PRId64 ",\"merged_pipes\":%" PRId64 ",\"dead_workers\":%" PRId64 ",\"dead_pipes\":%" PRId64 "}}\n",
+                program->optimization.merged_workers, program->optimization.merged_pipes, program->optimization.dead_workers, program->optimization.dead_pipes);
+        return;
+    }
+
+    fprintf(stream, "===== Pass timing report: %s =====\n", program->filename);
+    fprintf(stream, "%-12s %12s %7s %12s %14s %14s\n", "pass", "wall ms", "%", "allocations", "alloc bytes", "peak bytes");
+    for (int64_t i = 0; i < PASS_COUNT; ++i)
+    {
+        struct pass_stats *stats = &program->passes[i];
+        if (stats->runs == 0)
+        {
+            continue;
+        }
+        fprintf(stream, "%-12s %12.3f %7.2f %12" PRId64 " %14" PRId64 " %14" PRId64 "\n",
+                pass_names[i], stats->wall_ns / 1e6, total_ns == 0 ? 0.0 : 100.0 * stats->wall_ns / total_ns,
+                stats->allocations, stats->allocated_bytes, stats->peak_bytes);
+    }
+    fprintf(stream, "%-12s %12.3f %7.2f %12" PRId64 " %14" PRId64 " %14" PRId64 "\n",
+            "total", total_ns / 1e6, 100.0, program->memory.allocations, program->memory.allocated_bytes, program->memory.peak_bytes);
+    fprintf(stream, "definitions: %" PRId64 ", pipelines: %" PRId64 ", workers: %" PRId64 ", pipes: %" PRId64 ", names: %" PRId64 "\n",
+            program->definitions_len, pipelines, program->workflow.workers_len, program->workflow.pipes_len, program->names.names_len);
+    if (program->passes[PASS_OPTIMIZE].runs != 0)
+    {
+        fprintf(stream, "merged workers: %" PRId64 ", merged pipes: %" PRId64 ", dead workers: %" PRId64 ", dead pipes: %" PRId64 "\n",
+                program->optimization.merged_workers, program->optimization.merged_pipes, program->optimization.dead_workers, program->optimization.dead_pipes);
+    }
+}
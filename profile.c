@@ -0,0 +1,279 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+#define PROFILE_VERSION 2
+/* items a pipe hands over at once, at most */
+#define MAX_PROFILE_BATCH 64
+/* consumers cheaper than this per item are run by their producer */
+#define FUSE_ITEM_NS 1000
+
+
+static uint64_t source_hash(struct program *program)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int64_t i = 0; i < program->source_code_len; ++i)
+    {
+        hash = (hash ^ (unsigned char)program->source_code[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+
+/* copies of one definition share code positions, so each scope is told
+   apart by how many earlier scopes are copies of the same definition.
+   returns NULL if out of memory */
+static int64_t *scope_instances(struct program *program)
+{
+    struct workflow *workflow = &program->workflow;
+    int64_t *instances = program_alloc(program, sizeof(*instances) * (workflow->scopes_len + 1));
+    int64_t *counts = program_alloc(program, sizeof(*counts) * (program->definitions_len + 1));
+    if (instances == NULL || counts == NULL)
+    {
+        program_free(program, instances);
+        program_free(program, counts);
+        return NULL;
+    }
+    memset(counts, 0, sizeof(*counts) * (program->definitions_len + 1));
+    for (int64_t s = 0; s < workflow->scopes_len; ++s)
+    {
+        instances[s] = counts[workflow->scope_definitions[s]]++;
+    }
+    program_free(program, counts);
+    return instances;
+}
+
+
+static int64_t scope_definition(struct workflow *workflow, int64_t scope)
+{
+    return scope >= 0 && scope < workflow->scopes_len ? workflow->scope_definitions[scope] : -1;
+}
+
+
+static int64_t scope_instance(struct workflow *workflow, int64_t *instances, int64_t scope)
+{
+    return scope >= 0 && scope < workflow->scopes_len ? instances[scope] : 0;
+}
+
+
+/* one line per worker and pipe, keyed by definition, its instance and
+   code position, so the next compile of the same source finds them again */
+void program_profile_write(FILE *stream, struct program *program)
+{
+    struct workflow *workflow = &program->workflow;
+    int64_t *instances = scope_instances(program);
+    if (instances == NULL)
+    {
+        return;
+    }
+
+    fprintf(stream, "profile %d %" PRId64 " %llu\n", PROFILE_VERSION, program->source_code_len, (unsigned long long)source_hash(program));
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        struct worker_stats *stats = &workflow->worker_stats[i];
+        int64_t scope = workflow->worker_scopes[i];
+        fprintf(stream, "worker %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                scope_definition(workflow, scope), scope_instance(workflow, instances, scope),
+                workflow->worker_code_positions[i].begin, workflow->worker_code_positions[i].end,
+                atomic_load(&stats->items_in), atomic_load(&stats->items_out), atomic_load(&stats->busy_ns),
+                atomic_load(&stats->blocked_input_ns), atomic_load(&stats->blocked_output_ns),
+                atomic_load(&stats->branch_true), atomic_load(&stats->branch_false));
+    }
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        struct pipe_stats *stats = &workflow->pipe_stats[i];
+        int64_t scope = workflow->pipe_scopes[i];
+        fprintf(stream, "pipe %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                scope_definition(workflow, scope), scope_instance(workflow, instances, scope),
+                workflow->pipe_code_positions[i].begin, workflow->pipe_code_positions[i].end,
+                atomic_load(&stats->enqueued), atomic_load(&stats->dequeued), atomic_load(&stats->max_depth));
+    }
+    program_free(program, instances);
+}
+
+
+/* key is definition, instance of it and code span */
+static int64_t find_record(struct workflow *workflow, int64_t *instances, int64_t len, int64_t *scopes, struct code_span *positions, long long *key)
+{
+    for (int64_t i = 0; i < len; ++i)
+    {
+        if (scope_definition(workflow, scopes[i]) == key[0] && scope_instance(workflow, instances, scopes[i]) == key[1] &&
+            positions[i].begin == key[2] && positions[i].end == key[3])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* returns 0 if profile doesn't belong to this source */
+static int64_t load_stats(struct program *program, const char *profile, int64_t profile_len)
+{
+    struct workflow *workflow = &program->workflow;
+    char line[512];
+    int64_t matched = 0;
+    int64_t *instances = scope_instances(program);
+    if (instances == NULL)
+    {
+        return 0;
+    }
+
+    for (int64_t begin = 0, number = 0; begin < profile_len; ++number)
+    {
+        int64_t end = begin;
+        while (end < profile_len && profile[end] != '\n')
+        {
+            end++;
+        }
+        int64_t len = end - begin < (int64_t)sizeof(line) - 1 ? end - begin : (int64_t)sizeof(line) - 1;
+        memcpy(line, profile + begin, len);
+        line[len] = '\0';
+        begin = end + 1;
+
+        long long key[4], a, c, d, e, f, g, h, k;
+        unsigned long long hash;
+        int version;
+        if (number == 0)
+        {
+            if (sscanf(line, "profile %d %lld %llu", &version, &a, &hash) != 3 ||
+                version != PROFILE_VERSION || a != program->source_code_len || hash != source_hash(program))
+            {
+                program_free(program, instances);
+                return 0;
+            }
+        }
+        else if (sscanf(line, "worker %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+                        &key[0], &key[1], &key[2], &key[3], &c, &d, &e, &f, &g, &h, &k) == 11)
+        {
+            int64_t worker = find_record(workflow, instances, workflow->workers_len, workflow->worker_scopes, workflow->worker_code_positions, key);
+            if (worker != -1)
+            {
+                struct worker_stats *stats = &workflow->worker_stats[worker];
+                atomic_store(&stats->items_in, c);
+                atomic_store(&stats->items_out, d);
+                atomic_store(&stats->busy_ns, e);
+                atomic_store(&stats->blocked_input_ns, f);
+                atomic_store(&stats->blocked_output_ns, g);
+                atomic_store(&stats->branch_true, h);
+                atomic_store(&stats->branch_false, k);
+                matched++;
+            }
+        }
+        else if (sscanf(line, "pipe %lld %lld %lld %lld %lld %lld %lld", &key[0], &key[1], &key[2], &key[3], &c, &d, &e) == 7)
+        {
+            int64_t pipe = find_record(workflow, instances, workflow->pipes_len, workflow->pipe_scopes, workflow->pipe_code_positions, key);
+            if (pipe != -1)
+            {
+                struct pipe_stats *stats = &workflow->pipe_stats[pipe];
+                atomic_store(&stats->enqueued, c);
+                atomic_store(&stats->dequeued, d);
+                atomic_store(&stats->max_depth, e);
+                matched++;
+            }
+        }
+    }
+    program_free(program, instances);
+    return matched != 0;
+}
+
+
+static int64_t batch_size(struct workflow *workflow, int64_t pipe)
+{
+    /* pipe that never carried anything keeps runtime default */
+    if (atomic_load(&workflow->pipe_stats[pipe].enqueued) == 0)
+    {
+        return 0;
+    }
+
+    /* starved consumers want items as soon as they are there */
+    int64_t wait = 0, busy = 0;
+    for (int64_t i = workflow->pipe_consumers_offsets[pipe]; i < workflow->pipe_consumers_offsets[pipe + 1]; ++i)
+    {
+        int64_t consumer = workflow->pipe_consumers[i];
+        wait += atomic_load(&workflow->worker_stats[consumer].blocked_input_ns);
+        busy += atomic_load(&workflow->worker_stats[consumer].busy_ns);
+    }
+    if (wait > busy)
+    {
+        return 1;
+    }
+
+    /* backlog that piled up can go in batches of half of it */
+    int64_t depth = atomic_load(&workflow->pipe_stats[pipe].max_depth) / 2;
+    int64_t batch = 1;
+    while (batch * 2 <= depth && batch * 2 <= MAX_PROFILE_BATCH)
+    {
+        batch *= 2;
+    }
+    return batch;
+}
+
+
+/* pipe between one producer and one cheap consumer is a call, not a queue */
+static int64_t fusable(struct workflow *workflow, int64_t pipe)
+{
+    if (workflow->pipe_producers_offsets[pipe + 1] - workflow->pipe_producers_offsets[pipe] != 1 ||
+        workflow->pipe_consumers_offsets[pipe + 1] - workflow->pipe_consumers_offsets[pipe] != 1)
+    {
+        return 0;
+    }
+    int64_t consumer = workflow->pipe_consumers[workflow->pipe_consumers_offsets[pipe]];
+    int64_t items = atomic_load(&workflow->worker_stats[consumer].items_in);
+    return items != 0 && atomic_load(&workflow->worker_stats[consumer].busy_ns) / items < FUSE_ITEM_NS;
+}
+
+
+/* recorded stats of previous run go back into workflow and decide
+   batches and fusion host runs pipes with, replica shares, and build
+   ahead the !if branch that was taken more often */
+void program_apply_profile(struct program *program, const char *profile, int64_t profile_len)
+{
+    program_pass_begin(program, PASS_PROFILE);
+
+    struct workflow *workflow = &program->workflow;
+    if (!load_stats(program, profile, profile_len))
+    {
+        program_log(program, LOG_WORKFLOW, LOG_WARNING, "Profile was recorded for different source, it is ignored", SPAN(0, 0), NULL);
+        program_pass_end(program, PASS_PROFILE);
+        return;
+    }
+
+    int64_t total_busy = 0;
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        total_busy += atomic_load(&workflow->worker_stats[i].busy_ns);
+    }
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        int64_t busy = atomic_load(&workflow->worker_stats[i].busy_ns);
+        workflow->worker_weights[i] = total_busy != 0 ? busy * 1000 / total_busy : 0;
+    }
+
+    /* branches only append workers, the ones seen here keep their ids */
+    int64_t workers_len = workflow->workers_len;
+    for (int64_t i = 0; i < workers_len; ++i)
+    {
+        int64_t taken_true = atomic_load(&workflow->worker_stats[i].branch_true);
+        int64_t taken_false = atomic_load(&workflow->worker_stats[i].branch_false);
+        if (workflow->worker_definitions[i]->lazy_branches != 0 && taken_true + taken_false != 0)
+        {
+            program_instantiate_branch(program, i, taken_true >= taken_false);
+        }
+    }
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        workflow->pipe_batches[p] = batch_size(workflow, p);
+        if (fusable(workflow, p))
+        {
+            workflow->pipe_flags[p] |= PIPE_FUSED;
+        }
+    }
+
+    program_pass_end(program, PASS_PROFILE);
+}
@@ -10,14 +10,12 @@ static int64_t iskey(int chr);
 static int64_t skip_spaces(struct program *program, int64_t position);
 static int64_t skip_until(struct program *program, int64_t position, int symbol);
 static char *str_from_code(struct program *program, int64_t begin, int64_t end);
-static struct log_item *program_log(struct program *program, enum log_source_type source, enum log_level level, char *message, struct code_span code_span, struct log_item *associated_item);
 static int64_t parse_pipeline_argument(struct program *program, int64_t position, struct definition *definition, struct pipeline_definition *pipeline, struct pipeline_argument_definition *arg);
 static int64_t parse_pipeline_worker(struct program *program, int64_t position, struct definition *definition, struct pipeline_definition *pipeline, struct pipeline_worker_definition *worker);
 static int64_t parse_pipeline_output(struct program *program, int64_t position, struct definition *definition, struct pipeline_definition *pipeline, struct pipeline_output_definition *output);
 static int64_t parse_pipeline(struct program *program, int64_t position, struct definition *definition, struct pipeline_definition *pipeline);
 static int64_t parse_pipeline_many(struct program *program, int64_t position, struct definition *definition);
 static int64_t parse_definition(struct program *program, int64_t position);
-static void program_parse(struct program *program);
 
 static int64_t iskey(int chr)
 {
@@ -39,22 +37,23 @@ static int64_t skip_until(struct program *program, int64_t position, int symbol)
 }
 
 
-static void register_definition(struct program *program, struct definition *definition)
+static int64_t register_definition(struct program *program, struct definition *definition)
 {
     if (program->definitions_len >= program->definitions_alloc)
     {
-        program->definitions_alloc = 2 * program->definitions_alloc + !program->definitions_alloc;
-        void *new_ptr = realloc(program->definitions, sizeof(*program->definitions) * program->definitions_alloc);
+        int64_t new_alloc = 2 * program->definitions_alloc + !program->definitions_alloc;
+        void *new_ptr = program_realloc(program, program->definitions, sizeof(*program->definitions) * new_alloc);
         if (new_ptr == NULL)
         {
-            fprintf(stderr, "Error: No memory for PARSING.\n");
-            exit(1);
+            return 0;
         }
 
         program->definitions = new_ptr;
+        program->definitions_alloc = new_alloc;
     }
 
     program->definitions[program->definitions_len++] = definition;
+    return 1;
 }
 
 
@@ -64,16 +63,9 @@ static char *str_from_code(struct program *program, int64_t begin, int64_t end)
     {
         end = program->source_code_len;
     }
-    if (begin >= end)
-    {
-        char *empty = malloc(1);
-        empty[0] = '\0';
-        return empty;
-    }
-    char *res = malloc(end - begin + 1);
-    memcpy(res, program->source_code + begin, end - begin);
-    res[end - begin] = 0;
-    return res;
+    char *name = program_intern(program, program->source_code + begin, begin < end ? end - begin : 0);
+    /* out of memory is already recorded, later stages will not run */
+    return name != NULL ? name : "";
 }
 
 
@@ -126,7 +118,11 @@ static int64_t parse_pipeline_argument(struct program *program, int64_t position
     if (program->source_code[arg_begin] == '(' && program->source_code[arg_end - 1] == ')')
     {
         arg->type = ARGUMENT_PIPELINE;
-        arg->pipeline = malloc(sizeof(*arg->pipeline));
+        arg->pipeline = program_alloc(program, sizeof(*arg->pipeline));
+        if (arg->pipeline == NULL)
+        {
+            return program->source_code_len;
+        }
         parse_pipeline(program, arg_begin + 1, NULL, arg->pipeline);
     }
     else
@@ -212,6 +208,8 @@ static int64_t parse_pipeline_worker(struct program *program, int64_t position,
     /* 2. parse replacement table */
     {
         worker->subs_len = 0;
+        worker->lazy_branches = 0;
+        worker->memoize = 0;
         
         int64_t i = name_end + 1;
         while (1)
@@ -245,12 +243,22 @@ static int64_t parse_pipeline_worker(struct program *program, int64_t position,
                 }
             }
 
+            if (worker->subs_len >= MAX_PIPELINE_WORKER_SUBS)
+            {
+                program_log(program, LOG_PARSER, LOG_ERROR, "Too many substitutions in pipeline worker", SPAN(begin, end), NULL);
+                return position;
+            }
+
             if (program->source_code[delim + 1] == '(' && program->source_code[end - 1] == ')')
             {
                 worker->subs[worker->subs_len].code_position = SPAN(begin, end);
                 worker->subs[worker->subs_len].type = SUBSTITUTION_PIPELINE;
                 worker->subs[worker->subs_len].name = str_from_code(program, begin, delim);
-                worker->subs[worker->subs_len].pipeline = malloc(sizeof(*worker->subs[worker->subs_len].pipeline));
+                worker->subs[worker->subs_len].pipeline = program_alloc(program, sizeof(*worker->subs[worker->subs_len].pipeline));
+                if (worker->subs[worker->subs_len].pipeline == NULL)
+                {
+                    return program->source_code_len;
+                }
                 parse_pipeline(program, delim + 2, NULL, worker->subs[worker->subs_len].pipeline);
                 worker->subs_len++;
             }
@@ -365,6 +373,12 @@ static int64_t parse_pipeline(struct program *program, int64_t position, struct
             break;
         }
 
+        if (pipeline->args_len >= MAX_PIPELINE_ARGUMENTS)
+        {
+            program_log(program, LOG_PARSER, LOG_ERROR, "Too many pipeline arguments", SPAN(position, position + 1), NULL);
+            return position;
+        }
+
         position = parse_pipeline_argument(program, position, definition, pipeline, &pipeline->args[pipeline->args_len++]);
 
         position = skip_spaces(program, position);
@@ -427,6 +441,12 @@ static int64_t parse_pipeline(struct program *program, int64_t position, struct
             return position;
         }
 
+        if (pipeline->workers_len >= MAX_PIPELINE_WORKERS)
+        {
+            program_log(program, LOG_PARSER, LOG_ERROR, "Too many workers in pipeline", SPAN(position, position + 1), NULL);
+            return position;
+        }
+
         position = parse_pipeline_worker(program, position, definition, pipeline, &pipeline->workers[pipeline->workers_len++]);
     }
 
@@ -453,6 +473,12 @@ static int64_t parse_pipeline(struct program *program, int64_t position, struct
                 break;
             }
 
+            if (pipeline->outputs_len >= MAX_PIPELINE_OUTPUTS)
+            {
+                program_log(program, LOG_PARSER, LOG_ERROR, "Too many pipeline outputs", SPAN(position, position + 1), NULL);
+                return position;
+            }
+
             position = parse_pipeline_output(program, position, definition, pipeline, &pipeline->outputs[pipeline->outputs_len++]);
 
             position = skip_spaces(program, position);
@@ -507,6 +533,12 @@ static int64_t parse_pipeline_many(struct program *program, int64_t position, st
         /* this is pipelines gathering */
         while (1)
         {
+            if (definition->pipelines_len >= MAX_PIPELINES)
+            {
+                program_log(program, LOG_PARSER, LOG_ERROR, "Too many pipelines in pipeline group", SPAN(position, position + 1), NULL);
+                return position;
+            }
+
             position = parse_pipeline(program, position, definition, &definition->pipelines[definition->pipelines_len++]);
 
             position = skip_spaces(program, position);
@@ -559,7 +591,11 @@ static int64_t parse_definition(struct program *program, int64_t position)
     }
 
 
-    struct definition *definition = malloc(sizeof(*definition));
+    struct definition *definition = program_alloc(program, sizeof(*definition));
+    if (definition == NULL)
+    {
+        return program->source_code_len;
+    }
     definition->name = NULL;
     definition->free_vars_len = 0;
     definition->pipeline_vars_len = 0;
@@ -627,6 +663,11 @@ static int64_t parse_definition(struct program *program, int64_t position)
                 while (iskey(program->source_code[i])) { i++; }
                 int64_t name_end = i;
 
+                if (name_start != name_end && definition->pipeline_vars_len >= MAX_PIPELINE_VARS)
+                {
+                    program_log(program, LOG_PARSER, LOG_ERROR, "Too many definition pipeline variables", SPAN(name_start, name_end), NULL);
+                    break;
+                }
                 if (name_start != name_end)
                 {
                     definition->pipeline_vars[definition->pipeline_vars_len++] = str_from_code(program, name_start, name_end);
@@ -683,6 +724,11 @@ static int64_t parse_definition(struct program *program, int64_t position)
                 while (iskey(program->source_code[i])) { i++; }
                 int64_t name_end = i;
 
+                if (name_start != name_end && definition->free_vars_len >= MAX_FREE_VARS)
+                {
+                    program_log(program, LOG_PARSER, LOG_ERROR, "Too many definition free variables", SPAN(name_start, name_end), NULL);
+                    break;
+                }
                 if (name_start != name_end)
                 {
                     definition->free_vars[definition->free_vars_len++] = str_from_code(program, name_start, name_end);
@@ -719,64 +765,87 @@ static int64_t parse_definition(struct program *program, int64_t position)
 
     definition->code_position.end = position;
     
-    register_definition(program, definition);
+    if (!register_definition(program, definition))
+    {
+        return program->source_code_len;
+    }
 
     return position;
 }
 
 
-static void program_parse(struct program *program)
+void program_parse(struct program *program)
 {
+    program_pass_begin(program, PASS_PARSE);
+
     /* parse all top-level definitions */
     int64_t position = 0;
-    while (position < program->source_code_len)
+    while (position < program->source_code_len && !program->memory.failed)
     {
         /* parse definition */
         position = parse_definition(program, position);
     }
+
+    program_pass_end(program, PASS_PARSE);
 }
 
 
-struct program *program_create_from_code(char *filename, char *code)
+/* program owns copies of filename and code */
+struct program *program_create(const char *filename, const char *code, int64_t code_len, int64_t memory_limit)
 {
     struct program *program = malloc(sizeof(*program));
+    if (program == NULL)
+    {
+        return NULL;
+    }
+    memset(program, 0, sizeof(*program));
+    program->memory.limit = memory_limit;
 
-    program->log.items = NULL;
-    program->log.items_len = 0;
-    program->log.items_alloc = 0;
-
-    program->definitions = NULL;
-    program->definitions_len = 0;
-    program->definitions_alloc = 0;
+    program_pass_begin(program, PASS_LINE_INDEX);
 
-    program->filename = filename;
-    program->source_code_len = strlen(code);
-    program->source_code = code;
+    program->filename = program_intern(program, filename, strlen(filename));
+    /* parser looks one character ahead, so keep terminating zero */
+    program->source_code = program_alloc(program, code_len + 1);
 
     int64_t code_lines_alloc = 1;
-    for (int64_t i = 0; i < program->source_code_len; ++i)
+    for (int64_t i = 0; i < code_len; ++i)
     {
         code_lines_alloc += (code[i] == '\n');
     }
-    program->line_to_position = malloc(sizeof(*program->line_to_position) * code_lines_alloc);
+    program->line_to_position = program_alloc(program, sizeof(*program->line_to_position) * code_lines_alloc);
+
+    if (program->filename == NULL || program->source_code == NULL || program->line_to_position == NULL)
+    {
+        program_destroy(program);
+        return NULL;
+    }
+
+    memcpy(program->source_code, code, code_len);
+    program->source_code[code_len] = '\0';
+    program->source_code_len = code_len;
+
     program->code_lines = 1;
     program->line_to_position[0] = 0;
-    for (int64_t i = 0; i < program->source_code_len; ++i)
+    for (int64_t i = 0; i < code_len; ++i)
     {
         if (code[i] == '\n')
         {
-            program->line_to_position[program->code_lines++] = i;
+            program->line_to_position[program->code_lines++] = i + 1;
         }
     }
 
-    /* parse file content */
-    program_parse(program);
+    program_pass_end(program, PASS_LINE_INDEX);
 
-    /* print program */
-    program_ast_dump(stdout, program);
+    return program;
+}
 
-    /* get full workflow */
-    program_get_workflow(program);
 
-    return program;
+void program_destroy(struct program *program)
+{
+    if (program == NULL)
+    {
+        return;
+    }
+    program_free_all(program);
+    free(program);
 }
@@ -0,0 +1,340 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+#define PURITY_ALL (PURITY_PURE | PURITY_STATELESS)
+
+
+static int64_t is_free_var(struct definition *scope, const char *name)
+{
+    for (int64_t i = 0; scope != NULL && i < scope->free_vars_len; ++i)
+    {
+        if (scope->free_vars[i] == name)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* returns -1 if name is not callable at all, like a[0] or x */
+static int64_t callable_purity(struct program *program, struct definition *scope, const char *name)
+{
+    const struct builtin *builtin = builtin_find(name);
+    if (builtin != NULL)
+    {
+        if (builtin->flags & BUILTIN_EFFECTFUL)
+        {
+            return 0;
+        }
+        return (builtin->flags & BUILTIN_STATEFUL) ? PURITY_PURE : PURITY_ALL;
+    }
+
+    int64_t index = program_find_definition(program, name);
+    struct definition *definition = index != -1 ? program->definitions[index] : NULL;
+    if (definition != NULL)
+    {
+        return definition->flags;
+    }
+
+    /* function parameter, whoever passes it is checked at call site */
+    if (is_free_var(scope, name))
+    {
+        return PURITY_ALL;
+    }
+
+    return -1;
+}
+
+
+static int64_t pipeline_purity(struct program *program, struct definition *scope, struct pipeline_definition *pipeline);
+
+
+static int64_t worker_purity(struct program *program, struct definition *scope, struct pipeline_worker_definition *worker)
+{
+    int64_t flags = callable_purity(program, scope, worker->name);
+    if (flags == -1)
+    {
+        /* calls something unknown */
+        return 0;
+    }
+
+    for (int64_t i = 0; i < worker->subs_len && flags != 0; ++i)
+    {
+        struct pipeline_worker_substitution *sub = &worker->subs[i];
+        if (sub->type == SUBSTITUTION_PIPELINE)
+        {
+            flags &= pipeline_purity(program, scope, sub->pipeline);
+        }
+        else
+        {
+            /* function argument like !foreach f=to_int_one is called
+               anew for every item, state it keeps lasts one call */
+            int64_t sub_flags = callable_purity(program, scope, sub->symbol);
+            if (sub_flags != -1)
+            {
+                flags &= (sub_flags & PURITY_PURE) ? sub_flags | PURITY_STATELESS : 0;
+            }
+        }
+    }
+    return flags;
+}
+
+
+static int64_t pipeline_purity(struct program *program, struct definition *scope, struct pipeline_definition *pipeline)
+{
+    int64_t flags = PURITY_ALL;
+    for (int64_t i = 0; i < pipeline->args_len && flags != 0; ++i)
+    {
+        if (pipeline->args[i].type == ARGUMENT_PIPELINE)
+        {
+            flags &= pipeline_purity(program, scope, pipeline->args[i].pipeline);
+        }
+    }
+    for (int64_t i = 0; i < pipeline->workers_len && flags != 0; ++i)
+    {
+        flags &= worker_purity(program, scope, &pipeline->workers[i]);
+    }
+    return flags;
+}
+
+
+/* like x[0] or x[1..] */
+static int64_t is_indexed(struct definition *definition, const char *name)
+{
+    for (int64_t i = 0; i < definition->pipeline_vars_len; ++i)
+    {
+        int64_t len = strlen(definition->pipeline_vars[i]);
+        if (strncmp(name, definition->pipeline_vars[i], len) == 0 && name[len] == '[')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* definition that indexes or slices its piped var looks at the stream
+   as a whole, like reduce does, not at one item at a time */
+static int64_t aggregates(struct definition *definition, struct pipeline_definition *pipeline)
+{
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
+    {
+        if (pipeline->args[i].type == ARGUMENT_PIPELINE ? aggregates(definition, pipeline->args[i].pipeline) : is_indexed(definition, pipeline->args[i].name))
+        {
+            return 1;
+        }
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        for (int64_t j = 0; j < pipeline->workers[i].subs_len; ++j)
+        {
+            struct pipeline_worker_substitution *sub = &pipeline->workers[i].subs[j];
+            if (sub->type == SUBSTITUTION_PIPELINE ? aggregates(definition, sub->pipeline) : is_indexed(definition, sub->symbol))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* worker calling name emits one value for its whole stream, like
+   reduce does, instead of one per item */
+int64_t program_worker_aggregates(struct program *program, const char *name)
+{
+    int64_t index = program_find_definition(program, name);
+    struct definition *definition = index != -1 ? program->definitions[index] : NULL;
+    for (int64_t i = 0; definition != NULL && i < definition->pipelines_len; ++i)
+    {
+        if (aggregates(definition, &definition->pipelines[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* greatest fixpoint: every definition starts pure and loses flags
+   until nothing changes, so recursion like reduce stays pure.
+   definitions aggregating their stream are never stateless */
+void program_infer_purity(struct program *program)
+{
+    program_pass_begin(program, PASS_PURITY);
+
+    /* stateless is taken away for good before fixpoint starts */
+    int64_t *limits = program_alloc(program, sizeof(*limits) * (program->definitions_len + 1));
+    if (limits == NULL)
+    {
+        program_pass_end(program, PASS_PURITY);
+        return;
+    }
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        struct definition *definition = program->definitions[i];
+        limits[i] = PURITY_ALL;
+        for (int64_t j = 0; j < definition->pipelines_len; ++j)
+        {
+            limits[i] &= aggregates(definition, &definition->pipelines[j]) ? PURITY_PURE : PURITY_ALL;
+        }
+        definition->flags = limits[i];
+    }
+
+    int64_t changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (int64_t i = 0; i < program->definitions_len; ++i)
+        {
+            struct definition *definition = program->definitions[i];
+            int64_t flags = limits[i];
+            for (int64_t j = 0; j < definition->pipelines_len && flags != 0; ++j)
+            {
+                flags &= pipeline_purity(program, definition, &definition->pipelines[j]);
+            }
+            if (flags != definition->flags)
+            {
+                definition->flags = flags;
+                changed = 1;
+            }
+        }
+    }
+
+    program_free(program, limits);
+    program_pass_end(program, PASS_PURITY);
+}
+
+
+/* scope is definition worker is written in, NULL if unknown. a free
+   var of scope counts as pure, its call sites are checked instead */
+int64_t program_worker_purity(struct program *program, struct definition *scope, struct pipeline_worker_definition *worker)
+{
+    return worker_purity(program, scope, worker);
+}
+
+
+void program_classify_workers(struct program *program)
+{
+    struct workflow *workflow = &program->workflow;
+    /* worker named by free var calls what its instance binds it to,
+       like f=!sum, so that counts too. unbound ones are pure as far as
+       this instance knows */
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        int64_t scope = workflow->worker_scopes[i];
+        struct definition *definition = scope < workflow->scopes_len ? program->definitions[workflow->scope_definitions[scope]] : NULL;
+        int64_t flags = program_worker_purity(program, definition, workflow->worker_definitions[i]);
+        if (workflow->worker_names[i] != workflow->worker_definitions[i]->name)
+        {
+            int64_t bound = callable_purity(program, definition, workflow->worker_names[i]);
+            flags &= bound != -1 ? bound : 0;
+        }
+        workflow->worker_flags[i] = flags;
+    }
+}
+
+
+/* free var of callee is safe to memoize over if call site binds it to
+   something pure. names nobody binds here, like free vars of caller,
+   are unknown until run time, so such calls aren't memoized */
+static int64_t binding_pure(struct program *program, struct definition *scope, struct pipeline_worker_substitution *sub)
+{
+    if (sub == NULL)
+    {
+        return 0;
+    }
+    if (sub->type == SUBSTITUTION_PIPELINE)
+    {
+        return (pipeline_purity(program, NULL, sub->pipeline) & PURITY_PURE) != 0;
+    }
+    if (is_free_var(scope, sub->symbol))
+    {
+        return 0;
+    }
+    /* data like a[0] is part of arguments, not of function */
+    int64_t flags = callable_purity(program, NULL, sub->symbol);
+    return flags == -1 || (flags & PURITY_PURE);
+}
+
+
+static int64_t call_memoizable(struct program *program, struct definition *scope, struct pipeline_worker_definition *worker)
+{
+    int64_t index = program_find_definition(program, worker->name);
+    struct definition *callee = index != -1 ? program->definitions[index] : NULL;
+    if (callee == NULL || !callee->memoize)
+    {
+        return 0;
+    }
+    for (int64_t i = 0; i < callee->free_vars_len; ++i)
+    {
+        struct pipeline_worker_substitution *bound = NULL;
+        for (int64_t k = 0; k < worker->subs_len; ++k)
+        {
+            bound = worker->subs[k].name == callee->free_vars[i] ? &worker->subs[k] : bound;
+        }
+        if (!binding_pure(program, scope, bound))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static void plan_calls(struct program *program, struct definition *scope, struct pipeline_definition *pipeline)
+{
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
+    {
+        if (pipeline->args[i].type == ARGUMENT_PIPELINE)
+        {
+            plan_calls(program, scope, pipeline->args[i].pipeline);
+        }
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        struct pipeline_worker_definition *worker = &pipeline->workers[i];
+        worker->memoize = call_memoizable(program, scope, worker);
+        if (worker->memoize)
+        {
+            program_log(program, LOG_WORKFLOW, LOG_NOTE, "Call is pure with its bindings, it can be memoized", worker->code_position, NULL);
+        }
+        for (int64_t k = 0; k < worker->subs_len; ++k)
+        {
+            if (worker->subs[k].type == SUBSTITUTION_PIPELINE)
+            {
+                plan_calls(program, scope, worker->subs[k].pipeline);
+            }
+        }
+    }
+}
+
+
+/* only definitions with parameters can be called with different
+   arguments, pure ones always give the same result for the same ones.
+   free vars make that depend on call site, reduce f=!sum may be
+   memoized while reduce f=!print may not, so each call is decided by
+   what it binds */
+void program_plan_memoization(struct program *program)
+{
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        struct definition *definition = program->definitions[i];
+        definition->memoize = (definition->flags & PURITY_PURE) &&
+                              (definition->free_vars_len != 0 || definition->pipeline_vars_len != 0);
+    }
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        struct definition *definition = program->definitions[i];
+        for (int64_t j = 0; j < definition->pipelines_len; ++j)
+        {
+            plan_calls(program, definition, &definition->pipelines[j]);
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include "unistd.h"
+#endif
+
+
+int64_t runtime_cores(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+#endif
+}
+
+
+/* cores == 0 means all cores of this machine */
+struct replica_plan *replica_plan_create(struct workflow *workflow, int64_t cores)
+{
+    struct replica_plan *plan = malloc(sizeof(*plan));
+    if (plan == NULL)
+    {
+        return NULL;
+    }
+    plan->replicas = malloc(sizeof(*plan->replicas) * (workflow->workers_len + 1));
+    if (plan->replicas == NULL)
+    {
+        free(plan);
+        return NULL;
+    }
+
+    if (cores <= 0)
+    {
+        cores = runtime_cores();
+    }
+
+    plan->workers_len = workflow->workers_len;
+    plan->replicated_workers = 0;
+    plan->threads = 0;
+    int64_t profiled = 0;
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        profiled |= workflow->worker_weights[i] != 0;
+    }
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        /* sources and workers reading only literals have one item at most */
+        int64_t streamed = 0;
+        for (int64_t j = workflow->worker_inputs_offsets[i]; j < workflow->worker_inputs_offsets[i + 1]; ++j)
+        {
+            int64_t pipe = workflow->worker_inputs[j];
+            streamed |= workflow->pipe_producers_offsets[pipe] != workflow->pipe_producers_offsets[pipe + 1];
+        }
+        plan->replicas[i] = 1;
+        if ((workflow->worker_flags[i] & PURITY_STATELESS) && streamed && cores > 1)
+        {
+            /* profiled workers get cores by their share of busy time */
+            plan->replicas[i] = profiled ? (cores * workflow->worker_weights[i] + 500) / 1000 : cores;
+            plan->replicas[i] = plan->replicas[i] > 1 ? plan->replicas[i] : 1;
+            plan->replicated_workers += plan->replicas[i] > 1;
+        }
+        plan->threads += plan->replicas[i];
+    }
+
+    return plan;
+}
+
+
+void replica_plan_destroy(struct replica_plan *plan)
+{
+    free(plan->replicas);
+    free(plan);
+}
+
+
+/* item with sequence number seq is handled by this replica */
+int64_t replica_of_item(struct replica_plan *plan, int64_t worker, int64_t seq)
+{
+    return seq % plan->replicas[worker];
+}
+
+
+void replica_plan_dump(FILE *stream, struct program *program, struct replica_plan *plan)
+{
+    struct workflow *workflow = &program->workflow;
+
+    fprintf(stream, "Replication of %" PRId64 " workers in %" PRId64 " threads\n", plan->replicated_workers, plan->threads);
+    for (int64_t i = 0; i < plan->workers_len; ++i)
+    {
+        if (plan->replicas[i] > 1)
+        {
+            int64_t line, col;
+            program_position_to_line_col(program, workflow->worker_code_positions[i].begin, &line, &col);
+            fprintf(stream, "worker %" PRId64 ": %s x%" PRId64 " at %s:%" PRId64 ":%" PRId64 "\n", i, workflow->worker_names[i], plan->replicas[i], program->filename, line, col);
+        }
+    }
+}
@@ -0,0 +1,660 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+
+#include "lang.h"
+
+#include "inttypes.h"
+#include "stdio.h"
+#include "threads.h"
+
+
+enum trace_event_type
+{
+    TRACE_WORKER_BUSY,
+    TRACE_WORKER_BLOCKED_INPUT,
+    TRACE_WORKER_BLOCKED_OUTPUT,
+    TRACE_PIPE_DEPTH,
+};
+
+/* for TRACE_PIPE_DEPTH end_ns holds queue depth at begin_ns */
+struct trace_event
+{
+    enum trace_event_type type;
+    int64_t id;
+    int64_t begin_ns;
+    int64_t end_ns;
+};
+
+/* owned by exactly one thread, so recording doesn't need any locks */
+struct trace_buffer
+{
+    int64_t thread_id;
+
+    struct trace_event *events;
+    int64_t events_len;
+    int64_t events_alloc;
+    int64_t events_dropped;
+    int64_t max_events;
+
+    struct trace_buffer *next;
+};
+
+struct trace
+{
+    mtx_t lock;
+    struct trace_buffer *buffers;
+    int64_t buffers_len;
+
+    int64_t start_ns;
+    int64_t max_events_per_thread;
+    /* header and flushed events are out, see trace_flush_chrome */
+    int64_t written;
+};
+
+/* how many copies of each worker executor starts. replicated worker
+   gets item seq on replica seq % replicas, outputs are merged back
+   in seq order, so consumers see the same order as without replicas */
+struct replica_plan
+{
+    int64_t *replicas;
+    int64_t workers_len;
+    int64_t replicated_workers;
+    int64_t threads;
+};
+
+
+#define MAX_MAP_BATCH 64
+
+/* f(context, input, output), called from any thread of the map */
+typedef void (*map_function)(void *context, const void *input, void *output);
+
+struct parallel_map_options
+{
+    /* 0 means all cores */
+    int64_t threads;
+    /* items one thread takes at once, up to MAX_MAP_BATCH */
+    int64_t batch;
+    /* items pushed but not popped yet, bounds memory of reorder buffer */
+    int64_t window;
+    /* 0 pops results as soon as they are ready */
+    int64_t ordered;
+
+    /* optional, busy time and items go to stats of this worker */
+    struct trace *trace;
+    struct workflow *workflow;
+    int64_t worker;
+};
+
+/* parallel map of !foreach and replicated workers. items are tagged
+   with sequence numbers and stored in window slots, which double as
+   reorder buffer. push blocks while window is full */
+struct parallel_map
+{
+    struct parallel_map_options options;
+    map_function function;
+    void *context;
+    int64_t input_size;
+    int64_t output_size;
+
+    mtx_t lock;
+    cnd_t work_available;
+    cnd_t result_ready;
+    cnd_t not_full;
+    int64_t sync_initialized;
+
+    char *inputs;
+    char *outputs;
+    /* enum slot_state of every slot */
+    int64_t *states;
+
+    /* rings of slot indices, capacity is window */
+    int64_t *pending;
+    int64_t pending_head;
+    int64_t pending_len;
+    int64_t *done;
+    int64_t done_head;
+    int64_t done_len;
+    /* unordered mode only, ordered one uses slot seq % window */
+    int64_t *free_slots;
+    int64_t free_slots_len;
+
+    int64_t pushed;
+    int64_t popped;
+    int64_t closed;
+    int64_t shutdown;
+
+    struct map_thread *threads;
+    int64_t threads_started;
+};
+
+
+struct memo_stats
+{
+    _Atomic int64_t hits;
+    _Atomic int64_t misses;
+    _Atomic int64_t insertions;
+    _Atomic int64_t evictions;
+};
+
+/* entries double as clock ring, buckets chain them by hash */
+struct memo_shard
+{
+    mtx_t lock;
+    struct memo_entry *entries;
+    int64_t entries_len;
+    int64_t capacity;
+    int64_t hand;
+    int64_t *buckets;
+    int64_t buckets_len;
+};
+
+/* results of memoized calls keyed by definition index and bytes of
+   arguments, shards keep threads of one pipeline off each other.
+   calls binding free vars differently must put bindings in key too */
+struct memo_cache
+{
+    struct memo_shard *shards;
+    int64_t shards_len;
+
+    /* indexed by definition */
+    struct memo_stats *stats;
+    int64_t definitions_len;
+};
+
+
+/* ring of unboxed items of one pipe, capacity is power of two */
+struct typed_buffer
+{
+    int64_t type;
+    int64_t element_size;
+    char *data;
+    int64_t head;
+    int64_t len;
+    int64_t capacity;
+};
+
+
+/* compiler daemon, keeps compiled files resident between requests */
+struct compile_server
+{
+    struct compiler *compiler;
+    struct log_render_options log_options;
+
+    struct server_entry *entries;
+    int64_t entries_len;
+
+    int listen_fd;
+    char socket_path[108];
+
+    int64_t requests;
+    int64_t hits;
+    int64_t compiles;
+};
+
+
+/* pipe cut by partitioning, items go from process to process */
+struct partition_channel
+{
+    int64_t pipe;
+    int64_t from;
+    int64_t to;
+    int64_t element_size;
+};
+
+/* which local process runs each worker */
+struct partition_plan
+{
+    int64_t partitions;
+    int64_t *worker_partitions;
+    int64_t workers_len;
+    /* -1 for pipes crossing partitions */
+    int64_t *pipe_partitions;
+    int64_t pipes_len;
+
+    struct partition_channel *channels;
+    int64_t channels_len;
+    int64_t channels_alloc;
+};
+
+/* ring of one channel in POSIX shared memory */
+struct shm_ring
+{
+    struct shm_ring_header *header;
+    char *data;
+    int64_t mapped_bytes;
+    /* creator unlinks it */
+    int64_t owner;
+    char name[64];
+};
+
+/* body of one process, rings are indexed like plan->channels.
+   nonzero result fails the whole launch */
+typedef int (*partition_function)(void *context, struct partition_plan *plan, int64_t partition, struct shm_ring *rings);
+
+
+/* bytes held by pipes and workers of whole process, checked against
+   limit before anything is taken, so the sum never goes over it */
+struct memory_budget
+{
+    /* 0 means no limit */
+    int64_t limit;
+    _Atomic int64_t bytes;
+    _Atomic int64_t peak_bytes;
+
+    int64_t pipes_len;
+    _Atomic int64_t *pipe_bytes;
+    _Atomic int64_t *pipe_peak_bytes;
+    int64_t workers_len;
+    _Atomic int64_t *worker_bytes;
+    _Atomic int64_t *worker_peak_bytes;
+};
+
+union window_number
+{
+    int64_t integer;
+    double real;
+};
+
+/* aggregate of !window over last items of endless stream, O(1)
+   amortized per item. invertible operator keeps running total and
+   subtracts evicted items, others use two stacks: oldest items carry
+   aggregates of themselves and everything after them up to back part,
+   which has one running aggregate. empty front is rebuilt from back */
+struct window
+{
+    struct window_options options;
+    /* TYPE_INT or TYPE_DOUBLE */
+    int64_t type;
+    int64_t invertible;
+
+    /* rings in arrival order, oldest item at head */
+    union window_number *items;
+    union window_number *front;
+    int64_t *sizes;
+    int64_t head;
+    int64_t len;
+    int64_t alloc;
+
+    /* first front_len items of ring are front stack */
+    int64_t front_len;
+    union window_number back;
+    union window_number total;
+    int64_t bytes;
+
+    /* items pushed since last result */
+    int64_t pending;
+    int64_t results;
+};
+
+
+/* pipe of fixed capacity between threads, full one either suspends
+   producer or spills items to temporary file, in order */
+struct bounded_pipe
+{
+    struct memory_budget *budget;
+    int64_t id;
+    int64_t charged;
+
+    mtx_t lock;
+    cnd_t not_full;
+    cnd_t not_empty;
+    int64_t sync_initialized;
+
+    struct typed_buffer buffer;
+    int64_t closed;
+
+    int64_t spill_allowed;
+    FILE *spill_file;
+    /* in items, from start of file */
+    int64_t spill_read;
+    int64_t spill_write;
+
+    int64_t spilled_total;
+    int64_t producer_waits;
+};
+
+
+typedef void (*fiber_function)(void *arg);
+
+/* runs workers as fibers on one thread, blocking pipe operations park
+   fiber and switch in user space instead of blocking thread */
+struct fiber_scheduler
+{
+    struct fiber **fibers;
+    int64_t fibers_len;
+    int64_t fibers_alloc;
+    int64_t stack_size;
+
+    /* saved stack pointer, ucontext_t or fiber handle of thread
+       running scheduler */
+    void *main_context;
+    int64_t current;
+    int64_t ready_head;
+    int64_t ready_tail;
+    int64_t free_head;
+
+    int64_t alive;
+    int64_t switches;
+};
+
+/* pipe between fibers of one scheduler, wait lists are fiber ids */
+struct fiber_pipe
+{
+    struct typed_buffer buffer;
+    int64_t readers_head;
+    int64_t readers_tail;
+    int64_t writers_head;
+    int64_t writers_tail;
+    int64_t closed;
+};
+
+
+/* items lent by host, read in place */
+struct host_batch
+{
+    const void *data;
+    int64_t len;
+    int64_t read;
+};
+
+struct host_kernel
+{
+    map_function function;
+    void *context;
+    /* NULL when kernel runs on calling thread */
+    struct parallel_map *map;
+};
+
+/* block of file in flight, at most one request per block */
+struct file_block
+{
+    char *data;
+    int64_t offset;
+    /* bytes wanted and bytes done so far, short transfers are resumed */
+    int64_t want;
+    int64_t done;
+    int64_t in_flight;
+    /* source only, bytes already pushed into pipe */
+    int64_t delivered;
+};
+
+/* io_uring submission and completion rings, see files.c */
+struct file_ring;
+
+/* file read ahead in fixed blocks, up to depth of them in flight.
+   blocks complete in any order but go into pipe in file order */
+struct file_source
+{
+    int fd;
+    int64_t size;
+    int64_t block_size;
+    int64_t depth;
+
+    char *memory;
+    struct file_block *blocks;
+    /* oldest block, others follow it in ring */
+    int64_t head;
+    int64_t submitted;
+    int64_t next_offset;
+    int64_t delivered;
+    int64_t failed;
+
+    /* NULL when io_uring isn't there, then blocks are read by pread */
+    struct file_ring *ring;
+};
+
+/* file written from pipe in fixed blocks, full ones go out while
+   next is filled */
+struct file_sink
+{
+    int fd;
+    int64_t block_size;
+    int64_t depth;
+
+    char *memory;
+    struct file_block *blocks;
+    /* block being filled, others are in flight or free */
+    int64_t fill;
+    int64_t in_flight;
+    int64_t next_offset;
+    int64_t failed;
+
+    struct file_ring *ring;
+};
+
+
+/* workflow embedded in host application, pipes are fed from and
+   drained into caller memory instead of !read and !print. kernels
+   count into stats of workflow, program_profile_write saves them */
+struct host_session
+{
+    struct program *program;
+    struct workflow *workflow;
+    int64_t threads;
+    int64_t capacity;
+
+    /* indexed by pipe */
+    struct typed_buffer *buffers;
+    struct host_batch *batches;
+    /* indexed by worker */
+    struct host_kernel *kernels;
+
+    /* set by host_session_trace, written out by host_session_destroy */
+    struct trace *trace;
+    struct trace_buffer *trace_buffer;
+    FILE *trace_stream;
+    FILE *summary_stream;
+};
+
+
+/* what host_swap changed */
+struct swap_report
+{
+    /* scopes of definitions whose text differs */
+    int64_t swapped_scopes;
+    /* pipes that kept their buffer, and items that were in them */
+    int64_t rebound_pipes;
+    int64_t moved_items;
+    int64_t rebound_kernels;
+    int64_t dropped_kernels;
+    /* pipe that blocked swap, -1 if none */
+    int64_t blocking_pipe;
+};
+
+
+/* NaN-boxed: doubles as they are, ints up to 48 bits, strings up to
+   5 bytes and pointers to struct object hide in payload of quiet NaN */
+struct value
+{
+    uint64_t bits;
+};
+
+enum value_tag
+{
+    VALUE_TAG_DOUBLE,
+    VALUE_TAG_NIL,
+    VALUE_TAG_INT,
+    VALUE_TAG_SMALL_STRING,
+    VALUE_TAG_OBJECT,
+};
+
+enum object_kind
+{
+    OBJECT_INT,
+    OBJECT_STRING,
+    OBJECT_SEQUENCE,
+    OBJECT_SLICE,
+};
+
+/* immutable once shared, freed with last reference. fan-out to many
+   consumers only retains it, builtins that change sequence copy it
+   first unless they hold the only reference */
+struct object
+{
+    _Atomic int64_t refcount;
+    enum object_kind kind;
+    int64_t len;
+    union
+    {
+        int64_t integer;
+        char *bytes;
+        struct
+        {
+            struct value *items;
+            int64_t capacity;
+        };
+        struct
+        {
+            struct value slice_parent;
+            int64_t slice_begin;
+        };
+    };
+};
+
+
+struct trace *trace_create(int64_t max_events_per_thread);
+void trace_destroy(struct trace *trace);
+struct trace_buffer *trace_thread_attach(struct trace *trace);
+void trace_record(struct trace_buffer *buffer, enum trace_event_type type, int64_t id, int64_t begin_ns, int64_t end_ns);
+
+void worker_stats_items(struct workflow *workflow, int64_t worker, int64_t items_in, int64_t items_out);
+void worker_stats_branch(struct workflow *workflow, int64_t worker, int64_t cond);
+void worker_stats_busy(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns);
+void worker_stats_blocked_input(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns);
+void worker_stats_blocked_output(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns);
+void pipe_stats_enqueue(struct trace_buffer *buffer, struct workflow *workflow, int64_t pipe, int64_t count);
+void pipe_stats_dequeue(struct workflow *workflow, int64_t pipe, int64_t count);
+
+void trace_flush_chrome(FILE *stream, struct program *program, struct trace *trace);
+void trace_export_chrome(FILE *stream, struct program *program, struct trace *trace);
+void trace_export_summary(FILE *stream, struct program *program);
+
+int64_t runtime_cores(void);
+struct replica_plan *replica_plan_create(struct workflow *workflow, int64_t cores);
+void replica_plan_destroy(struct replica_plan *plan);
+int64_t replica_of_item(struct replica_plan *plan, int64_t worker, int64_t seq);
+void replica_plan_dump(FILE *stream, struct program *program, struct replica_plan *plan);
+
+struct parallel_map *parallel_map_create(struct parallel_map_options *options, map_function function, void *context, int64_t input_size, int64_t output_size);
+int64_t parallel_map_push(struct parallel_map *map, const void *input);
+void parallel_map_close(struct parallel_map *map);
+int64_t parallel_map_pop(struct parallel_map *map, void *output);
+void parallel_map_destroy(struct parallel_map *map);
+int64_t parallel_map_run(struct parallel_map_options *options, map_function function, void *context,
+                         const void *inputs, int64_t input_size, int64_t len, void *outputs, int64_t output_size);
+
+struct memo_cache *memo_cache_create(int64_t definitions_len, int64_t capacity, int64_t shards_len);
+void memo_cache_destroy(struct memo_cache *cache);
+int64_t memo_lookup(struct memo_cache *cache, int64_t definition, const void *key, int64_t key_len, void *value, int64_t value_alloc);
+void memo_insert(struct memo_cache *cache, int64_t definition, const void *key, int64_t key_len, const void *value, int64_t value_len);
+void memo_stats_dump(FILE *stream, struct program *program, struct memo_cache *cache);
+
+int64_t type_element_size(int64_t type);
+int64_t typed_buffer_init(struct typed_buffer *buffer, int64_t type, int64_t capacity);
+void typed_buffer_free(struct typed_buffer *buffer);
+int64_t typed_buffer_push(struct typed_buffer *buffer, const void *elements, int64_t count);
+int64_t typed_buffer_pop(struct typed_buffer *buffer, void *elements, int64_t count);
+int64_t typed_buffer_peek(struct typed_buffer *buffer, void **elements);
+void typed_buffer_skip(struct typed_buffer *buffer, int64_t count);
+struct typed_buffer *workflow_buffers_create(struct workflow *workflow, int64_t capacity);
+void workflow_buffers_destroy(struct workflow *workflow, struct typed_buffer *buffers);
+int64_t workflow_buffers_bytes(struct workflow *workflow, int64_t capacity);
+
+struct host_session *host_session_create(struct program *program, int64_t capacity, int64_t threads);
+void host_session_destroy(struct host_session *host);
+int64_t host_session_trace(struct host_session *host, FILE *trace, FILE *summary, int64_t max_events);
+int64_t host_find_pipe(struct host_session *host, const char *key, int64_t nth);
+int64_t host_find_worker(struct host_session *host, const char *key, int64_t nth);
+int64_t host_bind_kernel(struct host_session *host, int64_t worker, map_function function, void *context);
+int64_t host_feed(struct host_session *host, int64_t pipe, const void *elements, int64_t count);
+int64_t host_pending(struct host_session *host, int64_t pipe);
+int64_t host_drain(struct host_session *host, int64_t pipe, void *elements, int64_t count);
+int64_t host_run(struct host_session *host);
+int64_t host_swap(struct host_session *host, struct program *program, struct swap_report *report);
+
+struct compile_server *compile_server_create(struct compiler_options *options, struct log_render_options *log_options);
+void compile_server_destroy(struct compile_server *server);
+int64_t compile_server_handle(struct compile_server *server, const char *request, FILE *response);
+int64_t compile_server_listen(struct compile_server *server, const char *socket_path);
+void compile_server_serve(struct compile_server *server);
+int64_t compile_client_request(const char *socket_path, const char *request, FILE *out);
+
+struct partition_plan *partition_plan_create(struct workflow *workflow, int64_t partitions);
+void partition_plan_destroy(struct partition_plan *plan);
+void partition_plan_dump(FILE *stream, struct program *program, struct partition_plan *plan);
+int64_t partition_launch(struct partition_plan *plan, int64_t capacity, partition_function function, void *context);
+int64_t shm_ring_create(struct shm_ring *ring, const char *name, int64_t element_size, int64_t capacity);
+int64_t shm_ring_open(struct shm_ring *ring, const char *name);
+void shm_ring_destroy(struct shm_ring *ring);
+int64_t shm_ring_push(struct shm_ring *ring, const void *element);
+int64_t shm_ring_pop(struct shm_ring *ring, void *element);
+void shm_ring_close(struct shm_ring *ring);
+int64_t shm_ring_finished(struct shm_ring *ring);
+
+int64_t file_source_open(struct file_source *source, const char *path, int64_t block_size, int64_t depth);
+int64_t file_source_next(struct file_source *source, struct typed_buffer *buffer);
+int64_t file_source_finished(struct file_source *source);
+void file_source_close(struct file_source *source);
+int64_t file_sink_open(struct file_sink *sink, const char *path, int64_t block_size, int64_t depth);
+int64_t file_sink_write(struct file_sink *sink, const void *data, int64_t len);
+int64_t file_sink_drain(struct file_sink *sink, struct typed_buffer *buffer);
+int64_t file_sink_close(struct file_sink *sink);
+
+int64_t window_init(struct window *window, struct window_options *options, int64_t type);
+void window_free(struct window *window);
+int64_t window_push(struct window *window, const void *element, int64_t size, void *result);
+int64_t window_flush(struct window *window, void *result);
+
+struct memory_budget *memory_budget_create(int64_t limit, int64_t pipes_len, int64_t workers_len);
+void memory_budget_destroy(struct memory_budget *budget);
+int64_t memory_budget_charge_pipe(struct memory_budget *budget, int64_t pipe, int64_t bytes);
+void memory_budget_release_pipe(struct memory_budget *budget, int64_t pipe, int64_t bytes);
+int64_t memory_budget_charge_worker(struct memory_budget *budget, int64_t worker, int64_t bytes);
+void memory_budget_release_worker(struct memory_budget *budget, int64_t worker, int64_t bytes);
+void memory_budget_report(FILE *stream, struct workflow *workflow, struct memory_budget *budget);
+int64_t bounded_pipe_init(struct bounded_pipe *pipe, struct memory_budget *budget, int64_t id, int64_t type, int64_t capacity, int64_t spill);
+void bounded_pipe_free(struct bounded_pipe *pipe);
+int64_t bounded_pipe_push(struct bounded_pipe *pipe, const void *element);
+int64_t bounded_pipe_pop(struct bounded_pipe *pipe, void *element);
+void bounded_pipe_close(struct bounded_pipe *pipe);
+
+struct fiber_scheduler *fiber_scheduler_create(int64_t stack_size);
+void fiber_scheduler_destroy(struct fiber_scheduler *scheduler);
+int64_t fiber_spawn(struct fiber_scheduler *scheduler, fiber_function function, void *arg);
+void fiber_yield(struct fiber_scheduler *scheduler);
+void fiber_park(struct fiber_scheduler *scheduler);
+void fiber_wake(struct fiber_scheduler *scheduler, int64_t id);
+int64_t fiber_scheduler_run(struct fiber_scheduler *scheduler);
+int64_t fiber_pipe_init(struct fiber_pipe *pipe, int64_t type, int64_t capacity);
+void fiber_pipe_free(struct fiber_pipe *pipe);
+int64_t fiber_pipe_write(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe, const void *element);
+int64_t fiber_pipe_read(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe, void *element);
+void fiber_pipe_close(struct fiber_scheduler *scheduler, struct fiber_pipe *pipe);
+
+struct value value_nil(void);
+struct value value_from_int(int64_t x);
+struct value value_from_double(double x);
+struct value value_from_bytes(const char *data, int64_t len);
+struct value value_sequence_from(struct value *items, int64_t len);
+struct value value_slice(struct value value, int64_t begin, int64_t end);
+struct value value_index(struct value value, int64_t index);
+struct value value_sequence_append(struct value sequence, struct value item);
+struct value value_sequence_set(struct value sequence, int64_t index, struct value item);
+void value_retain(struct value value);
+void value_retain_n(struct value value, int64_t n);
+void value_release(struct value value);
+enum value_tag value_tag(struct value value);
+int64_t value_type(struct value value);
+int64_t value_is_int(struct value value);
+int64_t value_truthy(struct value value);
+int64_t value_as_int(struct value value);
+double value_as_double(struct value value);
+int64_t value_len(struct value value);
+const char *value_bytes(const struct value *value, int64_t *len);
+const struct value *value_items(struct value value, int64_t *len);
+int64_t value_equal(struct value a, struct value b);
+uint64_t value_hash(struct value value);
+
+
+#endif
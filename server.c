@@ -0,0 +1,443 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#ifndef _WIN32
+#include "unistd.h"
+#include "sys/stat.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#endif
+
+
+#define MAX_SERVER_FILES 256
+#define MAX_REQUEST_LINE 4096
+
+
+/* compiled file kept resident, diagnostics are rendered once */
+struct server_entry
+{
+    char *filename;
+    /* nanoseconds */
+    int64_t mtime;
+    int64_t size;
+    uint64_t hash;
+
+    struct program *program;
+    enum compile_status status;
+    char *diagnostics;
+    int64_t diagnostics_len;
+    char *dump;
+    int64_t dump_len;
+
+    int64_t last_used;
+};
+
+
+static uint64_t code_hash(const char *code, int64_t len)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int64_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char)code[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+
+static void entry_release(struct server_entry *entry)
+{
+    if (entry->program != NULL)
+    {
+        program_destroy(entry->program);
+    }
+    free(entry->filename);
+    free(entry->diagnostics);
+    free(entry->dump);
+    memset(entry, 0, sizeof(*entry));
+}
+
+
+struct compile_server *compile_server_create(struct compiler_options *options, struct log_render_options *log_options)
+{
+    struct compile_server *server = calloc(1, sizeof(*server));
+    if (server == NULL)
+    {
+        return NULL;
+    }
+    server->entries = calloc(MAX_SERVER_FILES, sizeof(*server->entries));
+    server->compiler = compiler_create(options);
+    if (server->entries == NULL || server->compiler == NULL)
+    {
+        compile_server_destroy(server);
+        return NULL;
+    }
+    server->log_options = *log_options;
+    server->listen_fd = -1;
+    return server;
+}
+
+
+void compile_server_destroy(struct compile_server *server)
+{
+    for (int64_t i = 0; server->entries != NULL && i < server->entries_len; ++i)
+    {
+        entry_release(&server->entries[i]);
+    }
+    free(server->entries);
+    if (server->compiler != NULL)
+    {
+        compiler_destroy(server->compiler);
+    }
+#ifndef _WIN32
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+        unlink(server->socket_path);
+    }
+#endif
+    free(server);
+}
+
+
+/* renders into memory through temporary file, works everywhere */
+static char *render(struct program *program, struct log_render_options *log_options, int64_t dump, int64_t *len)
+{
+    FILE *stream = tmpfile();
+    if (stream == NULL)
+    {
+        *len = 0;
+        return NULL;
+    }
+    if (dump)
+    {
+        program_workflow_dump(stream, program);
+    }
+    else
+    {
+        program_log_render(stream, program, log_options);
+    }
+    *len = ftell(stream);
+    rewind(stream);
+    char *text = malloc(*len + 1);
+    if (text != NULL)
+    {
+        *len = fread(text, 1, *len, stream);
+        text[*len] = '\0';
+    }
+    fclose(stream);
+    return text;
+}
+
+
+static struct server_entry *find_entry(struct compile_server *server, const char *filename)
+{
+    for (int64_t i = 0; i < server->entries_len; ++i)
+    {
+        if (strcmp(server->entries[i].filename, filename) == 0)
+        {
+            return &server->entries[i];
+        }
+    }
+
+    char *copy = malloc(strlen(filename) + 1);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    strcpy(copy, filename);
+
+    /* least recently used file goes when cache is full */
+    struct server_entry *entry = &server->entries[server->entries_len];
+    if (server->entries_len == MAX_SERVER_FILES)
+    {
+        entry = &server->entries[0];
+        for (int64_t i = 1; i < server->entries_len; ++i)
+        {
+            entry = server->entries[i].last_used < entry->last_used ? &server->entries[i] : entry;
+        }
+        entry_release(entry);
+    }
+    else
+    {
+        server->entries_len++;
+    }
+    entry->filename = copy;
+    entry->size = -1;
+    return entry;
+}
+
+
+static char *read_file(const char *filename, int64_t *len)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    int64_t size = ftell(f);
+    rewind(f);
+    char *code = malloc(size + 1);
+    if (code != NULL)
+    {
+        *len = fread(code, 1, size, f);
+        code[*len] = '\0';
+    }
+    fclose(f);
+    return code;
+}
+
+
+/* file unchanged since last request is served from memory, changed
+   one is read and compiled again only if its content differs. file
+   systems with coarse timestamps keep mtime for edits in the same tick,
+   so file modified within the last second is always hashed */
+static struct server_entry *compile_file(struct compile_server *server, const char *filename)
+{
+    struct server_entry *entry = find_entry(server, filename);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    entry->last_used = ++server->requests;
+
+    int64_t mtime = 0, size = -1, settled = 0;
+#ifndef _WIN32
+    struct stat info;
+    struct timespec now;
+    if (stat(filename, &info) == 0 && clock_gettime(CLOCK_REALTIME, &now) == 0)
+    {
+        mtime = info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
+        size = info.st_size;
+        settled = now.tv_sec * 1000000000ll + now.tv_nsec - mtime >= 1000000000ll;
+    }
+#endif
+    if (entry->program != NULL && settled && mtime == entry->mtime && size == entry->size)
+    {
+        server->hits++;
+        return entry;
+    }
+
+    int64_t len = 0;
+    char *code = read_file(filename, &len);
+    if (code == NULL)
+    {
+        return NULL;
+    }
+    uint64_t hash = code_hash(code, len);
+    entry->mtime = mtime;
+    entry->size = size;
+    if (entry->program != NULL && hash == entry->hash)
+    {
+        free(code);
+        server->hits++;
+        return entry;
+    }
+
+    if (entry->program != NULL)
+    {
+        program_destroy(entry->program);
+    }
+    free(entry->diagnostics);
+    free(entry->dump);
+    entry->hash = hash;
+    entry->status = compiler_compile(server->compiler, entry->filename, code, len, 0, &entry->program);
+    free(code);
+    entry->diagnostics = NULL;
+    entry->dump = NULL;
+    if (entry->program != NULL)
+    {
+        entry->diagnostics = render(entry->program, &server->log_options, 0, &entry->diagnostics_len);
+        entry->dump = render(entry->program, &server->log_options, 1, &entry->dump_len);
+    }
+    server->compiles++;
+    return entry;
+}
+
+
+/* request is "compile <file>" or "check <file>", response is status
+   line "<status> <bytes>" followed by that many bytes of text: workflow
+   dump and diagnostics for compile, only diagnostics for check */
+int64_t compile_server_handle(struct compile_server *server, const char *request, FILE *response)
+{
+    char command[16];
+    char filename[MAX_REQUEST_LINE];
+    if (sscanf(request, "%15s %4095[^\n]", command, filename) != 2 ||
+        (strcmp(command, "compile") != 0 && strcmp(command, "check") != 0))
+    {
+        fprintf(response, "%s 0\n", compile_status_name(COMPILE_INVALID_ARGUMENT));
+        return 0;
+    }
+
+    struct server_entry *entry = compile_file(server, filename);
+    if (entry == NULL || entry->program == NULL)
+    {
+        const char *status = compile_status_name(entry == NULL ? COMPILE_INVALID_ARGUMENT : entry->status);
+        fprintf(response, "%s 0\n", status);
+        return 0;
+    }
+
+    int64_t dump = strcmp(command, "compile") == 0 && entry->dump != NULL;
+    int64_t dump_len = dump ? entry->dump_len : 0;
+    int64_t diagnostics_len = entry->diagnostics != NULL ? entry->diagnostics_len : 0;
+    fprintf(response, "%s %" PRId64 "\n", compile_status_name(entry->status), dump_len + diagnostics_len);
+    fwrite(entry->dump, 1, dump_len, response);
+    fwrite(entry->diagnostics, 1, diagnostics_len, response);
+    return 1;
+}
+
+
+#ifndef _WIN32
+
+int64_t compile_server_listen(struct compile_server *server, const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path) || strlen(socket_path) >= sizeof(server->socket_path))
+    {
+        return 0;
+    }
+    strcpy(address.sun_path, socket_path);
+    strcpy(server->socket_path, socket_path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd < 0)
+    {
+        return 0;
+    }
+    unlink(socket_path);
+    if (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server->listen_fd, 64) != 0)
+    {
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+
+/* one request per connection, until "shutdown" request comes */
+void compile_server_serve(struct compile_server *server)
+{
+    for (;;)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        FILE *stream = fdopen(fd, "r+");
+        if (stream == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        char request[MAX_REQUEST_LINE];
+        int64_t shutdown = 0;
+        if (fgets(request, sizeof(request), stream) != NULL)
+        {
+            shutdown = strncmp(request, "shutdown", 8) == 0;
+            if (shutdown)
+            {
+                fprintf(stream, "%s 0\n", compile_status_name(COMPILE_OK));
+            }
+            else
+            {
+                fseek(stream, 0, SEEK_CUR);
+                compile_server_handle(server, request, stream);
+            }
+        }
+        fclose(stream);
+        if (shutdown)
+        {
+            return;
+        }
+    }
+}
+
+
+/* sends request and copies response text to out, returns 0 if server
+   could not be reached and 1 if it answered with status ok */
+int64_t compile_client_request(const char *socket_path, const char *request, FILE *out)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        return 0;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    FILE *stream = fdopen(fd, "r+");
+    if (stream == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    fprintf(stream, "%s\n", request);
+    fflush(stream);
+    fseek(stream, 0, SEEK_CUR);
+
+    char status[32];
+    long long len = 0;
+    int64_t ok = 0;
+    if (fscanf(stream, "%31s %lld", status, &len) == 2)
+    {
+        ok = strcmp(status, compile_status_name(COMPILE_OK)) == 0;
+        fgetc(stream);
+        char chunk[4096];
+        while (len > 0)
+        {
+            size_t read = fread(chunk, 1, len < (long long)sizeof(chunk) ? len : (long long)sizeof(chunk), stream);
+            if (read == 0)
+            {
+                break;
+            }
+            fwrite(chunk, 1, read, out);
+            len -= read;
+        }
+    }
+    fclose(stream);
+    return ok;
+}
+
+#else
+
+/* unix sockets of Windows need winsock setup, server runs in process */
+int64_t compile_server_listen(struct compile_server *server, const char *socket_path)
+{
+    (void)server, (void)socket_path;
+    return 0;
+}
+
+
+void compile_server_serve(struct compile_server *server)
+{
+    (void)server;
+}
+
+
+int64_t compile_client_request(const char *socket_path, const char *request, FILE *out)
+{
+    (void)socket_path, (void)request, (void)out;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/* branches of !if are built only when asked for, once, in scope of the
+   !if, and recursion is reported only outside of them.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *code =
+    "(a, 10 > mul), b > add |: intsum{a, b}\n\n"
+    "> !if cond=x[1] true=(> f a=x[0] b=(x[1..] > reduce f=f)) false=x[0] |: reduce(x){f}\n\n"
+    "x > spin |: spin(x)\n\n"
+    "{\n"
+    "    > !read > reduce f=intsum > !print;\n"
+    "    > !read > spin > !print\n"
+    "} |: main\n";
+
+
+static int64_t count_workers(struct workflow *workflow, const char *name)
+{
+    int64_t count = 0;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        count += strcmp(workflow->worker_names[w], name) == 0;
+    }
+    return count;
+}
+
+
+/* warnings about recursion at definition called name */
+static int64_t recursion_warnings(struct program *program, const char *name)
+{
+    int64_t count = 0;
+    for (int64_t d = 0; d < program->definitions_len; ++d)
+    {
+        struct definition *definition = program->definitions[d];
+        for (int64_t i = 0; i < program->log.items_len && strcmp(definition->name, name) == 0; ++i)
+        {
+            struct log_item *item = &program->log.items[i];
+            count += item->level == LOG_WARNING && strstr(item->message, "Recursion") != NULL &&
+                     item->code_span.begin == definition->code_position.begin;
+        }
+    }
+    return count;
+}
+
+
+int main(void)
+{
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    struct program *program = NULL;
+    int failed = 1;
+    if (compiler == NULL || compiler_compile(compiler, "branches.test", code, strlen(code), 0, &program) != COMPILE_OK)
+    {
+        fprintf(stderr, "branches: program doesn't compile\n");
+        goto cleanup;
+    }
+
+    if (recursion_warnings(program, "spin") == 0 || recursion_warnings(program, "reduce") != 0)
+    {
+        fprintf(stderr, "branches: recursion is reported under !if branch or not reported outside of it\n");
+        goto cleanup;
+    }
+
+    struct workflow *workflow = &program->workflow;
+    int64_t branch = -1;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        branch = strcmp(workflow->worker_names[w], "!if") == 0 ? w : branch;
+    }
+    if (branch == -1 || count_workers(workflow, "intsum") != 0 || count_workers(workflow, "add") != 0)
+    {
+        fprintf(stderr, "branches: branch of !if was built before cond is known\n");
+        goto cleanup;
+    }
+
+    int64_t workers_len = workflow->workers_len;
+    int64_t scopes_len = workflow->scopes_len;
+    if (program_instantiate_branch(program, branch, 0) != -1 || workflow->workers_len != workers_len)
+    {
+        fprintf(stderr, "branches: false=x[0] built workers\n");
+        goto cleanup;
+    }
+
+    int64_t tail = program_instantiate_branch(program, branch, 1);
+    if (tail == -1 || strcmp(workflow->worker_names[tail], "intsum") != 0 || workflow->worker_scopes[tail] != workflow->worker_scopes[branch])
+    {
+        fprintf(stderr, "branches: true branch doesn't end in intsum in scope of !if\n");
+        goto cleanup;
+    }
+    /* reduce f=f calls instance it's in, only intsum is new */
+    if (workflow->scopes_len != scopes_len + 1 || count_workers(workflow, "add") != 1 || count_workers(workflow, "!if") != 1)
+    {
+        fprintf(stderr, "branches: %" PRId64 " scopes instead of %" PRId64 "\n", workflow->scopes_len, scopes_len + 1);
+        goto cleanup;
+    }
+
+    workers_len = workflow->workers_len;
+    if (program_instantiate_branch(program, branch, 1) != tail || workflow->workers_len != workers_len)
+    {
+        fprintf(stderr, "branches: branch was built twice\n");
+        goto cleanup;
+    }
+
+    printf("branches: ok\n");
+    failed = 0;
+
+cleanup:
+    program_destroy(program);
+    if (compiler != NULL)
+    {
+        compiler_destroy(compiler);
+    }
+    return failed;
+}
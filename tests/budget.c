@@ -0,0 +1,104 @@
+/* pipes shrink their ring to what is left of memory budget, spill what
+   doesn't fit to file and give every item back in push order, however
+   pushes and pops interleave with spilling and unspilling.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "inttypes.h"
+
+
+/* pushes in rounds of push_len and pops pop_len after each, then closes
+   and drains, every item must come out in the order it went in */
+static int check_order(const char *name, int64_t limit, int64_t items, int64_t push_len, int64_t pop_len)
+{
+    struct memory_budget *budget = memory_budget_create(limit, 1, 0);
+    struct bounded_pipe pipe;
+    if (budget == NULL || !bounded_pipe_init(&pipe, budget, 0, TYPE_INT, 1 << 20, 1))
+    {
+        fprintf(stderr, "budget: %s pipe can't be set up\n", name);
+        return 0;
+    }
+
+    int ok = 1;
+    int64_t pushed = 0, popped = 0, item;
+    while (ok && pushed < items)
+    {
+        for (int64_t i = 0; i < push_len && pushed < items; ++i, ++pushed)
+        {
+            ok = ok && bounded_pipe_push(&pipe, &pushed);
+        }
+        for (int64_t i = 0; ok && i < pop_len && popped < pushed; ++i, ++popped)
+        {
+            ok = bounded_pipe_pop(&pipe, &item) && item == popped;
+        }
+    }
+    bounded_pipe_close(&pipe);
+    while (ok && bounded_pipe_pop(&pipe, &item))
+    {
+        ok = item == popped++;
+    }
+    if (!ok || popped != items)
+    {
+        fprintf(stderr, "budget: %s gave item %" PRId64 " as %" PRId64 " of %" PRId64 "\n", name, item, popped - 1, items);
+        ok = 0;
+    }
+    if (ok && (pipe.spilled_total == 0 || pipe.producer_waits != 0 || pipe.spill_write != 0))
+    {
+        fprintf(stderr, "budget: %s spilled %" PRId64 " items, waited %" PRId64 " times, left %" PRId64 " in file\n",
+                name, pipe.spilled_total, pipe.producer_waits, pipe.spill_write);
+        ok = 0;
+    }
+
+    bounded_pipe_free(&pipe);
+    if (ok && atomic_load(&budget->bytes) != 0)
+    {
+        fprintf(stderr, "budget: %s left %" PRId64 " bytes charged\n", name, atomic_load(&budget->bytes));
+        ok = 0;
+    }
+    memory_budget_destroy(budget);
+    return ok;
+}
+
+
+int main(void)
+{
+    /* ring of 8 ints fits 64 bytes, rest of 1 << 20 asked for doesn't */
+    struct memory_budget *budget = memory_budget_create(64, 2, 0);
+    struct bounded_pipe ints, values;
+    if (budget == NULL || !bounded_pipe_init(&ints, budget, 0, TYPE_INT, 1 << 20, 1))
+    {
+        fprintf(stderr, "budget: pipe can't be set up\n");
+        return 1;
+    }
+    /* ring of one item goes over exhausted budget, boxed items never spill */
+    int64_t values_init = bounded_pipe_init(&values, budget, 1, TYPE_STRING, 16, 1);
+    int ok = values_init;
+    if (!ok || ints.buffer.capacity != 8 || values.buffer.capacity != 1 || values.spill_allowed ||
+        atomic_load(&budget->bytes) != 64 + (int64_t)sizeof(struct value))
+    {
+        fprintf(stderr, "budget: rings of %" PRId64 " and %" PRId64 " items take %" PRId64 " bytes\n",
+                ints.buffer.capacity, values.buffer.capacity, atomic_load(&budget->bytes));
+        ok = 0;
+    }
+    bounded_pipe_free(&ints);
+    if (values_init)
+    {
+        bounded_pipe_free(&values);
+    }
+    memory_budget_destroy(budget);
+
+    /* unspilled chunks are bounded by room in ring, then by 4 KiB */
+    ok = ok && check_order("all spilled, then drained", 64, 1000, 1000, 0) &&
+         check_order("pops between pushes", 64, 1000, 5, 3) &&
+         check_order("ring larger than chunk", 8 * 1024, 5000, 700, 300) &&
+         check_order("ring emptied each round", 64, 1000, 20, 20);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    printf("budget: ok\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* chain of 100k fibers hands 50 items down fiber pipes one by one,
+   every stage parks on its neighbours and all of them finish.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "inttypes.h"
+
+
+#define STAGES 100000
+#define ITEMS 50
+
+
+struct stage
+{
+    struct fiber_scheduler *scheduler;
+    struct fiber_pipe *input;
+    struct fiber_pipe *output;
+};
+
+struct sink
+{
+    struct fiber_scheduler *scheduler;
+    struct fiber_pipe *input;
+    int64_t count;
+    int64_t sum;
+};
+
+
+static struct fiber_scheduler *source_scheduler;
+
+
+static void source(void *arg)
+{
+    struct fiber_pipe *output = arg;
+    for (int64_t i = 0; i < ITEMS; ++i)
+    {
+        fiber_pipe_write(source_scheduler, output, &i);
+    }
+    fiber_pipe_close(source_scheduler, output);
+}
+
+
+static void pass(void *arg)
+{
+    struct stage *stage = arg;
+    int64_t item;
+    while (fiber_pipe_read(stage->scheduler, stage->input, &item))
+    {
+        fiber_pipe_write(stage->scheduler, stage->output, &item);
+    }
+    fiber_pipe_close(stage->scheduler, stage->output);
+}
+
+
+static void drain(void *arg)
+{
+    struct sink *sink = arg;
+    int64_t item;
+    while (fiber_pipe_read(sink->scheduler, sink->input, &item))
+    {
+        sink->count++;
+        sink->sum += item;
+    }
+}
+
+
+int main(void)
+{
+    int failed = 1;
+    int64_t pipes_len = 0;
+    struct fiber_scheduler *scheduler = fiber_scheduler_create(0);
+    struct fiber_pipe *pipes = calloc(STAGES + 1, sizeof(*pipes));
+    struct stage *stages = calloc(STAGES, sizeof(*stages));
+    struct sink sink = { scheduler, NULL, 0, 0 };
+    if (scheduler == NULL || pipes == NULL || stages == NULL)
+    {
+        fprintf(stderr, "fibers: out of memory\n");
+        goto cleanup;
+    }
+
+    /* capacity of one, each item parks every stage on its way */
+    for (; pipes_len <= STAGES; ++pipes_len)
+    {
+        if (!fiber_pipe_init(&pipes[pipes_len], TYPE_INT, 1))
+        {
+            fprintf(stderr, "fibers: out of memory\n");
+            goto cleanup;
+        }
+    }
+    source_scheduler = scheduler;
+    sink.input = &pipes[STAGES];
+    int64_t spawned = fiber_spawn(scheduler, source, &pipes[0]) != -1 && fiber_spawn(scheduler, drain, &sink) != -1;
+    for (int64_t i = 0; spawned && i < STAGES; ++i)
+    {
+        stages[i] = (struct stage){ scheduler, &pipes[i], &pipes[i + 1] };
+        spawned = fiber_spawn(scheduler, pass, &stages[i]) != -1;
+    }
+    if (!spawned)
+    {
+        fprintf(stderr, "fibers: can't spawn %d fibers\n", STAGES + 2);
+        goto cleanup;
+    }
+
+    int64_t parked = fiber_scheduler_run(scheduler);
+    if (parked != 0 || sink.count != ITEMS || sink.sum != ITEMS * (ITEMS - 1) / 2)
+    {
+        fprintf(stderr, "fibers: %" PRId64 " items summing to %" PRId64 " came out, %" PRId64 " fibers left parked\n",
+                sink.count, sink.sum, parked);
+        goto cleanup;
+    }
+
+    printf("fibers: ok\n");
+    failed = 0;
+
+cleanup:
+    for (int64_t i = 0; i < pipes_len; ++i)
+    {
+        fiber_pipe_free(&pipes[i]);
+    }
+    if (scheduler != NULL)
+    {
+        fiber_scheduler_destroy(scheduler);
+    }
+    free(pipes);
+    free(stages);
+    return failed;
+}
@@ -0,0 +1,190 @@
+/* files written through sink and read back through source keep every
+   byte in order, with io_uring and with pread and pwrite when kernel
+   refuses rings, whatever block size, depth and file size, and a file
+   shortened after it was opened ends where it ends now.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "errno.h"
+#include "unistd.h"
+#include "stddef.h"
+#include "sys/prctl.h"
+#include "sys/syscall.h"
+#include "linux/filter.h"
+#include "linux/seccomp.h"
+
+
+#define BLOCK 4096
+#define CHUNK 1000
+
+
+static char path[] = "/tmp/files_test_XXXXXX";
+
+
+static char byte_at(int64_t i)
+{
+    return (char)(i * 131 + i / 251);
+}
+
+
+/* writes len bytes in chunks that don't line up with blocks */
+static int write_file(const char *name, int64_t len, int64_t block_size, int64_t depth, int64_t ring)
+{
+    struct file_sink sink;
+    if (!file_sink_open(&sink, path, block_size, depth))
+    {
+        fprintf(stderr, "files: %s sink can't be opened\n", name);
+        return 0;
+    }
+    if ((sink.ring != NULL) != ring)
+    {
+        fprintf(stderr, "files: %s sink %s ring\n", name, ring ? "has no" : "has");
+        file_sink_close(&sink);
+        return 0;
+    }
+    char chunk[CHUNK];
+    int ok = 1;
+    for (int64_t offset = 0; ok && offset < len; offset += CHUNK)
+    {
+        int64_t count = len - offset < CHUNK ? len - offset : CHUNK;
+        for (int64_t i = 0; i < count; ++i)
+        {
+            chunk[i] = byte_at(offset + i);
+        }
+        ok = file_sink_write(&sink, chunk, count);
+    }
+    if (!file_sink_close(&sink) || !ok)
+    {
+        fprintf(stderr, "files: %s sink failed\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+
+/* reads through pipe smaller than a block, so blocks go out in parts */
+static int read_file(const char *name, int64_t len, int64_t shorten, int64_t block_size, int64_t depth, int64_t ring)
+{
+    struct file_source source;
+    struct typed_buffer buffer;
+    if (!typed_buffer_init(&buffer, TYPE_BYTE, CHUNK))
+    {
+        fprintf(stderr, "files: out of memory\n");
+        return 0;
+    }
+    if (!file_source_open(&source, path, block_size, depth))
+    {
+        fprintf(stderr, "files: %s source can't be opened\n", name);
+        typed_buffer_free(&buffer);
+        return 0;
+    }
+    int ok = (source.ring != NULL) == ring;
+    if (!ok)
+    {
+        fprintf(stderr, "files: %s source %s ring\n", name, ring ? "has no" : "has");
+    }
+    if (ok && shorten >= 0 && truncate(path, shorten) != 0)
+    {
+        fprintf(stderr, "files: %s can't be shortened\n", name);
+        ok = 0;
+    }
+    int64_t expected = shorten >= 0 ? shorten : len;
+    int64_t read = 0;
+    char chunk[CHUNK];
+    while (ok && !file_source_finished(&source))
+    {
+        if (file_source_next(&source, &buffer) < 0)
+        {
+            fprintf(stderr, "files: %s source failed at %" PRId64 "\n", name, read);
+            ok = 0;
+        }
+        int64_t count = typed_buffer_pop(&buffer, chunk, CHUNK);
+        for (int64_t i = 0; ok && i < count; ++i, ++read)
+        {
+            if (read >= expected || chunk[i] != byte_at(read))
+            {
+                fprintf(stderr, "files: %s has wrong byte at %" PRId64 "\n", name, read);
+                ok = 0;
+            }
+        }
+    }
+    if (ok && (read != expected || source.delivered != expected))
+    {
+        fprintf(stderr, "files: %s gave %" PRId64 " of %" PRId64 " bytes\n", name, read, expected);
+        ok = 0;
+    }
+    file_source_close(&source);
+    typed_buffer_free(&buffer);
+    return ok;
+}
+
+
+static int check_file(const char *name, int64_t len, int64_t shorten, int64_t block_size, int64_t depth, int64_t ring)
+{
+    return write_file(name, len, block_size, depth, ring) && read_file(name, len, shorten, block_size, depth, ring);
+}
+
+
+static int check_files(int64_t ring)
+{
+    return check_file("empty", 0, -1, BLOCK, 4, ring) &&
+           check_file("smaller than block", 100, -1, BLOCK, 4, ring) &&
+           check_file("whole blocks", 8 * BLOCK, -1, BLOCK, 4, ring) &&
+           check_file("block and a bit", 5 * BLOCK + 17, -1, BLOCK, 1, ring) &&
+           check_file("odd block size", 50000, -1, 777, 3, ring) &&
+           /* depth is clamped to 64 */
+           check_file("deeper than allowed", 100 * BLOCK + 1, -1, BLOCK, 100, ring) &&
+           /* first block is read at open, rest comes short or empty */
+           check_file("shortened", 3 * BLOCK, BLOCK + 100, BLOCK, 1, ring);
+}
+
+
+/* io_uring_setup fails from now on as on kernels without it */
+static int refuse_rings(void)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = { sizeof(filter) / sizeof(*filter), filter };
+    return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 && prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0;
+}
+
+
+int main(void)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "files: can't create %s\n", path);
+        return 1;
+    }
+    close(fd);
+
+    /* kernel may not have io_uring, then only pread path is there */
+    struct file_source probe;
+    int64_t ring = file_source_open(&probe, path, BLOCK, 1) && probe.ring != NULL;
+    file_source_close(&probe);
+    int ok = !ring || check_files(1);
+    if (ok && !refuse_rings())
+    {
+        fprintf(stderr, "files: io_uring can't be turned off\n");
+        ok = 0;
+    }
+    ok = ok && check_files(0);
+    unlink(path);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    printf("files: ok\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+/* memo cache answers what was inserted, keeps no more entries than its
+   capacity however it is sharded, and clock eviction spares entries
+   hit since the hand last passed them.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static int64_t insert(struct memo_cache *cache, int64_t definition, int64_t key, int64_t value)
+{
+    memo_insert(cache, definition, &key, sizeof(key), &value, sizeof(value));
+    return value;
+}
+
+
+/* value stored for key, -1 if cache doesn't have it */
+static int64_t lookup(struct memo_cache *cache, int64_t definition, int64_t key)
+{
+    int64_t value = -1;
+    if (memo_lookup(cache, definition, &key, sizeof(key), &value, sizeof(value)) != sizeof(value))
+    {
+        return -1;
+    }
+    return value;
+}
+
+
+int main(void)
+{
+    int failed = 1;
+
+    /* one shard, so keys meet on one clock */
+    struct memo_cache *cache = memo_cache_create(2, 2, 1);
+    struct memo_cache *tiny = memo_cache_create(1, 1, 16);
+    struct memo_cache *off = memo_cache_create(1, 0, 16);
+    if (cache == NULL || tiny == NULL || off == NULL)
+    {
+        fprintf(stderr, "memo: no memory for caches\n");
+        goto cleanup;
+    }
+
+    insert(cache, 0, 1, 10);
+    insert(cache, 1, 1, 11);
+    if (lookup(cache, 0, 1) != 10 || lookup(cache, 1, 1) != 11 || lookup(cache, 0, 2) != -1 || lookup(cache, 2, 1) != -1)
+    {
+        fprintf(stderr, "memo: lookup doesn't return what was inserted per definition\n");
+        goto cleanup;
+    }
+
+    /* hits above referenced both, so hand clears them and comes back
+       to evict 1, then 3 is hit again and 11 is evicted instead of it */
+    insert(cache, 0, 3, 30);
+    lookup(cache, 0, 3);
+    insert(cache, 0, 4, 40);
+    if (lookup(cache, 0, 1) != -1 || lookup(cache, 1, 1) != -1 || lookup(cache, 0, 3) != 30 || lookup(cache, 0, 4) != 40)
+    {
+        fprintf(stderr, "memo: clock evicted an entry hit since hand passed it\n");
+        goto cleanup;
+    }
+    if (atomic_load(&cache->stats[0].evictions) + atomic_load(&cache->stats[1].evictions) != 2)
+    {
+        fprintf(stderr, "memo: %" PRId64 " evictions instead of 2\n",
+                atomic_load(&cache->stats[0].evictions) + atomic_load(&cache->stats[1].evictions));
+        goto cleanup;
+    }
+
+    int64_t held = 0;
+    for (int64_t key = 0; key < 64; ++key)
+    {
+        insert(tiny, 0, key, key);
+        insert(off, 0, key, key);
+    }
+    for (int64_t key = 0; key < 64; ++key)
+    {
+        held += lookup(tiny, 0, key) == key;
+        if (lookup(off, 0, key) != -1)
+        {
+            fprintf(stderr, "memo: cache of capacity 0 kept an entry\n");
+            goto cleanup;
+        }
+    }
+    if (held != 1)
+    {
+        fprintf(stderr, "memo: cache of capacity 1 held %" PRId64 " entries\n", held);
+        goto cleanup;
+    }
+
+    printf("memo: ok\n");
+    failed = 0;
+
+cleanup:
+    if (cache != NULL)
+    {
+        memo_cache_destroy(cache);
+    }
+    if (tiny != NULL)
+    {
+        memo_cache_destroy(tiny);
+    }
+    if (off != NULL)
+    {
+        memo_cache_destroy(off);
+    }
+    return failed;
+}
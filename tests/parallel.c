@@ -0,0 +1,143 @@
+/* ordered parallel map gives results in push order even when later
+   items finish first and window is small, unordered one gives every
+   result exactly once, parallel_map_run keeps order of its array.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+#define ITEMS 1000
+
+
+/* every seventh item is slow, so items behind it finish first */
+static void square(void *context, const void *input, void *output)
+{
+    (void)context;
+    int64_t x;
+    memcpy(&x, input, sizeof(x));
+    if (x % 7 == 0)
+    {
+        thrd_sleep(&(struct timespec){ .tv_nsec = 100000 }, NULL);
+    }
+    int64_t y = x * x;
+    memcpy(output, &y, sizeof(y));
+}
+
+
+/* result popped as number popped, unordered ones may come in any order
+   but each only once */
+static int check_result(const char *name, int64_t ordered, int64_t result, int64_t popped, char *seen)
+{
+    int64_t root = 0;
+    while (root < ITEMS && root * root < result)
+    {
+        root++;
+    }
+    if (ordered && result != popped * popped)
+    {
+        fprintf(stderr, "parallel: %s popped %" PRId64 " as result %" PRId64 "\n", name, result, popped);
+        return 0;
+    }
+    if (root >= ITEMS || root * root != result || seen[root])
+    {
+        fprintf(stderr, "parallel: %s popped %" PRId64 " that wasn't pushed or twice\n", name, result);
+        return 0;
+    }
+    seen[root] = 1;
+    return 1;
+}
+
+
+/* pushes and pops interleaved like host does, checks what comes out */
+static int check_map(const char *name, int64_t ordered, int64_t threads, int64_t batch, int64_t window)
+{
+    struct parallel_map_options options = {
+        .threads = threads,
+        .batch = batch,
+        .window = window,
+        .ordered = ordered,
+    };
+    struct parallel_map *map = parallel_map_create(&options, square, NULL, sizeof(int64_t), sizeof(int64_t));
+    char *seen = calloc(ITEMS, 1);
+    int ok = map != NULL && seen != NULL;
+    int64_t popped = 0, result;
+    for (int64_t i = 0; ok && i < ITEMS; ++i)
+    {
+        while (ok && i - popped >= map->options.window)
+        {
+            ok = parallel_map_pop(map, &result) == 1 && check_result(name, ordered, result, popped, seen);
+            popped++;
+        }
+        if (ok && parallel_map_push(map, &i) != i)
+        {
+            fprintf(stderr, "parallel: %s numbered item %" PRId64 " out of order\n", name, i);
+            ok = 0;
+        }
+    }
+    if (ok)
+    {
+        parallel_map_close(map);
+    }
+    while (ok && parallel_map_pop(map, &result))
+    {
+        ok = check_result(name, ordered, result, popped, seen);
+        popped++;
+    }
+    if (ok && popped != ITEMS)
+    {
+        fprintf(stderr, "parallel: %s gave %" PRId64 " of %d results\n", name, popped, ITEMS);
+        ok = 0;
+    }
+    if (map != NULL)
+    {
+        parallel_map_destroy(map);
+    }
+    free(seen);
+    return ok;
+}
+
+
+int main(void)
+{
+    int ok = check_map("ordered", 1, 4, 1, 0) &&
+             check_map("ordered batched", 1, 4, 3, 0) &&
+             /* window smaller than threads times batch holds on slow item */
+             check_map("ordered small window", 1, 4, 4, 5) &&
+             check_map("unordered", 0, 4, 2, 16);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    int64_t *inputs = malloc(sizeof(*inputs) * ITEMS);
+    int64_t *outputs = malloc(sizeof(*outputs) * ITEMS);
+    struct parallel_map_options options = { .threads = 3, .batch = 5 };
+    for (int64_t i = 0; inputs != NULL && i < ITEMS; ++i)
+    {
+        inputs[i] = ITEMS - i;
+    }
+    ok = inputs != NULL && outputs != NULL &&
+         parallel_map_run(&options, square, NULL, inputs, sizeof(*inputs), ITEMS, outputs, sizeof(*outputs));
+    for (int64_t i = 0; ok && i < ITEMS; ++i)
+    {
+        if (outputs[i] != inputs[i] * inputs[i])
+        {
+            fprintf(stderr, "parallel: parallel_map_run wrote %" PRId64 " at %" PRId64 "\n", outputs[i], i);
+            ok = 0;
+        }
+    }
+    free(inputs);
+    free(outputs);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    printf("parallel: ok\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* plans of a.test for any number of processes give a channel to every
+   pipe read across processes, substitutions like a=a[0] included, and
+   keep check with to_int whose boxed results it reads that way.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static int64_t has_channel(struct partition_plan *plan, int64_t pipe, int64_t from, int64_t to)
+{
+    for (int64_t k = 0; k < plan->channels_len; ++k)
+    {
+        if (plan->channels[k].pipe == pipe && plan->channels[k].from == from && plan->channels[k].to == to)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* every reader of pipe, by input or by substitution, is in partition
+   of each producer or gets channel from it */
+static int64_t check_plan(struct workflow *workflow, struct partition_plan *plan)
+{
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        for (int64_t side = 0; side < 2; ++side)
+        {
+            int64_t *offsets = side ? workflow->worker_symbols_offsets : workflow->worker_inputs_offsets;
+            int64_t *pipes = side ? workflow->worker_symbols : workflow->worker_inputs;
+            for (int64_t i = offsets[w]; i < offsets[w + 1]; ++i)
+            {
+                int64_t pipe = pipes[i];
+                for (int64_t j = 0; pipe != -1 && j < workflow->pipe_producers_offsets[pipe + 1] - workflow->pipe_producers_offsets[pipe]; ++j)
+                {
+                    int64_t from = plan->worker_partitions[workflow->pipe_producers[workflow->pipe_producers_offsets[pipe] + j]];
+                    int64_t to = plan->worker_partitions[w];
+                    if (from != to && !has_channel(plan, pipe, from, to))
+                    {
+                        fprintf(stderr, "partition: %s reads pipe %" PRId64 ":%s of process %" PRId64 " from %" PRId64 " without channel\n",
+                                workflow->worker_names[w], pipe, workflow->pipe_names[pipe], from, to);
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+
+/* partition of every worker called name is the same, -1 if not */
+static int64_t partition_of(struct workflow *workflow, struct partition_plan *plan, const char *name)
+{
+    int64_t partition = -2;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (strcmp(workflow->worker_names[w], name) == 0)
+        {
+            partition = partition == -2 || partition == plan->worker_partitions[w] ? plan->worker_partitions[w] : -1;
+        }
+    }
+    return partition;
+}
+
+
+int main(void)
+{
+    int failed = 1;
+    char *code = NULL;
+    struct compiler *compiler = NULL;
+    struct program *program = NULL;
+
+    FILE *file = fopen("a.test", "rb");
+    int64_t code_len = 0;
+    if (file != NULL && fseek(file, 0, SEEK_END) == 0 && (code_len = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        code = malloc(code_len);
+        code_len = code != NULL ? (int64_t)fread(code, 1, code_len, file) : 0;
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    if (code == NULL || code_len == 0)
+    {
+        fprintf(stderr, "partition: can't read a.test\n");
+        goto cleanup;
+    }
+
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_OPTIMIZE | STAGE_TYPES,
+    };
+    compiler = compiler_create(&options);
+    if (compiler == NULL || compiler_compile(compiler, "a.test", code, code_len, 0, &program) != COMPILE_OK)
+    {
+        fprintf(stderr, "partition: a.test doesn't compile\n");
+        goto cleanup;
+    }
+
+    struct workflow *workflow = &program->workflow;
+    for (int64_t processes = 1; processes <= 4; ++processes)
+    {
+        struct partition_plan *plan = partition_plan_create(workflow, processes);
+        if (plan == NULL)
+        {
+            fprintf(stderr, "partition: no plan for %" PRId64 " processes\n", processes);
+            goto cleanup;
+        }
+        int64_t ok = check_plan(workflow, plan);
+        int64_t check = partition_of(workflow, plan, "check");
+        if (ok && (check < 0 || check != partition_of(workflow, plan, "to_int")))
+        {
+            fprintf(stderr, "partition: check is split from to_int it reads a and b of with %" PRId64 " processes\n", processes);
+            ok = 0;
+        }
+        partition_plan_destroy(plan);
+        if (!ok)
+        {
+            goto cleanup;
+        }
+    }
+
+    printf("partition: ok\n");
+    failed = 0;
+
+cleanup:
+    program_destroy(program);
+    if (compiler != NULL)
+    {
+        compiler_destroy(compiler);
+    }
+    free(code);
+    return failed;
+}
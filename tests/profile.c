@@ -0,0 +1,146 @@
+/* profile of a run builds ahead the !if branch taken more often, backs
+   up pipes into batches and fuses cheap consumers, pipes it saw no
+   items of keep runtime default.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *code =
+    "(a, 10 > mul), b > add |: intsum{a, b}\n\n"
+    "> !if cond=x[1] true=(> f a=x[0] b=(x[1..] > reduce f=f)) false=x[0] |: reduce(x){f}\n\n"
+    "{\n"
+    "    > !read > reduce f=intsum > !print\n"
+    "} |: main\n";
+
+
+static int64_t count_workers(struct workflow *workflow, const char *name)
+{
+    int64_t count = 0;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        count += strcmp(workflow->worker_names[w], name) == 0;
+    }
+    return count;
+}
+
+
+/* first pipe from one producer to one consumer, -1 if there is none */
+static int64_t simple_pipe(struct workflow *workflow)
+{
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        if (workflow->pipe_producers_offsets[p + 1] - workflow->pipe_producers_offsets[p] == 1 &&
+            workflow->pipe_consumers_offsets[p + 1] - workflow->pipe_consumers_offsets[p] == 1)
+        {
+            return p;
+        }
+    }
+    return -1;
+}
+
+
+int main(void)
+{
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_OPTIMIZE | STAGE_TYPES,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    struct compiler *profiled = NULL;
+    struct program *program = NULL, *again = NULL;
+    char *profile = NULL;
+    int failed = 1;
+    FILE *stream = tmpfile();
+    if (stream == NULL || compiler == NULL || compiler_compile(compiler, "profile.test", code, strlen(code), 0, &program) != COMPILE_OK)
+    {
+        fprintf(stderr, "profile: program doesn't compile\n");
+        goto cleanup;
+    }
+
+    /* run that went into true branch mostly and backed up one pipe */
+    struct workflow *workflow = &program->workflow;
+    int64_t branch = -1;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        branch = strcmp(workflow->worker_names[w], "!if") == 0 ? w : branch;
+    }
+    int64_t pipe = simple_pipe(workflow);
+    if (branch == -1 || pipe == -1)
+    {
+        fprintf(stderr, "profile: program has no !if or no simple pipe\n");
+        goto cleanup;
+    }
+    int64_t consumer = workflow->pipe_consumers[workflow->pipe_consumers_offsets[pipe]];
+    atomic_store(&workflow->worker_stats[branch].branch_true, 9);
+    atomic_store(&workflow->worker_stats[branch].branch_false, 1);
+    atomic_store(&workflow->worker_stats[consumer].items_in, 100);
+    atomic_store(&workflow->worker_stats[consumer].busy_ns, 100);
+    atomic_store(&workflow->pipe_stats[pipe].enqueued, 100);
+    atomic_store(&workflow->pipe_stats[pipe].max_depth, 20);
+    program_profile_write(stream, program);
+
+    int64_t profile_len = ftell(stream);
+    profile = malloc(profile_len + 1);
+    rewind(stream);
+    if (profile == NULL || fread(profile, 1, profile_len, stream) != (size_t)profile_len)
+    {
+        fprintf(stderr, "profile: can't read profile back\n");
+        goto cleanup;
+    }
+    options.profile = profile;
+    options.profile_len = profile_len;
+    profiled = compiler_create(&options);
+    if (profiled == NULL || compiler_compile(profiled, "profile.test", code, strlen(code), 0, &again) != COMPILE_OK)
+    {
+        fprintf(stderr, "profile: program doesn't compile with its profile\n");
+        goto cleanup;
+    }
+
+    workflow = &again->workflow;
+    if (count_workers(workflow, "intsum") != 1 || workflow->worker_branches[2 * branch + 1] == -1 ||
+        workflow->worker_branches[2 * branch] != -1)
+    {
+        fprintf(stderr, "profile: true branch taken 9 of 10 times isn't built ahead alone\n");
+        goto cleanup;
+    }
+    /* backlog of 20 goes in batches of half of it */
+    if (workflow->pipe_batches[pipe] != 8 || !(workflow->pipe_flags[pipe] & PIPE_FUSED))
+    {
+        fprintf(stderr, "profile: pipe %" PRId64 " has batch %" PRId64 " instead of 8 or isn't fused\n", pipe, workflow->pipe_batches[pipe]);
+        goto cleanup;
+    }
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        if (p != pipe && workflow->pipe_batches[p] != 0)
+        {
+            fprintf(stderr, "profile: pipe %" PRId64 " without items has batch %" PRId64 "\n", p, workflow->pipe_batches[p]);
+            goto cleanup;
+        }
+    }
+
+    printf("profile: ok\n");
+    failed = 0;
+
+cleanup:
+    program_destroy(program);
+    program_destroy(again);
+    if (compiler != NULL)
+    {
+        compiler_destroy(compiler);
+    }
+    if (profiled != NULL)
+    {
+        compiler_destroy(profiled);
+    }
+    if (stream != NULL)
+    {
+        fclose(stream);
+    }
+    free(profile);
+    return failed;
+}
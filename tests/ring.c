@@ -0,0 +1,104 @@
+/* two processes pass 1M ints through one shared-memory channel, the
+   consumer checks they all arrive once and in order.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "inttypes.h"
+
+#include "sched.h"
+
+
+#define ITEMS 1000000
+
+
+static int ring_process(void *context, struct partition_plan *plan, int64_t partition, struct shm_ring *rings)
+{
+    (void)context, (void)plan;
+    struct shm_ring *ring = &rings[0];
+    if (partition == 0)
+    {
+        for (int64_t i = 0; i < ITEMS; ++i)
+        {
+            while (!shm_ring_push(ring, &i))
+            {
+                sched_yield();
+            }
+        }
+        shm_ring_close(ring);
+        return 0;
+    }
+
+    int64_t expected = 0;
+    while (!shm_ring_finished(ring))
+    {
+        int64_t item;
+        if (!shm_ring_pop(ring, &item))
+        {
+            sched_yield();
+            continue;
+        }
+        if (item != expected)
+        {
+            fprintf(stderr, "ring: got %" PRId64 " instead of %" PRId64 "\n", item, expected);
+            return 1;
+        }
+        expected++;
+    }
+    if (expected != ITEMS)
+    {
+        fprintf(stderr, "ring: %" PRId64 " of %d items arrived\n", expected, ITEMS);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int failing_process(void *context, struct partition_plan *plan, int64_t partition, struct shm_ring *rings)
+{
+    (void)context, (void)plan;
+    if (partition == 1)
+    {
+        return 1;
+    }
+    /* waits for items that never come, failure of the other one ends it */
+    while (!shm_ring_finished(&rings[0]))
+    {
+        sched_yield();
+    }
+    return 0;
+}
+
+
+int main(void)
+{
+    struct partition_channel channel = {
+        .pipe = 0,
+        .from = 1,
+        .to = 0,
+        .element_size = sizeof(int64_t),
+    };
+    struct partition_plan plan = {
+        .partitions = 2,
+        .channels = &channel,
+        .channels_len = 1,
+    };
+
+    int64_t failed = partition_launch(&plan, 1024, ring_process, NULL);
+    if (failed != 0)
+    {
+        fprintf(stderr, "ring: %" PRId64 " partitions failed\n", failed);
+        return 1;
+    }
+
+    failed = partition_launch(&plan, 1024, failing_process, NULL);
+    if (failed < 1)
+    {
+        fprintf(stderr, "ring: failing partition wasn't reported, got %" PRId64 "\n", failed);
+        return 1;
+    }
+
+    printf("ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,197 @@
+/* compile server serves files it has from memory while their size and
+   mtime stay and are old enough to trust, compiles again files whose
+   content changed, even within the same timestamp tick, answers for
+   files gone since, and evicts least recently used file when full.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/stat.h"
+
+
+/* MAX_SERVER_FILES of server.c */
+#define SERVER_FILES 256
+
+
+/* same size, they differ only in worker inc is made of */
+static const char *add_code = "x, 1 > add |: inc(x)\n\n{\n    > !read > inc > !print\n} |: main\n";
+static const char *sub_code = "x, 1 > sub |: inc(x)\n\n{\n    > !read > inc > !print\n} |: main\n";
+static const char *broken_code = "x, 1 > add |: inc(x\n";
+
+static char dir[] = "/tmp/server_test_XXXXXX";
+
+
+static void file_path(char *path, int64_t index)
+{
+    snprintf(path, 64, "%s/%" PRId64 ".test", dir, index);
+}
+
+
+/* mtime is set in seconds, or left as written if it's 0 */
+static int write_code(const char *path, const char *code, int64_t mtime)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    int ok = fwrite(code, 1, strlen(code), f) == strlen(code);
+    ok = fclose(f) == 0 && ok;
+    if (ok && mtime != 0)
+    {
+        struct timespec stamp = { .tv_sec = mtime };
+        ok = utimensat(AT_FDCWD, path, (struct timespec[]){ stamp, stamp }, 0) == 0;
+    }
+    return ok;
+}
+
+
+/* response starts with status and has text in it, or lacks it if
+   text starts with '-' */
+static int request(struct compile_server *server, const char *step, const char *command, const char *path,
+                   enum compile_status status, const char *text)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%s %s", command, path);
+    FILE *stream = tmpfile();
+    if (stream == NULL)
+    {
+        fprintf(stderr, "server: %s has no file to answer into\n", step);
+        return 0;
+    }
+    compile_server_handle(server, line, stream);
+    int64_t len = ftell(stream);
+    char *response = malloc(len + 1);
+    rewind(stream);
+    int ok = response != NULL && fread(response, 1, len, stream) == (size_t)len;
+    fclose(stream);
+    if (ok)
+    {
+        response[len] = '\0';
+        const char *name = compile_status_name(status);
+        int64_t has = strstr(response, text[0] == '-' ? text + 1 : text) != NULL;
+        ok = strncmp(response, name, strlen(name)) == 0 && response[strlen(name)] == ' ' && has == (text[0] != '-');
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "server: %s answered\n%s\n", step, response != NULL ? response : "nothing");
+    }
+    free(response);
+    return ok;
+}
+
+
+static int counted(struct compile_server *server, const char *step, int64_t compiles, int64_t hits)
+{
+    if (server->compiles != compiles || server->hits != hits)
+    {
+        fprintf(stderr, "server: %s compiled %" PRId64 " times and hit %" PRId64 " instead of %" PRId64 " and %" PRId64 "\n",
+                step, server->compiles, server->hits, compiles, hits);
+        return 0;
+    }
+    return 1;
+}
+
+
+static int check_changes(struct compile_server *server)
+{
+    char path[64];
+    file_path(path, SERVER_FILES);
+    /* less than a second ago */
+    int64_t recent = time(NULL), old = recent - 10;
+    return write_code(path, add_code, old) &&
+           request(server, "first request", "compile", path, COMPILE_OK, "add (stateless)") &&
+           counted(server, "first request", 1, 0) &&
+           /* old enough mtime and size are trusted, file isn't even read */
+           request(server, "unchanged file", "compile", path, COMPILE_OK, "add (stateless)") &&
+           write_code(path, sub_code, old) &&
+           request(server, "edit keeping size and mtime", "compile", path, COMPILE_OK, "add (stateless)") &&
+           counted(server, "unchanged file", 1, 2) &&
+           write_code(path, sub_code, recent) &&
+           request(server, "recent edit", "compile", path, COMPILE_OK, "sub (stateless)") &&
+           /* edit in the same tick keeps size and mtime, file is hashed */
+           write_code(path, add_code, recent) &&
+           request(server, "edit in same tick", "compile", path, COMPILE_OK, "add (stateless)") &&
+           request(server, "recent file", "compile", path, COMPILE_OK, "add (stateless)") &&
+           counted(server, "edit in same tick", 3, 3) &&
+           /* touched file has same hash */
+           write_code(path, add_code, old - 10) &&
+           request(server, "touched file", "compile", path, COMPILE_OK, "add (stateless)") &&
+           request(server, "check", "check", path, COMPILE_OK, "-Workflow of") &&
+           counted(server, "touched file", 3, 5) &&
+           write_code(path, broken_code, 0) &&
+           request(server, "broken file", "check", path, COMPILE_FAILED, "Expected closing ')'") &&
+           write_code(path, add_code, 0) &&
+           request(server, "fixed file", "compile", path, COMPILE_OK, "add (stateless)") &&
+           counted(server, "fixed file", 5, 5) &&
+           unlink(path) == 0 &&
+           request(server, "removed file", "compile", path, COMPILE_INVALID_ARGUMENT, "-add");
+}
+
+
+/* file used longest ago is compiled again after cache filled up, one
+   used last is still there */
+static int check_eviction(struct compile_server *server)
+{
+    char path[64];
+    int64_t old = time(NULL) - 10;
+    int64_t compiles = server->compiles, hits = server->hits;
+    int ok = 1;
+    for (int64_t i = 0; ok && i < SERVER_FILES; ++i)
+    {
+        file_path(path, i);
+        ok = write_code(path, add_code, old) && request(server, "filling cache", "compile", path, COMPILE_OK, "add");
+    }
+    file_path(path, SERVER_FILES);
+    ok = ok && write_code(path, add_code, old) &&
+         request(server, "file over cache", "compile", path, COMPILE_OK, "add") &&
+         counted(server, "file over cache", compiles + SERVER_FILES + 1, hits);
+    file_path(path, SERVER_FILES - 1);
+    ok = ok && request(server, "last used file", "compile", path, COMPILE_OK, "add") &&
+         counted(server, "last used file", compiles + SERVER_FILES + 1, hits + 1);
+    file_path(path, 0);
+    ok = ok && request(server, "evicted file", "compile", path, COMPILE_OK, "add") &&
+         counted(server, "evicted file", compiles + SERVER_FILES + 2, hits + 1);
+    return ok;
+}
+
+
+int main(void)
+{
+    if (mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "server: can't create %s\n", dir);
+        return 1;
+    }
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_TYPES,
+    };
+    struct log_render_options log_options = { 0 };
+    struct compile_server *server = compile_server_create(&options, &log_options);
+    int ok = server != NULL && check_changes(server) && check_eviction(server);
+    if (server != NULL)
+    {
+        compile_server_destroy(server);
+    }
+
+    char path[64];
+    for (int64_t i = 0; i <= SERVER_FILES; ++i)
+    {
+        file_path(path, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    printf("server: ok\n");
+    return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# runs driver on a.test with the options that plan the workflow, every
+# run has to succeed and print what the plan promises
+set -e
+cd "$(dirname "$0")/.."
+
+driver=${1:-./a.out}
+out=$(mktemp)
+profile=$(mktemp)
+trap 'rm -f "$out" "$profile" "$profile.2"' EXIT
+
+expect()
+{
+    if ! grep -q "$1" "$out"; then
+        echo "smoke: '$1' missing from output of $2"
+        exit 1
+    fi
+}
+
+$driver a.test > "$out"
+expect "^Workflow of" "a.test"
+expect "^pipe [0-9]*: a : .* (broadcast)" "a.test"
+# reduce folds the iteration, 1000 next to its result in div is read
+# once anyway, while 1 in check is called per item and is broadcast
+literal=$(sed -n '/^worker [0-9]*: div/{n;s/.* \([0-9]*\):numeric pipeline.*/\1/p;}' "$out")
+if [ -z "$literal" ] || grep -q "^pipe $literal: .*(broadcast)" "$out"; then
+    echo "smoke: literal after reduce is broadcast in a.test"
+    exit 1
+fi
+
+for n in 1 2 4; do
+    $driver --processes=$n a.test > "$out"
+    expect "^Partitions: " "--processes=$n"
+done
+
+$driver --replicas=4 a.test > "$out"
+expect "^Replication of" "--replicas=4"
+expect "to_int x4" "--replicas=4"
+
+$driver --profile-out="$profile" a.test > "$out"
+grep -q "^worker " "$profile" || { echo "smoke: --profile-out wrote no workers"; exit 1; }
+$driver --profile="$profile" --profile-out="$profile.2" a.test > "$out"
+cmp -s "$profile" "$profile.2" || { echo "smoke: profile changed on reload"; exit 1; }
+
+$driver --profile="$profile" --trace-summary a.test > "$out"
+expect "^Workers: " "--trace-summary"
+
+$driver --trace-summary a.test > "$out"
+expect "^Note: no runtime data" "--trace-summary without --profile"
+
+echo "smoke: ok"
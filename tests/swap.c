@@ -0,0 +1,150 @@
+/* host session survives swap onto recompiled program whose definitions
+   moved around, lent items stay with the pipe of the same definition,
+   and unnamed pipe isn't taken for one at another place.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *before =
+    "x > !str_iter > sub b=48 |: to_i(x)\n\n"
+    "{\n    > !read > to_i >> left;\n    > !read > !print\n} |: first\n\n"
+    "x > !str_iter > sub b=49 |: to_j(x)\n\n"
+    "{\n    > !read > to_j >> right;\n    > !read > !print\n} |: second\n\n";
+
+/* same definitions, second one comes first now */
+static const char *after =
+    "x > !str_iter > sub b=49 |: to_j(x)\n\n"
+    "{\n    > !read > to_j >> right;\n    > !read > !print\n} |: second\n\n"
+    "x > !str_iter > sub b=48 |: to_i(x)\n\n"
+    "{\n    > !read > to_i >> left;\n    > !read > !print\n} |: first\n\n";
+
+
+/* dangling pipe of add, removed as its >> s is never read, is first
+   unnamed pipe before and second one after */
+static const char *dangling =
+    "{\n    > !read > add b=1 >> s;\n    > !read > !print\n} |: main\n";
+static const char *dangling_after =
+    "{\n    > !read > !print;\n    > !read > add b=1 >> s;\n    > !read > !print\n} |: main\n";
+
+
+static struct program *compile(struct compiler *compiler, const char *code)
+{
+    struct program *program = NULL;
+    if (compiler_compile(compiler, "swap.test", code, strlen(code), 0, &program) != COMPILE_OK)
+    {
+        fprintf(stderr, "swap: program doesn't compile\n");
+        program_destroy(program);
+        return NULL;
+    }
+    return program;
+}
+
+
+/* pipe !print reads in scope of given definition, -1 if there is none */
+static int64_t print_input(struct program *program, const char *definition)
+{
+    struct workflow *workflow = &program->workflow;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        int64_t scope = workflow->worker_scopes[w];
+        if (strcmp(workflow->worker_names[w], "!print") == 0 &&
+            strcmp(program->definitions[workflow->scope_definitions[scope]]->name, definition) == 0)
+        {
+            return workflow->worker_inputs[workflow->worker_inputs_offsets[w]];
+        }
+    }
+    return -1;
+}
+
+
+int main(void)
+{
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_OPTIMIZE | STAGE_TYPES,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    struct program *old = compile(compiler, before);
+    struct program *new = compile(compiler, after);
+    if (old == NULL || new == NULL)
+    {
+        return 1;
+    }
+
+    int failed = 1;
+    struct host_session *host = host_session_create(old, 16, 1);
+    int64_t pipe = print_input(old, "first");
+    int64_t new_pipe = print_input(new, "first");
+    const char *items[3] = { "1", "2", "3" };
+    if (host == NULL || pipe == -1 || new_pipe == -1 || !host_feed(host, pipe, items, 3))
+    {
+        fprintf(stderr, "swap: session can't be set up\n");
+        goto cleanup;
+    }
+
+    /* both roots have !print, definition tells them apart */
+    int64_t first = host_find_worker(host, "first.!print", 0);
+    int64_t second = host_find_worker(host, "second.!print", 0);
+    if (first == -1 || old->workflow.worker_inputs[old->workflow.worker_inputs_offsets[first]] != pipe ||
+        second == -1 || second == first || host_find_worker(host, "first.!print", 1) != -1 ||
+        host_find_worker(host, "!print", 0) != first || host_find_worker(host, "!print", 1) != second ||
+        host_find_pipe(host, "second.right", 0) == -1 || host_find_pipe(host, "first.right", 0) != -1 ||
+        host_find_pipe(host, "to_i.x", 0) == -1 || host_find_pipe(host, "x", 0) != -1)
+    {
+        fprintf(stderr, "swap: lookup by definition and name doesn't find the one of that definition\n");
+        goto cleanup;
+    }
+
+    struct swap_report report;
+    int64_t swapped = host_swap(host, new, &report);
+    if (swapped != 1 || report.swapped_scopes != 0)
+    {
+        fprintf(stderr, "swap: got %" PRId64 " with %" PRId64 " swapped scopes\n", swapped, report.swapped_scopes);
+        goto cleanup;
+    }
+    if (host_pending(host, new_pipe) != 3)
+    {
+        fprintf(stderr, "swap: %" PRId64 " of 3 lent items are in pipe of first\n", host_pending(host, new_pipe));
+        goto cleanup;
+    }
+
+    host_session_destroy(host);
+    host = NULL;
+    program_destroy(old);
+    program_destroy(new);
+    old = compile(compiler, dangling);
+    new = compile(compiler, dangling_after);
+    pipe = -1;
+    for (int64_t p = 0; old != NULL && p < old->workflow.pipes_len; ++p)
+    {
+        pipe = old->workflow.pipe_consumers_offsets[p] == old->workflow.pipe_consumers_offsets[p + 1] ? p : pipe;
+    }
+    if (old == NULL || new == NULL || pipe == -1 || (host = host_session_create(old, 16, 1)) == NULL ||
+        !host_feed(host, pipe, items, 3))
+    {
+        fprintf(stderr, "swap: session with dangling pipe can't be set up\n");
+        goto cleanup;
+    }
+    if (host_swap(host, new, &report) != -1 || report.blocking_pipe != pipe || host_pending(host, pipe) != 3)
+    {
+        fprintf(stderr, "swap: items of dangling pipe went to pipe that only shares its name and order\n");
+        goto cleanup;
+    }
+
+    printf("swap: ok\n");
+    failed = 0;
+
+cleanup:
+    if (host != NULL)
+    {
+        host_session_destroy(host);
+    }
+    program_destroy(old);
+    program_destroy(new);
+    compiler_destroy(compiler);
+    return failed;
+}
@@ -0,0 +1,138 @@
+/* host session records kernels it runs, chrome trace and summary are
+   written when session is destroyed, events from before a swap stay in
+   the same trace under names of the program they ran in.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *code =
+    "{\n    > !read > !print\n} |: main\n\n";
+
+/* main is same, its !print moved two lines down */
+static const char *code_after =
+    "x > add b=1 |: inc(x)\n\n{\n    > !read > !print\n} |: main\n\n";
+
+
+static void print_kernel(void *context, const void *input, void *output)
+{
+    (void)input;
+    struct value nil = value_nil();
+    (*(int64_t *)context)++;
+    memcpy(output, &nil, sizeof(nil));
+}
+
+
+/* whole stream as string, caller frees it */
+static char *contents(FILE *stream)
+{
+    long len = ftell(stream);
+    char *text = calloc(len + 1, 1);
+    rewind(stream);
+    if (text != NULL && fread(text, 1, len, stream) != (size_t)len)
+    {
+        text[0] = '\0';
+    }
+    return text;
+}
+
+
+int main(void)
+{
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_OPTIMIZE | STAGE_TYPES,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    struct program *program = NULL, *program_after = NULL;
+    if (compiler_compile(compiler, "trace.test", code, strlen(code), 0, &program) != COMPILE_OK ||
+        compiler_compile(compiler, "trace.test", code_after, strlen(code_after), 0, &program_after) != COMPILE_OK)
+    {
+        fprintf(stderr, "trace: program doesn't compile\n");
+        program_destroy(program);
+        program_destroy(program_after);
+        compiler_destroy(compiler);
+        return 1;
+    }
+
+    int failed = 1;
+    int64_t printed = 0;
+    char *trace_text = NULL, *summary_text = NULL;
+    FILE *trace = tmpfile();
+    FILE *summary = tmpfile();
+    struct host_session *host = host_session_create(program, 16, 1);
+    int64_t worker = host != NULL ? host_find_worker(host, "main.!print", 0) : -1;
+    int64_t pipe = worker != -1 ? program->workflow.worker_inputs[program->workflow.worker_inputs_offsets[worker]] : -1;
+    struct value items[3] = { value_from_int(1), value_from_int(2), value_from_int(3) };
+    if (trace == NULL || summary == NULL || host == NULL || pipe == -1 ||
+        !host_session_trace(host, trace, summary, 1024) ||
+        !host_bind_kernel(host, worker, print_kernel, &printed) || !host_feed(host, pipe, items, 3))
+    {
+        fprintf(stderr, "trace: session can't be set up\n");
+        goto cleanup;
+    }
+
+    host_run(host);
+    struct swap_report report;
+    worker = host_find_worker(host, "main.!print", 0);
+    if (host_swap(host, program_after, &report) != 1 || (worker = host_find_worker(host, "main.!print", 0)) == -1 ||
+        !host_feed(host, program_after->workflow.worker_inputs[program_after->workflow.worker_inputs_offsets[worker]], items, 2))
+    {
+        fprintf(stderr, "trace: session doesn't swap onto program with same main\n");
+        goto cleanup;
+    }
+    host_run(host);
+    host_session_destroy(host);
+    host = NULL;
+    trace_text = contents(trace);
+    summary_text = contents(summary);
+    if (printed != 5 || trace_text == NULL || summary_text == NULL)
+    {
+        fprintf(stderr, "trace: kernel ran %" PRId64 " of 5 times\n", printed);
+        goto cleanup;
+    }
+    if (strstr(trace_text, "\"cat\":\"busy\",\"name\":\"!print\"") == NULL)
+    {
+        fprintf(stderr, "trace: no busy event of !print in trace\n");
+        goto cleanup;
+    }
+    const char *header = strstr(trace_text, "traceEvents");
+    if (header == NULL || strstr(header + 1, "traceEvents") != NULL ||
+        strstr(trace_text, "\"line\":2,") == NULL || strstr(trace_text, "\"line\":4,") == NULL)
+    {
+        fprintf(stderr, "trace: events of both versions aren't in one trace at their own lines\n");
+        goto cleanup;
+    }
+    if (strstr(summary_text, "Workers: ") == NULL || strstr(summary_text, "!print") == NULL)
+    {
+        fprintf(stderr, "trace: summary doesn't list !print\n");
+        goto cleanup;
+    }
+
+    printf("trace: ok\n");
+    failed = 0;
+
+cleanup:
+    if (host != NULL)
+    {
+        host_session_destroy(host);
+    }
+    free(trace_text);
+    free(summary_text);
+    if (trace != NULL)
+    {
+        fclose(trace);
+    }
+    if (summary != NULL)
+    {
+        fclose(summary);
+    }
+    program_destroy(program);
+    program_destroy(program_after);
+    compiler_destroy(compiler);
+    return failed;
+}
@@ -0,0 +1,99 @@
+/* results that depend on parameters are dynamic, not bottom, so a
+   numeric worker fed by them and by a literal doesn't take the type of
+   the literal, and no pipe is left with unknown in its type.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+static const char *code =
+    "x > f |: g(x){f}\n\n"
+    "x > !str_iter > !foreach f=g |: each(x)\n\n"
+    "{\n"
+    "    > !read > each >> s;\n"
+    "    (1.5 > g f=!sum), 2 > div > !print;\n"
+    "    1, 2 > add > !print\n"
+    "} |: main\n";
+
+
+/* type of result of nth worker called name, outputs that enter callee
+   are skipped, -1 if there is none */
+static int64_t output_type(struct program *program, const char *name, int64_t nth)
+{
+    struct workflow *workflow = &program->workflow;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        if (strcmp(workflow->worker_names[w], name) != 0 || nth-- != 0)
+        {
+            continue;
+        }
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            int64_t pipe = workflow->worker_outputs[i];
+            if (!(workflow->pipe_flags[pipe] & PIPE_ENTRY))
+            {
+                return workflow->pipe_types[pipe];
+            }
+        }
+    }
+    return -1;
+}
+
+
+int main(void)
+{
+    struct compiler_options options = {
+        .stages = STAGE_PARSE | STAGE_WORKFLOW | STAGE_TYPES,
+    };
+    struct compiler *compiler = compiler_create(&options);
+    struct program *program = NULL;
+    int failed = 1;
+    if (compiler == NULL || compiler_compile(compiler, "types.test", code, strlen(code), 0, &program) != COMPILE_OK)
+    {
+        fprintf(stderr, "types: program doesn't compile\n");
+        goto cleanup;
+    }
+
+    struct workflow *workflow = &program->workflow;
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        char type[64];
+        type_name(workflow->pipe_types[p], type, sizeof(type));
+        if (strstr(type, "unknown") != NULL)
+        {
+            fprintf(stderr, "types: pipe %" PRId64 " %s is %s\n", p, workflow->pipe_names[p], type);
+            goto cleanup;
+        }
+    }
+
+    if (output_type(program, "div", 0) != TYPE_DYNAMIC)
+    {
+        fprintf(stderr, "types: div of parameter dependent result isn't dynamic\n");
+        goto cleanup;
+    }
+    if (output_type(program, "each", 0) != TYPE_SEQUENCE_OF(TYPE_DYNAMIC))
+    {
+        fprintf(stderr, "types: !foreach of parameter dependent result isn't [dynamic]\n");
+        goto cleanup;
+    }
+    if (output_type(program, "add", 0) != TYPE_INT)
+    {
+        fprintf(stderr, "types: add of two int literals isn't int\n");
+        goto cleanup;
+    }
+
+    printf("types: ok\n");
+    failed = 0;
+
+cleanup:
+    program_destroy(program);
+    if (compiler != NULL)
+    {
+        compiler_destroy(compiler);
+    }
+    return failed;
+}
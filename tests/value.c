@@ -0,0 +1,207 @@
+/* NaN-boxed values keep doubles, 48 bit ints and 5 byte strings inline
+   and box the rest without changing what they equal or hash to, and
+   sequences are copied on write only while they are shared.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include "inttypes.h"
+
+
+#define INT48_MIN (-((int64_t)1 << 47))
+#define INT48_MAX (((int64_t)1 << 47) - 1)
+
+
+static struct object *object_of(struct value value)
+{
+    return (struct object *)(uintptr_t)(value.bits & 0x0000FFFFFFFFFFFFull);
+}
+
+
+static int check_doubles(void)
+{
+    static const double doubles[] = { 0.0, -0.0, 1.5, -1e300, 5e-324, INFINITY, -INFINITY };
+    for (int64_t i = 0; i < (int64_t)(sizeof(doubles) / sizeof(*doubles)); ++i)
+    {
+        struct value value = value_from_double(doubles[i]);
+        double back = value_as_double(value);
+        if (value_tag(value) != VALUE_TAG_DOUBLE || memcmp(&back, &doubles[i], sizeof(back)) != 0)
+        {
+            fprintf(stderr, "value: double %g doesn't come back as it was\n", doubles[i]);
+            return 0;
+        }
+    }
+
+    /* NaN with sign and payload of a boxed object stays a double */
+    uint64_t bits = 0xFFFC00000000BEEFull;
+    double nan;
+    memcpy(&nan, &bits, sizeof(nan));
+    struct value value = value_from_double(nan);
+    if (value_tag(value) != VALUE_TAG_DOUBLE || !isnan(value_as_double(value)) || value_type(value) != TYPE_DOUBLE)
+    {
+        fprintf(stderr, "value: NaN is taken for tag %d\n", (int)value_tag(value));
+        return 0;
+    }
+    return 1;
+}
+
+
+static int check_ints(void)
+{
+    static const int64_t inline_ints[] = { 0, -1, 1, INT48_MIN, INT48_MAX };
+    static const int64_t boxed_ints[] = { INT48_MAX + 1, INT48_MIN - 1, INT64_MIN, INT64_MAX };
+    for (int64_t i = 0; i < (int64_t)(sizeof(inline_ints) / sizeof(*inline_ints)); ++i)
+    {
+        struct value value = value_from_int(inline_ints[i]);
+        if (value_tag(value) != VALUE_TAG_INT || value_as_int(value) != inline_ints[i])
+        {
+            fprintf(stderr, "value: int %" PRId64 " isn't inline\n", inline_ints[i]);
+            return 0;
+        }
+    }
+    for (int64_t i = 0; i < (int64_t)(sizeof(boxed_ints) / sizeof(*boxed_ints)); ++i)
+    {
+        struct value value = value_from_int(boxed_ints[i]);
+        struct value other = value_from_int(boxed_ints[i]);
+        int ok = value_tag(value) == VALUE_TAG_OBJECT && value_is_int(value) && value_type(value) == TYPE_INT &&
+                 value_as_int(value) == boxed_ints[i] && value_equal(value, other) && value_hash(value) == value_hash(other);
+        value_release(value);
+        value_release(other);
+        if (!ok)
+        {
+            fprintf(stderr, "value: boxed int %" PRId64 " doesn't come back or compare as it was\n", boxed_ints[i]);
+            return 0;
+        }
+    }
+    if (value_equal(value_from_int(1), value_from_double(1.0)))
+    {
+        fprintf(stderr, "value: 1 equals 1.0\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+static int check_strings(void)
+{
+    struct value empty = value_from_bytes("", 0);
+    struct value small = value_from_bytes("abcde", 5);
+    struct value large = value_from_bytes("abcdef", 6);
+    struct value parent = value_from_bytes("xabcdefx", 8);
+    struct value slice = value_slice(parent, 1, 7);
+    struct value short_slice = value_slice(parent, 1, 6);
+    int64_t len;
+    const char *bytes = value_bytes(&small, &len);
+    int ok = value_tag(empty) == VALUE_TAG_SMALL_STRING && value_len(empty) == 0 &&
+             value_tag(small) == VALUE_TAG_SMALL_STRING && len == 5 && memcmp(bytes, "abcde", 5) == 0 &&
+             value_tag(large) == VALUE_TAG_OBJECT && value_len(large) == 6;
+    if (!ok)
+    {
+        fprintf(stderr, "value: strings of 5 bytes aren't inline or of 6 aren't boxed\n");
+    }
+    /* slice of 6 keeps parent, one of 5 is copied inline */
+    if (ok && (object_of(slice)->kind != OBJECT_SLICE || atomic_load(&object_of(parent)->refcount) != 2 ||
+               value_tag(short_slice) != VALUE_TAG_SMALL_STRING))
+    {
+        fprintf(stderr, "value: slices of string don't share or copy it\n");
+        ok = 0;
+    }
+    if (ok && (!value_equal(slice, large) || value_hash(slice) != value_hash(large) ||
+               !value_equal(short_slice, small) || value_hash(short_slice) != value_hash(small)))
+    {
+        fprintf(stderr, "value: slice and string of same bytes differ\n");
+        ok = 0;
+    }
+    value_release(slice);
+    value_release(short_slice);
+    if (ok && atomic_load(&object_of(parent)->refcount) != 1)
+    {
+        fprintf(stderr, "value: released slice still holds its parent\n");
+        ok = 0;
+    }
+    value_release(large);
+    value_release(parent);
+    return ok;
+}
+
+
+/* items of sequence are ints of expected */
+static int has_ints(struct value sequence, const int64_t *expected, int64_t expected_len)
+{
+    int64_t len;
+    const struct value *items = value_items(sequence, &len);
+    for (int64_t i = 0; items != NULL && len == expected_len && i < len; ++i)
+    {
+        if (value_as_int(items[i]) != expected[i])
+        {
+            return 0;
+        }
+    }
+    return items != NULL && len == expected_len;
+}
+
+
+static int check_sequences(void)
+{
+    static const int64_t original[] = { 1, 2, 3 };
+    static const int64_t changed[] = { 9, 2, 3 };
+    static const int64_t twice[] = { 9, 8, 3 };
+    static const int64_t appended[] = { 9, 8, 3, 7 };
+    struct value items[3] = { value_from_int(1), value_from_int(2), value_from_int(3) };
+    struct value sequence = value_sequence_from(items, 3);
+
+    /* shared one is copied, the other reference still sees old items */
+    value_retain(sequence);
+    struct value copy = value_sequence_set(sequence, 0, value_from_int(9));
+    int ok = copy.bits != sequence.bits && has_ints(sequence, original, 3) && has_ints(copy, changed, 3) &&
+             atomic_load(&object_of(sequence)->refcount) == 1;
+    if (!ok)
+    {
+        fprintf(stderr, "value: set on shared sequence changed it for the other holder\n");
+    }
+
+    /* only reference is changed in place */
+    struct value same = value_sequence_set(copy, 1, value_from_int(8));
+    if (ok && (same.bits != copy.bits || !has_ints(same, twice, 3)))
+    {
+        fprintf(stderr, "value: set on unique sequence copied it\n");
+        ok = 0;
+    }
+    same = value_sequence_append(same, value_from_int(7));
+    if (ok && !has_ints(same, appended, 4))
+    {
+        fprintf(stderr, "value: append lost items\n");
+        ok = 0;
+    }
+
+    /* slice shares parent, changing it copies */
+    struct value slice = value_slice(sequence, 1, 3);
+    struct value slice_changed = value_sequence_set(slice, 0, value_from_int(5));
+    int64_t len;
+    const struct value *slice_items = value_items(slice_changed, &len);
+    if (ok && (object_of(slice_changed)->kind != OBJECT_SEQUENCE || len != 2 || value_as_int(slice_items[0]) != 5 ||
+               value_as_int(slice_items[1]) != 3 || !has_ints(sequence, original, 3)))
+    {
+        fprintf(stderr, "value: set on slice changed its parent\n");
+        ok = 0;
+    }
+
+    value_release(slice_changed);
+    value_release(same);
+    value_release(sequence);
+    return ok;
+}
+
+
+int main(void)
+{
+    if (!check_doubles() || !check_ints() || !check_strings() || !check_sequences())
+    {
+        return 1;
+    }
+    printf("value: ok\n");
+    return 0;
+}
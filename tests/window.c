@@ -0,0 +1,92 @@
+/* sliding, tumbling and byte sized windows emit aggregates of the right
+   items at the right time, count windows never grow their rings.
+
+   ./build.sh test */
+#include "runtime.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+#define MAX_RESULTS 16
+
+
+/* pushes items of given sizes and flushes, returns number of results */
+static int64_t run(struct window_options options, const int64_t *items, const int64_t *sizes, int64_t len, int64_t *results)
+{
+    struct window window;
+    if (!window_init(&window, &options, TYPE_INT))
+    {
+        return -1;
+    }
+    int64_t alloc = window.alloc;
+    int64_t results_len = 0;
+    for (int64_t i = 0; i < len && results_len < MAX_RESULTS; ++i)
+    {
+        results_len += window_push(&window, &items[i], sizes != NULL ? sizes[i] : 0, &results[results_len]);
+    }
+    results_len += window_flush(&window, &results[results_len]);
+    if (options.count != 0 && window.alloc != alloc)
+    {
+        fprintf(stderr, "window: ring of count window grew from %" PRId64 " to %" PRId64 "\n", alloc, window.alloc);
+        results_len = -1;
+    }
+    window_free(&window);
+    return results_len;
+}
+
+
+static int check(const char *name, struct window_options options, const int64_t *items, const int64_t *sizes, int64_t len,
+                 const int64_t *expected, int64_t expected_len)
+{
+    int64_t results[MAX_RESULTS];
+    int64_t results_len = run(options, items, sizes, len, results);
+    if (results_len != expected_len)
+    {
+        fprintf(stderr, "window: %s gave %" PRId64 " results instead of %" PRId64 "\n", name, results_len, expected_len);
+        return 0;
+    }
+    for (int64_t i = 0; i < expected_len; ++i)
+    {
+        if (results[i] != expected[i])
+        {
+            fprintf(stderr, "window: %s result %" PRId64 " is %" PRId64 " instead of %" PRId64 "\n", name, i, results[i], expected[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int main(void)
+{
+    static const int64_t counting[] = { 1, 2, 3, 4, 5, 6, 7 };
+    static const int64_t mixed[] = { 5, 1, 2, 0, 3, 1 };
+    static const int64_t quads[] = { 4, 4, 4, 4 };
+
+    /* running total subtracts evicted items */
+    static const int64_t sliding_sum[] = { 6, 9, 12, 15, 18 };
+    /* max has no inverse, front stack is rebuilt from back */
+    static const int64_t sliding_max[] = { 5, 2, 3, 3 };
+    static const int64_t stepped_sum[] = { 6, 12, 18 };
+    /* last partial window comes from flush */
+    static const int64_t tumbling_sum[] = { 6, 15, 7 };
+    /* 10 bytes fit two items of 4 */
+    static const int64_t sliding_bytes[] = { 1, 3, 5, 7 };
+    static const int64_t tumbling_bytes[] = { 3, 7 };
+
+    int ok = check("sliding sum", (struct window_options){ WINDOW_SUM, 3, 0, 1 }, counting, NULL, 7, sliding_sum, 5) &&
+             check("sliding max", (struct window_options){ WINDOW_MAX, 3, 0, 1 }, mixed, NULL, 6, sliding_max, 4) &&
+             check("sliding sum by 2", (struct window_options){ WINDOW_SUM, 3, 0, 2 }, counting, NULL, 7, stepped_sum, 3) &&
+             check("tumbling sum", (struct window_options){ WINDOW_SUM, 3, 0, 0 }, counting, NULL, 7, tumbling_sum, 3) &&
+             check("sliding bytes", (struct window_options){ WINDOW_SUM, 0, 10, 1 }, counting, quads, 4, sliding_bytes, 4) &&
+             check("tumbling bytes", (struct window_options){ WINDOW_SUM, 0, 10, 0 }, counting, quads, 4, tumbling_bytes, 2);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    printf("window: ok\n");
+    return 0;
+}
@@ -0,0 +1,353 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+struct trace *trace_create(int64_t max_events_per_thread)
+{
+    struct trace *trace = malloc(sizeof(*trace));
+    if (trace == NULL)
+    {
+        return NULL;
+    }
+
+    mtx_init(&trace->lock, mtx_plain);
+    trace->buffers = NULL;
+    trace->buffers_len = 0;
+    trace->start_ns = time_now_ns();
+    trace->max_events_per_thread = max_events_per_thread;
+    trace->written = 0;
+
+    return trace;
+}
+
+
+void trace_destroy(struct trace *trace)
+{
+    struct trace_buffer *buffer = trace->buffers;
+    while (buffer != NULL)
+    {
+        struct trace_buffer *next = buffer->next;
+        free(buffer->events);
+        free(buffer);
+        buffer = next;
+    }
+    mtx_destroy(&trace->lock);
+    free(trace);
+}
+
+
+struct trace_buffer *trace_thread_attach(struct trace *trace)
+{
+    struct trace_buffer *buffer = malloc(sizeof(*buffer));
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    buffer->events = NULL;
+    buffer->events_len = 0;
+    buffer->events_alloc = 0;
+    buffer->events_dropped = 0;
+    buffer->max_events = trace->max_events_per_thread;
+
+    mtx_lock(&trace->lock);
+    buffer->thread_id = trace->buffers_len++;
+    buffer->next = trace->buffers;
+    trace->buffers = buffer;
+    mtx_unlock(&trace->lock);
+
+    /* preallocate, so the hot path almost never reallocates */
+    buffer->events_alloc = trace->max_events_per_thread < 4096 ? trace->max_events_per_thread : 4096;
+    buffer->events = malloc(sizeof(*buffer->events) * buffer->events_alloc);
+    if (buffer->events == NULL)
+    {
+        buffer->events_alloc = 0;
+    }
+
+    return buffer;
+}
+
+
+void trace_record(struct trace_buffer *buffer, enum trace_event_type type, int64_t id, int64_t begin_ns, int64_t end_ns)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    if (buffer->events_len >= buffer->events_alloc)
+    {
+        /* full buffer drops events instead of stalling the worker */
+        int64_t new_alloc = 2 * buffer->events_alloc + !buffer->events_alloc;
+        if (new_alloc > buffer->max_events)
+        {
+            new_alloc = buffer->max_events;
+        }
+        void *new_ptr = NULL;
+        if (new_alloc > buffer->events_alloc)
+        {
+            new_ptr = realloc(buffer->events, sizeof(*buffer->events) * new_alloc);
+        }
+        if (new_ptr == NULL)
+        {
+            buffer->events_dropped++;
+            return;
+        }
+        buffer->events = new_ptr;
+        buffer->events_alloc = new_alloc;
+    }
+
+    buffer->events[buffer->events_len++] = (struct trace_event){
+        .type = type,
+        .id = id,
+        .begin_ns = begin_ns,
+        .end_ns = end_ns,
+    };
+}
+
+
+void worker_stats_items(struct workflow *workflow, int64_t worker, int64_t items_in, int64_t items_out)
+{
+    struct worker_stats *stats = &workflow->worker_stats[worker];
+    atomic_fetch_add_explicit(&stats->items_in, items_in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->items_out, items_out, memory_order_relaxed);
+}
+
+
+void worker_stats_branch(struct workflow *workflow, int64_t worker, int64_t cond)
+{
+    struct worker_stats *stats = &workflow->worker_stats[worker];
+    atomic_fetch_add_explicit(cond ? &stats->branch_true : &stats->branch_false, 1, memory_order_relaxed);
+}
+
+
+void worker_stats_busy(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns)
+{
+    atomic_fetch_add_explicit(&workflow->worker_stats[worker].busy_ns, end_ns - begin_ns, memory_order_relaxed);
+    trace_record(buffer, TRACE_WORKER_BUSY, worker, begin_ns, end_ns);
+}
+
+
+void worker_stats_blocked_input(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns)
+{
+    atomic_fetch_add_explicit(&workflow->worker_stats[worker].blocked_input_ns, end_ns - begin_ns, memory_order_relaxed);
+    trace_record(buffer, TRACE_WORKER_BLOCKED_INPUT, worker, begin_ns, end_ns);
+}
+
+
+void worker_stats_blocked_output(struct trace_buffer *buffer, struct workflow *workflow, int64_t worker, int64_t begin_ns, int64_t end_ns)
+{
+    atomic_fetch_add_explicit(&workflow->worker_stats[worker].blocked_output_ns, end_ns - begin_ns, memory_order_relaxed);
+    trace_record(buffer, TRACE_WORKER_BLOCKED_OUTPUT, worker, begin_ns, end_ns);
+}
+
+
+void pipe_stats_enqueue(struct trace_buffer *buffer, struct workflow *workflow, int64_t pipe, int64_t count)
+{
+    struct pipe_stats *stats = &workflow->pipe_stats[pipe];
+    int64_t enqueued = atomic_fetch_add_explicit(&stats->enqueued, count, memory_order_relaxed) + count;
+    int64_t depth = enqueued - atomic_load_explicit(&stats->dequeued, memory_order_relaxed);
+
+    /* only new high-water marks are recorded */
+    int64_t max_depth = atomic_load_explicit(&stats->max_depth, memory_order_relaxed);
+    while (depth > max_depth)
+    {
+        if (atomic_compare_exchange_weak_explicit(&stats->max_depth, &max_depth, depth, memory_order_relaxed, memory_order_relaxed))
+        {
+            trace_record(buffer, TRACE_PIPE_DEPTH, pipe, time_now_ns(), depth);
+            break;
+        }
+    }
+}
+
+
+void pipe_stats_dequeue(struct workflow *workflow, int64_t pipe, int64_t count)
+{
+    atomic_fetch_add_explicit(&workflow->pipe_stats[pipe].dequeued, count, memory_order_relaxed);
+}
+
+
+static void print_json_string(FILE *stream, const char *s)
+{
+    fputc('"', stream);
+    for (; *s != '\0'; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fprintf(stream, "\\%c", *s);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(stream, "\\u%04x", *s);
+        }
+        else
+        {
+            fputc(*s, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+
+/* events of every buffer named after workers and pipes of program,
+   header first unless earlier flush wrote it already */
+static void write_events(FILE *stream, struct program *program, struct trace *trace)
+{
+    struct workflow *workflow = &program->workflow;
+    int64_t first = !trace->written;
+
+    if (!trace->written)
+    {
+        fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        trace->written = 1;
+    }
+
+    for (struct trace_buffer *buffer = trace->buffers; buffer != NULL; buffer = buffer->next)
+    {
+        fprintf(stream, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%" PRId64 ",\"args\":{\"name\":\"worker thread %" PRId64 "\",\"dropped\":%" PRId64 "}}",
+                first ? "" : ",\n", buffer->thread_id, buffer->thread_id, buffer->events_dropped);
+        first = 0;
+
+        for (int64_t i = 0; i < buffer->events_len; ++i)
+        {
+            struct trace_event *event = &buffer->events[i];
+            double ts = (double)(event->begin_ns - trace->start_ns) / 1000.0;
+
+            if (event->type == TRACE_PIPE_DEPTH)
+            {
+                fprintf(stream, ",\n{\"ph\":\"C\",\"pid\":1,\"tid\":%" PRId64 ",\"ts\":%.3f,\"name\":", buffer->thread_id, ts);
+                print_json_string(stream, workflow->pipe_names[event->id]);
+                fprintf(stream, ",\"args\":{\"depth\":%" PRId64 "}}", event->end_ns);
+                continue;
+            }
+
+            int64_t worker = event->id;
+            const char *category = event->type == TRACE_WORKER_BUSY ? "busy" :
+                                   event->type == TRACE_WORKER_BLOCKED_INPUT ? "blocked_input" : "blocked_output";
+            int64_t line, col;
+            program_position_to_line_col(program, workflow->worker_code_positions[worker].begin, &line, &col);
+
+            fprintf(stream, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%" PRId64 ",\"ts\":%.3f,\"dur\":%.3f,\"cat\":\"%s\",\"name\":",
+                    buffer->thread_id, ts, (double)(event->end_ns - event->begin_ns) / 1000.0, category);
+            print_json_string(stream, workflow->worker_names[worker]);
+            fprintf(stream, ",\"args\":{\"worker\":%" PRId64 ",\"source\":", worker);
+            print_json_string(stream, program->filename);
+            fprintf(stream, ",\"line\":%" PRId64 ",\"col\":%" PRId64 "}}", line, col);
+        }
+    }
+}
+
+
+/* writes events recorded so far while their ids still mean workers
+   and pipes of program, then forgets them. trace goes on in same
+   document, so it may span program and what host_swap replaced it
+   with. nobody may record meanwhile */
+void trace_flush_chrome(FILE *stream, struct program *program, struct trace *trace)
+{
+    mtx_lock(&trace->lock);
+    write_events(stream, program, trace);
+    for (struct trace_buffer *buffer = trace->buffers; buffer != NULL; buffer = buffer->next)
+    {
+        buffer->events_len = 0;
+        buffer->events_dropped = 0;
+    }
+    mtx_unlock(&trace->lock);
+}
+
+
+void trace_export_chrome(FILE *stream, struct program *program, struct trace *trace)
+{
+    mtx_lock(&trace->lock);
+    write_events(stream, program, trace);
+    mtx_unlock(&trace->lock);
+
+    fprintf(stream, "\n]}\n");
+}
+
+
+/* qsort has no context argument, ids are sorted together with their keys */
+struct busy_order
+{
+    int64_t busy_ns;
+    int64_t worker;
+};
+
+
+static int compare_worker_busy(const void *a, const void *b)
+{
+    const struct busy_order *x = a, *y = b;
+    if (x->busy_ns != y->busy_ns)
+    {
+        return (x->busy_ns < y->busy_ns) - (x->busy_ns > y->busy_ns);
+    }
+    return (x->worker > y->worker) - (x->worker < y->worker);
+}
+
+
+void trace_export_summary(FILE *stream, struct program *program)
+{
+    struct workflow *workflow = &program->workflow;
+
+    /* busiest workers first, they are the bottleneck candidates */
+    struct busy_order *order = malloc(sizeof(*order) * (workflow->workers_len + 1));
+    if (order == NULL)
+    {
+        return;
+    }
+
+    int64_t total_busy = 0;
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        order[i].busy_ns = atomic_load(&workflow->worker_stats[i].busy_ns);
+        order[i].worker = i;
+        total_busy += order[i].busy_ns;
+    }
+    qsort(order, workflow->workers_len, sizeof(*order), compare_worker_busy);
+
+    fprintf(stream, "Workers: %" PRId64 "\n", workflow->workers_len);
+    fprintf(stream, "%-6s %-20s %-24s %10s %10s %12s %12s %12s %7s\n",
+            "id", "name", "source", "in", "out", "busy ms", "wait in ms", "wait out ms", "busy %");
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        int64_t worker = order[i].worker;
+        struct worker_stats *stats = &workflow->worker_stats[worker];
+        int64_t line, col;
+        program_position_to_line_col(program, workflow->worker_code_positions[worker].begin, &line, &col);
+
+        char source[256];
+        snprintf(source, sizeof(source), "%s:%" PRId64 ":%" PRId64, program->filename, line, col);
+
+        int64_t busy = order[i].busy_ns;
+        fprintf(stream, "%-6" PRId64 " %-20s %-24s %10" PRId64 " %10" PRId64 " %12.3f %12.3f %12.3f %7.2f\n",
+                worker, workflow->worker_names[worker], source,
+                atomic_load(&stats->items_in),
+                atomic_load(&stats->items_out),
+                busy / 1e6,
+                atomic_load(&stats->blocked_input_ns) / 1e6,
+                atomic_load(&stats->blocked_output_ns) / 1e6,
+                total_busy == 0 ? 0.0 : 100.0 * busy / total_busy);
+    }
+    free(order);
+
+    fprintf(stream, "\nPipes: %" PRId64 "\n", workflow->pipes_len);
+    fprintf(stream, "%-6s %-20s %-24s %10s %10s %10s\n", "id", "name", "source", "enqueued", "dequeued", "max depth");
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        struct pipe_stats *stats = &workflow->pipe_stats[i];
+        int64_t line, col;
+        program_position_to_line_col(program, workflow->pipe_code_positions[i].begin, &line, &col);
+
+        char source[256];
+        snprintf(source, sizeof(source), "%s:%" PRId64 ":%" PRId64, program->filename, line, col);
+
+        fprintf(stream, "%-6" PRId64 " %-20s %-24s %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+                i, workflow->pipe_names[i], source,
+                atomic_load(&stats->enqueued),
+                atomic_load(&stats->dequeued),
+                atomic_load(&stats->max_depth));
+    }
+}
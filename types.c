@@ -0,0 +1,374 @@
+#include "lang.h"
+
+#include "stdio.h"
+#include "ctype.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* recursion through sequences can nest types without end */
+#define MAX_TYPE_DEPTH 8
+#define MAX_TYPE_ITERATIONS 64
+
+
+static int64_t type_depth(int64_t type)
+{
+    int64_t depth = 0;
+    while (TYPE_KIND(type) == TYPE_SEQUENCE)
+    {
+        type = TYPE_ELEMENT(type);
+        depth++;
+    }
+    return depth;
+}
+
+
+static int64_t sequence_of(int64_t type)
+{
+    return type_depth(type) >= MAX_TYPE_DEPTH ? TYPE_DYNAMIC : TYPE_SEQUENCE_OF(type);
+}
+
+
+/* what is still unknown once nothing changes can't be known, it is
+   left to run time */
+static int64_t widen(int64_t type)
+{
+    if (type == TYPE_UNKNOWN)
+    {
+        return TYPE_DYNAMIC;
+    }
+    return TYPE_KIND(type) == TYPE_SEQUENCE ? TYPE_SEQUENCE_OF(widen(TYPE_ELEMENT(type))) : type;
+}
+
+
+/* least upper bound, unknown is bottom and dynamic is top */
+int64_t type_join(int64_t a, int64_t b)
+{
+    if (a == TYPE_UNKNOWN || a == b)
+    {
+        return b;
+    }
+    if (b == TYPE_UNKNOWN)
+    {
+        return a;
+    }
+    if (TYPE_KIND(a) == TYPE_SEQUENCE && TYPE_KIND(b) == TYPE_SEQUENCE)
+    {
+        return TYPE_SEQUENCE_OF(type_join(TYPE_ELEMENT(a), TYPE_ELEMENT(b)));
+    }
+    if ((a == TYPE_INT && b == TYPE_DOUBLE) || (a == TYPE_DOUBLE && b == TYPE_INT))
+    {
+        return TYPE_DOUBLE;
+    }
+    return TYPE_DYNAMIC;
+}
+
+
+/* returns length of name, like strlen */
+int64_t type_name(int64_t type, char *buffer, int64_t buffer_len)
+{
+    static const char *names[] = {
+        [TYPE_UNKNOWN] = "unknown",
+        [TYPE_INT] = "int",
+        [TYPE_DOUBLE] = "double",
+        [TYPE_BYTE] = "byte",
+        [TYPE_STRING] = "string",
+        [TYPE_DYNAMIC] = "dynamic",
+    };
+
+    int64_t depth = type_depth(type);
+    int64_t element = type;
+    for (int64_t i = 0; i < depth; ++i)
+    {
+        element = TYPE_ELEMENT(element);
+    }
+    return snprintf(buffer, buffer_len, "%.*s%s%.*s", (int)depth, "[[[[[[[[", names[TYPE_KIND(element)], (int)depth, "]]]]]]]]");
+}
+
+
+static int64_t literal_type(const char *text)
+{
+    int64_t digits = 0, dots = 0, i = 0;
+    for (; text[i] != '\0'; ++i)
+    {
+        digits += isdigit(text[i]) != 0;
+        dots += text[i] == '.';
+    }
+    if (i == 0)
+    {
+        return TYPE_UNKNOWN;
+    }
+    if (text[0] == '"')
+    {
+        return TYPE_STRING;
+    }
+    if (digits == i)
+    {
+        return TYPE_INT;
+    }
+    if (digits == i - 1 && dots == 1)
+    {
+        return TYPE_DOUBLE;
+    }
+    /* name of pipe or parameter, like x or a[0], may hold anything */
+    return TYPE_DYNAMIC;
+}
+
+
+static int64_t callable_result(struct program *program, const char *name)
+{
+    const struct builtin *builtin = builtin_find(name);
+    if (builtin != NULL)
+    {
+        return builtin->result == RESULT_FIXED ? builtin->type : TYPE_UNKNOWN;
+    }
+    /* free vars and opaque workers may stand for anything */
+    int64_t index = program_find_definition(program, name);
+    struct definition *definition = index != -1 ? program->definitions[index] : NULL;
+    return definition != NULL ? definition->result_type : TYPE_DYNAMIC;
+}
+
+
+static int64_t pipeline_type(struct program *program, struct pipeline_definition *pipeline);
+
+
+static int64_t substitution_type(struct program *program, struct pipeline_worker_substitution *sub)
+{
+    return sub->type == SUBSTITUTION_PIPELINE ? pipeline_type(program, sub->pipeline) : literal_type(sub->symbol);
+}
+
+
+/* name is what worker calls, parameters are resolved in workflow */
+static int64_t worker_type(struct program *program, struct pipeline_worker_definition *worker, const char *name, int64_t input)
+{
+    const struct builtin *builtin = builtin_find(name);
+    if (builtin == NULL)
+    {
+        return callable_result(program, name);
+    }
+
+    int64_t type = TYPE_UNKNOWN;
+    switch (builtin->result)
+    {
+        case RESULT_FIXED:
+            type = builtin->type;
+            break;
+        case RESULT_NUMERIC:
+            if (input == TYPE_BYTE || input == TYPE_INT)
+            {
+                type = TYPE_INT;
+            }
+            else if (input == TYPE_DOUBLE || input == TYPE_UNKNOWN)
+            {
+                type = input;
+            }
+            else
+            {
+                type = TYPE_DYNAMIC;
+            }
+            break;
+        case RESULT_FOREACH:
+            for (int64_t i = 0; i < worker->subs_len; ++i)
+            {
+                if (strcmp(worker->subs[i].name, "f") == 0 && worker->subs[i].type == SUBSTITUTION_SYMBOL)
+                {
+                    type = callable_result(program, worker->subs[i].symbol);
+                }
+            }
+            type = sequence_of(type);
+            break;
+        case RESULT_IF:
+            for (int64_t i = 0; i < worker->subs_len; ++i)
+            {
+                if (strcmp(worker->subs[i].name, "true") == 0 || strcmp(worker->subs[i].name, "false") == 0)
+                {
+                    type = type_join(type, substitution_type(program, &worker->subs[i]));
+                }
+            }
+            break;
+    }
+    return type;
+}
+
+
+/* parameters may be bound to anything, so only what body itself
+   fixes is found */
+static int64_t pipeline_type(struct program *program, struct pipeline_definition *pipeline)
+{
+    int64_t type = TYPE_UNKNOWN;
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
+    {
+        type = type_join(type, pipeline->args[i].type == ARGUMENT_NAME ?
+                               literal_type(pipeline->args[i].name) :
+                               pipeline_type(program, pipeline->args[i].pipeline));
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        type = worker_type(program, &pipeline->workers[i], pipeline->workers[i].name, type);
+    }
+    return type;
+}
+
+
+static void flow_definition_results(struct program *program)
+{
+    int64_t changed = 1;
+    for (int64_t iteration = 0; changed && iteration < MAX_TYPE_ITERATIONS; ++iteration)
+    {
+        changed = 0;
+        for (int64_t i = 0; i < program->definitions_len; ++i)
+        {
+            struct definition *definition = program->definitions[i];
+            if (definition->pipelines_len == 0)
+            {
+                continue;
+            }
+            /* value of definition is its last pipeline */
+            int64_t type = type_join(definition->result_type, pipeline_type(program, &definition->pipelines[definition->pipelines_len - 1]));
+            if (type != definition->result_type)
+            {
+                definition->result_type = type;
+                changed = 1;
+            }
+        }
+    }
+}
+
+
+/* unknown is bottom while results flow, so recursion like reduce
+   settles on what its base case gives. results depending on parameters
+   alone stay unknown, they are widened and flow once more, so callers
+   see dynamic instead of taking the type of their other inputs */
+static void infer_definition_results(struct program *program)
+{
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        program->definitions[i]->result_type = TYPE_UNKNOWN;
+    }
+
+    for (int64_t round = 0; round < 2; ++round)
+    {
+        for (int64_t i = 0; round != 0 && i < program->definitions_len; ++i)
+        {
+            program->definitions[i]->result_type = widen(program->definitions[i]->result_type);
+        }
+        flow_definition_results(program);
+    }
+}
+
+
+/* numeric pipes get their type from source text, other pipes nobody
+   writes may hold anything */
+static int64_t literal_pipe_type(struct program *program, struct workflow *workflow, int64_t pipe)
+{
+    struct code_span span = workflow->pipe_code_positions[pipe];
+    char text[64];
+    int64_t len = span.end - span.begin;
+    if (len <= 0 || len >= (int64_t)sizeof(text))
+    {
+        return TYPE_DYNAMIC;
+    }
+    memcpy(text, program->source_code + span.begin, len);
+    text[len] = '\0';
+    return literal_type(text);
+}
+
+
+/* call passes its inputs to pipeline vars of callee in order, what it
+   binds free vars to and what builtins pass may be anything */
+static int64_t entry_type(struct program *program, struct workflow *workflow, int64_t worker, int64_t pipe)
+{
+    if (builtin_find(workflow->worker_names[worker]) != NULL)
+    {
+        return TYPE_DYNAMIC;
+    }
+    struct definition *definition = program->definitions[workflow->scope_definitions[workflow->pipe_scopes[pipe]]];
+    int64_t inputs_len = workflow->worker_inputs_offsets[worker + 1] - workflow->worker_inputs_offsets[worker];
+    for (int64_t i = 0; i < definition->pipeline_vars_len && i < inputs_len; ++i)
+    {
+        if (definition->pipeline_vars[i] == workflow->pipe_names[pipe])
+        {
+            return workflow->pipe_types[workflow->worker_inputs[workflow->worker_inputs_offsets[worker] + i]];
+        }
+    }
+    return TYPE_DYNAMIC;
+}
+
+
+static void flow_pipe_types(struct program *program, struct workflow *workflow)
+{
+    int64_t changed = 1;
+    for (int64_t iteration = 0; changed && iteration < MAX_TYPE_ITERATIONS; ++iteration)
+    {
+        changed = 0;
+        for (int64_t w = 0; w < workflow->workers_len; ++w)
+        {
+            int64_t input = TYPE_UNKNOWN;
+            for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+            {
+                input = type_join(input, workflow->pipe_types[workflow->worker_inputs[i]]);
+            }
+            int64_t result = worker_type(program, workflow->worker_definitions[w], workflow->worker_names[w], input);
+            for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+            {
+                int64_t pipe = workflow->worker_outputs[i];
+                int64_t written = workflow->pipe_flags[pipe] & PIPE_ENTRY ? entry_type(program, workflow, w, pipe) : result;
+                int64_t type = type_join(workflow->pipe_types[pipe], written);
+                if (type != workflow->pipe_types[pipe])
+                {
+                    workflow->pipe_types[pipe] = type;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+
+/* flows types forward through pipes until nothing changes, pipes
+   left without type hold boxed values */
+void program_infer_types(struct program *program)
+{
+    program_pass_begin(program, PASS_TYPES);
+
+    infer_definition_results(program);
+
+    struct workflow *workflow = &program->workflow;
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        int64_t produced = workflow->pipe_producers_offsets[p] != workflow->pipe_producers_offsets[p + 1];
+        workflow->pipe_types[p] = produced ? TYPE_UNKNOWN : literal_pipe_type(program, workflow, p);
+    }
+
+    /* pipes on cycles may be left unknown, they are widened and flow
+       once more, so their consumers don't take type of other inputs */
+    for (int64_t round = 0; round < 2; ++round)
+    {
+        for (int64_t p = 0; round != 0 && p < workflow->pipes_len; ++p)
+        {
+            workflow->pipe_types[p] = widen(workflow->pipe_types[p]);
+        }
+        flow_pipe_types(program, workflow);
+    }
+
+    /* windows aggregate numbers, arguments are checked once here */
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        struct pipeline_worker_definition *worker = workflow->worker_definitions[w];
+        struct window_options options;
+        if (strcmp(worker->name, "!window") == 0 && window_options_parse(program, worker, &options))
+        {
+            for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+            {
+                int64_t type = workflow->pipe_types[workflow->worker_inputs[i]];
+                if (type != TYPE_INT && type != TYPE_DOUBLE && type != TYPE_BYTE && type != TYPE_DYNAMIC)
+                {
+                    program_log(program, LOG_WORKFLOW, LOG_WARNING, "!window input is not number", worker->code_position, NULL);
+                }
+            }
+        }
+    }
+
+    program_pass_end(program, PASS_TYPES);
+}
@@ -0,0 +1,599 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+
+/* doubles are stored as they are, everything else hides in quiet NaNs
+   with sign bit set: 1111 1111 1111 1ttt pppp ... pppp, t is tag and
+   p is 48 bit payload. real NaNs are canonicalized to positive one */
+#define VALUE_NAN_BOXED 0xFFF8000000000000ull
+#define VALUE_CANONICAL_NAN 0x7FF8000000000000ull
+#define VALUE_TAG_SHIFT 48
+#define VALUE_PAYLOAD_MASK 0x0000FFFFFFFFFFFFull
+
+/* 5 bytes of text and 3 bits of length fit into payload */
+#define SMALL_STRING_BYTES 5
+
+#define INT48_MIN (-((int64_t)1 << 47))
+#define INT48_MAX (((int64_t)1 << 47) - 1)
+
+
+static struct value make_tagged(enum value_tag tag, uint64_t payload)
+{
+    return (struct value){ VALUE_NAN_BOXED | ((uint64_t)tag << VALUE_TAG_SHIFT) | (payload & VALUE_PAYLOAD_MASK) };
+}
+
+
+static uint64_t payload_of(struct value value)
+{
+    return value.bits & VALUE_PAYLOAD_MASK;
+}
+
+
+enum value_tag value_tag(struct value value)
+{
+    if ((value.bits & VALUE_NAN_BOXED) != VALUE_NAN_BOXED)
+    {
+        return VALUE_TAG_DOUBLE;
+    }
+    return (enum value_tag)((value.bits >> VALUE_TAG_SHIFT) & 7);
+}
+
+
+static struct object *object_of(struct value value)
+{
+    return (struct object *)(uintptr_t)payload_of(value);
+}
+
+
+static struct object *object_alloc(enum object_kind kind, int64_t extra)
+{
+    struct object *object = malloc(sizeof(*object) + extra);
+    if (object == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&object->refcount, 1);
+    object->kind = kind;
+    object->len = 0;
+    return object;
+}
+
+
+/* user space pointers fit into 48 bits on every platform we target */
+static struct value make_object(struct object *object)
+{
+    if (object == NULL)
+    {
+        return value_nil();
+    }
+    return make_tagged(VALUE_TAG_OBJECT, (uint64_t)(uintptr_t)object);
+}
+
+
+struct value value_nil(void)
+{
+    return make_tagged(VALUE_TAG_NIL, 0);
+}
+
+
+struct value value_from_double(double x)
+{
+    struct value value;
+    memcpy(&value.bits, &x, sizeof(x));
+    if (x != x)
+    {
+        value.bits = VALUE_CANONICAL_NAN;
+    }
+    return value;
+}
+
+
+/* integers past 48 bits are the only scalars that need the heap */
+struct value value_from_int(int64_t x)
+{
+    if (x >= INT48_MIN && x <= INT48_MAX)
+    {
+        return make_tagged(VALUE_TAG_INT, (uint64_t)x);
+    }
+
+    struct object *object = object_alloc(OBJECT_INT, 0);
+    if (object == NULL)
+    {
+        return value_nil();
+    }
+    object->integer = x;
+    return make_object(object);
+}
+
+
+struct value value_from_bytes(const char *data, int64_t len)
+{
+    if (len <= SMALL_STRING_BYTES)
+    {
+        uint64_t payload = (uint64_t)len << 40;
+        for (int64_t i = 0; i < len; ++i)
+        {
+            payload |= (uint64_t)(unsigned char)data[i] << (8 * i);
+        }
+        return make_tagged(VALUE_TAG_SMALL_STRING, payload);
+    }
+
+    struct object *object = object_alloc(OBJECT_STRING, len + 1);
+    if (object == NULL)
+    {
+        return value_nil();
+    }
+    object->len = len;
+    object->bytes = (char *)(object + 1);
+    memcpy(object->bytes, data, len);
+    object->bytes[len] = '\0';
+    return make_object(object);
+}
+
+
+static struct object *sequence_alloc(int64_t len, int64_t capacity)
+{
+    struct object *object = object_alloc(OBJECT_SEQUENCE, sizeof(struct value) * capacity);
+    if (object == NULL)
+    {
+        return NULL;
+    }
+    object->len = len;
+    object->items = (struct value *)(object + 1);
+    object->capacity = capacity;
+    return object;
+}
+
+
+/* takes ownership of one reference to every item */
+struct value value_sequence_from(struct value *items, int64_t len)
+{
+    struct object *object = sequence_alloc(len, len);
+    if (object == NULL)
+    {
+        for (int64_t i = 0; i < len; ++i)
+        {
+            value_release(items[i]);
+        }
+        return value_nil();
+    }
+    if (len > 0)
+    {
+        memcpy(object->items, items, sizeof(*items) * len);
+    }
+    return make_object(object);
+}
+
+
+/* short slices of strings are copied inline, longer ones keep parent alive */
+struct value value_slice(struct value value, int64_t begin, int64_t end)
+{
+    int64_t len = value_len(value);
+    begin = begin < 0 ? 0 : begin > len ? len : begin;
+    end = end < begin ? begin : end > len ? len : end;
+
+    if (value_tag(value) == VALUE_TAG_SMALL_STRING ||
+        (value_tag(value) == VALUE_TAG_OBJECT && end - begin <= SMALL_STRING_BYTES && value_type(value) == TYPE_STRING))
+    {
+        int64_t bytes_len;
+        const char *bytes = value_bytes(&value, &bytes_len);
+        return value_from_bytes(bytes + begin, end - begin);
+    }
+    if (value_tag(value) != VALUE_TAG_OBJECT)
+    {
+        return value_nil();
+    }
+
+    struct object *parent = object_of(value);
+    if (parent->kind == OBJECT_SLICE)
+    {
+        begin += parent->slice_begin;
+        end += parent->slice_begin;
+        parent = object_of(parent->slice_parent);
+    }
+
+    struct object *object = object_alloc(OBJECT_SLICE, 0);
+    if (object == NULL)
+    {
+        return value_nil();
+    }
+    object->len = end - begin;
+    object->slice_begin = begin;
+    object->slice_parent = make_object(parent);
+    atomic_fetch_add_explicit(&parent->refcount, 1, memory_order_relaxed);
+    return make_object(object);
+}
+
+
+/* returns new reference to item, nil when out of range */
+struct value value_index(struct value value, int64_t index)
+{
+    int64_t len;
+    const struct value *items = value_items(value, &len);
+    if (items == NULL || index < 0 || index >= len)
+    {
+        return value_nil();
+    }
+    value_retain(items[index]);
+    return items[index];
+}
+
+
+/* sequence whose items the caller may change in place. shared sequences
+   and slices are copied, the reference passed in is consumed */
+static struct object *unique_sequence(struct value sequence, int64_t capacity)
+{
+    int64_t len;
+    const struct value *items = value_items(sequence, &len);
+    capacity = capacity > len ? capacity : len;
+
+    if (items != NULL && object_of(sequence)->kind == OBJECT_SEQUENCE &&
+        atomic_load_explicit(&object_of(sequence)->refcount, memory_order_acquire) == 1)
+    {
+        struct object *object = object_of(sequence);
+        if (object->capacity >= capacity)
+        {
+            return object;
+        }
+        /* nobody else sees it, so it can move */
+        object = realloc(object, sizeof(*object) + sizeof(struct value) * capacity);
+        if (object == NULL)
+        {
+            return NULL;
+        }
+        object->items = (struct value *)(object + 1);
+        object->capacity = capacity;
+        return object;
+    }
+
+    struct object *object = sequence_alloc(len, capacity);
+    if (object != NULL)
+    {
+        for (int64_t i = 0; i < len; ++i)
+        {
+            value_retain(items[i]);
+            object->items[i] = items[i];
+        }
+    }
+    value_release(sequence);
+    return object;
+}
+
+
+/* strings and their slices have bytes, not items, to change */
+static int64_t has_items(struct value value)
+{
+    int64_t len;
+    return value_items(value, &len) != NULL;
+}
+
+
+/* consumes both references, nil sequence starts an empty one, anything
+   else but sequence is left as is */
+struct value value_sequence_append(struct value sequence, struct value item)
+{
+    if (value_tag(sequence) != VALUE_TAG_NIL && !has_items(sequence))
+    {
+        value_release(item);
+        return sequence;
+    }
+    int64_t len = value_len(sequence);
+    int64_t capacity = len;
+    if (value_tag(sequence) == VALUE_TAG_OBJECT && object_of(sequence)->kind == OBJECT_SEQUENCE)
+    {
+        capacity = object_of(sequence)->capacity;
+    }
+    if (len == capacity)
+    {
+        capacity = 2*capacity + !capacity;
+    }
+
+    struct object *object = unique_sequence(sequence, capacity);
+    if (object == NULL)
+    {
+        value_release(item);
+        return value_nil();
+    }
+    object->items[object->len++] = item;
+    return make_object(object);
+}
+
+
+/* consumes both references, index out of range or value that isn't
+   sequence leaves it as is */
+struct value value_sequence_set(struct value sequence, int64_t index, struct value item)
+{
+    if (!has_items(sequence) || index < 0 || index >= value_len(sequence))
+    {
+        value_release(item);
+        return sequence;
+    }
+
+    struct object *object = unique_sequence(sequence, 0);
+    if (object == NULL)
+    {
+        value_release(item);
+        return value_nil();
+    }
+    value_release(object->items[index]);
+    object->items[index] = item;
+    return make_object(object);
+}
+
+
+void value_retain(struct value value)
+{
+    if (value_tag(value) == VALUE_TAG_OBJECT)
+    {
+        atomic_fetch_add_explicit(&object_of(value)->refcount, 1, memory_order_relaxed);
+    }
+}
+
+
+/* fan-out of one value to n consumers costs one atomic add */
+void value_retain_n(struct value value, int64_t n)
+{
+    if (value_tag(value) == VALUE_TAG_OBJECT && n > 0)
+    {
+        atomic_fetch_add_explicit(&object_of(value)->refcount, n, memory_order_relaxed);
+    }
+}
+
+
+void value_release(struct value value)
+{
+    if (value_tag(value) != VALUE_TAG_OBJECT)
+    {
+        return;
+    }
+
+    struct object *object = object_of(value);
+    if (atomic_fetch_sub_explicit(&object->refcount, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    if (object->kind == OBJECT_SEQUENCE)
+    {
+        for (int64_t i = 0; i < object->len; ++i)
+        {
+            value_release(object->items[i]);
+        }
+    }
+    else if (object->kind == OBJECT_SLICE)
+    {
+        value_release(object->slice_parent);
+    }
+    free(object);
+}
+
+
+int64_t value_is_int(struct value value)
+{
+    return value_tag(value) == VALUE_TAG_INT || (value_tag(value) == VALUE_TAG_OBJECT && object_of(value)->kind == OBJECT_INT);
+}
+
+
+/* cond of !if: nonzero numbers and nonempty strings and sequences */
+int64_t value_truthy(struct value value)
+{
+    switch (value_tag(value))
+    {
+        case VALUE_TAG_DOUBLE:
+            return value_as_double(value) != 0.0;
+        case VALUE_TAG_INT:
+            return value_as_int(value) != 0;
+        case VALUE_TAG_NIL:
+            return 0;
+        default:
+            return value_is_int(value) ? value_as_int(value) != 0 : value_len(value) != 0;
+    }
+}
+
+
+int64_t value_as_int(struct value value)
+{
+    switch (value_tag(value))
+    {
+        case VALUE_TAG_INT:
+            /* sign extend 48 bit payload */
+            return (int64_t)(payload_of(value) << 16) >> 16;
+        case VALUE_TAG_DOUBLE:
+            return (int64_t)value_as_double(value);
+        case VALUE_TAG_OBJECT:
+            return object_of(value)->kind == OBJECT_INT ? object_of(value)->integer : 0;
+        default:
+            return 0;
+    }
+}
+
+
+double value_as_double(struct value value)
+{
+    if (value_tag(value) == VALUE_TAG_DOUBLE)
+    {
+        double x;
+        memcpy(&x, &value.bits, sizeof(x));
+        return x;
+    }
+    return (double)value_as_int(value);
+}
+
+
+int64_t value_type(struct value value)
+{
+    switch (value_tag(value))
+    {
+        case VALUE_TAG_DOUBLE:
+            return TYPE_DOUBLE;
+        case VALUE_TAG_INT:
+            return TYPE_INT;
+        case VALUE_TAG_SMALL_STRING:
+            return TYPE_STRING;
+        case VALUE_TAG_OBJECT:
+        {
+            struct object *object = object_of(value);
+            if (object->kind == OBJECT_SLICE)
+            {
+                object = object_of(object->slice_parent);
+            }
+            return object->kind == OBJECT_INT ? TYPE_INT :
+                   object->kind == OBJECT_STRING ? TYPE_STRING : TYPE_SEQUENCE_OF(TYPE_DYNAMIC);
+        }
+        default:
+            return TYPE_UNKNOWN;
+    }
+}
+
+
+int64_t value_len(struct value value)
+{
+    switch (value_tag(value))
+    {
+        case VALUE_TAG_SMALL_STRING:
+            return (payload_of(value) >> 40) & 7;
+        case VALUE_TAG_OBJECT:
+            return object_of(value)->kind == OBJECT_INT ? 0 : object_of(value)->len;
+        default:
+            return 0;
+    }
+}
+
+
+/* bytes of string value, small strings point into *value itself,
+   so the pointer lives as long as that variable */
+const char *value_bytes(const struct value *value, int64_t *len)
+{
+    *len = 0;
+    switch (value_tag(*value))
+    {
+        case VALUE_TAG_SMALL_STRING:
+            /* payload starts at lowest byte on little endian targets */
+            *len = value_len(*value);
+            return (const char *)&value->bits;
+        case VALUE_TAG_OBJECT:
+        {
+            struct object *object = object_of(*value);
+            if (object->kind == OBJECT_STRING)
+            {
+                *len = object->len;
+                return object->bytes;
+            }
+            if (object->kind == OBJECT_SLICE && object_of(object->slice_parent)->kind == OBJECT_STRING)
+            {
+                *len = object->len;
+                return object_of(object->slice_parent)->bytes + object->slice_begin;
+            }
+            return NULL;
+        }
+        default:
+            return NULL;
+    }
+}
+
+
+/* items of sequence value, NULL for everything else */
+const struct value *value_items(struct value value, int64_t *len)
+{
+    *len = 0;
+    if (value_tag(value) != VALUE_TAG_OBJECT)
+    {
+        return NULL;
+    }
+    struct object *object = object_of(value);
+    if (object->kind == OBJECT_SEQUENCE)
+    {
+        *len = object->len;
+        return object->items;
+    }
+    if (object->kind == OBJECT_SLICE && object_of(object->slice_parent)->kind == OBJECT_SEQUENCE)
+    {
+        *len = object->len;
+        return object_of(object->slice_parent)->items + object->slice_begin;
+    }
+    return NULL;
+}
+
+
+/* structural equality, 1 and 1.0 are different values */
+int64_t value_equal(struct value a, struct value b)
+{
+    if (a.bits == b.bits)
+    {
+        return 1;
+    }
+
+    int64_t type = value_type(a);
+    if (type != value_type(b))
+    {
+        return 0;
+    }
+    if (type == TYPE_INT)
+    {
+        return value_as_int(a) == value_as_int(b);
+    }
+    if (type == TYPE_STRING)
+    {
+        int64_t a_len, b_len;
+        const char *a_bytes = value_bytes(&a, &a_len);
+        const char *b_bytes = value_bytes(&b, &b_len);
+        return a_len == b_len && memcmp(a_bytes, b_bytes, a_len) == 0;
+    }
+    if (TYPE_KIND(type) == TYPE_SEQUENCE)
+    {
+        int64_t a_len, b_len;
+        const struct value *a_items = value_items(a, &a_len);
+        const struct value *b_items = value_items(b, &b_len);
+        if (a_len != b_len)
+        {
+            return 0;
+        }
+        for (int64_t i = 0; i < a_len; ++i)
+        {
+            if (!value_equal(a_items[i], b_items[i]))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+/* equal values hash equally, whatever their representation */
+uint64_t value_hash(struct value value)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    int64_t type = value_type(value);
+
+    if (type == TYPE_STRING)
+    {
+        int64_t len;
+        const char *bytes = value_bytes(&value, &len);
+        for (int64_t i = 0; i < len; ++i)
+        {
+            hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+    if (TYPE_KIND(type) == TYPE_SEQUENCE)
+    {
+        int64_t len;
+        const struct value *items = value_items(value, &len);
+        for (int64_t i = 0; i < len; ++i)
+        {
+            hash = (hash ^ value_hash(items[i])) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+    if (type == TYPE_INT)
+    {
+        return (hash ^ (uint64_t)value_as_int(value)) * 0x9E3779B97F4A7C15ull;
+    }
+    return (hash ^ value.bits) * 0x9E3779B97F4A7C15ull;
+}
@@ -0,0 +1,291 @@
+#include "runtime.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "float.h"
+
+
+static union window_number identity(struct window *window)
+{
+    union window_number number = { .integer = 0 };
+    int64_t real = window->type == TYPE_DOUBLE;
+    switch (window->options.op)
+    {
+        case WINDOW_SUM:
+            number.integer = 0;
+            if (real)
+            {
+                number.real = 0.0;
+            }
+            break;
+        case WINDOW_PRODUCT:
+            number.integer = 1;
+            if (real)
+            {
+                number.real = 1.0;
+            }
+            break;
+        case WINDOW_MIN:
+            number.integer = INT64_MAX;
+            if (real)
+            {
+                number.real = DBL_MAX;
+            }
+            break;
+        case WINDOW_MAX:
+            number.integer = INT64_MIN;
+            if (real)
+            {
+                number.real = -DBL_MAX;
+            }
+            break;
+    }
+    return number;
+}
+
+
+/* integers wrap around instead of overflowing */
+static union window_number combine(struct window *window, union window_number a, union window_number b)
+{
+    union window_number number = { .integer = 0 };
+    if (window->type == TYPE_DOUBLE)
+    {
+        switch (window->options.op)
+        {
+            case WINDOW_SUM: number.real = a.real + b.real; break;
+            case WINDOW_PRODUCT: number.real = a.real * b.real; break;
+            case WINDOW_MIN: number.real = a.real < b.real ? a.real : b.real; break;
+            case WINDOW_MAX: number.real = a.real > b.real ? a.real : b.real; break;
+        }
+        return number;
+    }
+    switch (window->options.op)
+    {
+        case WINDOW_SUM: number.integer = (int64_t)((uint64_t)a.integer + (uint64_t)b.integer); break;
+        case WINDOW_PRODUCT: number.integer = (int64_t)((uint64_t)a.integer * (uint64_t)b.integer); break;
+        case WINDOW_MIN: number.integer = a.integer < b.integer ? a.integer : b.integer; break;
+        case WINDOW_MAX: number.integer = a.integer > b.integer ? a.integer : b.integer; break;
+    }
+    return number;
+}
+
+
+static int64_t tumbling(struct window *window)
+{
+    return window->options.step == 0 || (window->options.count != 0 && window->options.step >= window->options.count);
+}
+
+
+/* type is element type of input pipe, bytes become ints */
+int64_t window_init(struct window *window, struct window_options *options, int64_t type)
+{
+    memset(window, 0, sizeof(*window));
+    window->options = *options;
+    window->type = type == TYPE_DOUBLE ? TYPE_DOUBLE : TYPE_INT;
+    /* wrapping integer sum subtracts exactly, double one would drift */
+    window->invertible = options->op == WINDOW_SUM && window->type == TYPE_INT;
+    window->back = identity(window);
+    window->total = identity(window);
+
+    /* count window holds count items and the one pushed before oldest
+       is evicted, so it never grows. sized one does on demand */
+    window->alloc = options->count != 0 ? options->count + 1 : 16;
+    window->items = malloc(window->alloc * sizeof(*window->items));
+    window->front = malloc(window->alloc * sizeof(*window->front));
+    window->sizes = malloc(window->alloc * sizeof(*window->sizes));
+    if (window->items == NULL || window->front == NULL || window->sizes == NULL)
+    {
+        window_free(window);
+        return 0;
+    }
+    return 1;
+}
+
+
+void window_free(struct window *window)
+{
+    free(window->items);
+    free(window->front);
+    free(window->sizes);
+    window->items = NULL;
+    window->front = NULL;
+    window->sizes = NULL;
+    window->len = 0;
+}
+
+
+static int64_t grow(struct window *window)
+{
+    int64_t alloc = 2*window->alloc + !window->alloc;
+    union window_number *items = malloc(alloc * sizeof(*items));
+    union window_number *front = malloc(alloc * sizeof(*front));
+    int64_t *sizes = malloc(alloc * sizeof(*sizes));
+    if (items == NULL || front == NULL || sizes == NULL)
+    {
+        free(items);
+        free(front);
+        free(sizes);
+        return 0;
+    }
+    /* ring is unwrapped, so head starts from 0 */
+    for (int64_t i = 0; i < window->len; ++i)
+    {
+        int64_t slot = (window->head + i) % window->alloc;
+        items[i] = window->items[slot];
+        front[i] = window->front[slot];
+        sizes[i] = window->sizes[slot];
+    }
+    free(window->items);
+    free(window->front);
+    free(window->sizes);
+    window->items = items;
+    window->front = front;
+    window->sizes = sizes;
+    window->head = 0;
+    window->alloc = alloc;
+    return 1;
+}
+
+
+/* whole back becomes front, each item gets aggregate of itself and
+   everything newer, so every item is moved once before it's evicted */
+static void flip(struct window *window)
+{
+    union window_number suffix = identity(window);
+    for (int64_t i = window->len - 1; i >= 0; --i)
+    {
+        int64_t slot = (window->head + i) % window->alloc;
+        suffix = combine(window, window->items[slot], suffix);
+        window->front[slot] = suffix;
+    }
+    window->front_len = window->len;
+    window->back = identity(window);
+}
+
+
+static void evict(struct window *window)
+{
+    int64_t slot = window->head;
+    if (window->invertible)
+    {
+        window->total.integer = (int64_t)((uint64_t)window->total.integer - (uint64_t)window->items[slot].integer);
+    }
+    else
+    {
+        if (window->front_len == 0)
+        {
+            flip(window);
+        }
+        window->front_len--;
+    }
+    window->bytes -= window->sizes[slot];
+    window->head = (window->head + 1) % window->alloc;
+    window->len--;
+}
+
+
+static void clear(struct window *window)
+{
+    window->head = 0;
+    window->len = 0;
+    window->front_len = 0;
+    window->bytes = 0;
+    window->back = identity(window);
+    window->total = identity(window);
+}
+
+
+static void aggregate(struct window *window, void *result)
+{
+    union window_number number = window->total;
+    if (!window->invertible)
+    {
+        number = window->front_len != 0 ? combine(window, window->front[window->head], window->back) : window->back;
+    }
+    memcpy(result, &number, sizeof(number));
+    window->pending = 0;
+    window->results++;
+}
+
+
+/* element is int64_t or double by type of window, size counts only
+   for windows limited by bytes. returns 1 if result was written, it
+   has type of elements */
+int64_t window_push(struct window *window, const void *element, int64_t size, void *result)
+{
+    union window_number number;
+    memcpy(&number, element, sizeof(number));
+    int64_t emitted = 0;
+
+    /* sized tumbling window is done when next item doesn't fit */
+    if (window->options.bytes != 0 && tumbling(window) && window->len != 0 && window->bytes + size > window->options.bytes)
+    {
+        aggregate(window, result);
+        clear(window);
+        emitted = 1;
+    }
+
+    if (window->len == window->alloc && !grow(window))
+    {
+        return emitted;
+    }
+    int64_t slot = (window->head + window->len) % window->alloc;
+    window->items[slot] = number;
+    window->sizes[slot] = size;
+    window->len++;
+    window->bytes += size;
+    window->pending++;
+    if (window->invertible)
+    {
+        window->total = combine(window, window->total, number);
+    }
+    else
+    {
+        window->back = combine(window, window->back, number);
+    }
+
+    /* oversized item still makes window of its own */
+    while ((window->options.count != 0 && window->len > window->options.count) ||
+           (window->options.bytes != 0 && window->len > 1 && window->bytes > window->options.bytes))
+    {
+        evict(window);
+    }
+
+    if (window->options.count != 0 && !emitted)
+    {
+        int64_t step = tumbling(window) ? window->options.count : window->options.step;
+        if (window->len == window->options.count && window->pending >= step)
+        {
+            aggregate(window, result);
+            emitted = 1;
+            if (tumbling(window))
+            {
+                clear(window);
+            }
+        }
+    }
+    else if (window->options.bytes != 0 && !tumbling(window) && window->pending >= window->options.step)
+    {
+        aggregate(window, result);
+        emitted = 1;
+    }
+    return emitted;
+}
+
+
+/* at end of stream, result of items not covered by any result yet */
+int64_t window_flush(struct window *window, void *result)
+{
+    if (window->pending == 0 || window->len == 0)
+    {
+        return 0;
+    }
+    aggregate(window, result);
+    if (tumbling(window))
+    {
+        clear(window);
+    }
+    return 1;
+}
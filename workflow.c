@@ -10,65 +10,440 @@
 #define MAX_FUNCTION_WORKERS 1024
 struct name_table
 {
-    struct pipe *pipes[MAX_FUNCTION_PIPES];
+    int64_t pipes[MAX_FUNCTION_PIPES];
     int64_t pipes_len;
 
-    struct worker *workers[MAX_FUNCTION_WORKERS];
+    int64_t workers[MAX_FUNCTION_WORKERS];
     int64_t workers_len;
 };
 
+/* more would mean bindings of callables multiply without end */
+#define MAX_INSTANCES 65536
 
-static struct pipe *add_pipe(struct program *program, char *name, struct code_span code_position)
+/* instances by definition and bindings, open addressing over scopes
+   of builder, -1 is empty slot */
+struct instance_table
 {
-    struct workflow *workflow = &program->workflow;
+    int64_t *slots;
+    int64_t slots_alloc;
+    int64_t len;
+};
+
+struct build
+{
+    struct workflow_builder *builder;
+    struct instance_table instances;
+};
+
+
+/* grows *items to hold at least len + 1 elements of given size */
+static int64_t reserve(struct program *program, void **items, int64_t *alloc, int64_t len, int64_t size)
+{
+    if (len < *alloc)
+    {
+        return 1;
+    }
+
+    int64_t new_alloc = 2 * *alloc + !*alloc;
+    void *new_ptr = program_realloc(program, *items, size * new_alloc);
+    if (new_ptr == NULL)
+    {
+        return 0;
+    }
+    *items = new_ptr;
+    *alloc = new_alloc;
+    return 1;
+}
+
+
+/* returns id of new worker, -1 if out of memory */
+int64_t workflow_add_worker(struct program *program, struct workflow_builder *builder, char *name, struct code_span code_position, struct pipeline_worker_definition *worker_definition)
+{
+    if (!reserve(program, (void **)&builder->workers, &builder->workers_alloc, builder->workers_len, sizeof(*builder->workers)))
+    {
+        return -1;
+    }
+
+    builder->workers[builder->workers_len] = (struct workflow_worker_record){
+        .name = name,
+        .code_position = code_position,
+        .worker_definition = worker_definition,
+        .scope = builder->scope,
+        .branches = { -1, -1 },
+    };
+    return builder->workers_len++;
+}
+
+
+/* returns id of new pipe, -1 if out of memory */
+int64_t workflow_add_pipe(struct program *program, struct workflow_builder *builder, char *name, struct code_span code_position)
+{
+    if (!reserve(program, (void **)&builder->pipes, &builder->pipes_alloc, builder->pipes_len, sizeof(*builder->pipes)))
+    {
+        return -1;
+    }
+
+    builder->pipes[builder->pipes_len] = (struct workflow_pipe_record){
+        .name = name,
+        .code_position = code_position,
+        .scope = builder->scope,
+        .flags = 0,
+    };
+    return builder->pipes_len++;
+}
+
 
-    if (workflow->pipes_len >= workflow->pipes_alloc)
+/* bindings holds one name per free var of definition. returns id of
+   new scope, -1 if out of memory */
+int64_t workflow_add_scope(struct program *program, struct workflow_builder *builder, int64_t definition, int64_t caller, char **bindings)
+{
+    int64_t free_vars_len = program->definitions[definition]->free_vars_len;
+    if (!reserve(program, (void **)&builder->scopes, &builder->scopes_alloc, builder->scopes_len, sizeof(*builder->scopes)))
     {
-        workflow->pipes_alloc = 2 * workflow->pipes_alloc + !workflow->pipes_alloc;
-        void *new_ptr = realloc(workflow->pipes, sizeof(*workflow->pipes) * workflow->pipes_alloc);
-        if (new_ptr == NULL)
+        return -1;
+    }
+    for (int64_t k = 0; k < free_vars_len; ++k)
+    {
+        if (!reserve(program, (void **)&builder->bindings, &builder->bindings_alloc, builder->bindings_len, sizeof(*builder->bindings)))
         {
-            fprintf(stderr, "Error: No memory for WORKFLOW.\n");
-            exit(1);
+            return -1;
         }
-        workflow->pipes = new_ptr;
+        builder->bindings[builder->bindings_len++] = bindings[k];
     }
 
-    workflow->pipes[workflow->pipes_len] = malloc(sizeof(*workflow->pipes[workflow->pipes_len]));
-    if (workflow->pipes[workflow->pipes_len] == NULL)
+    builder->scopes[builder->scopes_len] = (struct workflow_scope_record){
+        .definition = definition,
+        .caller = caller,
+        .bindings = builder->bindings_len - free_vars_len,
+        .entries = -1,
+    };
+    return builder->scopes_len++;
+}
+
+
+/* ports are numbered in connection order */
+void workflow_connect_input(struct program *program, struct workflow_builder *builder, int64_t worker, int64_t pipe)
+{
+    if (reserve(program, (void **)&builder->inputs, &builder->inputs_alloc, builder->inputs_len, sizeof(*builder->inputs)))
     {
-        fprintf(stderr, "Error: No memory for WORKFLOW.\n");
+        builder->inputs[builder->inputs_len++] = (struct workflow_edge){worker, pipe};
     }
-        
-    workflow->pipes[workflow->pipes_len]->name = name;
-    workflow->pipes[workflow->pipes_len]->code_position = code_position;
-    
-    return workflow->pipes[workflow->pipes_len++];
 }
 
 
-static struct pipe *get_pipe(struct program *program, struct name_table *name_table, char *name, struct code_span span)
+void workflow_connect_output(struct program *program, struct workflow_builder *builder, int64_t worker, int64_t pipe)
+{
+    if (reserve(program, (void **)&builder->outputs, &builder->outputs_alloc, builder->outputs_len, sizeof(*builder->outputs)))
+    {
+        builder->outputs[builder->outputs_len++] = (struct workflow_edge){worker, pipe};
+    }
+}
+
+
+/* stable counting sort of edges into rows, by_worker selects row key */
+static void fill_rows(struct workflow_edge *edges, int64_t edges_len, int64_t by_worker, int64_t rows_len, int64_t *offsets, int64_t *columns)
+{
+    memset(offsets, 0, sizeof(*offsets) * (rows_len + 1));
+    for (int64_t i = 0; i < edges_len; ++i)
+    {
+        offsets[(by_worker ? edges[i].worker : edges[i].pipe) + 1]++;
+    }
+    for (int64_t i = 0; i < rows_len; ++i)
+    {
+        offsets[i + 1] += offsets[i];
+    }
+    /* offsets[row] is used as cursor and restored afterwards */
+    for (int64_t i = 0; i < edges_len; ++i)
+    {
+        int64_t row = by_worker ? edges[i].worker : edges[i].pipe;
+        columns[offsets[row]++] = by_worker ? edges[i].pipe : edges[i].worker;
+    }
+    for (int64_t i = rows_len; i > 0; --i)
+    {
+        offsets[i] = offsets[i - 1];
+    }
+    offsets[0] = 0;
+}
+
+
+static uint64_t pipe_name_hash(int64_t scope, const char *name, int64_t len)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ (uint64_t)scope;
+    for (int64_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+
+/* open addressing table of pipes by scope and name, -1 is empty slot */
+struct pipe_table
+{
+    int64_t *slots;
+    int64_t alloc;
+};
+
+
+static int64_t find_pipe(struct workflow *workflow, struct pipe_table *table, int64_t scope, const char *symbol)
+{
+    /* a[0] and a.len both read pipe a */
+    int64_t len = strcspn(symbol, "[.");
+    int64_t mask = table->alloc - 1;
+    for (uint64_t slot = pipe_name_hash(scope, symbol, len) & mask; table->slots[slot] != -1; slot = (slot + 1) & mask)
+    {
+        int64_t pipe = table->slots[slot];
+        if (workflow->pipe_scopes[pipe] == scope &&
+            strncmp(workflow->pipe_names[pipe], symbol, len) == 0 && workflow->pipe_names[pipe][len] == '\0')
+        {
+            return pipe;
+        }
+    }
+    return -1;
+}
+
+
+/* fills worker_symbols and pipe_symbol_readers of frozen workflow,
+   leaves memory failed if out of memory */
+static void resolve_symbols(struct program *program, struct workflow *workflow)
+{
+    int64_t symbols_len = 0;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        struct pipeline_worker_definition *worker = workflow->worker_definitions[w];
+        for (int64_t i = 0; i < worker->subs_len; ++i)
+        {
+            symbols_len += worker->subs[i].type == SUBSTITUTION_SYMBOL;
+        }
+    }
+
+    struct pipe_table table = { NULL, 1 };
+    while (table.alloc < 2 * workflow->pipes_len)
+    {
+        table.alloc *= 2;
+    }
+    table.slots = program_alloc(program, sizeof(*table.slots) * table.alloc);
+    struct workflow_edge *reads = program_alloc(program, sizeof(*reads) * (symbols_len + 1));
+    workflow->worker_symbols_offsets = program_alloc(program, sizeof(*workflow->worker_symbols_offsets) * (workflow->workers_len + 1));
+    workflow->worker_symbols = program_alloc(program, sizeof(*workflow->worker_symbols) * (symbols_len + 1));
+    workflow->pipe_symbol_readers_offsets = program_alloc(program, sizeof(*workflow->pipe_symbol_readers_offsets) * (workflow->pipes_len + 1));
+    workflow->pipe_symbol_readers = program_alloc(program, sizeof(*workflow->pipe_symbol_readers) * (symbols_len + 1));
+    if (program->memory.failed)
+    {
+        program_free(program, table.slots);
+        program_free(program, reads);
+        return;
+    }
+
+    memset(table.slots, -1, sizeof(*table.slots) * table.alloc);
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        uint64_t slot = pipe_name_hash(workflow->pipe_scopes[p], workflow->pipe_names[p], strlen(workflow->pipe_names[p])) & (table.alloc - 1);
+        while (table.slots[slot] != -1)
+        {
+            slot = (slot + 1) & (table.alloc - 1);
+        }
+        table.slots[slot] = p;
+    }
+
+    int64_t len = 0, reads_len = 0;
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        workflow->worker_symbols_offsets[w] = len;
+        struct pipeline_worker_definition *worker = workflow->worker_definitions[w];
+        for (int64_t i = 0; i < worker->subs_len; ++i)
+        {
+            if (worker->subs[i].type != SUBSTITUTION_SYMBOL)
+            {
+                continue;
+            }
+            int64_t pipe = find_pipe(workflow, &table, workflow->worker_scopes[w], worker->subs[i].symbol);
+            workflow->worker_symbols[len++] = pipe;
+            if (pipe != -1)
+            {
+                reads[reads_len++] = (struct workflow_edge){w, pipe};
+            }
+        }
+    }
+    workflow->worker_symbols_offsets[workflow->workers_len] = len;
+    fill_rows(reads, reads_len, 0, workflow->pipes_len, workflow->pipe_symbol_readers_offsets, workflow->pipe_symbol_readers);
+
+    program_free(program, table.slots);
+    program_free(program, reads);
+}
+
+
+/* builder is released, workflow is left empty if out of memory */
+void workflow_freeze(struct program *program, struct workflow_builder *builder, struct workflow *workflow)
+{
+    int64_t workers_len = builder->workers_len;
+    int64_t pipes_len = builder->pipes_len;
+
+    memset(workflow, 0, sizeof(*workflow));
+    workflow->worker_names = program_alloc(program, sizeof(*workflow->worker_names) * workers_len);
+    workflow->worker_code_positions = program_alloc(program, sizeof(*workflow->worker_code_positions) * workers_len);
+    workflow->worker_definitions = program_alloc(program, sizeof(*workflow->worker_definitions) * workers_len);
+    workflow->worker_scopes = program_alloc(program, sizeof(*workflow->worker_scopes) * workers_len);
+    workflow->worker_flags = program_alloc(program, sizeof(*workflow->worker_flags) * workers_len);
+    workflow->worker_stats = program_alloc(program, sizeof(*workflow->worker_stats) * workers_len);
+    workflow->worker_weights = program_alloc(program, sizeof(*workflow->worker_weights) * workers_len);
+    workflow->worker_branches = program_alloc(program, sizeof(*workflow->worker_branches) * 2 * workers_len);
+    workflow->worker_inputs_offsets = program_alloc(program, sizeof(*workflow->worker_inputs_offsets) * (workers_len + 1));
+    workflow->worker_inputs = program_alloc(program, sizeof(*workflow->worker_inputs) * builder->inputs_len);
+    workflow->worker_outputs_offsets = program_alloc(program, sizeof(*workflow->worker_outputs_offsets) * (workers_len + 1));
+    workflow->worker_outputs = program_alloc(program, sizeof(*workflow->worker_outputs) * builder->outputs_len);
+    workflow->pipe_names = program_alloc(program, sizeof(*workflow->pipe_names) * pipes_len);
+    workflow->pipe_code_positions = program_alloc(program, sizeof(*workflow->pipe_code_positions) * pipes_len);
+    workflow->pipe_scopes = program_alloc(program, sizeof(*workflow->pipe_scopes) * pipes_len);
+    workflow->pipe_types = program_alloc(program, sizeof(*workflow->pipe_types) * pipes_len);
+    workflow->pipe_stats = program_alloc(program, sizeof(*workflow->pipe_stats) * pipes_len);
+    workflow->pipe_flags = program_alloc(program, sizeof(*workflow->pipe_flags) * pipes_len);
+    workflow->pipe_batches = program_alloc(program, sizeof(*workflow->pipe_batches) * pipes_len);
+    workflow->pipe_producers_offsets = program_alloc(program, sizeof(*workflow->pipe_producers_offsets) * (pipes_len + 1));
+    workflow->pipe_producers = program_alloc(program, sizeof(*workflow->pipe_producers) * builder->outputs_len);
+    workflow->pipe_consumers_offsets = program_alloc(program, sizeof(*workflow->pipe_consumers_offsets) * (pipes_len + 1));
+    workflow->pipe_consumers = program_alloc(program, sizeof(*workflow->pipe_consumers) * builder->inputs_len);
+    workflow->scope_definitions = program_alloc(program, sizeof(*workflow->scope_definitions) * builder->scopes_len);
+    workflow->scope_callers = program_alloc(program, sizeof(*workflow->scope_callers) * builder->scopes_len);
+    workflow->scope_bindings_offsets = program_alloc(program, sizeof(*workflow->scope_bindings_offsets) * (builder->scopes_len + 1));
+    workflow->scope_bindings = program_alloc(program, sizeof(*workflow->scope_bindings) * builder->bindings_len);
+
+    if (!program->memory.failed)
+    {
+        workflow->workers_len = workers_len;
+        for (int64_t i = 0; i < workers_len; ++i)
+        {
+            workflow->worker_names[i] = builder->workers[i].name;
+            workflow->worker_code_positions[i] = builder->workers[i].code_position;
+            workflow->worker_definitions[i] = builder->workers[i].worker_definition;
+            workflow->worker_scopes[i] = builder->workers[i].scope;
+            workflow->worker_branches[2 * i] = builder->workers[i].branches[0];
+            workflow->worker_branches[2 * i + 1] = builder->workers[i].branches[1];
+        }
+        memset(workflow->worker_flags, 0, sizeof(*workflow->worker_flags) * workers_len);
+        memset(workflow->worker_stats, 0, sizeof(*workflow->worker_stats) * workers_len);
+        memset(workflow->worker_weights, 0, sizeof(*workflow->worker_weights) * workers_len);
+
+        workflow->pipes_len = pipes_len;
+        for (int64_t i = 0; i < pipes_len; ++i)
+        {
+            workflow->pipe_names[i] = builder->pipes[i].name;
+            workflow->pipe_code_positions[i] = builder->pipes[i].code_position;
+            workflow->pipe_scopes[i] = builder->pipes[i].scope;
+            workflow->pipe_flags[i] = builder->pipes[i].flags;
+        }
+        memset(workflow->pipe_types, 0, sizeof(*workflow->pipe_types) * pipes_len);
+        memset(workflow->pipe_stats, 0, sizeof(*workflow->pipe_stats) * pipes_len);
+        memset(workflow->pipe_batches, 0, sizeof(*workflow->pipe_batches) * pipes_len);
+
+        fill_rows(builder->inputs, builder->inputs_len, 1, workers_len, workflow->worker_inputs_offsets, workflow->worker_inputs);
+        fill_rows(builder->outputs, builder->outputs_len, 1, workers_len, workflow->worker_outputs_offsets, workflow->worker_outputs);
+        fill_rows(builder->outputs, builder->outputs_len, 0, pipes_len, workflow->pipe_producers_offsets, workflow->pipe_producers);
+        fill_rows(builder->inputs, builder->inputs_len, 0, pipes_len, workflow->pipe_consumers_offsets, workflow->pipe_consumers);
+
+        /* bindings of scopes are added in order of scopes */
+        workflow->scopes_len = builder->scopes_len;
+        for (int64_t i = 0; i < builder->scopes_len; ++i)
+        {
+            workflow->scope_definitions[i] = builder->scopes[i].definition;
+            workflow->scope_callers[i] = builder->scopes[i].caller;
+            workflow->scope_bindings_offsets[i] = builder->scopes[i].bindings;
+        }
+        workflow->scope_bindings_offsets[builder->scopes_len] = builder->bindings_len;
+        for (int64_t i = 0; i < builder->bindings_len; ++i)
+        {
+            workflow->scope_bindings[i] = builder->bindings[i];
+        }
+        resolve_symbols(program, workflow);
+    }
+    if (program->memory.failed)
+    {
+        workflow_release(program, workflow);
+    }
+
+    program_free(program, builder->workers);
+    program_free(program, builder->pipes);
+    program_free(program, builder->inputs);
+    program_free(program, builder->outputs);
+    program_free(program, builder->scopes);
+    program_free(program, builder->bindings);
+    program_free(program, builder->calls);
+    memset(builder, 0, sizeof(*builder));
+}
+
+
+void workflow_release(struct program *program, struct workflow *workflow)
+{
+    program_free(program, workflow->worker_names);
+    program_free(program, workflow->worker_code_positions);
+    program_free(program, workflow->worker_definitions);
+    program_free(program, workflow->worker_scopes);
+    program_free(program, workflow->worker_flags);
+    program_free(program, workflow->worker_stats);
+    program_free(program, workflow->worker_weights);
+    program_free(program, workflow->worker_branches);
+    program_free(program, workflow->worker_inputs_offsets);
+    program_free(program, workflow->worker_inputs);
+    program_free(program, workflow->worker_outputs_offsets);
+    program_free(program, workflow->worker_outputs);
+    program_free(program, workflow->pipe_names);
+    program_free(program, workflow->pipe_code_positions);
+    program_free(program, workflow->pipe_scopes);
+    program_free(program, workflow->pipe_types);
+    program_free(program, workflow->pipe_stats);
+    program_free(program, workflow->pipe_flags);
+    program_free(program, workflow->pipe_batches);
+    program_free(program, workflow->pipe_producers_offsets);
+    program_free(program, workflow->pipe_producers);
+    program_free(program, workflow->pipe_consumers_offsets);
+    program_free(program, workflow->pipe_consumers);
+    program_free(program, workflow->worker_symbols_offsets);
+    program_free(program, workflow->worker_symbols);
+    program_free(program, workflow->pipe_symbol_readers_offsets);
+    program_free(program, workflow->pipe_symbol_readers);
+    program_free(program, workflow->scope_definitions);
+    program_free(program, workflow->scope_callers);
+    program_free(program, workflow->scope_bindings_offsets);
+    program_free(program, workflow->scope_bindings);
+    memset(workflow, 0, sizeof(*workflow));
+}
+
+
+/* returns pipe id, -1 if there is no such pipe */
+static int64_t get_pipe(struct program *program, struct workflow_builder *builder, struct name_table *name_table, char *name, struct code_span span)
 {    
-    int i = 0;
+    int i = 0, dots = 0;
     for (; name[i] != '\0'; ++i)
     {
-        if (!isdigit(name[i]))
+        dots += name[i] == '.';
+        if (!isdigit(name[i]) && (name[i] != '.' || dots > 1))
         {
             break;
         }
     }
-    if (name[i] == '\0')
+    if (name[i] == '\0' && i > dots)
     {
-        /* this is number */
-        struct pipe *pipe = add_pipe(program, "numeric pipeline", span);
-        name_table->pipes[name_table->pipes_len++] = pipe;
+        /* this is number, like 10 or 1.5 */
+        if (name_table->pipes_len >= MAX_FUNCTION_PIPES)
+        {
+            program_log(program, LOG_WORKFLOW, LOG_ERROR, "Too many pipes in one definition", span, NULL);
+            return -1;
+        }
+        int64_t pipe = workflow_add_pipe(program, builder, "numeric pipeline", span);
+        if (pipe != -1)
+        {
+            name_table->pipes[name_table->pipes_len++] = pipe;
+        }
         return pipe;
     }
 
+    /* x[0] and x[1..] read pipe x */
+    int64_t len = strcspn(name, "[.");
     int a = 0;
     for (; a < name_table->pipes_len; ++a)
     {
-        if (strcmp(name_table->pipes[a]->name, name) == 0)
+        const char *pipe_name = builder->pipes[name_table->pipes[a]].name;
+        if (strncmp(pipe_name, name, len) == 0 && pipe_name[len] == '\0')
         {
             return name_table->pipes[a];
         }
@@ -79,51 +454,285 @@ static struct pipe *get_pipe(struct program *program, struct name_table *name_ta
         program_log(program, LOG_WORKFLOW, LOG_ERROR, "Wrong name of pipe: this pipeline name doesn't exists", span, NULL);
     }
     
+    return -1;
+}
+
+
+/* free var of scope stands for callable it is bound to */
+static char *resolve_name(struct program *program, struct workflow_builder *builder, int64_t scope, char *name)
+{
+    struct workflow_scope_record *record = &builder->scopes[scope];
+    struct definition *definition = program->definitions[record->definition];
+    for (int64_t k = 0; k < definition->free_vars_len; ++k)
+    {
+        if (definition->free_vars[k] == name && builder->bindings[record->bindings + k] != NULL)
+        {
+            return builder->bindings[record->bindings + k];
+        }
+    }
+    return name;
+}
+
+
+static int64_t is_callable(struct program *program, const char *name)
+{
+    return builtin_find(name) != NULL || program_find_definition(program, name) != -1;
+}
+
+
+static uint64_t instance_hash(struct program *program, int64_t definition, char **bindings)
+{
+    uint64_t hash = (uint64_t)definition * 0x9E3779B97F4A7C15ull;
+    for (int64_t k = 0; k < program->definitions[definition]->free_vars_len; ++k)
+    {
+        hash = (hash ^ (uint64_t)(uintptr_t)bindings[k]) * 0x9E3779B97F4A7C15ull;
+    }
+    return hash ^ (hash >> 32);
+}
+
+
+/* returns scope of instance, -1 if there is none yet */
+static int64_t find_instance(struct program *program, struct build *build, int64_t definition, char **bindings)
+{
+    struct workflow_builder *builder = build->builder;
+    struct instance_table *table = &build->instances;
+    if (table->slots_alloc == 0)
+    {
+        return -1;
+    }
+    int64_t free_vars_len = program->definitions[definition]->free_vars_len;
+    uint64_t mask = table->slots_alloc - 1;
+    for (uint64_t slot = instance_hash(program, definition, bindings) & mask; table->slots[slot] != -1; slot = (slot + 1) & mask)
+    {
+        struct workflow_scope_record *record = &builder->scopes[table->slots[slot]];
+        if (record->definition == definition &&
+            memcmp(builder->bindings + record->bindings, bindings, sizeof(*bindings) * free_vars_len) == 0)
+        {
+            return table->slots[slot];
+        }
+    }
+    return -1;
+}
+
+
+/* returns 0 if out of memory */
+static int64_t add_instance(struct program *program, struct build *build, int64_t scope)
+{
+    struct workflow_builder *builder = build->builder;
+    struct instance_table *table = &build->instances;
+    if (2 * (table->len + 1) > table->slots_alloc)
+    {
+        int64_t alloc = table->slots_alloc != 0 ? 2 * table->slots_alloc : 64;
+        int64_t *slots = program_alloc(program, sizeof(*slots) * alloc);
+        if (slots == NULL)
+        {
+            return 0;
+        }
+        memset(slots, -1, sizeof(*slots) * alloc);
+        for (int64_t i = 0; i < table->slots_alloc; ++i)
+        {
+            if (table->slots[i] == -1)
+            {
+                continue;
+            }
+            struct workflow_scope_record *record = &builder->scopes[table->slots[i]];
+            uint64_t slot = instance_hash(program, record->definition, builder->bindings + record->bindings) & (alloc - 1);
+            while (slots[slot] != -1)
+            {
+                slot = (slot + 1) & (alloc - 1);
+            }
+            slots[slot] = table->slots[i];
+        }
+        program_free(program, table->slots);
+        table->slots = slots;
+        table->slots_alloc = alloc;
+    }
+
+    struct workflow_scope_record *record = &builder->scopes[scope];
+    uint64_t mask = table->slots_alloc - 1;
+    uint64_t slot = instance_hash(program, record->definition, builder->bindings + record->bindings) & mask;
+    while (table->slots[slot] != -1)
+    {
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = scope;
+    table->len++;
+    return 1;
+}
+
+
+/* pipe of var in instance, entry pipes of an instance are added one
+   after another before anything else of it. -1 if var has none */
+static int64_t entry_pipe(struct workflow_builder *builder, int64_t scope, const char *var)
+{
+    for (int64_t p = builder->scopes[scope].entries; p >= 0 && p < builder->pipes_len; ++p)
+    {
+        if (builder->pipes[p].scope != scope || !(builder->pipes[p].flags & PIPE_ENTRY))
+        {
+            break;
+        }
+        if (builder->pipes[p].name == var)
+        {
+            return p;
+        }
+    }
+    return -1;
+}
+
+
+/* returns 0 if out of memory */
+static int64_t add_call(struct program *program, struct workflow_builder *builder, int64_t caller, int64_t callee)
+{
+    if (!reserve(program, (void **)&builder->calls, &builder->calls_alloc, builder->calls_len, sizeof(*builder->calls)))
+    {
+        return 0;
+    }
+    builder->calls[builder->calls_len++] = (struct workflow_call){caller, callee};
+    return 1;
+}
+
+
+static int64_t build_pipeline(struct program *program, struct build *build, struct name_table *name_table, struct pipeline_definition *pipeline);
+static int64_t instantiate(struct program *program, struct build *build, int64_t definition, char **bindings, int64_t caller);
+
+
+static struct pipeline_worker_substitution *find_sub(struct pipeline_worker_definition *worker, const char *name)
+{
+    for (int64_t i = 0; i < worker->subs_len; ++i)
+    {
+        if (worker->subs[i].name == name)
+        {
+            return &worker->subs[i];
+        }
+    }
     return NULL;
 }
 
 
-static struct worker *add_worker(struct program *program, struct pipeline_worker_definition *worker)
+/* worker calling definition writes pipeline vars of its instance and
+   free vars it binds to data, like a=a[0] or b=(x[1..] > reduce).
+   builtin like !foreach f=to_int_one writes pipeline vars of instance
+   of function it's passed. !if branches are never built here */
+static void instantiate_calls(struct program *program, struct build *build, struct name_table *name_table, int64_t worker, char *name)
 {
-    struct workflow *workflow = &program->workflow;
+    struct workflow_builder *builder = build->builder;
+    struct pipeline_worker_definition *definition = builder->workers[worker].worker_definition;
+    int64_t scope = builder->scope;
+    const struct builtin *builtin = builtin_find(name);
 
-    if (workflow->workers_len >= workflow->workers_alloc)
+    int64_t callee = builtin == NULL ? program_find_definition(program, name) : -1;
+    if (callee != -1)
     {
-        workflow->workers_alloc = 2 * workflow->workers_alloc + !workflow->workers_alloc;
-        void *new_ptr = realloc(workflow->workers, sizeof(*workflow->workers) * workflow->workers_alloc);
-        if (new_ptr == NULL)
+        struct definition *callee_definition = program->definitions[callee];
+        char *bindings[MAX_FREE_VARS] = { NULL };
+        for (int64_t k = 0; k < callee_definition->free_vars_len; ++k)
+        {
+            struct pipeline_worker_substitution *sub = find_sub(definition, callee_definition->free_vars[k]);
+            if (sub != NULL && sub->type == SUBSTITUTION_SYMBOL)
+            {
+                char *symbol = resolve_name(program, builder, scope, sub->symbol);
+                bindings[k] = is_callable(program, symbol) ? symbol : NULL;
+            }
+        }
+
+        int64_t instance = instantiate(program, build, callee, bindings, worker);
+        if (instance == -1 || !add_call(program, builder, scope, instance))
         {
-            fprintf(stderr, "Error: No memory for WORKFLOW.\n");
-            exit(1);
+            return;
         }
-        workflow->workers = new_ptr;
+        for (int64_t i = 0; i < callee_definition->pipeline_vars_len; ++i)
+        {
+            int64_t pipe = entry_pipe(builder, instance, callee_definition->pipeline_vars[i]);
+            if (pipe != -1)
+            {
+                workflow_connect_output(program, builder, worker, pipe);
+            }
+        }
+        for (int64_t k = 0; k < callee_definition->free_vars_len; ++k)
+        {
+            struct pipeline_worker_substitution *sub = find_sub(definition, callee_definition->free_vars[k]);
+            int64_t pipe = bindings[k] == NULL && sub != NULL ? entry_pipe(builder, instance, callee_definition->free_vars[k]) : -1;
+            if (pipe == -1)
+            {
+                continue;
+            }
+            if (sub->type == SUBSTITUTION_PIPELINE)
+            {
+                /* bound pipeline is built in caller, worker passes on its result */
+                int64_t tail = build_pipeline(program, build, name_table, sub->pipeline);
+                int64_t result = tail != -1 ? workflow_add_pipe(program, builder, "inline pipe", sub->code_position) : -1;
+                if (result == -1)
+                {
+                    continue;
+                }
+                workflow_connect_output(program, builder, tail, result);
+                workflow_connect_input(program, builder, worker, result);
+            }
+            workflow_connect_output(program, builder, worker, pipe);
+        }
+        return;
     }
 
-    workflow->workers[workflow->workers_len] = malloc(sizeof(*workflow->workers[workflow->workers_len]));
-    if (workflow->workers[workflow->workers_len] == NULL)
+    for (int64_t i = 0; builtin != NULL && i < definition->subs_len; ++i)
     {
-        fprintf(stderr, "Error: No memory for WORKFLOW.\n");
+        struct pipeline_worker_substitution *sub = &definition->subs[i];
+        if (sub->type != SUBSTITUTION_SYMBOL)
+        {
+            continue;
+        }
+        char *symbol = resolve_name(program, builder, scope, sub->symbol);
+        int64_t function = builtin_find(symbol) == NULL ? program_find_definition(program, symbol) : -1;
+        if (function == -1)
+        {
+            continue;
+        }
+        char *bindings[MAX_FREE_VARS] = { NULL };
+        int64_t instance = instantiate(program, build, function, bindings, worker);
+        if (instance == -1 || !add_call(program, builder, scope, instance))
+        {
+            continue;
+        }
+        struct definition *function_definition = program->definitions[function];
+        for (int64_t k = 0; k < function_definition->pipeline_vars_len; ++k)
+        {
+            int64_t pipe = entry_pipe(builder, instance, function_definition->pipeline_vars[k]);
+            if (pipe != -1)
+            {
+                workflow_connect_output(program, builder, worker, pipe);
+            }
+        }
     }
-        
-    workflow->workers[workflow->workers_len]->name = worker->name;
-    workflow->workers[workflow->workers_len]->code_position = worker->code_position;
-    workflow->workers[workflow->workers_len]->worker_definition = worker;
-    workflow->workers[workflow->workers_len]->inputs_len = 0;
-    workflow->workers[workflow->workers_len]->outputs_len = 0;
-    
-    return workflow->workers[workflow->workers_len++];
 }
 
-static void build_pipeline(struct program *program, struct name_table *name_table, struct definition *definition, struct pipeline_definition *pipeline)
+
+/* returns last worker of pipeline, -1 if there is none */
+static int64_t build_pipeline(struct program *program, struct build *build, struct name_table *name_table, struct pipeline_definition *pipeline)
 {
-    struct workflow *workflow = &program->workflow;
-    (void)workflow;
-    
+    struct workflow_builder *builder = build->builder;
     /* add pipe's name */
-    struct worker *worker, *prev_worker;
+    int64_t worker = -1, prev_worker = -1;
     for (int64_t j = 0; j < pipeline->workers_len; ++j)
     {
-        name_table->workers[name_table->workers_len++] = worker = add_worker(program, &pipeline->workers[j]);
+        if (name_table->workers_len >= MAX_FUNCTION_WORKERS)
+        {
+            program_log(program, LOG_WORKFLOW, LOG_ERROR, "Too many workers in one definition", pipeline->workers[j].code_position, NULL);
+            return -1;
+        }
+        char *name = resolve_name(program, builder, builder->scope, pipeline->workers[j].name);
+        worker = workflow_add_worker(program, builder, name, pipeline->workers[j].code_position, &pipeline->workers[j]);
+        if (worker == -1)
+        {
+            return -1;
+        }
+        name_table->workers[name_table->workers_len++] = worker;
+        /* branches of !if are built once cond is known */
+        const struct builtin *builtin = builtin_find(name);
+        pipeline->workers[j].lazy_branches = 0;
+        for (int64_t k = 0; k < pipeline->workers[j].subs_len; ++k)
+        {
+            struct pipeline_worker_substitution *sub = &pipeline->workers[j].subs[k];
+            pipeline->workers[j].lazy_branches += sub->type == SUBSTITUTION_PIPELINE && is_branch(builtin, sub);
+        }
         /* add connection */
         if (j == 0)
         {
@@ -132,10 +741,10 @@ static void build_pipeline(struct program *program, struct name_table *name_tabl
                 if (pipeline->args[k].type == ARGUMENT_NAME)
                 {
                     /* find pipeline by name */
-                    struct pipe *pipe = get_pipe(program, name_table, pipeline->args[k].name, pipeline->args[k].code_position);
-                    if (pipe != NULL)
+                    int64_t pipe = get_pipe(program, builder, name_table, pipeline->args[k].name, pipeline->args[k].code_position);
+                    if (pipe != -1)
                     {
-                        worker->inputs[worker->inputs_len++] = pipe;
+                        workflow_connect_input(program, builder, worker, pipe);
                     }
                 }
                 else
@@ -145,103 +754,563 @@ static void build_pipeline(struct program *program, struct name_table *name_tabl
                     {
                         program_log(program, LOG_WORKFLOW, LOG_ERROR, "Unsopported for now: inline pipelines, with output pipes", pipeline->args[k].pipeline->code_position, NULL);
                     }
-                    build_pipeline(program, name_table, definition, pipeline->args[k].pipeline);
+                    int64_t tail = build_pipeline(program, build, name_table, pipeline->args[k].pipeline);
+                    if (tail != -1)
+                    {
+                        /* result of inline pipeline is this argument */
+                        int64_t pipe = workflow_add_pipe(program, builder, "inline pipe", pipeline->args[k].code_position);
+                        if (pipe == -1)
+                        {
+                            return -1;
+                        }
+                        workflow_connect_output(program, builder, tail, pipe);
+                        workflow_connect_input(program, builder, worker, pipe);
+                    }
                 }
             }
         }
         else
         {
-            worker->inputs[worker->inputs_len++] = prev_worker->outputs[prev_worker->outputs_len++] = add_pipe(program, "implict pipe", SPAN(prev_worker->code_position.end, worker->code_position.begin));
+            struct code_span span = SPAN(builder->workers[prev_worker].code_position.end, builder->workers[worker].code_position.begin);
+            int64_t pipe = workflow_add_pipe(program, builder, "implict pipe", span);
+            if (pipe == -1)
+            {
+                return -1;
+            }
+            workflow_connect_output(program, builder, prev_worker, pipe);
+            workflow_connect_input(program, builder, worker, pipe);
         }
+        instantiate_calls(program, build, name_table, worker, name);
         prev_worker = worker;
     }
+
+    if (worker == -1 && pipeline->outputs_len != 0)
+    {
+        program_log(program, LOG_WORKFLOW, LOG_ERROR, "Unsupported for now: pipelines with outputs, but without workers", pipeline->code_position, NULL);
+        return -1;
+    }
+
     /* add pipes to all outputs */
     for (int k = 0; k < pipeline->outputs_len; ++k)
     {
         /* find pipeline by name */
-        struct pipe *pipe = get_pipe(program, name_table, pipeline->outputs[k].name, pipeline->outputs[k].code_position);
-        if (pipe != NULL)
+        int64_t pipe = get_pipe(program, builder, name_table, pipeline->outputs[k].name, pipeline->outputs[k].code_position);
+        if (pipe != -1)
         {
-            worker->outputs[worker->outputs_len++] = pipe;
+            workflow_connect_output(program, builder, worker, pipe);
         }
     }
+
+    return worker;
 }
 
-static void update_using_pure_definition(struct program *program, struct definition *definition)
+
+/* entry pipes come first, then >> outputs, then workers. scope is
+   registered before its body is built, so recursive calls find it and
+   write its entry pipes instead of instantiating it again. returns
+   scope of instance, -1 if it can't be built */
+static int64_t instantiate(struct program *program, struct build *build, int64_t definition, char **bindings, int64_t caller)
 {
+    struct workflow_builder *builder = build->builder;
+    int64_t scope = find_instance(program, build, definition, bindings);
+    if (scope != -1)
+    {
+        return scope;
+    }
+    struct definition *instance = program->definitions[definition];
+    if (builder->scopes_len >= MAX_INSTANCES)
+    {
+        program_log(program, LOG_WORKFLOW, LOG_ERROR, "Too many instances of definitions, calls of this one stay opaque", instance->code_position, NULL);
+        return -1;
+    }
 
-    struct workflow *workflow = &program->workflow;
-    struct name_table name_table;
-    (void)workflow;
+    /* too big for small thread stacks of embedding applications */
+    struct name_table *name_table = program_alloc(program, sizeof(*name_table));
+    scope = name_table != NULL ? workflow_add_scope(program, builder, definition, caller, bindings) : -1;
+    if (scope == -1 || !add_instance(program, build, scope))
+    {
+        program_free(program, name_table);
+        return -1;
+    }
+    name_table->pipes_len = 0;
+    name_table->workers_len = 0;
 
-    name_table.pipes_len = 0;
-    name_table.workers_len = 0;
+    int64_t outer = builder->scope;
+    builder->scope = scope;
+    builder->scopes[scope].entries = builder->pipes_len;
+    for (int64_t i = 0; i < instance->pipeline_vars_len + instance->free_vars_len; ++i)
+    {
+        int64_t free = i - instance->pipeline_vars_len;
+        if (free >= 0 && bindings[free] != NULL)
+        {
+            /* callable, workers named by var call it instead */
+            continue;
+        }
+        char *var = free < 0 ? instance->pipeline_vars[i] : instance->free_vars[free];
+        int64_t pipe = workflow_add_pipe(program, builder, var, instance->code_position);
+        if (pipe == -1)
+        {
+            break;
+        }
+        builder->pipes[pipe].flags = PIPE_ENTRY;
+        name_table->pipes[name_table->pipes_len++] = pipe;
+    }
 
-    /* 1. create all pipelines output pipes */
-    for (int64_t i = 0; i < definition->pipelines_len; ++i)
+    for (int64_t i = 0; i < instance->pipelines_len && !program->memory.failed; ++i)
     {
-        /* add pipe's name */
-        for (int64_t j = 0; j < definition->pipelines[i].outputs_len; ++j)
+        for (int64_t j = 0; j < instance->pipelines[i].outputs_len; ++j)
         {
-            name_table.pipes[name_table.pipes_len++] = add_pipe(program, 
-                                                                definition->pipelines[i].outputs[j].name, 
-                                                                definition->pipelines[i].outputs[j].code_position);
+            int64_t pipe = workflow_add_pipe(program, builder,
+                                             instance->pipelines[i].outputs[j].name,
+                                             instance->pipelines[i].outputs[j].code_position);
+            if (pipe == -1 || name_table->pipes_len >= MAX_FUNCTION_PIPES)
+            {
+                break;
+            }
+            name_table->pipes[name_table->pipes_len++] = pipe;
         }
     }
 
     /* connect all workers using pipes */
-    for (int64_t i = 0; i < definition->pipelines_len; ++i)
+    for (int64_t i = 0; i < instance->pipelines_len && !program->memory.failed; ++i)
+    {
+        build_pipeline(program, build, name_table, &instance->pipelines[i]);
+    }
+
+    builder->scope = outer;
+    program_free(program, name_table);
+    return scope;
+}
+
+
+static uint64_t name_slot(const char *name, int64_t slots_alloc)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull;
+    return (hash ^ (hash >> 32)) & (slots_alloc - 1);
+}
+
+
+/* returns 0 if out of memory */
+static int64_t index_definitions(struct program *program)
+{
+    int64_t alloc = 64;
+    while (alloc < 2 * program->definitions_len)
+    {
+        alloc *= 2;
+    }
+    int64_t *slots = program_alloc(program, sizeof(*slots) * alloc);
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    memset(slots, -1, sizeof(*slots) * alloc);
+
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        uint64_t slot = name_slot(program->definitions[i]->name, alloc);
+        while (slots[slot] != -1)
+        {
+            slot = (slot + 1) & (alloc - 1);
+        }
+        slots[slot] = i;
+    }
+
+    program_free(program, program->definition_slots);
+    program->definition_slots = slots;
+    program->definition_slots_alloc = alloc;
+    program->definitions_indexed = program->definitions_len;
+    return 1;
+}
+
+
+/* names are interned, so pointers identify them. index is made again
+   once definitions were added. returns index of definition, -1 if
+   there is none */
+int64_t program_find_definition(struct program *program, const char *name)
+{
+    if ((program->definition_slots == NULL || program->definitions_indexed != program->definitions_len) &&
+        !index_definitions(program))
+    {
+        return -1;
+    }
+
+    uint64_t slot = name_slot(name, program->definition_slots_alloc);
+    while (program->definition_slots[slot] != -1)
     {
-        build_pipeline(program, &name_table, definition, &definition->pipelines[i]);
+        if (program->definitions[program->definition_slots[slot]]->name == name)
+        {
+            return program->definition_slots[slot];
+        }
+        slot = (slot + 1) & (program->definition_slots_alloc - 1);
     }
-    printf("\n\nadd %lld pipes\n", name_table.pipes_len);
-    for (int i = 0; i < name_table.pipes_len; ++i)
+    return -1;
+}
+
+
+/* definitions reached by walk from main, queue holds those still to visit */
+struct reach
+{
+    /* enum reach_level of every definition */
+    char *levels;
+    int64_t *queue;
+    int64_t queue_len;
+};
+
+enum reach_level
+{
+    REACH_NONE,
+    /* only under branch of !if, instantiated later if at all */
+    REACH_LAZY,
+    REACH_EAGER,
+};
+
+
+static void reach_name(struct program *program, struct reach *reach, const char *name, int64_t level)
+{
+    int64_t definition = program_find_definition(program, name);
+    /* definition reached lazily first is visited again once it's eager */
+    if (definition != -1 && reach->levels[definition] < level)
     {
-        printf("pipe %d: %s\n", i, name_table.pipes[i]->name);
+        reach->levels[definition] = level;
+        reach->queue[reach->queue_len++] = definition;
     }
-    printf("\n\nadd %lld workers\n", name_table.workers_len);
-    for (int i = 0; i < name_table.workers_len; ++i)
+}
+
+
+/* worker calls definition by its name, substitutions may pass more of
+   them, like f=to_int_one */
+static void reach_pipeline(struct program *program, struct reach *reach, struct pipeline_definition *pipeline, int64_t level)
+{
+    for (int64_t i = 0; i < pipeline->args_len; ++i)
     {
-        printf("worker %d: %s\n", i, name_table.workers[i]->name);
-        printf("inputs: ");
-        for (int a = 0; a < name_table.workers[i]->inputs_len; ++a)
+        if (pipeline->args[i].type != ARGUMENT_NAME)
         {
-            printf("%s ", name_table.workers[i]->inputs[a]->name);
+            reach_pipeline(program, reach, pipeline->args[i].pipeline, level);
         }
-        printf("\n");
-        printf("outputs: ");
-        for (int a = 0; a < name_table.workers[i]->outputs_len; ++a)
+    }
+    for (int64_t i = 0; i < pipeline->workers_len; ++i)
+    {
+        struct pipeline_worker_definition *worker = &pipeline->workers[i];
+        reach_name(program, reach, worker->name, level);
+        for (int64_t k = 0; k < worker->subs_len; ++k)
         {
-            printf("%s ", name_table.workers[i]->outputs[a]->name);
+            struct pipeline_worker_substitution *sub = &worker->subs[k];
+            if (sub->type == SUBSTITUTION_PIPELINE)
+            {
+                int64_t branch = is_branch(builtin_find(worker->name), sub);
+                reach_pipeline(program, reach, sub->pipeline, branch ? REACH_LAZY : level);
+            }
+            else
+            {
+                reach_name(program, reach, sub->symbol, level);
+            }
         }
-        printf("\n");
     }
 }
 
+
+/* walks call graph from roots, each definition is visited at most once
+   per level, and notes definitions main never calls */
+static void note_unreachable(struct program *program, int64_t main)
+{
+    struct reach reach;
+    memset(&reach, 0, sizeof(reach));
+    reach.levels = program_alloc(program, program->definitions_len + 1);
+    reach.queue = program_alloc(program, sizeof(*reach.queue) * (2 * program->definitions_len + 1));
+    if (main == -1 || reach.levels == NULL || reach.queue == NULL)
+    {
+        program_free(program, reach.levels);
+        program_free(program, reach.queue);
+        return;
+    }
+    memset(reach.levels, REACH_NONE, program->definitions_len + 1);
+    reach.levels[main] = REACH_EAGER;
+    reach.queue[reach.queue_len++] = main;
+
+    for (int64_t head = 0; head < reach.queue_len; ++head)
+    {
+        struct definition *definition = program->definitions[reach.queue[head]];
+        for (int64_t k = 0; k < definition->pipelines_len; ++k)
+        {
+            reach_pipeline(program, &reach, &definition->pipelines[k], reach.levels[reach.queue[head]]);
+        }
+    }
+
+    for (int64_t i = 0; i < program->definitions_len; ++i)
+    {
+        if (reach.levels[i] == REACH_NONE)
+        {
+            program_log(program, LOG_WORKFLOW, LOG_NOTE, "Definition is not reachable from main, it is not built", program->definitions[i]->code_position, NULL);
+        }
+    }
+
+    program_free(program, reach.levels);
+    program_free(program, reach.queue);
+}
+
+
+/* main, or without it every definition without parameters, is root.
+   definitions are instantiated once per distinct binding of their free
+   vars to callables, as their callers are built, so only what roots
+   call outside of !if branches is built at all. each call site writes
+   entry pipes of the instance it calls, recursion writes them back */
 void program_get_workflow(struct program *program)
 {
-    printf("get workflow...\n");
-    
-    struct workflow *workflow = &program->workflow;
-    workflow->pipes = NULL;
-    workflow->pipes_len = 0;
-    workflow->pipes_alloc = 0;
-    workflow->workers = NULL;
-    workflow->workers_len = 0;
-    workflow->workers_alloc = 0;
-
-    int64_t empty = 1;
+    program_infer_purity(program);
+
+    program_pass_begin(program, PASS_WORKFLOW);
+
+    struct workflow_builder builder;
+    memset(&builder, 0, sizeof(builder));
+    struct build build = { .builder = &builder };
+    workflow_release(program, &program->workflow);
+
+    int64_t main = -1;
     for (int64_t i = 0; i < program->definitions_len; ++i)
     {
-        if (program->definitions[i]->free_vars_len == 0 && 
-            program->definitions[i]->pipeline_vars_len == 0)
-        {        
-            empty = 0;
-            update_using_pure_definition(program, program->definitions[i]);
+        main = strcmp(program->definitions[i]->name, "main") == 0 ? i : main;
+    }
+    char *bindings[MAX_FREE_VARS] = { NULL };
+    int64_t roots = 0;
+    for (int64_t i = 0; i < program->definitions_len && !program->memory.failed; ++i)
+    {
+        struct definition *definition = program->definitions[i];
+        if (main != -1 ? i == main : definition->free_vars_len == 0 && definition->pipeline_vars_len == 0)
+        {
+            builder.scope = -1;
+            roots += instantiate(program, &build, i, bindings, -1) != -1;
         }
     }
-    if (empty)
+    if (roots == 0)
     {
         program_log(program, LOG_WORKFLOW, LOG_ERROR, "Wrong function: no pure functions to build found", SPAN(0, 0), NULL);
     }
+    note_unreachable(program, main);
+    program_plan_branches(program, &builder);
+    program_free(program, build.instances.slots);
+
+    workflow_freeze(program, &builder, &program->workflow);
+    program_classify_workers(program);
+
+    program_pass_end(program, PASS_WORKFLOW);
+}
+
+
+/* builder holding everything workflow does, with the same ids, and
+   instances of its scopes. returns 0 if out of memory */
+static int64_t workflow_thaw(struct program *program, struct workflow *workflow, struct build *build)
+{
+    struct workflow_builder *builder = build->builder;
+    builder->workers_alloc = workflow->workers_len + 1;
+    builder->pipes_alloc = workflow->pipes_len + 1;
+    builder->inputs_alloc = workflow->worker_inputs_offsets[workflow->workers_len] + 1;
+    builder->outputs_alloc = workflow->worker_outputs_offsets[workflow->workers_len] + 1;
+    builder->scopes_alloc = workflow->scopes_len + 1;
+    builder->bindings_alloc = workflow->scope_bindings_offsets[workflow->scopes_len] + 1;
+    builder->workers = program_alloc(program, sizeof(*builder->workers) * builder->workers_alloc);
+    builder->pipes = program_alloc(program, sizeof(*builder->pipes) * builder->pipes_alloc);
+    builder->inputs = program_alloc(program, sizeof(*builder->inputs) * builder->inputs_alloc);
+    builder->outputs = program_alloc(program, sizeof(*builder->outputs) * builder->outputs_alloc);
+    builder->scopes = program_alloc(program, sizeof(*builder->scopes) * builder->scopes_alloc);
+    builder->bindings = program_alloc(program, sizeof(*builder->bindings) * builder->bindings_alloc);
+    if (program->memory.failed)
+    {
+        return 0;
+    }
+
+    for (int64_t w = 0; w < workflow->workers_len; ++w)
+    {
+        builder->workers[builder->workers_len++] = (struct workflow_worker_record){
+            .name = workflow->worker_names[w],
+            .code_position = workflow->worker_code_positions[w],
+            .worker_definition = workflow->worker_definitions[w],
+            .scope = workflow->worker_scopes[w],
+            .branches = { workflow->worker_branches[2 * w], workflow->worker_branches[2 * w + 1] },
+        };
+        for (int64_t i = workflow->worker_inputs_offsets[w]; i < workflow->worker_inputs_offsets[w + 1]; ++i)
+        {
+            builder->inputs[builder->inputs_len++] = (struct workflow_edge){w, workflow->worker_inputs[i]};
+        }
+        for (int64_t i = workflow->worker_outputs_offsets[w]; i < workflow->worker_outputs_offsets[w + 1]; ++i)
+        {
+            builder->outputs[builder->outputs_len++] = (struct workflow_edge){w, workflow->worker_outputs[i]};
+        }
+    }
+
+    for (int64_t s = 0; s < workflow->scopes_len; ++s)
+    {
+        builder->scopes[builder->scopes_len++] = (struct workflow_scope_record){
+            .definition = workflow->scope_definitions[s],
+            .caller = workflow->scope_callers[s],
+            .bindings = workflow->scope_bindings_offsets[s],
+            .entries = -1,
+        };
+    }
+    for (int64_t i = 0; i < workflow->scope_bindings_offsets[workflow->scopes_len]; ++i)
+    {
+        builder->bindings[builder->bindings_len++] = workflow->scope_bindings[i];
+    }
+
+    for (int64_t p = 0; p < workflow->pipes_len; ++p)
+    {
+        builder->pipes[builder->pipes_len++] = (struct workflow_pipe_record){
+            .name = workflow->pipe_names[p],
+            .code_position = workflow->pipe_code_positions[p],
+            .scope = workflow->pipe_scopes[p],
+            .flags = workflow->pipe_flags[p],
+        };
+        int64_t scope = workflow->pipe_scopes[p];
+        if (scope != -1 && (workflow->pipe_flags[p] & PIPE_ENTRY) && builder->scopes[scope].entries == -1)
+        {
+            builder->scopes[scope].entries = p;
+        }
+    }
+
+    for (int64_t s = 0; s < builder->scopes_len; ++s)
+    {
+        if (!add_instance(program, build, s))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* builds branch !if worker takes once its cond is known, in scope of
+   the worker, and its last worker writes what !if does. the other
+   branch is never built. workflow is frozen again keeping ids, stats
+   and types of what it had, pipes of branch are typed dynamic and
+   are not flowed again. returns last worker of branch, -1 if branch is
+   a symbol like false=x[0] or can't be built */
+int64_t program_instantiate_branch(struct program *program, int64_t worker, int64_t cond)
+{
+    struct workflow *workflow = &program->workflow;
+    cond = cond != 0;
+    if (worker < 0 || worker >= workflow->workers_len)
+    {
+        return -1;
+    }
+    if (workflow->worker_branches[2 * worker + cond] != -1)
+    {
+        return workflow->worker_branches[2 * worker + cond];
+    }
+    struct pipeline_worker_substitution *branch = if_branch(workflow->worker_definitions[worker], cond);
+    if (branch == NULL || branch->type != SUBSTITUTION_PIPELINE || !is_branch(builtin_find(workflow->worker_names[worker]), branch))
+    {
+        return -1;
+    }
+
+    struct workflow_builder builder;
+    memset(&builder, 0, sizeof(builder));
+    struct build build = { .builder = &builder };
+    struct name_table *name_table = program_alloc(program, sizeof(*name_table));
+    int64_t tail = -1;
+    if (name_table != NULL && workflow_thaw(program, workflow, &build))
+    {
+        int64_t scope = workflow->worker_scopes[worker];
+        name_table->pipes_len = 0;
+        name_table->workers_len = 0;
+        for (int64_t p = 0; p < workflow->pipes_len && name_table->pipes_len < MAX_FUNCTION_PIPES; ++p)
+        {
+            if (workflow->pipe_scopes[p] == scope)
+            {
+                name_table->pipes[name_table->pipes_len++] = p;
+            }
+        }
+        for (int64_t w = 0; w < workflow->workers_len && name_table->workers_len < MAX_FUNCTION_WORKERS; ++w)
+        {
+            if (workflow->worker_scopes[w] == scope)
+            {
+                name_table->workers[name_table->workers_len++] = w;
+            }
+        }
+
+        builder.scope = scope;
+        tail = build_pipeline(program, &build, name_table, branch->pipeline);
+        for (int64_t i = workflow->worker_outputs_offsets[worker]; tail != -1 && i < workflow->worker_outputs_offsets[worker + 1]; ++i)
+        {
+            workflow_connect_output(program, &builder, tail, workflow->worker_outputs[i]);
+        }
+        if (tail != -1)
+        {
+            builder.workers[worker].branches[cond] = tail;
+        }
+    }
+    program_free(program, name_table);
+    program_free(program, build.instances.slots);
+
+    if (tail == -1 || program->memory.failed)
+    {
+        /* old graph is still valid, keep it */
+        workflow_freeze(program, &builder, &(struct workflow){0});
+        return -1;
+    }
+
+    struct workflow grown;
+    workflow_freeze(program, &builder, &grown);
+    if (grown.workers_len == 0)
+    {
+        return -1;
+    }
+    memcpy(grown.worker_stats, workflow->worker_stats, sizeof(*grown.worker_stats) * workflow->workers_len);
+    memcpy(grown.worker_weights, workflow->worker_weights, sizeof(*grown.worker_weights) * workflow->workers_len);
+    memcpy(grown.pipe_types, workflow->pipe_types, sizeof(*grown.pipe_types) * workflow->pipes_len);
+    memcpy(grown.pipe_stats, workflow->pipe_stats, sizeof(*grown.pipe_stats) * workflow->pipes_len);
+    memcpy(grown.pipe_batches, workflow->pipe_batches, sizeof(*grown.pipe_batches) * workflow->pipes_len);
+    for (int64_t p = workflow->pipes_len; p < grown.pipes_len && program->passes[PASS_TYPES].runs != 0; ++p)
+    {
+        grown.pipe_types[p] = TYPE_DYNAMIC;
+    }
+    workflow_release(program, workflow);
+    *workflow = grown;
+    program_classify_workers(program);
+    return tail;
+}
+
+
+void program_workflow_dump(FILE *stream, struct program *program)
+{
+    struct workflow *workflow = &program->workflow;
+
+    fprintf(stream, "Workflow of %" PRId64 " pipes and %" PRId64 " workers\n", workflow->pipes_len, workflow->workers_len);
+    for (int64_t i = 0; i < workflow->pipes_len; ++i)
+    {
+        const char *broadcast = (workflow->pipe_flags[i] & PIPE_BROADCAST) ? " (broadcast)" :
+                                (workflow->pipe_flags[i] & PIPE_FUSED) ? " (fused)" : "";
+        /* types are known only after types stage */
+        if (workflow->pipe_types[i] == TYPE_UNKNOWN)
+        {
+            fprintf(stream, "pipe %" PRId64 ": %s%s\n", i, workflow->pipe_names[i], broadcast);
+            continue;
+        }
+        char type[64];
+        type_name(workflow->pipe_types[i], type, sizeof(type));
+        fprintf(stream, "pipe %" PRId64 ": %s : %s%s\n", i, workflow->pipe_names[i], type, broadcast);
+    }
+    for (int64_t i = 0; i < workflow->workers_len; ++i)
+    {
+        int64_t flags = workflow->worker_flags[i];
+        fprintf(stream, "worker %" PRId64 ": %s%s", i, workflow->worker_names[i],
+                (flags & PURITY_STATELESS) ? " (stateless)" : (flags & PURITY_PURE) ? " (pure)" : "");
+        if (workflow->worker_definitions[i]->lazy_branches != 0)
+        {
+            fprintf(stream, " lazy branches: %" PRId64, workflow->worker_definitions[i]->lazy_branches);
+        }
+        fprintf(stream, "\n");
+        fprintf(stream, "inputs: ");
+        for (int64_t a = workflow->worker_inputs_offsets[i]; a < workflow->worker_inputs_offsets[i + 1]; ++a)
+        {
+            int64_t pipe = workflow->worker_inputs[a];
+            fprintf(stream, "%" PRId64 ":%s ", pipe, workflow->pipe_names[pipe]);
+        }
+        fprintf(stream, "\n");
+        fprintf(stream, "outputs: ");
+        for (int64_t a = workflow->worker_outputs_offsets[i]; a < workflow->worker_outputs_offsets[i + 1]; ++a)
+        {
+            int64_t pipe = workflow->worker_outputs[a];
+            fprintf(stream, "%" PRId64 ":%s ", pipe, workflow->pipe_names[pipe]);
+        }
+        fprintf(stream, "\n");
+    }
 }